@@ -0,0 +1,97 @@
+#ifndef _BENCH_H
+#define _BENCH_H
+//Helpers shared by the benchmarks, included first by every one of them
+//A bench counts the checks and runs that failed and main returns
+//bench_result() so `make bench` stops at the first bench that failed
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE
+#endif
+#include "fused/bfuse.h"
+#include "fused/primitives.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+
+static u32 bench_failures;
+
+static inline double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+//Writes an image of size bytes, byte i of every MiB is i * step + first
+static inline int create_image(const char * name, u64 size, u8 step, u8 first) {
+    static u8 chunk[1 << 20];
+    FILE * file = fopen(name, "wb");
+    if (file == 0x0) {
+        return 1;
+    }
+    for (u32 i = 0; i < sizeof(chunk); i++) {
+        chunk[i] = (u8)(i * step + first);
+    }
+    for (u64 offset = 0; offset < size; offset += sizeof(chunk)) {
+        fwrite(chunk, 1, (size - offset < sizeof(chunk)) ? size - offset : sizeof(chunk), file);
+    }
+    fclose(file);
+    return 0;
+}
+
+//Bytes the file takes on disk, holes left out
+static inline u64 allocated(const char * name) {
+    struct stat st;
+    if (stat(name, &st) != 0) {
+        return 0;
+    }
+    return (u64)st.st_blocks * 512;
+}
+
+//Counts a check that did not pass, returns what to print for it
+static inline const char * verdict(uint8_t passed) {
+    if (!passed)
+        bench_failures++;
+    return passed ? "ok" : "FAILED";
+}
+
+//Counts a run with failed operations, returns what to print after it
+static inline const char * run_failed(u64 failures) {
+    if (failures != 0)
+        bench_failures++;
+    return (failures != 0) ? " (failed)" : "";
+}
+
+//Random reads of sectors sectors over the first size bytes, returns kIOPS
+static inline double random_reads(drive_t drive, u64 size, u32 reads, u32 sectors) {
+    static u8 buffer[1 << 20];
+    unsigned seed = 7;
+    u64 failures = 0;
+    double start = now_ns();
+    for (u32 i = 0; i < reads; i++) {
+        failures += read_disk_h(drive, buffer, (u64)(rand_r(&seed) % (size / (sectors * 512))) * sectors, sectors);
+    }
+    run_failed(failures);
+    return reads / ((now_ns() - start) / 1e9) / 1e3;
+}
+
+//Whether the first size bytes of both drives are the same
+static inline uint8_t same_contents(drive_t drive, drive_t other, u64 size) {
+    static u8 chunk[1 << 20];
+    static u8 other_chunk[sizeof(chunk)];
+    for (u64 sector = 0; sector < size / 512; sector += sizeof(chunk) / 512) {
+        if (read_disk_h(drive, chunk, sector, sizeof(chunk) / 512) || read_disk_h(other, other_chunk, sector, sizeof(chunk) / 512) ||
+            memcmp(chunk, other_chunk, sizeof(chunk)) != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static inline int bench_result() {
+    if (bench_failures != 0)
+        printf("failed checks: %u\n", bench_failures);
+    return bench_failures != 0;
+}
+#endif
@@ -0,0 +1,59 @@
+//Drive backend benchmark
+//Registers the same image once per kind of drive in a single process and
+//runs random 4 KiB reads and writes on each, the ops table of the drive
+//picks the backend on every call
+#include "bench.h"
+
+#include <stdlib.h>
+
+#define IMAGE_SIZE      (64u << 20)
+#define BLOCK_SECTORS   8
+#define OPERATIONS      1000000
+
+static void run(const char * name, drive_t drive) {
+    static u8 buffer[BLOCK_SECTORS * 512];
+    u64 blocks = IMAGE_SIZE / sizeof(buffer);
+    u64 failures = 0;
+    unsigned seed = 42;
+    double start = now_ns();
+    for (u32 i = 0; i < OPERATIONS; i++) {
+        u64 sector = (u64)(rand_r(&seed) % blocks) * BLOCK_SECTORS;
+        if (i & 1)
+            failures += read_disk_h(drive, buffer, sector, BLOCK_SECTORS);
+        else
+            failures += write_disk_h(drive, buffer, sector, BLOCK_SECTORS);
+    }
+    failures += ioctl_disk_h(drive, IOCTL_SYNC, 0x0);
+    double ns = (now_ns() - start) / OPERATIONS;
+    printf("%10s %12.1f %12.1f%s\n", name, ns, 1e6 / ns, run_failed(failures));
+}
+
+int main() {
+    const char * images[] = {"bench_backends_fd.img", "bench_backends_mapped.img", "bench_backends_windowed.img"};
+    const char * names[] = {"fd", "mapped", "windowed"};
+    const u32 flags[] = {0, DRIVE_MAPPED, DRIVE_WINDOWED};
+
+    printf("%10s %12s %12s\n", "drive", "ns/op", "kIOPS");
+    for (u32 i = 0; i < 3; i++) {
+        if (create_image(images[i], IMAGE_SIZE, 0, 0) || !register_drive_ex(images[i], names[i], 512, flags[i]))
+            printf("%10s %12s\n", names[i], "unsupported");
+    }
+    if (!register_ram_drive("ram", 512, IMAGE_SIZE / 512)) {
+        printf("%10s %12s\n", "ram", "unsupported");
+    }
+    //Every drive stays registered so the calls share the process
+    for (u32 i = 0; i < 3; i++) {
+        drive_t drive = open_drive(names[i]);
+        if (drive != 0x0)
+            run(names[i], drive);
+    }
+    if (open_drive("ram") != 0x0)
+        run("ram", open_drive("ram"));
+
+    for (u32 i = 0; i < 3; i++) {
+        unregister_drive(names[i]);
+        remove(images[i]);
+    }
+    unregister_drive("ram");
+    return bench_result();
+}
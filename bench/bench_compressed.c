@@ -0,0 +1,204 @@
+//Compressed drive benchmark
+//Builds an image laid out like a file system, mostly free space with
+//metadata tables, text and some incompressible files, converts it into a
+//compressed container and reports how much smaller it is, compares random
+//4 KiB reads against a plain drive over the image, alone and from several
+//threads that check what they read, then rewrites random blocks of both and
+//a range of them with incompressible data until the container is compacted,
+//and checks the container still reads like the image, also once it is
+//registered again
+#include "bench.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define IMAGE           "bench_compressed.img"
+#define CONTAINER       "bench_compressed.fcz"
+#define IMAGE_SIZE      (256u << 20)
+#define GROUP_SIZE      (8u << 20)
+#define BLOCK_SECTORS   8
+#define READS           20000
+#define WRITES          4000
+#define READ_THREADS    4
+#define REWRITE_SIZE    (32u << 20)
+#define REWRITE_PASSES  3
+
+static u8 chunk[1 << 20];
+static const char * words[] = {
+    "the ", "drive ", "sector ", "of ", "a ", "block ", "and ", "file ", "to ", "is ",
+    "write ", "read ", "cache ", "in ", "data\n", "system ", "with ", "for ", "image ", "on "
+};
+
+//Every group starts with bitmaps and an inode table, a third of the rest
+//is text, a twentieth random bytes and the rest free
+static void fill_group(u8 * group, unsigned * seed) {
+    memset(group, 0, GROUP_SIZE);
+    memset(group, 0xFF, 4096);
+    for (u32 inode = 0; inode < 2048; inode++) {
+        u8 * record = group + 8192 + inode * 128;
+        u32 fields[8] = {0x81A4, 1000, inode * 4096, 1700000000 + inode, 1, inode * 8 + 1024, 0, 0};
+        memcpy(record, fields, sizeof(fields));
+    }
+    u32 text_end = GROUP_SIZE / 3;
+    for (u32 offset = 1 << 20; offset < text_end;) {
+        const char * word = words[rand_r(seed) % (sizeof(words) / sizeof(words[0]))];
+        u32 length = (u32)strlen(word);
+        memcpy(group + offset, word, (offset + length <= text_end) ? length : text_end - offset);
+        offset += length;
+    }
+    for (u32 offset = text_end; offset < text_end + GROUP_SIZE / 20; offset++) {
+        group[offset] = (u8)rand_r(seed);
+    }
+}
+
+static int build_image() {
+    FILE * file = fopen(IMAGE, "wb");
+    u8 * group = malloc(GROUP_SIZE);
+    unsigned seed = 11;
+    if (file == 0x0 || group == 0x0) {
+        return 1;
+    }
+    for (u32 offset = 0; offset < IMAGE_SIZE; offset += GROUP_SIZE) {
+        fill_group(group, &seed);
+        fwrite(group, 1, GROUP_SIZE, file);
+    }
+    fclose(file);
+    free(group);
+    return 0;
+}
+
+static drive_t plain;
+static drive_t compressed;
+static u8 checking;
+static u32 wrong_reads[READ_THREADS];
+
+//Reads random blocks of the compressed drive, checking them against the
+//plain one if checking
+static void * reader(void * arg) {
+    u64 thread = (u64)arg;
+    u8 buffer[BLOCK_SECTORS * 512];
+    u8 expected[sizeof(buffer)];
+    unsigned seed = 13 + (unsigned)thread;
+    for (u32 i = 0; i < READS / READ_THREADS; i++) {
+        u64 sector = (u64)(rand_r(&seed) % (IMAGE_SIZE / sizeof(buffer))) * BLOCK_SECTORS;
+        if (read_disk_h(compressed, buffer, sector, BLOCK_SECTORS)) {
+            wrong_reads[thread]++;
+        } else if (checking && (read_disk_h(plain, expected, sector, BLOCK_SECTORS) || memcmp(buffer, expected, sizeof(buffer)) != 0)) {
+            wrong_reads[thread]++;
+        }
+    }
+    return 0x0;
+}
+
+static double threaded_reads() {
+    pthread_t workers[READ_THREADS];
+    double start = now_ns();
+    for (u64 i = 0; i < READ_THREADS; i++) {
+        pthread_create(&workers[i], 0x0, reader, (void *)i);
+    }
+    for (u32 i = 0; i < READ_THREADS; i++) {
+        pthread_join(workers[i], 0x0);
+    }
+    return READS / ((now_ns() - start) / 1e9) / 1e3;
+}
+
+int main() {
+    if (build_image()) {
+        printf("Failed to create the image\n");
+        return 1;
+    }
+    unlink(CONTAINER);
+    if (!register_drive(IMAGE, "/mnt/plain", 512) ||
+        !register_compressed_drive(CONTAINER, "/mnt/compressed", 512, IMAGE_SIZE / 512)) {
+        printf("Failed to register the drives\n");
+        return 1;
+    }
+    plain = open_drive("/mnt/plain");
+    compressed = open_drive("/mnt/compressed");
+
+    double start = now_ns();
+    for (u64 sector = 0; sector < IMAGE_SIZE / 512; sector += sizeof(chunk) / 512) {
+        read_disk_h(plain, chunk, sector, sizeof(chunk) / 512);
+        write_disk_h(compressed, chunk, sector, sizeof(chunk) / 512);
+    }
+    ioctl_disk_h(compressed, IOCTL_SYNC, 0x0);
+    double convert_s = (now_ns() - start) / 1e9;
+    struct disk_storage_stats stats;
+    ioctl_disk_h(compressed, IOCTL_GET_STORAGE_STATS, &stats);
+    printf("%u MiB image: %.1f MiB on disk, container %.1f MiB on disk (%.1fx), %.1f MiB of data compressed %.2fx, converted at %.0f MiB/s\n",
+        IMAGE_SIZE >> 20, (double)allocated(IMAGE) / (1 << 20), (double)allocated(CONTAINER) / (1 << 20),
+        (double)allocated(IMAGE) / allocated(CONTAINER), (double)stats.logical_bytes / (1 << 20),
+        (double)stats.logical_bytes / stats.stored_bytes, (IMAGE_SIZE >> 20) / convert_s);
+
+    double plain_kiops = random_reads(plain, IMAGE_SIZE, READS, BLOCK_SECTORS);
+    double compressed_kiops = random_reads(compressed, IMAGE_SIZE, READS, BLOCK_SECTORS);
+    ioctl_disk_h(compressed, IOCTL_GET_STORAGE_STATS, &stats);
+    printf("random 4 KiB reads: plain %.1f kIOPS, compressed %.1f kIOPS (%.1fx slower), chunk cache hit rate %.1f%%, %.2f MiB of memory\n",
+        plain_kiops, compressed_kiops, plain_kiops / compressed_kiops,
+        100.0 * stats.cache_hits / (stats.cache_hits + stats.cache_misses), (double)stats.memory_bytes / (1 << 20));
+    double threaded_kiops = threaded_reads();
+    checking = 1;
+    threaded_reads();
+    u32 wrong = 0;
+    for (u32 i = 0; i < READ_THREADS; i++) {
+        wrong += wrong_reads[i];
+    }
+    printf("random 4 KiB reads from %u threads: compressed %.1f kIOPS, %u wrong reads%s\n", READ_THREADS, threaded_kiops, wrong,
+        run_failed(wrong));
+
+    u8 buffer[BLOCK_SECTORS * 512];
+    unsigned seed = 3;
+    start = now_ns();
+    for (u32 i = 0; i < WRITES; i++) {
+        u64 sector = (u64)(rand_r(&seed) % (IMAGE_SIZE / sizeof(buffer))) * BLOCK_SECTORS;
+        memset(buffer, (int)i, sizeof(buffer));
+        write_disk_h(plain, buffer, sector, BLOCK_SECTORS);
+        write_disk_h(compressed, buffer, sector, BLOCK_SECTORS);
+    }
+    ioctl_disk_h(compressed, IOCTL_SYNC, 0x0);
+    double write_us = (now_ns() - start) / 1e3 / WRITES;
+    ioctl_disk_h(compressed, IOCTL_GET_STORAGE_STATS, &stats);
+    printf("%u random 4 KiB rewrites: %.1f us each, container %.1f MiB on disk, %.1f MiB garbage, %lu compactions\n",
+        WRITES, write_us, (double)allocated(CONTAINER) / (1 << 20), (double)stats.garbage_bytes / (1 << 20),
+        (unsigned long)stats.compactions);
+    printf("container reads like the image: %s\n", verdict(same_contents(plain, compressed, IMAGE_SIZE)));
+
+    //Every pass leaves the whole previous one as garbage
+    u64 state = 5;
+    start = now_ns();
+    for (u32 pass = 0; pass < REWRITE_PASSES; pass++) {
+        for (u64 sector = 0; sector < REWRITE_SIZE / 512; sector += sizeof(chunk) / 512) {
+            for (u32 i = 0; i < sizeof(chunk); i += 8) {
+                state ^= state << 13;
+                state ^= state >> 7;
+                state ^= state << 17;
+                memcpy(chunk + i, &state, 8);
+            }
+            write_disk_h(plain, chunk, sector, sizeof(chunk) / 512);
+            write_disk_h(compressed, chunk, sector, sizeof(chunk) / 512);
+        }
+    }
+    ioctl_disk_h(compressed, IOCTL_SYNC, 0x0);
+    double rewrite_s = (now_ns() - start) / 1e9;
+    ioctl_disk_h(compressed, IOCTL_GET_STORAGE_STATS, &stats);
+    printf("%u rewrites of %u MiB of random data: %.0f MiB/s, container %.1f MiB on disk, %.1f MiB garbage, %lu compactions%s\n",
+        REWRITE_PASSES, REWRITE_SIZE >> 20, REWRITE_PASSES * (REWRITE_SIZE >> 20) / rewrite_s,
+        (double)allocated(CONTAINER) / (1 << 20), (double)stats.garbage_bytes / (1 << 20),
+        (unsigned long)stats.compactions, run_failed(stats.compactions == 0));
+    printf("compacted container reads like the image: %s\n", verdict(same_contents(plain, compressed, IMAGE_SIZE)));
+    unregister_drive("/mnt/compressed");
+    if (!register_compressed_drive(CONTAINER, "/mnt/compressed", 512, IMAGE_SIZE / 512)) {
+        printf("Failed to register the compacted container again\n");
+        return 1;
+    }
+    compressed = open_drive("/mnt/compressed");
+    printf("compacted container registered again reads like the image: %s\n", verdict(same_contents(plain, compressed, IMAGE_SIZE)));
+
+    unregister_drive("/mnt/plain");
+    unregister_drive("/mnt/compressed");
+    unlink(IMAGE);
+    unlink(CONTAINER);
+    return bench_result();
+}
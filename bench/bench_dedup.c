@@ -0,0 +1,144 @@
+//Deduplicating drive benchmark
+//Builds an image laid out like a file system with superblock backups in
+//every group, inode tables and the same files stored several times, writes
+//it into a deduplicated drive and reports how many distinct blocks it kept
+//and the memory it holds for them, compares writing and random 4 KiB reads
+//against a plain drive, then overwrites some file copies and checks the
+//drive still reads like a plain one given the same writes
+#include "bench.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define IMAGE           "bench_dedup.img"
+#define STORE           "bench_dedup.store"
+#define IMAGE_SIZE      (256u << 20)
+#define GROUP_SIZE      (8u << 20)
+#define FILE_SIZE       (512u << 10)
+#define FILES           8
+#define COPIES          4
+#define BLOCK_SECTORS   8
+#define READS           20000
+
+static u8 chunk[1 << 20];
+static u8 files[FILES][FILE_SIZE];
+
+//The low byte of rand_r repeats too soon to fill blocks that differ
+static u8 random_byte(u64 * state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return (u8)(*state >> 32);
+}
+
+//Every group starts with a copy of the superblock and the group
+//descriptors, a block bitmap and an inode table, holds a copy of some of
+//the files and some data of its own, the rest is free
+static void fill_group(u8 * group, u32 index, u64 * state) {
+    memset(group, 0, GROUP_SIZE);
+    for (u32 i = 0; i < 4096; i++) {
+        group[i] = (u8)(i * 13 + 5);
+    }
+    memset(group + 4096, 0xFF, 1024 + index * 8);
+    for (u32 inode = 0; inode < 1024; inode++) {
+        u32 fields[4] = {0x81A4, 1000, index * 1024 + inode, 1700000000};
+        memcpy(group + 8192 + inode * 256, fields, sizeof(fields));
+    }
+    u32 offset = 1 << 20;
+    for (u32 copy = 0; copy < COPIES; copy++) {
+        memcpy(group + offset, files[(index + copy) % FILES], FILE_SIZE);
+        offset += FILE_SIZE;
+    }
+    for (u32 end = offset + (1 << 20); offset < end; offset++) {
+        group[offset] = random_byte(state);
+    }
+}
+
+static int build_image() {
+    FILE * file = fopen(IMAGE, "wb");
+    u8 * group = malloc(GROUP_SIZE);
+    u64 state = 17;
+    if (file == 0x0 || group == 0x0) {
+        return 1;
+    }
+    for (u32 f = 0; f < FILES; f++) {
+        for (u32 i = 0; i < FILE_SIZE; i++) {
+            files[f][i] = random_byte(&state);
+        }
+    }
+    for (u32 index = 0; index < IMAGE_SIZE / GROUP_SIZE; index++) {
+        fill_group(group, index, &state);
+        fwrite(group, 1, GROUP_SIZE, file);
+    }
+    fclose(file);
+    free(group);
+    return 0;
+}
+
+//Copies the image into the drive, returns MiB/s
+static double fill_drive(drive_t source, drive_t target) {
+    double start = now_ns();
+    for (u64 sector = 0; sector < IMAGE_SIZE / 512; sector += sizeof(chunk) / 512) {
+        read_disk_h(source, chunk, sector, sizeof(chunk) / 512);
+        write_disk_h(target, chunk, sector, sizeof(chunk) / 512);
+    }
+    ioctl_disk_h(target, IOCTL_SYNC, 0x0);
+    return (IMAGE_SIZE >> 20) / ((now_ns() - start) / 1e9);
+}
+
+int main() {
+    if (build_image()) {
+        printf("Failed to create the image\n");
+        return 1;
+    }
+    unlink(STORE);
+    unlink("bench_dedup_copy.img");
+    FILE * copy = fopen("bench_dedup_copy.img", "wb");
+    fseek(copy, IMAGE_SIZE - 1, SEEK_SET);
+    fputc(0, copy);
+    fclose(copy);
+    if (!register_drive(IMAGE, "/mnt/image", 512) || !register_drive("bench_dedup_copy.img", "/mnt/plain", 512) ||
+        !register_dedup_drive(STORE, "/mnt/dedup", 512, IMAGE_SIZE / 512)) {
+        printf("Failed to register the drives\n");
+        return 1;
+    }
+    drive_t image = open_drive("/mnt/image");
+    drive_t plain = open_drive("/mnt/plain");
+    drive_t dedup = open_drive("/mnt/dedup");
+
+    double plain_mbs = fill_drive(image, plain);
+    double dedup_mbs = fill_drive(image, dedup);
+    struct disk_storage_stats stats;
+    ioctl_disk_h(dedup, IOCTL_GET_STORAGE_STATS, &stats);
+    printf("%u MiB image: %.1f MiB of data in %lu distinct blocks, dedup ratio %.2fx, store %.1f MiB on disk, %.2f MiB of memory (%.2f%% of the data)\n",
+        IMAGE_SIZE >> 20, (double)stats.logical_bytes / (1 << 20), (unsigned long)stats.unique_blocks,
+        (double)stats.logical_bytes / stats.stored_bytes, (double)allocated(STORE) / (1 << 20),
+        (double)stats.memory_bytes / (1 << 20), 100.0 * stats.memory_bytes / stats.logical_bytes);
+    printf("writing the image: plain %.0f MiB/s, dedup %.0f MiB/s\n", plain_mbs, dedup_mbs);
+
+    double plain_kiops = random_reads(plain, IMAGE_SIZE, READS, BLOCK_SECTORS);
+    double dedup_kiops = random_reads(dedup, IMAGE_SIZE, READS, BLOCK_SECTORS);
+    printf("random 4 KiB reads: plain %.1f kIOPS, dedup %.1f kIOPS\n", plain_kiops, dedup_kiops);
+
+    //The first file copy of the first groups is overwritten with the same
+    //filler, the file blocks lose references and the filler is stored once
+    memset(chunk, 0x5A, FILE_SIZE);
+    for (u32 group = 0; group < 8; group++) {
+        u64 sector = ((u64)group * GROUP_SIZE + (1 << 20)) / 512;
+        write_disk_h(plain, chunk, sector, FILE_SIZE / 512);
+        write_disk_h(dedup, chunk, sector, FILE_SIZE / 512);
+    }
+    ioctl_disk_h(dedup, IOCTL_GET_STORAGE_STATS, &stats);
+    printf("after overwriting 8 file copies: %lu distinct blocks, dedup ratio %.2fx\n",
+        (unsigned long)stats.unique_blocks, (double)stats.logical_bytes / stats.stored_bytes);
+    printf("dedup drive reads like the image: %s\n", verdict(same_contents(plain, dedup, IMAGE_SIZE)));
+
+    unregister_drive("/mnt/image");
+    unregister_drive("/mnt/plain");
+    unregister_drive("/mnt/dedup");
+    unlink(IMAGE);
+    unlink(STORE);
+    unlink("bench_dedup_copy.img");
+    return bench_result();
+}
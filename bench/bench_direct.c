@@ -0,0 +1,92 @@
+//O_DIRECT benchmark
+//Streams an image through the drive buffered and with DRIVE_DIRECT, with
+//aligned and unaligned buffers, and reports how much of the image the
+//host page cache holds afterwards
+#include "bench.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define IMAGE           "bench_direct.img"
+#define IMAGE_SIZE      (128u << 20)
+#define CHUNK_SECTORS   2048
+
+//Writes the image back and evicts it from the page cache
+static void drop_cache() {
+    int fd = open(IMAGE, O_RDONLY);
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+//Pages of the image resident in the host page cache
+static double cached_mib() {
+    int fd = open(IMAGE, O_RDONLY);
+    void * map = mmap(0x0, IMAGE_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+    long page = sysconf(_SC_PAGESIZE);
+    u64 pages = IMAGE_SIZE / page;
+    unsigned char * resident = malloc(pages);
+    u64 count = 0;
+    if (map != MAP_FAILED && resident != 0x0 && mincore(map, IMAGE_SIZE, resident) == 0) {
+        for (u64 i = 0; i < pages; i++) {
+            count += resident[i] & 1;
+        }
+    }
+    free(resident);
+    if (map != MAP_FAILED)
+        munmap(map, IMAGE_SIZE);
+    close(fd);
+    return (double)count * page / 1048576.0;
+}
+
+static void run(const char * name, u32 flags, u32 misalign, u8 * buffer) {
+    u64 failures = 0;
+    drop_cache();
+    if (!register_drive_ex(IMAGE, "/mnt/direct", 512, flags)) {
+        printf("%14s %12s\n", name, "unsupported");
+        return;
+    }
+    drive_t drive = open_drive("/mnt/direct");
+    u8 * data = buffer + misalign;
+    u64 sectors = IMAGE_SIZE / 512;
+
+    double start = now_ns();
+    for (u64 sector = 0; sector < sectors; sector += CHUNK_SECTORS) {
+        failures += write_disk_h(drive, data, sector, CHUNK_SECTORS);
+    }
+    failures += ioctl_disk_h(drive, IOCTL_SYNC, 0x0);
+    double write_s = (now_ns() - start) / 1e9;
+
+    start = now_ns();
+    for (u64 sector = 0; sector < sectors; sector += CHUNK_SECTORS) {
+        failures += read_disk_h(drive, data, sector, CHUNK_SECTORS);
+    }
+    double read_s = (now_ns() - start) / 1e9;
+
+    double mib = IMAGE_SIZE / 1048576.0;
+    printf("%14s %12.1f %12.1f %14.1f%s\n", name, mib / write_s, mib / read_s, cached_mib(),
+        run_failed(failures));
+    unregister_drive("/mnt/direct");
+}
+
+int main() {
+    u8 * buffer = 0x0;
+    if (create_image(IMAGE, IMAGE_SIZE, 0, 0) || posix_memalign((void **)&buffer, 4096, CHUNK_SECTORS * 512 + 4096) != 0) {
+        printf("Failed to create the image\n");
+        return 1;
+    }
+    for (u32 i = 0; i < CHUNK_SECTORS * 512 + 4096; i++) {
+        buffer[i] = (u8)(i * 31);
+    }
+
+    printf("%14s %12s %12s %14s\n", "mode", "write MiB/s", "read MiB/s", "page cache MiB");
+    run("buffered", 0, 0, buffer);
+    run("direct", DRIVE_DIRECT, 0, buffer);
+    run("direct bounce", DRIVE_DIRECT, 8, buffer);
+
+    free(buffer);
+    remove(IMAGE);
+    return bench_result();
+}
@@ -0,0 +1,60 @@
+//Elevator benchmark
+//Replays the write pattern of a filesystem allocating blocks: a data
+//block, then a rewrite of the bitmap and inode table sectors of its group
+//With the elevator the rewrites are absorbed and adjacent blocks merge
+#include "bench.h"
+
+#include <stdlib.h>
+
+#define IMAGE           "bench_elevator.img"
+#define IMAGE_SIZE      (64u << 20)
+#define BLOCK_SECTORS   2
+#define GROUP_SECTORS   16384
+#define WRITES          60000
+
+int main() {
+    const u32 policies[] = {ELEVATOR_NONE, ELEVATOR_NOOP, ELEVATOR_DEADLINE};
+    const char * names[] = {"none", "noop", "deadline"};
+    u8 block[BLOCK_SECTORS * 512];
+
+    if (create_image(IMAGE, IMAGE_SIZE, 0, 0) || !register_drive(IMAGE, "/mnt/elevator", 512)) {
+        printf("Failed to create the image\n");
+        return 1;
+    }
+    drive_t drive = open_drive("/mnt/elevator");
+    for (u32 i = 0; i < sizeof(block); i++) {
+        block[i] = (u8)i;
+    }
+
+    printf("%10s %12s %12s %12s %12s\n", "policy", "MiB/s", "writes", "host writes", "merge ratio");
+    for (u32 p = 0; p < sizeof(policies) / sizeof(policies[0]); p++) {
+        struct disk_elevator elevator = {policies[p], 2};
+        u64 failures = ioctl_disk_h(drive, IOCTL_SET_ELEVATOR, &elevator);
+
+        u64 groups = IMAGE_SIZE / 512 / GROUP_SECTORS;
+        double start = now_ns();
+        for (u32 i = 0; i < WRITES; i++) {
+            u64 group = (i / 256) % groups;
+            u64 base = group * GROUP_SECTORS;
+            //Blocks of a file are allocated one after the other
+            u64 data = base + 64 + ((i % 256) + 256 * (i / (256 * groups))) * BLOCK_SECTORS;
+            failures += write_disk_h(drive, block, data, BLOCK_SECTORS);
+            failures += write_disk_h(drive, block, base + 2, 1);
+            failures += write_disk_h(drive, block, base + 8 + (i % 16), 1);
+        }
+        failures += ioctl_disk_h(drive, IOCTL_SYNC, 0x0);
+        double elapsed = now_ns() - start;
+
+        struct disk_elevator_stats stats;
+        ioctl_disk_h(drive, IOCTL_GET_ELEVATOR_STATS, &stats);
+        u64 writes = (u64)WRITES * 3;
+        u64 host = (policies[p] == ELEVATOR_NONE) ? writes : stats.dispatched;
+        double bytes = (double)WRITES * (BLOCK_SECTORS + 2) * 512;
+        printf("%10s %12.1f %12lu %12lu %12.2f%s\n", names[p], bytes / 1048576.0 / (elapsed / 1e9),
+            (unsigned long)writes, (unsigned long)host, (double)writes / (double)host, run_failed(failures));
+    }
+
+    unregister_drive("/mnt/elevator");
+    remove(IMAGE);
+    return bench_result();
+}
@@ -0,0 +1,87 @@
+//FTL benchmark
+//Overwrites a RAM drive with random 4 KiB writes, uniform and with 90% of
+//them going to 10% of the drive, under both garbage collection policies,
+//with a tighter wear gap and once more after trimming half of the drive,
+//then reports the write amplification, the GC stall and how even the wear
+//is from the erase count of every block
+#include "bench.h"
+
+#include <stdlib.h>
+
+#define DRIVE_SIZE      (64u << 20)
+#define BLOCK_SECTORS   8
+#define PASSES          4
+
+static drive_t drive;
+static const char * policy_names[] = {"none", "greedy", "cost-benefit"};
+
+static void run(u32 policy, u32 hot, u32 trim, u32 wear_gap) {
+    struct disk_ftl ftl = {0};
+    ftl.policy = policy;
+    ftl.wear_gap = wear_gap;
+    u64 failures = ioctl_disk_h(drive, IOCTL_SET_FTL, &ftl);
+
+    u64 blocks = DRIVE_SIZE / (BLOCK_SECTORS * 512);
+    u64 live = blocks;
+    if (trim) {
+        struct disk_trim range = {blocks / 2 * BLOCK_SECTORS, blocks / 2 * BLOCK_SECTORS};
+        failures += ioctl_disk_h(drive, IOCTL_TRIM, &range);
+        live = blocks / 2;
+    }
+    ioctl_disk_h(drive, IOCTL_RESET_FTL_STATS, 0x0);
+
+    u8 buffer[BLOCK_SECTORS * 512] = {0};
+    unsigned seed = 1;
+    for (u64 i = 0; i < PASSES * blocks; i++) {
+        u64 block = rand_r(&seed) % live;
+        if (hot && rand_r(&seed) % 10 != 0)
+            block = block % (live / 10);
+        failures += write_disk_h(drive, buffer, block * BLOCK_SECTORS, BLOCK_SECTORS);
+    }
+
+    struct disk_ftl_stats stats = {0};
+    failures += ioctl_disk_h(drive, IOCTL_GET_FTL_STATS, &stats);
+    stats.erase_counts = malloc(stats.blocks * sizeof(u32));
+    failures += ioctl_disk_h(drive, IOCTL_GET_FTL_STATS, &stats);
+    double mean = (double)stats.erases / stats.blocks, deviation = 0;
+    for (u64 b = 0; b < stats.blocks; b++) {
+        deviation += (stats.erase_counts[b] > mean) ? stats.erase_counts[b] - mean : mean - stats.erase_counts[b];
+    }
+    free(stats.erase_counts);
+
+    printf("%14s %8s %6s %6u %8.2f %12.1f %8.1f %8.1f %6llu %6llu %6llu%s\n", policy_names[policy],
+        hot ? "90/10" : "uniform", trim ? "half" : "no", wear_gap,
+        (double)stats.nand_pages / stats.host_pages, stats.gc_stall_ns / 1e6,
+        mean, deviation / stats.blocks,
+        (unsigned long long)stats.min_erases, (unsigned long long)stats.max_erases,
+        (unsigned long long)stats.wear_moves, run_failed(failures));
+
+    //Writes the trimmed half back so every run starts from a full drive
+    if (trim) {
+        for (u64 block = blocks / 2; block < blocks; block++) {
+            write_disk_h(drive, buffer, block * BLOCK_SECTORS, BLOCK_SECTORS);
+        }
+    }
+}
+
+int main() {
+    if (!register_ram_drive("/mnt/ftl", 512, DRIVE_SIZE / 512)) {
+        printf("Failed to create the drive\n");
+        return 1;
+    }
+    drive = open_drive("/mnt/ftl");
+
+    printf("%14s %8s %6s %6s %8s %12s %8s %8s %6s %6s %6s\n", "policy", "writes", "trim", "gap",
+        "WA", "GC stall ms", "erases", "mean dev", "min", "max", "moves");
+    for (u32 policy = FTL_GC_GREEDY; policy <= FTL_GC_COST_BENEFIT; policy++) {
+        run(policy, 0, 0, 64);
+        run(policy, 1, 0, 64);
+        run(policy, 1, 0, 8);
+        run(policy, 0, 1, 64);
+    }
+
+    struct disk_ftl off = {0};
+    ioctl_disk_h(drive, IOCTL_SET_FTL, &off);
+    unregister_drive("/mnt/ftl");
+    return bench_result();
+}
@@ -0,0 +1,35 @@
+//Mount registry lookup benchmark
+//Registers up to 10k drives and measures the cost of resolving a mount point
+#include "bench.h"
+
+#define MAX_DRIVES      10000
+#define LOOKUPS         2000000
+
+int main() {
+    static char names[MAX_DRIVES][32];
+    const u32 steps[] = {1, 10, 100, 1000, 10000};
+    u32 registered = 0;
+    u64 unresolved = 0;
+
+    printf("%10s %14s\n", "drives", "ns/lookup");
+    for (u32 s = 0; s < sizeof(steps) / sizeof(steps[0]); s++) {
+        for (; registered < steps[s]; registered++) {
+            snprintf(names[registered], sizeof(names[registered]), "/mnt/bench%u", registered);
+            register_drive_subsection("bench.img", names[registered], 512, 0, 1);
+        }
+
+        double start = now_ns();
+        for (u32 i = 0; i < LOOKUPS; i++) {
+            drive_t drive = open_drive(names[(i * 7919u) % registered]);
+            unresolved += (drive == 0x0);
+        }
+        double elapsed = now_ns() - start;
+        printf("%10u %14.1f%s\n", registered, elapsed / LOOKUPS, run_failed(unresolved));
+        unresolved = 0;
+    }
+
+    for (u32 i = 0; i < registered; i++) {
+        unregister_drive(names[i]);
+    }
+    return bench_result();
+}
@@ -0,0 +1,98 @@
+//Multi-queue submission benchmark
+//Every thread keeps its queue full of random block reads through
+//submit_disk_io, throughput should grow with the submitting threads
+//until the hardware contexts of the drive are busy
+#include "bench.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#define IMAGE           "bench_multiqueue.img"
+#define IMAGE_SIZE      (64u << 20)
+#define BLOCK_SECTORS   8
+#define DEPTH           32
+#define REQUESTS        40000
+#define MAX_THREADS     16
+
+static drive_t drive;
+static volatile u64 failures = 0;
+
+static void * submitter(void * arg) {
+    static _Thread_local u8 buffers[DEPTH][BLOCK_SECTORS * 512];
+    unsigned seed = (unsigned)(unsigned long)arg;
+    u64 blocks = IMAGE_SIZE / (BLOCK_SECTORS * 512);
+    struct disk_completion completions[DEPTH];
+    struct disk_io requests[DEPTH];
+    u32 free_buffers[DEPTH];
+    u32 free_count = DEPTH;
+    u32 submitted = 0;
+    u32 completed = 0;
+    u64 failed = 0;
+
+    for (u32 i = 0; i < DEPTH; i++) {
+        free_buffers[i] = i;
+    }
+    while (completed < REQUESTS) {
+        int count = 0;
+        while (free_count > 0 && submitted + count < REQUESTS) {
+            u32 buffer = free_buffers[--free_count];
+            requests[count].op = DISK_IO_READ;
+            requests[count].count = BLOCK_SECTORS;
+            requests[count].sector = (u64)(rand_r(&seed) % blocks) * BLOCK_SECTORS;
+            requests[count].buffer = buffers[buffer];
+            requests[count].tag = buffer;
+            count++;
+        }
+        int accepted = submit_disk_io(drive, requests, count);
+        if (accepted < 0) {
+            failed++;
+            break;
+        }
+        for (int i = count - 1; i >= accepted; i--) {
+            free_buffers[free_count++] = (u32)requests[i].tag;
+        }
+        submitted += accepted;
+
+        int done = wait_disk_completions(drive, completions, 1, DEPTH);
+        for (int i = 0; i < done; i++) {
+            failed += completions[i].result;
+            free_buffers[free_count++] = (u32)completions[i].tag;
+        }
+        completed += done;
+    }
+    __atomic_fetch_add(&failures, failed, __ATOMIC_RELAXED);
+    return 0x0;
+}
+
+int main() {
+    const u32 threads[] = {1, 2, 4, 8};
+    pthread_t workers[MAX_THREADS];
+
+    if (create_image(IMAGE, IMAGE_SIZE, 31, 0) || !register_drive(IMAGE, "/mnt/multiqueue", 512)) {
+        printf("Failed to create the image\n");
+        return 1;
+    }
+    drive = open_drive("/mnt/multiqueue");
+    u32 depth = DEPTH;
+    ioctl_disk_h(drive, IOCTL_SET_QUEUE_DEPTH, &depth);
+
+    printf("%10s %12s %12s\n", "threads", "kIOPS", "MiB/s");
+    for (u32 t = 0; t < sizeof(threads) / sizeof(threads[0]); t++) {
+        double start = now_ns();
+        for (u32 i = 0; i < threads[t]; i++) {
+            pthread_create(&workers[i], 0x0, submitter, (void *)(unsigned long)(i + 1));
+        }
+        for (u32 i = 0; i < threads[t]; i++) {
+            pthread_join(workers[i], 0x0);
+        }
+        double elapsed = (now_ns() - start) / 1e9;
+        double requests = (double)threads[t] * REQUESTS;
+        printf("%10u %12.1f %12.1f%s\n", threads[t], requests / elapsed / 1e3,
+            requests * BLOCK_SECTORS * 512 / 1048576.0 / elapsed, run_failed(failures));
+        failures = 0;
+    }
+
+    unregister_drive("/mnt/multiqueue");
+    remove(IMAGE);
+    return bench_result();
+}
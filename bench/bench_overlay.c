@@ -0,0 +1,147 @@
+//Overlay drive benchmark
+//Compares copying an image for every test drive with registering
+//copy-on-write overlays that share it, then writes random 4 KiB blocks to
+//every overlay and reports how much their deltas grew, reads random 4 KiB
+//blocks from the overlays and from a plain drive, and commits an overlay
+//into a copy of the image checking the copy afterwards
+#include "bench.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define BASE            "bench_overlay_base.img"
+#define COPY            "bench_overlay_copy.img"
+#define DELTA           "bench_overlay_%u.delta"
+#define IMAGE_SIZE      (256u << 20)
+#define DRIVES          100
+#define BLOCK_SECTORS   8
+#define WRITES          256
+#define READS           20000
+
+static u8 chunk[1 << 20];
+
+static int build_image() {
+    FILE * file = fopen(BASE, "wb");
+    if (file == 0x0) {
+        return 1;
+    }
+    for (u32 offset = 0; offset < IMAGE_SIZE; offset += sizeof(chunk)) {
+        for (u32 i = 0; i < sizeof(chunk); i += 512) {
+            memset(chunk + i, (int)((offset + i) / 512 * 7 + 1), 512);
+        }
+        fwrite(chunk, 1, sizeof(chunk), file);
+    }
+    fclose(file);
+    return 0;
+}
+
+//What the reset target does for every test run
+static double copy_image() {
+    double start = now_ns();
+    FILE * in = fopen(BASE, "rb");
+    FILE * out = fopen(COPY, "wb");
+    size_t done;
+    while ((done = fread(chunk, 1, sizeof(chunk), in)) > 0) {
+        fwrite(chunk, 1, done, out);
+    }
+    fclose(in);
+    fclose(out);
+    return (now_ns() - start) / 1e6;
+}
+
+static void mount_point(char * name, u32 drive) {
+    sprintf(name, "/mnt/overlay%u", drive);
+}
+
+//Commits random writes into the copy and checks every block through a plain drive
+static int commit_copy() {
+    static s32 last[IMAGE_SIZE / (BLOCK_SECTORS * 512)];
+    u8 buffer[BLOCK_SECTORS * 512];
+    unlink("bench_overlay_commit.delta");
+    if (!register_overlay_drive(COPY, "bench_overlay_commit.delta", "/mnt/commit", 512)) {
+        return 1;
+    }
+    drive_t drive = open_drive("/mnt/commit");
+    memset(last, 0xFF, sizeof(last));
+    unsigned seed = 3;
+    for (u32 i = 0; i < WRITES; i++) {
+        u32 block = rand_r(&seed) % (IMAGE_SIZE / sizeof(buffer));
+        memset(buffer, (int)i, sizeof(buffer));
+        write_disk_h(drive, buffer, (u64)block * BLOCK_SECTORS, BLOCK_SECTORS);
+        last[block] = (s32)i;
+    }
+    int failed = !commit_drive("/mnt/commit");
+    unregister_drive("/mnt/commit");
+    unlink("bench_overlay_commit.delta");
+
+    register_drive(COPY, "/mnt/copy", 512);
+    drive = open_drive("/mnt/copy");
+    for (u32 block = 0; block < IMAGE_SIZE / sizeof(buffer) && !failed; block++) {
+        read_disk_h(drive, buffer, (u64)block * BLOCK_SECTORS, BLOCK_SECTORS);
+        u8 expected = (last[block] >= 0) ? (u8)last[block] : (u8)(block * BLOCK_SECTORS * 7 + 1);
+        failed = (buffer[0] != expected);
+    }
+    unregister_drive("/mnt/copy");
+    return failed;
+}
+
+int main() {
+    if (build_image()) {
+        printf("Failed to create the image\n");
+        return 1;
+    }
+    char name[64], delta[64];
+    double copy_ms = copy_image();
+
+    double start = now_ns();
+    for (u32 i = 0; i < DRIVES; i++) {
+        mount_point(name, i);
+        sprintf(delta, DELTA, i);
+        unlink(delta);
+        if (!register_overlay_drive(BASE, delta, name, 512)) {
+            printf("Failed to register overlay %u\n", i);
+            return 1;
+        }
+    }
+    double overlay_ms = (now_ns() - start) / 1e6 / DRIVES;
+    printf("%u MiB image: copy %.1f ms, overlay %.3f ms per drive\n", IMAGE_SIZE >> 20, copy_ms, overlay_ms);
+
+    u8 buffer[BLOCK_SECTORS * 512];
+    memset(buffer, 0xAB, sizeof(buffer));
+    start = now_ns();
+    for (u32 i = 0; i < DRIVES; i++) {
+        mount_point(name, i);
+        drive_t drive = open_drive(name);
+        unsigned seed = i + 1;
+        for (u32 w = 0; w < WRITES; w++) {
+            write_disk_h(drive, buffer, (u64)(rand_r(&seed) % (IMAGE_SIZE / sizeof(buffer))) * BLOCK_SECTORS, BLOCK_SECTORS);
+        }
+    }
+    double write_us = (now_ns() - start) / 1e3 / DRIVES / WRITES;
+    u64 delta_bytes = 0;
+    for (u32 i = 0; i < DRIVES; i++) {
+        sprintf(delta, DELTA, i);
+        delta_bytes += allocated(delta);
+    }
+    printf("%u random 4 KiB writes per drive: %.1f us each, delta %.2f MiB on disk per drive\n",
+        WRITES, write_us, (double)delta_bytes / DRIVES / (1 << 20));
+
+    mount_point(name, 0);
+    double overlay_kiops = random_reads(open_drive(name), IMAGE_SIZE, READS, BLOCK_SECTORS);
+    register_drive(COPY, "/mnt/plain", 512);
+    double plain_kiops = random_reads(open_drive("/mnt/plain"), IMAGE_SIZE, READS, BLOCK_SECTORS);
+    unregister_drive("/mnt/plain");
+    printf("random 4 KiB reads: overlay %.1f kIOPS, plain drive %.1f kIOPS\n", overlay_kiops, plain_kiops);
+
+    for (u32 i = 0; i < DRIVES; i++) {
+        mount_point(name, i);
+        sprintf(delta, DELTA, i);
+        unregister_drive(name);
+        unlink(delta);
+    }
+    printf("commit into a copy of the image: %s\n", verdict(!commit_copy()));
+    unlink(BASE);
+    unlink(COPY);
+    return bench_result();
+}
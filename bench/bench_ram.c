@@ -0,0 +1,76 @@
+//RAM drive benchmark
+//Runs the same random 4 KiB workload on an image drive and on a RAM drive,
+//then times a full checkpoint to a new file and an incremental one after
+//rewriting a small part of the drive
+#include "bench.h"
+
+#include <stdlib.h>
+
+#define IMAGE           "bench_ram.img"
+#define CHECKPOINT      "bench_ram_checkpoint.img"
+#define IMAGE_SIZE      (256u << 20)
+#define BLOCK_SECTORS   8
+#define OPERATIONS      200000
+#define TOUCHED         512
+
+//Half writes, half reads, each one block at a random place
+static double workload(drive_t drive, u64 * failures) {
+    static u8 buffer[BLOCK_SECTORS * 512];
+    u64 blocks = IMAGE_SIZE / sizeof(buffer);
+    unsigned seed = 42;
+    double start = now_ns();
+    for (u32 i = 0; i < OPERATIONS; i++) {
+        u64 sector = (u64)(rand_r(&seed) % blocks) * BLOCK_SECTORS;
+        if (i & 1)
+            *failures += read_disk_h(drive, buffer, sector, BLOCK_SECTORS);
+        else
+            *failures += write_disk_h(drive, buffer, sector, BLOCK_SECTORS);
+    }
+    *failures += ioctl_disk_h(drive, IOCTL_SYNC, 0x0);
+    return OPERATIONS / ((now_ns() - start) / 1e9);
+}
+
+static double timed_checkpoint(const char * filename, u64 * failures) {
+    double start = now_ns();
+    *failures += !checkpoint_drive("/mnt/ram", filename);
+    return (now_ns() - start) / 1e6;
+}
+
+int main() {
+    u64 failures = 0;
+    if (create_image(IMAGE, IMAGE_SIZE, 31, 7)) {
+        printf("Failed to create the image\n");
+        return 1;
+    }
+
+    printf("%14s %12s\n", "drive", "kIOPS");
+    if (register_drive(IMAGE, "/mnt/image", 512)) {
+        printf("%14s %12.1f\n", "image", workload(open_drive("/mnt/image"), &failures) / 1e3);
+        unregister_drive("/mnt/image");
+    }
+    if (!register_ram_drive_from_image(IMAGE, "/mnt/ram", 512)) {
+        printf("%14s %12s\n", "ram", "unsupported");
+        remove(IMAGE);
+        return 1;
+    }
+    drive_t drive = open_drive("/mnt/ram");
+    printf("%14s %12.1f\n", "ram", workload(drive, &failures) / 1e3);
+
+    printf("\n%14s %12s\n", "checkpoint", "ms");
+    printf("%14s %12.1f\n", "full", timed_checkpoint(CHECKPOINT, &failures));
+    static u8 buffer[BLOCK_SECTORS * 512];
+    unsigned seed = 7;
+    for (u32 i = 0; i < TOUCHED; i++) {
+        u64 sector = (u64)(rand_r(&seed) % (IMAGE_SIZE / sizeof(buffer))) * BLOCK_SECTORS;
+        failures += write_disk_h(drive, buffer, sector, BLOCK_SECTORS);
+    }
+    printf("%14s %12.1f\n", "incremental", timed_checkpoint(CHECKPOINT, &failures));
+
+    if (failures)
+        printf("%llu operations failed\n", (unsigned long long)failures);
+    run_failed(failures);
+    unregister_drive("/mnt/ram");
+    remove(CHECKPOINT);
+    remove(IMAGE);
+    return bench_result();
+}
@@ -0,0 +1,50 @@
+//Sequential readahead benchmark
+//Reads an image front to back in ext2 sized blocks with readahead off
+//and with growing maximum windows, and reports how much of it was used
+#include "bench.h"
+
+#include <stdlib.h>
+
+#define IMAGE           "bench_readahead.img"
+#define IMAGE_SIZE      (64u << 20)
+#define BLOCK_SECTORS   2
+#define CACHE_SECTORS   16384
+
+int main() {
+    const u64 windows[] = {0, 16 << 10, 128 << 10, 512 << 10, 2 << 20};
+    u8 block[BLOCK_SECTORS * 512];
+
+    if (create_image(IMAGE, IMAGE_SIZE, 31, 0) || !register_drive(IMAGE, "/mnt/readahead", 512)) {
+        printf("Failed to create the image\n");
+        return 1;
+    }
+    drive_t drive = open_drive("/mnt/readahead");
+
+    printf("%10s %12s %12s %12s %12s\n", "window", "MiB/s", "prefetched", "used", "wasted");
+    for (u32 w = 0; w < sizeof(windows) / sizeof(windows[0]); w++) {
+        u64 cache = 0;
+        ioctl_disk_h(drive, IOCTL_SET_CACHE_SIZE, &cache);
+        cache = CACHE_SECTORS;
+        ioctl_disk_h(drive, IOCTL_SET_CACHE_SIZE, &cache);
+        u64 window = windows[w];
+        ioctl_disk_h(drive, IOCTL_SET_READAHEAD, &window);
+
+        u64 sectors = IMAGE_SIZE / 512;
+        u64 failures = 0;
+        double start = now_ns();
+        for (u64 sector = 0; sector < sectors; sector += BLOCK_SECTORS) {
+            failures += read_disk_h(drive, block, sector, BLOCK_SECTORS);
+        }
+        double elapsed = now_ns() - start;
+
+        struct disk_cache_stats stats;
+        ioctl_disk_h(drive, IOCTL_GET_CACHE_STATS, &stats);
+        printf("%10lu %12.1f %12lu %12lu %12lu%s\n", (unsigned long)window, (IMAGE_SIZE / 1048576.0) / (elapsed / 1e9),
+            (unsigned long)stats.prefetched, (unsigned long)stats.prefetch_used, (unsigned long)stats.prefetch_wasted,
+            run_failed(failures));
+    }
+
+    unregister_drive("/mnt/readahead");
+    remove(IMAGE);
+    return bench_result();
+}
@@ -0,0 +1,72 @@
+//Borrowed read benchmark
+//Reads random 4 KiB metadata blocks with read_disk_h into a buffer and
+//with read_disk_ref, on an image drive, a mapped drive and a RAM drive
+#include "bench.h"
+
+#include <stdlib.h>
+
+#define IMAGE           "bench_ref.img"
+#define IMAGE_SIZE      (64u << 20)
+#define BLOCK_SECTORS   8
+#define OPERATIONS      1000000
+
+//Sums a word of every block so the reads are not optimized out
+static double copied(drive_t drive, u64 * failures, u64 * sum) {
+    static u8 buffer[BLOCK_SECTORS * 512];
+    u64 blocks = IMAGE_SIZE / sizeof(buffer);
+    unsigned seed = 42;
+    double start = now_ns();
+    for (u32 i = 0; i < OPERATIONS; i++) {
+        u64 sector = (u64)(rand_r(&seed) % blocks) * BLOCK_SECTORS;
+        *failures += read_disk_h(drive, buffer, sector, BLOCK_SECTORS);
+        *sum += buffer[i & 4095];
+    }
+    return OPERATIONS / ((now_ns() - start) / 1e9);
+}
+
+static double borrowed(drive_t drive, u64 * failures, u64 * sum) {
+    u64 blocks = IMAGE_SIZE / (BLOCK_SECTORS * 512);
+    unsigned seed = 42;
+    double start = now_ns();
+    for (u32 i = 0; i < OPERATIONS; i++) {
+        u64 sector = (u64)(rand_r(&seed) % blocks) * BLOCK_SECTORS;
+        const void * block;
+        if (read_disk_ref(drive, sector, BLOCK_SECTORS, &block)) {
+            (*failures)++;
+            continue;
+        }
+        *sum += ((const u8 *)block)[i & 4095];
+        *failures += release_disk_ref(drive, block);
+    }
+    return OPERATIONS / ((now_ns() - start) / 1e9);
+}
+
+static void run(const char * name, uint8_t registered) {
+    u64 failures = 0;
+    u64 sum = 0;
+    if (!registered) {
+        printf("%14s %12s\n", name, "unsupported");
+        return;
+    }
+    drive_t drive = open_drive("/mnt/ref");
+    double copy_rate = copied(drive, &failures, &sum);
+    double ref_rate = borrowed(drive, &failures, &sum);
+    printf("%14s %12.1f %12.1f%s\n", name, copy_rate / 1e3, ref_rate / 1e3,
+        (sum == 0) ? run_failed(1) : run_failed(failures));
+    unregister_drive("/mnt/ref");
+}
+
+int main() {
+    if (create_image(IMAGE, IMAGE_SIZE, 31, 7)) {
+        printf("Failed to create the image\n");
+        return 1;
+    }
+
+    printf("%14s %12s %12s\n", "drive", "copy kIOPS", "ref kIOPS");
+    run("image", register_drive(IMAGE, "/mnt/ref", 512));
+    run("mapped", register_drive_ex(IMAGE, "/mnt/ref", 512, DRIVE_MAPPED));
+    run("ram", register_ram_drive_from_image(IMAGE, "/mnt/ref", 512));
+
+    remove(IMAGE);
+    return bench_result();
+}
@@ -0,0 +1,68 @@
+//Sparse image benchmark
+//Scans a mostly unallocated image from start to end the way fsck would,
+//only the allocated extents found at register time reach the host
+#include "bench.h"
+
+#include <stdlib.h>
+
+#define IMAGE           "bench_sparse.img"
+#define IMAGE_SIZE      (256u << 20)
+#define EXTENT_SIZE     (64u << 10)
+#define EXTENT_EVERY    (4u << 20)
+#define CHUNK_SECTORS   256
+#define PASSES          4
+
+static u8 chunk[CHUNK_SECTORS * 512];
+
+//One allocated extent every EXTENT_EVERY bytes, the rest are holes
+static int build_image() {
+    static u8 extent[EXTENT_SIZE];
+    FILE * file = fopen(IMAGE, "wb");
+    if (file == 0x0) {
+        return 1;
+    }
+    for (u32 i = 0; i < sizeof(extent); i++) {
+        extent[i] = (u8)(i * 31 + 1);
+    }
+    for (u32 offset = 0; offset < IMAGE_SIZE; offset += EXTENT_EVERY) {
+        fseek(file, offset, SEEK_SET);
+        fwrite(extent, 1, sizeof(extent), file);
+    }
+    //Extend the file to its full size with a hole
+    fseek(file, IMAGE_SIZE - 1, SEEK_SET);
+    fputc(0, file);
+    fclose(file);
+    return 0;
+}
+
+int main() {
+    u64 failures = 0;
+
+    if (build_image()) {
+        printf("Failed to create the image\n");
+        return 1;
+    }
+    double start = now_ns();
+    if (!register_drive(IMAGE, "/mnt/sparse", 512)) {
+        printf("Failed to register the image\n");
+        return 1;
+    }
+    double register_ms = (now_ns() - start) / 1e6;
+    drive_t drive = open_drive("/mnt/sparse");
+
+    u64 sectors = IMAGE_SIZE / 512;
+    start = now_ns();
+    for (u32 pass = 0; pass < PASSES; pass++) {
+        for (u64 sector = 0; sector < sectors; sector += CHUNK_SECTORS) {
+            failures += read_disk_h(drive, chunk, sector, CHUNK_SECTORS);
+        }
+    }
+    double elapsed = (now_ns() - start) / 1e9;
+
+    printf("%24s %12.2f ms\n", "register", register_ms);
+    printf("%24s %12.1f MiB/s%s\n", "full scan", (double)PASSES * IMAGE_SIZE / 1048576.0 / elapsed, run_failed(failures));
+
+    unregister_drive("/mnt/sparse");
+    remove(IMAGE);
+    return bench_result();
+}
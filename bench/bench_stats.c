@@ -0,0 +1,77 @@
+//Drive statistics benchmark
+//Runs random 4 KiB reads and writes on a RAM drive from one and from
+//several threads, reports the throughput with the counters on and how
+//long a snapshot takes, then prints the counters with dump_drive_stats
+#include "bench.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#define DRIVE_SIZE      (64u << 20)
+#define BLOCK_SECTORS   8
+#define OPERATIONS      500000
+#define THREADS         4
+#define SNAPSHOTS       1000
+
+static drive_t drive;
+static volatile u64 failures = 0;
+
+//Half writes, half reads, each one block at a random place
+static void * workload(void * arg) {
+    u8 buffer[BLOCK_SECTORS * 512] = {0};
+    u64 blocks = DRIVE_SIZE / sizeof(buffer);
+    unsigned seed = (unsigned)(u64)arg;
+    u64 failed = 0;
+    for (u32 i = 0; i < OPERATIONS; i++) {
+        u64 sector = (u64)(rand_r(&seed) % blocks) * BLOCK_SECTORS;
+        if (i & 1)
+            failed += read_disk_h(drive, buffer, sector, BLOCK_SECTORS);
+        else
+            failed += write_disk_h(drive, buffer, sector, BLOCK_SECTORS);
+    }
+    __atomic_fetch_add(&failures, failed, __ATOMIC_RELAXED);
+    return 0x0;
+}
+
+static double run(u32 threads) {
+    pthread_t workers[THREADS];
+    double start = now_ns();
+    for (u64 i = 0; i < threads; i++) {
+        pthread_create(&workers[i], 0x0, workload, (void *)(i + 1));
+    }
+    for (u32 i = 0; i < threads; i++) {
+        pthread_join(workers[i], 0x0);
+    }
+    return (double)threads * OPERATIONS / ((now_ns() - start) / 1e9);
+}
+
+int main() {
+    if (!register_ram_drive("/mnt/stats", 512, DRIVE_SIZE / 512)) {
+        printf("Failed to create the drive\n");
+        return 1;
+    }
+    drive = open_drive("/mnt/stats");
+
+    printf("%14s %12s\n", "threads", "kIOPS");
+    double rate = run(1);
+    printf("%14d %12.1f%s\n", 1, rate / 1e3, run_failed(failures));
+    failures = ioctl_disk_h(drive, IOCTL_RESET_STATS, 0x0);
+    rate = run(THREADS);
+    printf("%14d %12.1f%s\n", THREADS, rate / 1e3, run_failed(failures));
+
+    struct disk_stats * stats = malloc(sizeof(struct disk_stats));
+    failures = 0;
+    double start = now_ns();
+    for (u32 i = 0; i < SNAPSHOTS; i++) {
+        failures += ioctl_disk_h(drive, IOCTL_GET_STATS, stats);
+    }
+    printf("snapshot %.1f us%s\n", (now_ns() - start) / SNAPSHOTS / 1e3, run_failed(failures));
+    //Every request since the reset is counted once
+    printf("counted every request: %s\n\n",
+        verdict(stats->ops[DISK_STATS_READ] + stats->ops[DISK_STATS_WRITE] == (u64)THREADS * OPERATIONS));
+    free(stats);
+
+    dump_drive_stats("/mnt/stats");
+    unregister_drive("/mnt/stats");
+    return bench_result();
+}
@@ -0,0 +1,143 @@
+//Device timing model benchmark
+//Runs random 4 KiB reads and sequential 128 KiB reads on a RAM drive
+//emulating each model with the virtual clock and reports the device time
+//they took, then random reads from more and more threads to show the queue
+//depth the SSD models need to reach their bandwidth, and a run with the
+//real clock checking the wall time and STATUS_BUSY against the model
+#include "bench.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#define DRIVE_SIZE      (256u << 20)
+#define RANDOM_SECTORS  8
+#define SEQUENTIAL_SECTORS 256
+#define OPERATIONS      4000
+#define REAL_OPERATIONS 500
+#define MAX_THREADS     64
+
+static drive_t drive;
+static const char * model_names[] = {"none", "hdd", "sata ssd", "nvme"};
+static volatile int polling;
+static volatile u64 failures = 0;
+
+static void set_model(u32 model, u32 clock) {
+    struct disk_timing timing = {0};
+    timing.model = model;
+    timing.clock = clock;
+    ioctl_disk_h(drive, IOCTL_SET_TIMING, &timing);
+}
+
+static struct disk_timing_stats get_timing() {
+    struct disk_timing_stats stats;
+    ioctl_disk_h(drive, IOCTL_GET_TIMING, &stats);
+    return stats;
+}
+
+static void * random_reader(void * arg) {
+    static _Thread_local u8 buffer[RANDOM_SECTORS * 512];
+    u64 blocks = DRIVE_SIZE / sizeof(buffer);
+    unsigned seed = (unsigned)(u64)arg;
+    u64 failed = 0;
+    for (u32 i = 0; i < OPERATIONS; i++) {
+        failed += read_disk_h(drive, buffer, (u64)(rand_r(&seed) % blocks) * RANDOM_SECTORS, RANDOM_SECTORS);
+    }
+    __atomic_fetch_add(&failures, failed, __ATOMIC_RELAXED);
+    return 0x0;
+}
+
+static void sequential_reads() {
+    u8 * buffer = malloc(SEQUENTIAL_SECTORS * 512);
+    for (u32 i = 0; i < OPERATIONS; i++) {
+        failures += read_disk_h(drive, buffer, (u64)i * SEQUENTIAL_SECTORS % (DRIVE_SIZE / 512), SEQUENTIAL_SECTORS);
+    }
+    free(buffer);
+}
+
+//Device time of threads running random_reader at once
+static double concurrent_reads(u32 threads) {
+    pthread_t workers[MAX_THREADS];
+    for (u64 i = 0; i < threads; i++) {
+        pthread_create(&workers[i], 0x0, random_reader, (void *)(i + 1));
+    }
+    for (u32 i = 0; i < threads; i++) {
+        pthread_join(workers[i], 0x0);
+    }
+    return (double)get_timing().busy_until;
+}
+
+//Samples the status every 50 us, counts[1] of counts[0] samples were busy
+static void * poll_status(void * arg) {
+    u64 * counts = arg;
+    struct timespec pause = {0, 50000};
+    while (polling) {
+        counts[0]++;
+        if (get_disk_status_h(drive) == STATUS_BUSY)
+            counts[1]++;
+        nanosleep(&pause, 0x0);
+    }
+    return 0x0;
+}
+
+int main() {
+    if (!register_ram_drive("/mnt/timing", 512, DRIVE_SIZE / 512)) {
+        printf("Failed to create the drive\n");
+        return 1;
+    }
+    drive = open_drive("/mnt/timing");
+    init_disk_h(drive);
+
+    printf("%10s %14s %14s %12s %10s\n", "model", "random kIOPS", "random us", "seq MB/s", "seeks");
+    for (u32 model = TIMING_HDD; model <= TIMING_NVME; model++) {
+        set_model(model, TIMING_CLOCK_VIRTUAL);
+        random_reader((void *)1);
+        struct disk_timing_stats random = get_timing();
+        set_model(model, TIMING_CLOCK_VIRTUAL);
+        sequential_reads();
+        struct disk_timing_stats sequential = get_timing();
+        printf("%10s %14.2f %14.1f %12.1f %10llu%s\n", model_names[model],
+            OPERATIONS / (random.clock_ns / 1e9) / 1e3,
+            random.clock_ns / 1e3 / OPERATIONS,
+            (double)OPERATIONS * SEQUENTIAL_SECTORS * 512 / (sequential.clock_ns / 1e9) / 1e6,
+            (unsigned long long)random.seeks, run_failed(failures));
+        failures = 0;
+    }
+
+    printf("\n%10s %10s %14s %12s\n", "model", "threads", "random kIOPS", "MB/s");
+    for (u32 model = TIMING_SATA_SSD; model <= TIMING_NVME; model++) {
+        for (u32 threads = 1; threads <= MAX_THREADS; threads *= 4) {
+            set_model(model, TIMING_CLOCK_VIRTUAL);
+            double device_ns = concurrent_reads(threads);
+            double iops = (double)threads * OPERATIONS / (device_ns / 1e9);
+            printf("%10s %10u %14.1f %12.1f%s\n", model_names[model], threads, iops / 1e3,
+                iops * RANDOM_SECTORS * 512 / 1e6, run_failed(failures));
+            failures = 0;
+        }
+    }
+
+    //The host I/O of a RAM drive is far below the model, the wall time
+    //should match it
+    set_model(TIMING_SATA_SSD, TIMING_CLOCK_REAL);
+    u64 samples[2] = {0, 0};
+    u8 buffer[RANDOM_SECTORS * 512];
+    pthread_t poller;
+    polling = 1;
+    pthread_create(&poller, 0x0, poll_status, samples);
+    double start = now_ns();
+    for (u32 i = 0; i < REAL_OPERATIONS; i++) {
+        failures += read_disk_h(drive, buffer, (u64)(i * 7919 % (DRIVE_SIZE / sizeof(buffer))) * RANDOM_SECTORS, RANDOM_SECTORS);
+    }
+    double elapsed = now_ns() - start;
+    polling = 0;
+    pthread_join(poller, 0x0);
+    struct disk_timing_stats real = get_timing();
+    printf("\nreal clock %s: %.1f us per read, model %.1f us, busy in %.0f%% of the samples, idle after: %s%s\n",
+        model_names[TIMING_SATA_SSD], elapsed / 1e3 / REAL_OPERATIONS,
+        (double)(real.queue_ns + real.service_ns) / 1e3 / real.requests,
+        100.0 * samples[1] / (samples[0] ? samples[0] : 1),
+        verdict(get_disk_status_h(drive) == STATUS_READY), run_failed(failures));
+
+    set_model(TIMING_NONE, TIMING_CLOCK_REAL);
+    unregister_drive("/mnt/timing");
+    return bench_result();
+}
@@ -0,0 +1,61 @@
+//Trim benchmark
+//Fills an image, trims every other megabyte of it and compares reading
+//the live and the trimmed halves, along with the space the image takes
+//on the host before and after
+#include "bench.h"
+
+#include <stdlib.h>
+
+#define IMAGE           "bench_trim.img"
+#define IMAGE_SIZE      (64u << 20)
+#define CHUNK_SECTORS   2048
+#define PASSES          8
+
+static u8 chunk[CHUNK_SECTORS * 512];
+
+//Reads every chunk whose index has the given parity
+static double read_half(drive_t drive, u32 parity, u64 * failures) {
+    u64 chunks = IMAGE_SIZE / sizeof(chunk);
+    double start = now_ns();
+    for (u32 pass = 0; pass < PASSES; pass++) {
+        for (u64 i = parity; i < chunks; i += 2) {
+            *failures += read_disk_h(drive, chunk, i * CHUNK_SECTORS, CHUNK_SECTORS);
+        }
+    }
+    double bytes = (double)PASSES * (chunks / 2) * sizeof(chunk);
+    return bytes / 1048576.0 / ((now_ns() - start) / 1e9);
+}
+
+int main() {
+    u64 failures = 0;
+
+    if (create_image(IMAGE, IMAGE_SIZE, 31, 1) || !register_drive(IMAGE, "/mnt/trim", 512)) {
+        printf("Failed to create the image\n");
+        return 1;
+    }
+    drive_t drive = open_drive("/mnt/trim");
+    double before = allocated(IMAGE) / 1048576.0;
+
+    u64 chunks = IMAGE_SIZE / sizeof(chunk);
+    double start = now_ns();
+    for (u64 i = 1; i < chunks; i += 2) {
+        struct disk_trim trim = {i * CHUNK_SECTORS, CHUNK_SECTORS};
+        failures += ioctl_disk_h(drive, IOCTL_TRIM, &trim);
+    }
+    failures += ioctl_disk_h(drive, IOCTL_SYNC, 0x0);
+    double trim_ms = (now_ns() - start) / 1e6;
+
+    printf("%24s %12.1f MiB\n", "allocated before", before);
+    printf("%24s %12.1f MiB\n", "allocated after", allocated(IMAGE) / 1048576.0);
+    printf("%24s %12.2f ms%s\n", "trim half", trim_ms, run_failed(failures));
+    failures = 0;
+    double live = read_half(drive, 0, &failures);
+    printf("%24s %12.1f MiB/s%s\n", "read live", live, run_failed(failures));
+    failures = 0;
+    double trimmed = read_half(drive, 1, &failures);
+    printf("%24s %12.1f MiB/s%s\n", "read trimmed", trimmed, run_failed(failures));
+
+    unregister_drive("/mnt/trim");
+    remove(IMAGE);
+    return bench_result();
+}
@@ -0,0 +1,251 @@
+//Zoned drive benchmark
+//Overwrites random 4 KiB blocks of an emulated SSD once in place and once
+//as a log appended to sequential zones, cleaned by copying the live blocks
+//of the emptiest zone and resetting it, then reports the write
+//amplification of the host log and of the FTL and the device time with the
+//zone resets charged. Then appends to one zone from several threads and
+//checks the zone rules
+#include "bench.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#define DRIVE_SIZE      (64u << 20)
+#define ZONE_SECTORS    2048        //1 MiB, the erase block of the FTL
+#define BLOCK_SECTORS   8
+#define LIVE_ZONES      48          //Zones worth of live blocks, of 63 sequential ones
+#define PASSES          4
+#define APPEND_THREADS  4
+#define APPENDS         256
+
+#define ZONES           (DRIVE_SIZE / 512 / ZONE_SECTORS)
+#define ZONE_BLOCKS     (ZONE_SECTORS / BLOCK_SECTORS)
+#define LIVE_BLOCKS     (LIVE_ZONES * ZONE_BLOCKS)
+#define UNMAPPED        0xFFFFFFFFu
+
+static drive_t drive;
+
+//Host side of the log: where every block lives and which block every slot holds
+static u32 location[LIVE_BLOCKS];
+static u32 owner[ZONES * ZONE_BLOCKS];
+static u32 valid[ZONES];
+static u8  state[ZONES];            //0 free, 1 open, 2 full
+static u32 open_zone;
+static u32 free_zones;
+
+static void start_devices() {
+    struct disk_ftl ftl = {0};
+    ftl.policy = FTL_GC_GREEDY;
+    ioctl_disk_h(drive, IOCTL_SET_FTL, &ftl);
+    struct disk_timing timing = {0};
+    timing.model = TIMING_NVME;
+    timing.clock = TIMING_CLOCK_VIRTUAL;
+    ioctl_disk_h(drive, IOCTL_SET_TIMING, &timing);
+    ioctl_disk_h(drive, IOCTL_RESET_STATS, 0x0);
+}
+
+static void report(const char * layout, u64 user_blocks) {
+    struct disk_ftl_stats ftl = {0};
+    struct disk_timing_stats timing;
+    struct disk_stats * stats = malloc(sizeof(struct disk_stats));
+    ioctl_disk_h(drive, IOCTL_GET_FTL_STATS, &ftl);
+    ioctl_disk_h(drive, IOCTL_GET_TIMING, &timing);
+    ioctl_disk_h(drive, IOCTL_GET_STATS, stats);
+    double host = (double)stats->ops[DISK_STATS_WRITE] / user_blocks;
+    double device = (double)ftl.nand_pages / ftl.host_pages;
+    printf("%10s %8.2f %10.2f %9.2f %8llu %12.1f %12.1f\n", layout, host, device, host * device,
+        (unsigned long long)stats->ops[DISK_STATS_RESET], timing.clock_ns / 1e6,
+        (double)timing.clock_ns / user_blocks / 1e3);
+    free(stats);
+}
+
+static void in_place() {
+    //Only the live blocks are ever written
+    struct disk_trim unused = {LIVE_BLOCKS * BLOCK_SECTORS, DRIVE_SIZE / 512 - LIVE_BLOCKS * BLOCK_SECTORS};
+    ioctl_disk_h(drive, IOCTL_TRIM, &unused);
+    start_devices();
+    u8 buffer[BLOCK_SECTORS * 512] = {0};
+    unsigned seed = 1;
+    for (u64 i = 0; i < PASSES * LIVE_BLOCKS; i++) {
+        write_disk_h(drive, buffer, (u64)(rand_r(&seed) % LIVE_BLOCKS) * BLOCK_SECTORS, BLOCK_SECTORS);
+    }
+    report("in place", PASSES * LIVE_BLOCKS);
+}
+
+static void open_next() {
+    for (u32 z = 1; z < ZONES; z++) {
+        if (state[z] == 0) {
+            state[z] = 1;
+            open_zone = z;
+            free_zones--;
+            return;
+        }
+    }
+}
+
+//Appends the block to the open zone, a full zone is replaced by a free one
+static void log_block(u32 block, u8 * buffer) {
+    u64 written;
+    if (append_disk_zone(drive, buffer, (u64)open_zone * ZONE_SECTORS, BLOCK_SECTORS, &written)) {
+        printf("Append failed\n");
+        exit(1);
+    }
+    u32 slot = (u32)(written / BLOCK_SECTORS);
+    if (location[block] != UNMAPPED) {
+        owner[location[block]] = UNMAPPED;
+        valid[location[block] / ZONE_BLOCKS]--;
+    }
+    location[block] = slot;
+    owner[slot] = block;
+    valid[open_zone]++;
+    if ((slot + 1) % ZONE_BLOCKS == 0) {
+        state[open_zone] = 2;
+        open_next();
+    }
+}
+
+//Moves the live blocks of the full zone with the fewest of them and resets it
+static void clean(u8 * buffer) {
+    u32 victim = 0;
+    for (u32 z = 1; z < ZONES; z++) {
+        if (state[z] == 2 && (victim == 0 || valid[z] < valid[victim]))
+            victim = z;
+    }
+    for (u32 slot = victim * ZONE_BLOCKS; slot < (victim + 1) * ZONE_BLOCKS; slot++) {
+        if (owner[slot] != UNMAPPED) {
+            read_disk_h(drive, buffer, (u64)slot * BLOCK_SECTORS, BLOCK_SECTORS);
+            log_block(owner[slot], buffer);
+        }
+    }
+    u64 sector = (u64)victim * ZONE_SECTORS;
+    ioctl_disk_h(drive, IOCTL_RESET_ZONE, &sector);
+    state[victim] = 0;
+    free_zones++;
+}
+
+static void zoned_log() {
+    struct disk_zoned zones = {ZONE_SECTORS, 1};
+    ioctl_disk_h(drive, IOCTL_SET_ZONES, &zones);
+    //The drive was written in place, every sequential zone starts full
+    for (u32 z = 1; z < ZONES; z++) {
+        u64 sector = (u64)z * ZONE_SECTORS;
+        ioctl_disk_h(drive, IOCTL_RESET_ZONE, &sector);
+    }
+    memset(location, 0xFF, sizeof(location));
+    memset(owner, 0xFF, sizeof(owner));
+    memset(state, 0, sizeof(state));
+    memset(valid, 0, sizeof(valid));
+    free_zones = ZONES - 1;
+    open_next();
+
+    u8 buffer[BLOCK_SECTORS * 512] = {0};
+    for (u32 block = 0; block < LIVE_BLOCKS; block++) {
+        log_block(block, buffer);
+    }
+    start_devices();
+    unsigned seed = 1;
+    for (u64 i = 0; i < PASSES * LIVE_BLOCKS; i++) {
+        //One free zone is kept for the live blocks of the next victim
+        while (free_zones < 2) {
+            clean(buffer);
+        }
+        log_block((u32)(rand_r(&seed) % LIVE_BLOCKS), buffer);
+    }
+    report("zoned log", PASSES * LIVE_BLOCKS);
+}
+
+static u64 append_sectors[APPEND_THREADS][APPENDS];
+
+static void * appender(void * arg) {
+    u64 thread = (u64)arg;
+    u8 buffer[512];
+    for (u32 i = 0; i < APPENDS; i++) {
+        memset(buffer, (int)(thread * APPENDS + i), sizeof(buffer));
+        buffer[0] = (u8)thread;
+        buffer[1] = (u8)i;
+        if (append_disk_zone(drive, buffer, ZONE_SECTORS, 1, &append_sectors[thread][i]))
+            append_sectors[thread][i] = UNMAPPED;
+    }
+    return 0x0;
+}
+
+//Every append got its own sector and holds what it wrote
+static void concurrent_appends() {
+    u64 sector = ZONE_SECTORS;
+    ioctl_disk_h(drive, IOCTL_RESET_ZONE, &sector);
+    pthread_t workers[APPEND_THREADS];
+    for (u64 i = 0; i < APPEND_THREADS; i++) {
+        pthread_create(&workers[i], 0x0, appender, (void *)i);
+    }
+    for (u32 i = 0; i < APPEND_THREADS; i++) {
+        pthread_join(workers[i], 0x0);
+    }
+    u32 wrong = 0;
+    u8 buffer[512];
+    for (u32 t = 0; t < APPEND_THREADS; t++) {
+        for (u32 i = 0; i < APPENDS; i++) {
+            if (read_disk_h(drive, buffer, append_sectors[t][i], 1) || buffer[0] != t || buffer[1] != (u8)i)
+                wrong++;
+        }
+    }
+    struct disk_zone zone;
+    struct disk_zone_report request = {ZONE_SECTORS, 1, 0, &zone};
+    ioctl_disk_h(drive, IOCTL_REPORT_ZONES, &request);
+    printf("\n%u appends from %u threads, %u misplaced, write pointer %llu sectors into the zone%s\n",
+        APPEND_THREADS * APPENDS, APPEND_THREADS, wrong, (unsigned long long)(zone.write_pointer - zone.start),
+        run_failed(wrong + (zone.write_pointer - zone.start != APPEND_THREADS * APPENDS)));
+}
+
+static void check(const char * rule, uint8_t passed) {
+    printf("%-48s %s\n", rule, verdict(passed));
+}
+
+static void zone_rules() {
+    u8 buffer[BLOCK_SECTORS * 512] = {0};
+    u64 zone = 2 * ZONE_SECTORS;
+    u32 error = 0;
+    ioctl_disk_h(drive, IOCTL_RESET_ZONE, &zone);
+    printf("\n");
+    check("conventional zone written anywhere", write_disk_h(drive, buffer, 100, BLOCK_SECTORS) == OP_SUCCESS);
+    check("write at the write pointer", write_disk_h(drive, buffer, zone, BLOCK_SECTORS) == OP_SUCCESS);
+    uint8_t failed = write_disk_h(drive, buffer, zone + 2 * BLOCK_SECTORS, BLOCK_SECTORS) == OP_FAILURE;
+    ioctl_disk_h(drive, IOCTL_GET_LAST_ERROR, &error);
+    check("write past the write pointer fails with EIO", failed && error == EIO);
+    check("write across zones fails", write_disk_h(drive, buffer, zone - 4, BLOCK_SECTORS) == OP_FAILURE);
+    ioctl_disk_h(drive, IOCTL_FINISH_ZONE, &zone);
+    check("write to a finished zone fails", write_disk_h(drive, buffer, zone + BLOCK_SECTORS, BLOCK_SECTORS) == OP_FAILURE);
+    ioctl_disk_h(drive, IOCTL_RESET_ZONE, &zone);
+    ioctl_disk_h(drive, IOCTL_OPEN_ZONE, &zone);
+    struct disk_zone state;
+    struct disk_zone_report request = {zone, 1, 0, &state};
+    ioctl_disk_h(drive, IOCTL_REPORT_ZONES, &request);
+    check("reset rewinds and open opens", state.write_pointer == zone && state.condition == ZONE_COND_EXPLICIT_OPEN);
+    read_disk_h(drive, buffer, zone, 1);
+    check("reset zone reads as zeros", buffer[0] == 0 && buffer[511] == 0);
+}
+
+int main() {
+    if (!register_ram_drive("/mnt/zoned", 512, DRIVE_SIZE / 512)) {
+        printf("Failed to create the drive\n");
+        return 1;
+    }
+    drive = open_drive("/mnt/zoned");
+    init_disk_h(drive);
+
+    printf("%10s %8s %10s %9s %8s %12s %12s\n", "layout", "host WA", "device WA", "total WA", "resets",
+        "device ms", "us per write");
+    in_place();
+    zoned_log();
+
+    struct disk_ftl ftl_off = {0};
+    struct disk_timing timing_off = {0};
+    ioctl_disk_h(drive, IOCTL_SET_FTL, &ftl_off);
+    ioctl_disk_h(drive, IOCTL_SET_TIMING, &timing_off);
+    concurrent_appends();
+    zone_rules();
+
+    unregister_drive("/mnt/zoned");
+    return bench_result();
+}
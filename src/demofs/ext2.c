@@ -52,18 +52,24 @@ char * ext2_file_type_names[8] = {
 struct ext2_partition * ext2_register_partition(const char* disk, uint32_t lba) {
     EXT2_INFO("Registering partition on disk %s at LBA %d", disk, lba);
 
-    if (!ext2_check_status(disk)) {
+    drive_t drive = open_drive(disk);
+    if (drive == 0) {
+        EXT2_WARN("Disk is not registered");
+        return EXT2_RESULT_ERROR;
+    }
+
+    if (!ext2_check_status(drive)) {
         EXT2_WARN("Disk is not ready");
         return EXT2_RESULT_ERROR;
     }
 
     uint32_t sector_size;
-    ioctl_disk(disk, IOCTL_GET_SECTOR_SIZE, &sector_size);
+    ioctl_disk_h(drive, IOCTL_GET_SECTOR_SIZE, &sector_size);
 
     EXT2_DEBUG("Disk %s is ready, sector size is %d", disk, sector_size);
 
     uint8_t superblock_buffer[1024];
-    if (read_disk(disk, superblock_buffer, lba+SB_OFFSET_LBA, 2)) {
+    if (read_disk_h(drive, superblock_buffer, lba+SB_OFFSET_LBA, 2)) {
         EXT2_ERROR("Failed to read superblock");
         return EXT2_RESULT_ERROR;
     }
@@ -101,7 +107,7 @@ struct ext2_partition * ext2_register_partition(const char* disk, uint32_t lba)
     uint32_t sectors_per_group = blocks_per_group * sectors_per_block;
     uint8_t dummy_sb_buffer[1024];
     for (uint32_t i = 0; i < block_groups_first; i++) {
-        if (read_disk(disk, dummy_sb_buffer, lba+(i*sectors_per_group)+SB_OFFSET_LBA, 2)) {
+        if (read_disk_h(drive, dummy_sb_buffer, lba+(i*sectors_per_group)+SB_OFFSET_LBA, 2)) {
             EXT2_ERROR("Failed to read dummy superblock");
             return EXT2_RESULT_ERROR;
         }
@@ -119,7 +125,7 @@ struct ext2_partition * ext2_register_partition(const char* disk, uint32_t lba)
 
     void * block_group_descriptor_buffer = malloc(block_group_descriptors_size * sector_size);
     
-    if (read_disk(disk, (uint8_t*)block_group_descriptor_buffer, lba+(sectors_per_block*bgdt_block), block_group_descriptors_size)) {
+    if (read_disk_h(drive, (uint8_t*)block_group_descriptor_buffer, lba+(sectors_per_block*bgdt_block), block_group_descriptors_size)) {
         EXT2_ERROR("Failed to read block group descriptor table");
         return EXT2_RESULT_ERROR;
     }
@@ -143,7 +149,7 @@ struct ext2_partition * ext2_register_partition(const char* disk, uint32_t lba)
     }
 
     snprintf(partition->name, 32, "%sp%d", disk, partition_id);
-    snprintf(partition->disk, 32, "%s", disk);
+    partition->drive = drive;
     partition->group_number = block_groups_first;
     partition->lba = lba;
     partition->sector_size = sector_size;
@@ -21,7 +21,7 @@ int64_t ext2_read_block(struct ext2_partition* partition, uint32_t block, uint8_
     uint32_t block_lba = (block * block_size) / partition->sector_size;
 
     if (block > 0) {
-        if (read_disk(partition->disk, destination_buffer, partition->lba + block_lba, block_sectors)) {
+        if (read_disk_h(partition->drive, destination_buffer, partition->lba + block_lba, block_sectors)) {
             EXT2_ERROR("Failed to read block %d", block);
             return EXT2_READ_FAILED;
         }
@@ -33,31 +33,53 @@ int64_t ext2_read_block(struct ext2_partition* partition, uint32_t block, uint8_
     return 1;
 }
 
+//Fills iov with the run of physically consecutive blocks starting at blocks[0]
+//Returns the run length, 0 if blocks[0] is not a valid block
+static uint32_t ext2_block_run(struct ext2_partition* partition, uint32_t * blocks, uint32_t max, uint8_t * buffer, uint64_t count, struct disk_iovec * iov) {
+    uint32_t block_size = 1024 << (((struct ext2_superblock*)partition->sb)->s_log_block_size);
+    uint32_t block_sectors = DIVIDE_ROUNDED_UP(block_size, partition->sector_size);
+    //Blocks smaller than a sector share sectors, those go one at a time
+    uint32_t limit = (block_size % partition->sector_size) ? 1 : EXT2_MAX_BLOCK_RUN;
+    uint32_t run = 0;
+
+    if (blocks[0] == 0) {
+        return 0;
+    }
+    while (run < max && run < count && run < limit && blocks[run] == blocks[0] + run) {
+        iov[run].buffer = buffer + (uint64_t)run * block_size;
+        iov[run].count = block_sectors;
+        run++;
+    }
+    return run;
+}
+
 int64_t ext2_read_direct_blocks(struct ext2_partition* partition, uint32_t * blocks, uint32_t max, uint8_t * destination_buffer, uint64_t count, uint64_t * skip_count) {
     uint32_t block_size = 1024 << (((struct ext2_superblock*)partition->sb)->s_log_block_size);
+    struct disk_iovec iov[EXT2_MAX_BLOCK_RUN];
     uint64_t blocks_read = 0;
+    uint32_t i = 0;
 
-    for (uint32_t i = 0; i < max; i++) {
-        if (*skip_count > 0) {
-            (*skip_count)--;
-            continue;
-        }
-
-        int64_t read_result = ext2_read_block(partition, blocks[i], destination_buffer);
+    while (i < max && *skip_count > 0) {
+        (*skip_count)--;
+        i++;
+    }
 
-        if (read_result == EXT2_READ_FAILED) {
-            return EXT2_READ_FAILED;
-        } else if (read_result == 0) {
-            return blocks_read;
+    while (i < max && blocks_read < count) {
+        uint32_t run = ext2_block_run(partition, &blocks[i], max - i, destination_buffer, count - blocks_read, iov);
+        if (run == 0) {
+            //Reports the invalid block
+            return (ext2_read_block(partition, blocks[i], destination_buffer) == EXT2_READ_FAILED) ? EXT2_READ_FAILED : (int64_t)blocks_read;
         }
 
-        destination_buffer += block_size;
-        blocks_read += read_result;
-        
-        if (blocks_read == count) {
-            break;
+        uint32_t block_lba = (blocks[i] * block_size) / partition->sector_size;
+        if (read_disk_v(partition->drive, iov, run, partition->lba + block_lba)) {
+            EXT2_ERROR("Failed to read blocks %d to %d", blocks[i], blocks[i] + run - 1);
+            return EXT2_READ_FAILED;
         }
 
+        destination_buffer += (uint64_t)run * block_size;
+        blocks_read += run;
+        i += run;
     }
 
     return blocks_read;
@@ -160,7 +182,7 @@ int64_t ext2_write_block(struct ext2_partition* partition, uint32_t block, uint8
     uint32_t block_lba = (block * block_size) / partition->sector_size;
 
     if (block) {
-        if (write_disk(partition->disk, source_buffer, partition->lba + block_lba, block_sectors)) {
+        if (write_disk_h(partition->drive, source_buffer, partition->lba + block_lba, block_sectors)) {
             EXT2_ERROR("Failed to write block %d", block);
             return EXT2_WRITE_FAILED;
         }
@@ -174,29 +196,33 @@ int64_t ext2_write_block(struct ext2_partition* partition, uint32_t block, uint8
 
 int64_t ext2_write_direct_blocks(struct ext2_partition* partition, uint32_t * blocks, uint32_t max, uint8_t * source_buffer, uint64_t count, uint64_t * skip) {
     uint32_t block_size = 1024 << (((struct ext2_superblock*)partition->sb)->s_log_block_size);
+    struct disk_iovec iov[EXT2_MAX_BLOCK_RUN];
     uint64_t blocks_written = 0;
+    uint32_t i = 0;
 
-    for (uint32_t i = 0; i < max; i++) {
+    while (i < max && *skip > 0) {
         if (blocks[i] == 0) EXT2_WARN("Direct block is 0");
-        if (*skip > 0) {
-            *skip -= 1;
-            continue;
-        }
-        int64_t write_result = ext2_write_block(partition, blocks[i], source_buffer);
+        *skip -= 1;
+        i++;
+    }
 
-        if (write_result == EXT2_WRITE_FAILED) {
-            return EXT2_WRITE_FAILED;
-        } else if (write_result == 0) {
-            return blocks_written;
+    while (i < max && blocks_written < count) {
+        uint32_t run = ext2_block_run(partition, &blocks[i], max - i, source_buffer, count - blocks_written, iov);
+        if (run == 0) {
+            EXT2_WARN("Direct block is 0");
+            //Reports the invalid block
+            return (ext2_write_block(partition, blocks[i], source_buffer) == EXT2_WRITE_FAILED) ? EXT2_WRITE_FAILED : (int64_t)blocks_written;
         }
 
-        source_buffer += block_size;
-        blocks_written += write_result;
-        
-        if (blocks_written == count) {
-            break;
+        uint32_t block_lba = (blocks[i] * block_size) / partition->sector_size;
+        if (write_disk_v(partition->drive, iov, run, partition->lba + block_lba)) {
+            EXT2_ERROR("Failed to write blocks %d to %d", blocks[i], blocks[i] + run - 1);
+            return EXT2_WRITE_FAILED;
         }
 
+        source_buffer += (uint64_t)run * block_size;
+        blocks_written += run;
+        i += run;
     }
 
     return blocks_written;
@@ -5,6 +5,8 @@
 #include "ext2_inode.h"
 
 #define EXT2_DEALLOCATE_FAILED 0xFFFFFFFC
+//Most physically consecutive blocks moved with a single scatter-gather transfer
+#define EXT2_MAX_BLOCK_RUN 64
 
 int64_t ext2_read_block(struct ext2_partition* partition, uint32_t block, uint8_t * destination_buffer);
 int64_t ext2_write_block(struct ext2_partition* partition, uint32_t block, uint8_t * source_buffer);
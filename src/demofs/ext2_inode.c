@@ -197,7 +197,7 @@ uint8_t* ext2_read_inode_bitmap(struct ext2_partition* partition, uint32_t inode
         return 0;
     }
 
-    if (read_disk(partition->disk, inode_bitmap_buffer, partition->lba + inode_bitmap_lba, sectors_per_block)) {
+    if (read_disk_h(partition->drive, inode_bitmap_buffer, partition->lba + inode_bitmap_lba, sectors_per_block)) {
         EXT2_ERROR("Inode read failed");
         free(inode_bitmap_buffer);
         return 0;
@@ -214,7 +214,7 @@ uint8_t ext2_write_inode_bitmap(struct ext2_partition* partition, uint32_t inode
     
     uint32_t inode_bitmap_block = partition->gd[inode_group].bg_inode_bitmap;
     uint32_t inode_bitmap_lba = (inode_bitmap_block * block_size) / partition->sector_size;
-    if (write_disk(partition->disk, inode_bitmap, partition->lba + inode_bitmap_lba, sectors_per_block)) {
+    if (write_disk_h(partition->drive, inode_bitmap, partition->lba + inode_bitmap_lba, sectors_per_block)) {
         EXT2_ERROR("Inode write failed");
         return 1;
     }
@@ -241,7 +241,7 @@ uint8_t ext2_write_inode(struct ext2_partition* partition, uint32_t inode_number
         return 1;
     }
 
-    if (read_disk(partition->disk, root_inode_buffer, partition->lba + inode_table_lba + inode_block*sectors_per_block, sectors_per_block)) {
+    if (read_disk_h(partition->drive, root_inode_buffer, partition->lba + inode_table_lba + inode_block*sectors_per_block, sectors_per_block)) {
         EXT2_ERROR("Root inode read failed");
         free(root_inode_buffer);
         return 1;
@@ -254,7 +254,7 @@ uint8_t ext2_write_inode(struct ext2_partition* partition, uint32_t inode_number
         return 1;
     }
 
-    if (write_disk(partition->disk, root_inode_buffer, partition->lba + inode_table_lba + inode_block*sectors_per_block, sectors_per_block)) {
+    if (write_disk_h(partition->drive, root_inode_buffer, partition->lba + inode_table_lba + inode_block*sectors_per_block, sectors_per_block)) {
         EXT2_ERROR("Root inode write failed");
         free(root_inode_buffer);
         return 1;
@@ -279,33 +279,26 @@ struct ext2_inode_descriptor * ext2_read_inode(struct ext2_partition* partition,
     uint32_t inode_block = (inode_index * inode_size) / (block_size);
     uint32_t inode_table_block = partition->gd[inode_group].bg_inode_table;
     uint32_t inode_table_lba = (inode_table_block * block_size) / partition->sector_size;
-    uint8_t * root_inode_buffer = malloc(block_size);
-    if (root_inode_buffer == 0) {
-        EXT2_ERROR("Failed to allocate memory for root inode");
-        return 0;
-    }
 
-    if (read_disk(partition->disk, root_inode_buffer, partition->lba + inode_table_lba + inode_block*sectors_per_block, sectors_per_block)) {
+    //Only the sectors holding the inode, borrowed from the drive when it keeps them in memory
+    uint32_t inode_offset = (inode_index * inode_size) % block_size;
+    uint32_t first_sector = inode_offset / partition->sector_size;
+    uint32_t sector_count = (inode_offset + inode_size - 1) / partition->sector_size - first_sector + 1;
+    const void * inode_sectors;
+    if (read_disk_ref(partition->drive, partition->lba + inode_table_lba + inode_block*sectors_per_block + first_sector, sector_count, &inode_sectors)) {
         EXT2_ERROR("Root inode read failed");
-        free(root_inode_buffer);
         return 0;
     }
 
     struct ext2_inode_descriptor * inode = malloc(inode_size);
     if (inode == 0) {
         EXT2_ERROR("Failed to allocate memory for root inode");
-        free(root_inode_buffer);
+        release_disk_ref(partition->drive, inode_sectors);
         return 0;
     }
 
-    if (memcpy(inode, root_inode_buffer + (((inode_index * inode_size) % block_size)), inode_size) == 0) {
-        EXT2_ERROR("Failed to copy root inode");
-        free(root_inode_buffer);
-        free(inode);
-        return 0;
-    }
-
-    free(root_inode_buffer);
+    memcpy(inode, (const uint8_t *)inode_sectors + (inode_offset - first_sector * partition->sector_size), inode_size);
+    release_disk_ref(partition->drive, inode_sectors);
 
     return inode;
 }
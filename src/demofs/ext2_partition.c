@@ -10,7 +10,7 @@
 void ext2_dump_partition(struct ext2_partition* partition) {
     printf("ext2 partition:\n");
     printf("name: %s\n", partition->name);
-    printf("disk: %s\n", partition->disk);
+    printf("drive: %p\n", (void*)partition->drive);
     printf("lba: %u\n", partition->lba);
     printf("group_number: %u\n", partition->group_number);
     printf("sector_size: %u\n", partition->sector_size);
@@ -35,15 +35,15 @@ void ext2_disk_from_partition(char * destination, const char * partition) {
     }
 }
 
-uint8_t ext2_check_status(const char* disk) {
-    int status = get_disk_status(disk);
-    EXT2_DEBUG("Checking disk %s status", disk);
+uint8_t ext2_check_status(drive_t drive) {
+    int status = get_disk_status_h(drive);
+    EXT2_DEBUG("Checking disk %p status", (void*)drive);
     if (status != STATUS_READY) {
-        if (init_disk(disk) != OP_SUCCESS) {
+        if (init_disk_h(drive) != OP_SUCCESS) {
             EXT2_WARN("Failed to initialize disk");
             return 0;
         }
-        if (get_disk_status(disk) != STATUS_READY) {
+        if (get_disk_status_h(drive) != STATUS_READY) {
             EXT2_WARN("Disk not ready");
             return 0;
         }
@@ -2,11 +2,12 @@
 #define _EXT2_PARTITION_H
 
 #include "ext2.h"
+#include "../fused/primitives.h"
 #include <stdint.h>
 
 struct ext2_partition {
     char name[32];
-    char disk[32];
+    drive_t drive;
     uint32_t lba;
     uint32_t group_number;
     uint32_t sector_size;
@@ -19,7 +20,7 @@ struct ext2_partition {
 };
 
 void ext2_disk_from_partition(char * destination, const char * partition);
-uint8_t ext2_check_status(const char* disk);
+uint8_t ext2_check_status(drive_t drive);
 struct ext2_partition * get_partition(struct ext2_partition* partition, const char * partno);
 void ext2_dump_partition(struct ext2_partition* partition);
 #endif /* _EXT2_PARTITION_H */
\ No newline at end of file
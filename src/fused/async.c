@@ -0,0 +1,636 @@
+#include "async.h"
+#include "discard.h"
+#include "backend.h"
+#include "stats.h"
+
+//io_uring works on the file descriptor, other drives use the workers
+#ifndef __ASYNC_THREADS
+#define ASYNC_URING
+//Slots of the io_uring of a hardware context, per request of depth
+#define ASYNC_RING_FACTOR   4
+#endif
+
+//Serializes creating and dropping the queue of a drive
+static __fuse_mutex_t create_lock = __fuse_MUTEX_INITIALIZER;
+static u64 next_queue_id = 1;
+static u64 next_thread_id = 1;
+//Every queue, under create_lock, for threads leaving their contexts
+static struct async_queue * queues = 0x0;
+//Holds the id of a thread that submitted so its contexts are left when it exits
+static __fuse_thread_key_t exit_key;
+static __fuse_once_t exit_key_once = __fuse_ONCE_INIT;
+static uint8_t exit_key_ready = 0;
+
+//Contexts of the calling thread on the drives it used last, a queue id
+//is never reused so a binding to a dropped queue cannot match
+struct async_binding {
+    u64  queue_id;
+    struct async_context * context;
+};
+static _Thread_local u64 thread_id = 0;
+static _Thread_local struct async_binding bindings[ASYNC_BINDINGS];
+static _Thread_local u32 binding_next = 0;
+
+static uint8_t valid_request(struct mount * mount, const struct disk_io * request) {
+    if (request->op == DISK_IO_SYNC) {
+        return 1;
+    }
+    if (request->op != DISK_IO_READ && request->op != DISK_IO_WRITE) {
+        return 0;
+    }
+    //The kernel takes 32 bit lengths
+    return request->buffer != 0x0 && request->count > 0 && request->count <= mount->sector_count &&
+        request->sector <= mount->sector_count - request->count &&
+        (u64)request->count * mount->sector_size <= 0xFFFFFFFFULL;
+}
+
+//Only one thread posts to a context at a time, the ring cannot overflow
+//as a context never has more than depth requests outstanding
+static void post_completion(struct async_context * context, u64 tag, int result, int error) {
+    u32 tail = context->completion_tail;
+    struct disk_completion * entry = &context->completions[tail & context->mask];
+    entry->tag = tag;
+    entry->result = result;
+    entry->error = error;
+    __fuse_store_release(&context->completion_tail, tail + 1);
+
+    __fuse_fence();
+    if (__fuse_load_acquire(&context->waiting)) {
+        __fuse_mutex_lock(&context->lock);
+        __fuse_cond_signal(&context->wake);
+        __fuse_mutex_unlock(&context->lock);
+    }
+}
+
+//The worker and the reaper of a hardware context post under its lock
+static void complete(struct async_hw * hw, struct async_context * context, u64 tag, int result, int error) {
+#ifdef ASYNC_URING
+    if (hw->ring != 0x0) {
+        __fuse_mutex_lock(&hw->lock);
+        post_completion(context, tag, result, error);
+        __fuse_mutex_unlock(&hw->lock);
+        return;
+    }
+#endif
+    (void)hw;
+    post_completion(context, tag, result, error);
+}
+
+#ifdef ASYNC_URING
+//The cache, the elevator, the timing model, the FTL and the zones only see requests made through them
+static uint8_t uring_usable(struct async_hw * hw) {
+    struct mount * mount = hw->queue->mount;
+    return hw->ring != 0x0 && mount->cache == 0x0 && mount->elevator == 0x0 &&
+        mount->timing == 0x0 && mount->ftl == 0x0 && mount->zones == 0x0;
+}
+
+static void prepare_slot(struct async_hw * hw, u32 slot) {
+    struct async_slot * request = &hw->slots[slot];
+    __fuse_uring_prepare(hw->ring, request->op, hw->queue->mount->file_handle, request->buffer, request->length, request->offset, slot);
+    hw->unsubmitted++;
+}
+
+static void submit_ring(struct async_hw * hw) {
+    int done = __fuse_uring_submit(hw->ring);
+    if (done > 0) {
+        hw->unsubmitted -= done;
+        hw->in_kernel += done;
+        __fuse_cond_signal(&hw->ring_wake);
+    }
+}
+
+//Takes a slot for the request, returns 0 if every slot is in use
+static uint8_t queue_slot(struct async_hw * hw, struct async_context * context, const struct disk_io * request) {
+    u32 sector_size = hw->queue->mount->sector_size;
+    __fuse_mutex_lock(&hw->lock);
+    if (hw->free_count == 0) {
+        __fuse_mutex_unlock(&hw->lock);
+        return 0;
+    }
+    u32 slot = hw->free_slots[--hw->free_count];
+    struct async_slot * entry = &hw->slots[slot];
+    entry->context = context;
+    entry->tag = request->tag;
+    entry->op = (request->op == DISK_IO_READ) ? __FUSE_URING_READ :
+                (request->op == DISK_IO_WRITE) ? __FUSE_URING_WRITE : __FUSE_URING_FSYNC;
+    entry->buffer = request->buffer;
+    entry->length = (request->op == DISK_IO_SYNC) ? 0 : request->count * sector_size;
+    entry->offset = request->sector * sector_size;
+    entry->stats_op = (request->op == DISK_IO_READ) ? DISK_STATS_READ :
+                      (request->op == DISK_IO_WRITE) ? DISK_STATS_WRITE : DISK_STATS_SYNC;
+    entry->size = entry->length;
+    entry->start = stats_begin(hw->queue->mount);
+    if (request->op == DISK_IO_WRITE)
+        discard_clear(hw->queue->mount, request->sector, request->count);
+    prepare_slot(hw, slot);
+    __fuse_mutex_unlock(&hw->lock);
+    return 1;
+}
+
+//Only the reaper takes kernel completions, so while in_kernel is not 0
+//a completion is always on its way when it blocks in __fuse_uring_wait
+static void * reaper(void * arg) {
+    struct async_hw * hw = arg;
+    u64 slot;
+    s32 res;
+
+    __fuse_mutex_lock(&hw->lock);
+    while (1) {
+        if (hw->unsubmitted > 0) {
+            submit_ring(hw);
+        }
+        if (hw->in_kernel == 0) {
+            if (hw->stop)
+                break;
+            //Requests the kernel refused are retried shortly
+            if (hw->unsubmitted > 0)
+                __fuse_cond_timedwait_ms(&hw->ring_wake, &hw->lock, 1);
+            else
+                __fuse_cond_wait(&hw->ring_wake, &hw->lock);
+            continue;
+        }
+
+        __fuse_mutex_unlock(&hw->lock);
+        __fuse_uring_wait(hw->ring);
+        __fuse_mutex_lock(&hw->lock);
+
+        u32 freed = 0;
+        while (__fuse_uring_reap(hw->ring, &slot, &res)) {
+            struct async_slot * done = &hw->slots[slot];
+            hw->in_kernel--;
+            if (res > 0 && (u32)res < done->length) {
+                done->buffer += res;
+                done->offset += res;
+                done->length -= res;
+                prepare_slot(hw, slot);
+                continue;
+            }
+            int error = (res < 0) ? -res : 0;
+            //Nothing transferred, past the end of the image
+            if (res >= 0 && (u32)res != done->length)
+                error = __fuse_EIO;
+            stats_end(hw->queue->mount, done->stats_op, done->size, done->start, error ? OP_FAILURE : OP_SUCCESS);
+            post_completion(done->context, done->tag, error ? OP_FAILURE : OP_SUCCESS, error);
+            hw->free_slots[hw->free_count++] = (u32)slot;
+            freed++;
+        }
+        //The worker may be waiting for a slot
+        if (freed > 0)
+            __fuse_cond_signal(&hw->wake);
+    }
+    __fuse_mutex_unlock(&hw->lock);
+    return 0x0;
+}
+
+static void stop_reaper(struct async_hw * hw) {
+    __fuse_mutex_lock(&hw->lock);
+    hw->stop = 1;
+    __fuse_cond_signal(&hw->ring_wake);
+    __fuse_mutex_unlock(&hw->lock);
+    __fuse_thread_join(hw->reaper);
+}
+#endif
+
+static int execute(struct mount * mount, struct disk_io * request) {
+    switch (request->op) {
+        case DISK_IO_READ:  return read_disk_h(mount, request->buffer, request->sector, request->count);
+        case DISK_IO_WRITE: return write_disk_h(mount, request->buffer, request->sector, request->count);
+        default:            return ioctl_disk_h(mount, IOCTL_SYNC, 0x0);
+    }
+}
+
+//Moves the requests of the contexts of hw to the kernel or runs them
+//Returns 0 if there was nothing it could take
+static uint8_t drain(struct async_hw * hw) {
+    struct async_queue * queue = hw->queue;
+    struct mount * mount = queue->mount;
+    uint8_t busy = 0;
+
+    u32 count = __fuse_load_acquire(&queue->context_count);
+    for (u32 i = hw->index; i < count; i += queue->hw_count) {
+        struct async_context * context = queue->contexts[i];
+        u32 head = context->request_head;
+        u32 tail = __fuse_load_acquire(&context->request_tail);
+        while (head != tail) {
+            struct disk_io request = context->requests[head & context->mask];
+            if (!valid_request(mount, &request)) {
+                complete(hw, context, request.tag, OP_FAILURE, __fuse_EINVAL);
+            }
+#ifdef ASYNC_URING
+            else if (uring_usable(hw)) {
+                if (!queue_slot(hw, context, &request))
+                    break;
+            }
+#endif
+            else {
+                int result = execute(mount, &request);
+                complete(hw, context, request.tag, result, result ? mount->last_error : 0);
+            }
+            head++;
+            __fuse_store_release(&context->request_head, head);
+            busy = 1;
+        }
+    }
+
+#ifdef ASYNC_URING
+    if (hw->ring != 0x0) {
+        __fuse_mutex_lock(&hw->lock);
+        if (hw->unsubmitted > 0)
+            submit_ring(hw);
+        __fuse_mutex_unlock(&hw->lock);
+    }
+#endif
+    return busy;
+}
+
+//Called with the lock of hw held
+static uint8_t has_work(struct async_hw * hw) {
+    struct async_queue * queue = hw->queue;
+#ifdef ASYNC_URING
+    //Waits for the reaper to free a slot
+    if (uring_usable(hw) && hw->free_count == 0)
+        return 0;
+#endif
+    u32 count = __fuse_load_acquire(&queue->context_count);
+    for (u32 i = hw->index; i < count; i += queue->hw_count) {
+        struct async_context * context = queue->contexts[i];
+        if (__fuse_load_acquire(&context->request_tail) != context->request_head)
+            return 1;
+    }
+    return 0;
+}
+
+static void * worker(void * arg) {
+    struct async_hw * hw = arg;
+
+    while (1) {
+        if (drain(hw))
+            continue;
+
+        //Submitters only signal while sleeping is set, the fences make
+        //sure either they see it or has_work sees their request
+        __fuse_mutex_lock(&hw->lock);
+        __fuse_store_release(&hw->sleeping, 1);
+        __fuse_fence();
+        while (!hw->stop && !has_work(hw)) {
+            __fuse_cond_wait(&hw->wake, &hw->lock);
+        }
+        __fuse_store_release(&hw->sleeping, 0);
+        uint8_t stop = hw->stop;
+        __fuse_mutex_unlock(&hw->lock);
+        if (stop)
+            break;
+    }
+    return 0x0;
+}
+
+static void wake_hw(struct async_hw * hw) {
+    __fuse_fence();
+    if (__fuse_load_acquire(&hw->sleeping)) {
+        __fuse_mutex_lock(&hw->lock);
+        __fuse_cond_signal(&hw->wake);
+        __fuse_mutex_unlock(&hw->lock);
+    }
+}
+
+//Starts the worker of a hardware context and its io_uring if the kernel
+//has it, leaves nothing behind on failure
+static int start_hw(struct async_hw * hw) {
+    __fuse_mutex_init(&hw->lock);
+    __fuse_cond_init(&hw->wake);
+    __fuse_cond_init(&hw->ring_wake);
+#ifdef ASYNC_URING
+    u32 entries = hw->queue->depth * ASYNC_RING_FACTOR;
+    hw->ring = hw->queue->mount->ops->positional ? __fuse_uring_create(entries) : 0x0;
+    if (hw->ring != 0x0) {
+        hw->slots = __fuse_malloc(entries * sizeof(struct async_slot));
+        hw->free_slots = __fuse_malloc(entries * sizeof(u32));
+        if (hw->slots != 0x0 && hw->free_slots != 0x0) {
+            for (u32 i = 0; i < entries; i++) {
+                hw->free_slots[i] = entries - 1 - i;
+            }
+            hw->free_count = entries;
+        }
+        if (hw->free_count == 0 || __fuse_thread_create(&hw->reaper, reaper, hw) != 0) {
+            __fuse_uring_destroy(hw->ring);
+            hw->ring = 0x0;
+            goto fail;
+        }
+    }
+#endif
+    if (__fuse_thread_create(&hw->thread, worker, hw) == 0) {
+        return OP_SUCCESS;
+    }
+#ifdef ASYNC_URING
+    if (hw->ring != 0x0) {
+        stop_reaper(hw);
+        __fuse_uring_destroy(hw->ring);
+        hw->ring = 0x0;
+    }
+fail:
+    if (hw->slots) __fuse_free(hw->slots);
+    if (hw->free_slots) __fuse_free(hw->free_slots);
+#endif
+    __fuse_cond_destroy(&hw->wake);
+    __fuse_cond_destroy(&hw->ring_wake);
+    __fuse_mutex_destroy(&hw->lock);
+    return OP_FAILURE;
+}
+
+//Stops the threads of a hardware context, the requests still in the
+//rings are dropped and the ones in the kernel are waited for
+static void stop_hw(struct async_hw * hw) {
+    __fuse_mutex_lock(&hw->lock);
+    hw->stop = 1;
+    __fuse_cond_signal(&hw->wake);
+    __fuse_mutex_unlock(&hw->lock);
+    __fuse_thread_join(hw->thread);
+#ifdef ASYNC_URING
+    if (hw->ring != 0x0) {
+        stop_reaper(hw);
+        __fuse_uring_destroy(hw->ring);
+    }
+    if (hw->slots) __fuse_free(hw->slots);
+    if (hw->free_slots) __fuse_free(hw->free_slots);
+#endif
+    __fuse_cond_destroy(&hw->wake);
+    __fuse_cond_destroy(&hw->ring_wake);
+    __fuse_mutex_destroy(&hw->lock);
+}
+
+static void free_context(struct async_context * context) {
+    if (context->requests) __fuse_free(context->requests);
+    if (context->completions) __fuse_free(context->completions);
+    __fuse_cond_destroy(&context->wake);
+    __fuse_mutex_destroy(&context->lock);
+    __fuse_free(context);
+}
+
+static struct async_context * create_context(struct async_queue * queue, u32 index) {
+    struct async_context * context = __fuse_malloc(sizeof(struct async_context));
+    if (context == 0x0) {
+        return 0x0;
+    }
+    __fuse_memset(context, 0, sizeof(struct async_context));
+    __fuse_mutex_init(&context->lock);
+    __fuse_cond_init(&context->wake);
+    context->queue = queue;
+    context->hw = &queue->hw[index % queue->hw_count];
+    context->owner = thread_id;
+
+    u32 size = 1;
+    while (size < queue->depth) {
+        size <<= 1;
+    }
+    context->mask = size - 1;
+    context->requests = __fuse_malloc(size * sizeof(struct disk_io));
+    context->completions = __fuse_malloc(size * sizeof(struct disk_completion));
+    if (context->requests == 0x0 || context->completions == 0x0) {
+        free_context(context);
+        return 0x0;
+    }
+    return context;
+}
+
+//Runs when a thread that submitted exits, its contexts go to the next
+//threads to submit once the requests in them complete
+static void leave_contexts(void * id) {
+    __fuse_mutex_lock(&create_lock);
+    for (struct async_queue * queue = queues; queue != 0x0; queue = queue->next) {
+        __fuse_mutex_lock(&queue->lock);
+        for (u32 i = 0; i < queue->context_count; i++) {
+            if (queue->contexts[i]->owner == (u64)id)
+                queue->contexts[i]->owner = 0;
+        }
+        __fuse_mutex_unlock(&queue->lock);
+    }
+    __fuse_mutex_unlock(&create_lock);
+}
+
+static void create_exit_key() {
+    exit_key_ready = (__fuse_thread_key_create(&exit_key, leave_contexts) == 0);
+}
+
+//Every request submitted to a context left by its thread has completed,
+//the completions nobody is going to take are dropped for the next owner
+static uint8_t adopt_context(struct async_context * context) {
+    u32 tail = __fuse_load_acquire(&context->completion_tail);
+    if (context->owner != 0 || tail != context->request_tail) {
+        return 0;
+    }
+    context->completion_head = tail;
+    __fuse_store_release(&context->outstanding, 0);
+    context->owner = thread_id;
+    return 1;
+}
+
+static void free_queue(struct async_queue * queue) {
+    for (u32 i = 0; i < queue->hw_count; i++) {
+        stop_hw(&queue->hw[i]);
+    }
+    for (u32 i = 0; i < queue->context_count; i++) {
+        free_context(queue->contexts[i]);
+    }
+    if (queue->hw) __fuse_free(queue->hw);
+    __fuse_mutex_destroy(&queue->lock);
+    __fuse_free(queue);
+}
+
+static struct async_queue * create_queue(struct mount * mount) {
+    struct async_queue * queue = __fuse_malloc(sizeof(struct async_queue));
+    if (queue == 0x0) {
+        return 0x0;
+    }
+    __fuse_memset(queue, 0, sizeof(struct async_queue));
+    __fuse_mutex_init(&queue->lock);
+    queue->mount = mount;
+    queue->id = __fuse_fetch_add(&next_queue_id, 1);
+    queue->depth = mount->queue_depth;
+
+    queue->hw = __fuse_malloc(__ASYNC_WORKERS * sizeof(struct async_hw));
+    if (queue->hw == 0x0) {
+        free_queue(queue);
+        return 0x0;
+    }
+    __fuse_memset(queue->hw, 0, __ASYNC_WORKERS * sizeof(struct async_hw));
+    //The contexts are spread over the hardware contexts that started
+    for (u32 i = 0; i < __ASYNC_WORKERS; i++) {
+        queue->hw[i].queue = queue;
+        queue->hw[i].index = i;
+        if (start_hw(&queue->hw[i]))
+            break;
+        queue->hw_count++;
+    }
+    if (queue->hw_count == 0) {
+        free_queue(queue);
+        return 0x0;
+    }
+    return queue;
+}
+
+static struct async_queue * get_queue(struct mount * mount) {
+    struct async_queue * queue = __fuse_load_acquire(&mount->async);
+    if (queue != 0x0) {
+        return queue;
+    }
+    __fuse_mutex_lock(&create_lock);
+    queue = mount->async;
+    if (queue == 0x0) {
+        queue = create_queue(mount);
+        if (queue != 0x0) {
+            queue->next = queues;
+            queues = queue;
+        }
+        __fuse_store_release(&mount->async, queue);
+    }
+    __fuse_mutex_unlock(&create_lock);
+    return queue;
+}
+
+//Returns the context of the calling thread, creating it if asked to
+static struct async_context * get_context(struct mount * mount, uint8_t create) {
+    struct async_queue * queue = create ? get_queue(mount) : __fuse_load_acquire(&mount->async);
+    if (queue == 0x0) {
+        return 0x0;
+    }
+    for (u32 i = 0; i < ASYNC_BINDINGS; i++) {
+        if (bindings[i].queue_id == queue->id)
+            return bindings[i].context;
+    }
+    if (thread_id == 0) {
+        __fuse_once(&exit_key_once, create_exit_key);
+        thread_id = __fuse_fetch_add(&next_thread_id, 1);
+        if (exit_key_ready)
+            __fuse_thread_key_set(exit_key, (void *)thread_id);
+    }
+
+    struct async_context * context = 0x0;
+    __fuse_mutex_lock(&queue->lock);
+    for (u32 i = 0; i < queue->context_count; i++) {
+        if (queue->contexts[i]->owner == thread_id) {
+            context = queue->contexts[i];
+            break;
+        }
+    }
+    for (u32 i = 0; context == 0x0 && create && i < queue->context_count; i++) {
+        if (adopt_context(queue->contexts[i]))
+            context = queue->contexts[i];
+    }
+    if (context == 0x0 && create && queue->context_count < ASYNC_CONTEXTS) {
+        context = create_context(queue, queue->context_count);
+        if (context != 0x0) {
+            queue->contexts[queue->context_count] = context;
+            __fuse_store_release(&queue->context_count, queue->context_count + 1);
+        }
+    }
+    __fuse_mutex_unlock(&queue->lock);
+    if (context == 0x0) {
+        return 0x0;
+    }
+
+    bindings[binding_next].queue_id = queue->id;
+    bindings[binding_next].context = context;
+    binding_next = (binding_next + 1) % ASYNC_BINDINGS;
+    return context;
+}
+
+int async_submit(struct mount * mount, const struct disk_io * requests, int count) {
+    struct async_context * context = get_context(mount, 1);
+    if (context == 0x0) {
+        return -1;
+    }
+
+    u32 depth = context->queue->depth;
+    u32 tail = context->request_tail;
+    int accepted = 0;
+    for (; accepted < count && context->outstanding < depth; accepted++) {
+        context->requests[tail & context->mask] = requests[accepted];
+        tail++;
+        __fuse_store_release(&context->outstanding, context->outstanding + 1);
+    }
+    if (accepted > 0) {
+        __fuse_store_release(&context->request_tail, tail);
+        wake_hw(context->hw);
+    }
+    return accepted;
+}
+
+int async_complete(struct mount * mount, struct disk_completion * completions, int min, int max) {
+    struct async_context * context = get_context(mount, 0);
+    if (context == 0x0 || max <= 0) {
+        return 0;
+    }
+
+    if (min < 0) min = 0;
+    if ((u32)min > context->outstanding) min = context->outstanding;
+    if (min > max) min = max;
+
+    int taken = 0;
+    while (1) {
+        u32 head = context->completion_head;
+        u32 tail = __fuse_load_acquire(&context->completion_tail);
+        while (taken < max && head != tail) {
+            completions[taken++] = context->completions[head & context->mask];
+            head++;
+        }
+        __fuse_store_release(&context->outstanding, context->outstanding - (head - context->completion_head));
+        context->completion_head = head;
+        if (taken >= min)
+            break;
+
+        __fuse_mutex_lock(&context->lock);
+        __fuse_store_release(&context->waiting, 1);
+        __fuse_fence();
+        while (__fuse_load_acquire(&context->completion_tail) == context->completion_head) {
+            __fuse_cond_wait(&context->wake, &context->lock);
+        }
+        __fuse_store_release(&context->waiting, 0);
+        __fuse_mutex_unlock(&context->lock);
+    }
+    return taken;
+}
+
+int async_set_depth(struct mount * mount, u32 depth) {
+    if (depth == 0) {
+        mount->last_error = __fuse_EINVAL;
+        return OP_FAILURE;
+    }
+    struct async_queue * queue = mount->async;
+    if (queue != 0x0) {
+        u32 outstanding = 0;
+        __fuse_mutex_lock(&queue->lock);
+        for (u32 i = 0; i < queue->context_count; i++) {
+            struct async_context * context = queue->contexts[i];
+            //Nobody takes the completions of a context left by its thread
+            if (context->owner == 0)
+                outstanding += context->request_tail - __fuse_load_acquire(&context->completion_tail);
+            else
+                outstanding += __fuse_load_acquire(&context->outstanding);
+        }
+        __fuse_mutex_unlock(&queue->lock);
+        if (outstanding > 0) {
+            mount->last_error = __fuse_EBUSY;
+            return OP_FAILURE;
+        }
+    }
+    async_destroy(mount);
+    mount->queue_depth = depth;
+    return OP_SUCCESS;
+}
+
+void async_destroy(struct mount * mount) {
+    __fuse_mutex_lock(&create_lock);
+    struct async_queue * queue = mount->async;
+    if (queue == 0x0) {
+        __fuse_mutex_unlock(&create_lock);
+        return;
+    }
+    __fuse_store_release(&mount->async, (struct async_queue *)0x0);
+    struct async_queue ** link = &queues;
+    while (*link != queue) {
+        link = &(*link)->next;
+    }
+    *link = queue->next;
+    __fuse_mutex_unlock(&create_lock);
+    free_queue(queue);
+}
@@ -0,0 +1,113 @@
+#ifndef _ASYNC_H
+#define _ASYNC_H
+#include "bfuse.h"
+#include "primitives.h"
+#include "dependencies.h"
+
+//Asynchronous requests of a drive, modelled on blk-mq
+//Every thread submitting to a drive gets its own context, a lock-free
+//single producer single consumer ring of requests and one of completions
+//Contexts are spread over a few hardware contexts, each a worker thread
+//that drains the rings of its contexts, so threads only share the worker
+//Requests on an uncached drive in buffered fd mode without a timing model,
+//an FTL or zones go to an io_uring per hardware context and a reaper thread turns the kernel completions into
+//disk_completions, everything else, or every request if io_uring is
+//missing, runs on the worker through the synchronous primitives so it
+//sees the cache
+//Completions go back to the context of the thread that submitted them
+//and a sync covers the requests submitted before it by the same thread
+//A thread that exits leaves its contexts, the next thread new to a drive
+//takes one over once every request in it has completed and drops the
+//completions left in it
+
+//Threads that can submit to one drive at the same time
+#define ASYNC_CONTEXTS      64
+//Drives a thread remembers its context for without a lookup
+#define ASYNC_BINDINGS      8
+//Keeps the indices of the two ends of a ring on different cache lines
+#define ASYNC_CACHE_LINE    64
+
+//A request in the kernel, a short transfer is resubmitted for the rest
+struct async_slot {
+    struct async_context * context;
+    u64  tag;
+    int  op;
+    u8   *buffer;
+    u32  length;
+    u64  offset;
+    u32  stats_op;      //DISK_STATS_* of the request
+    u32  size;          //Bytes of the whole request
+    u64  start;         //When it reached the drive
+};
+
+//Software queue of one submitting thread
+//The rings hold mask + 1 entries, a power of two no smaller than the depth
+struct async_context {
+    struct async_queue * queue;
+    struct async_hw * hw;
+    u64  owner;             //Id of the thread, 0 once it exits
+    u32  mask;
+    struct disk_io * requests;
+    struct disk_completion * completions;
+
+    //Written by the owner
+    u8   pad_owner[ASYNC_CACHE_LINE];
+    u32  request_tail;
+    u32  completion_head;
+    u32  outstanding;
+    u8   waiting;           //The owner sleeps until a completion arrives
+
+    //Written by the hardware context
+    u8   pad_hw[ASYNC_CACHE_LINE];
+    u32  request_head;
+    u32  completion_tail;
+    u8   pad_end[ASYNC_CACHE_LINE];
+
+    __fuse_mutex_t lock;
+    __fuse_cond_t wake;
+};
+
+//Hardware context, drains the rings of every context assigned to it
+struct async_hw {
+    struct async_queue * queue;
+    u32  index;
+    __fuse_thread_t thread;
+    __fuse_mutex_t lock;
+    __fuse_cond_t wake;
+    u8   sleeping;          //Submitters signal wake only while it is set
+    u8   stop;
+
+    struct __fuse_uring * ring;
+    struct async_slot * slots;
+    u32  *free_slots;
+    u32  free_count;
+    u32  unsubmitted;
+    u32  in_kernel;
+    __fuse_thread_t reaper;
+    __fuse_cond_t ring_wake;
+};
+
+struct async_queue {
+    struct mount * mount;
+    u64  id;
+    u32  depth;
+    __fuse_mutex_t lock;    //Only taken to add a context
+    struct async_context * contexts[ASYNC_CONTEXTS];
+    u32  context_count;
+    struct async_hw * hw;
+    u32  hw_count;
+    struct async_queue * next;
+};
+
+//Queues requests, returns how many were accepted or -1 on failure
+//Each thread has up to depth requests accepted and not yet returned
+int async_submit(struct mount * mount, const struct disk_io * requests, int count);
+//Takes up to max completions of the calling thread, waiting until there
+//are at least min, min is capped to the requests still outstanding
+int async_complete(struct mount * mount, struct disk_completion * completions, int min, int max);
+//Sets the depth of the queue of every thread, only while nothing is
+//outstanding and no thread is submitting
+int async_set_depth(struct mount * mount, u32 depth);
+//Waits for the requests in the kernel and drops the queue
+void async_destroy(struct mount * mount);
+#endif
@@ -0,0 +1,592 @@
+#include "backend.h"
+#include "primitives.h"
+#include "dependencies.h"
+#include "readahead.h"
+#include "elevator.h"
+#include "discard.h"
+#include "direct.h"
+#include "timing.h"
+#include "ftl.h"
+
+//Buffers handed to a single preadv/pwritev, well below IOV_MAX
+#define BACKEND_IOV_BATCH   64
+//Bytes written per call when a trim has to write zeros
+#define BACKEND_ZERO_CHUNK  (64 << 10)
+
+//Writes size bytes of buffer at offset of the image
+typedef int (*byte_writer)(struct mount * mount, const u8 * buffer, u64 size, u64 offset);
+
+//Positional transfers never touch the shared file offset, so several
+//threads may use the same file_handle
+int file_transfer(struct mount * mount, int fd, u8 * buffer, u64 size, u64 offset, uint8_t write) {
+    while (size > 0) {
+        s64 done = write ? __fuse_pwrite(fd, buffer, size, offset)
+                         : __fuse_pread(fd, buffer, size, offset);
+        if (done < 0) {
+            if (__fuse_errno() == __fuse_EINTR)
+                continue;
+            mount->last_error = __fuse_errno();
+            return OP_FAILURE;
+        }
+        if (done == 0) {
+            //Past the end of the file
+            mount->last_error = __fuse_EIO;
+            return OP_FAILURE;
+        }
+        buffer += done;
+        offset += done;
+        size -= done;
+    }
+    return OP_SUCCESS;
+}
+
+u64 round_up(u64 value, u64 alignment) {
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+//ORs blocks of bytes together so the loop has no branch to vectorize around
+uint8_t all_zeros(const u8 * data, u64 size) {
+    for (u64 i = 0; i < size; i += 64) {
+        u64 end = (size - i < 64) ? size - i : 64;
+        u8 bits = 0;
+        for (u64 j = 0; j < end; j++) {
+            bits |= data[i + j];
+        }
+        if (bits != 0)
+            return 0;
+    }
+    return 1;
+}
+
+static int pread_full(struct mount * mount, u8 * buffer, u64 size, u64 offset) {
+    return file_transfer(mount, mount->file_handle, buffer, size, offset, 0);
+}
+
+static int pwrite_full(struct mount * mount, const u8 * buffer, u64 size, u64 offset) {
+    return file_transfer(mount, mount->file_handle, (u8*)buffer, size, offset, 1);
+}
+
+//Turns the next BACKEND_IOV_BATCH buffers of iov at most into a host list
+static int fill_batch(struct mount * mount, const struct disk_iovec * iov, int iovcnt, __fuse_struct_iovec * vector, u64 * size) {
+    int batch = (iovcnt < BACKEND_IOV_BATCH) ? iovcnt : BACKEND_IOV_BATCH;
+    *size = 0;
+    for (int i = 0; i < batch; i++) {
+        vector[i].iov_base = iov[i].buffer;
+        vector[i].iov_len = (u64)iov[i].count * mount->sector_size;
+        *size += vector[i].iov_len;
+    }
+    return batch;
+}
+
+//Moves up to BACKEND_IOV_BATCH buffers per preadv/pwritev, a short
+//transfer is finished buffer by buffer
+static int vector_full(struct mount * mount, const struct disk_iovec * iov, int iovcnt, u64 offset, uint8_t write) {
+    __fuse_struct_iovec vector[BACKEND_IOV_BATCH];
+
+    while (iovcnt > 0) {
+        u64 size;
+        int batch = fill_batch(mount, iov, iovcnt, vector, &size);
+        s64 done = write ? __fuse_pwritev(mount->file_handle, vector, batch, offset)
+                         : __fuse_preadv(mount->file_handle, vector, batch, offset);
+        if (done < 0) {
+            if (__fuse_errno() != __fuse_EINTR) {
+                mount->last_error = __fuse_errno();
+                return OP_FAILURE;
+            }
+            done = 0;
+        }
+
+        for (int i = 0; i < batch; i++) {
+            u64 length = vector[i].iov_len;
+            if ((u64)done >= length) {
+                done -= length;
+            } else {
+                u8 * rest = (u8*)vector[i].iov_base + done;
+                int result = write ? pwrite_full(mount, rest, length - done, offset + done)
+                                   : pread_full(mount, rest, length - done, offset + done);
+                if (result) {
+                    return OP_FAILURE;
+                }
+                done = 0;
+            }
+            offset += length;
+        }
+        iov += batch;
+        iovcnt -= batch;
+    }
+    return OP_SUCCESS;
+}
+
+//For host file systems that cannot punch holes
+static int zero_fill(struct mount * mount, u64 offset, u64 size, byte_writer writer) {
+    static u8 zeros[BACKEND_ZERO_CHUNK];
+    while (size > 0) {
+        u64 length = (size < BACKEND_ZERO_CHUNK) ? size : BACKEND_ZERO_CHUNK;
+        if (writer(mount, zeros, length, offset))
+            return OP_FAILURE;
+        offset += length;
+        size -= length;
+    }
+    return OP_SUCCESS;
+}
+
+//Punches the range out of the image, writing zeros if the host cannot
+static int file_trim(struct mount * mount, u64 sector, u64 count, byte_writer writer) {
+    u64 offset = sector * mount->sector_size;
+    u64 size = count * mount->sector_size;
+    if (__fuse_punch_hole(mount->file_handle, offset, size) == -1) {
+        return zero_fill(mount, offset, size, writer);
+    }
+    return OP_SUCCESS;
+}
+
+static int file_sync(struct mount * mount) {
+    if (__fuse_fdatasync(mount->file_handle) == -1) {
+        mount->last_error = __fuse_errno();
+        return OP_FAILURE;
+    }
+    return OP_SUCCESS;
+}
+
+static void close_file(struct mount * mount) {
+    if (mount->file_handle != -1) {
+        __fuse_close(mount->file_handle);
+        mount->file_handle = -1;
+    }
+}
+
+static int fd_read(struct mount * mount, u8 * buffer, u64 sector, u64 count) {
+    return pread_full(mount, buffer, count * mount->sector_size, sector * mount->sector_size);
+}
+
+static int fd_write(struct mount * mount, const u8 * buffer, u64 sector, u64 count) {
+    return pwrite_full(mount, buffer, count * mount->sector_size, sector * mount->sector_size);
+}
+
+static int fd_readv(struct mount * mount, const struct disk_iovec * iov, int iovcnt, u64 sector) {
+    return vector_full(mount, iov, iovcnt, sector * mount->sector_size, 0);
+}
+
+static int fd_writev(struct mount * mount, const struct disk_iovec * iov, int iovcnt, u64 sector) {
+    return vector_full(mount, iov, iovcnt, sector * mount->sector_size, 1);
+}
+
+static int fd_trim(struct mount * mount, u64 sector, u64 count) {
+    return file_trim(mount, sector, count, pwrite_full);
+}
+
+const struct drive_ops fd_ops = {
+    fd_read, fd_write, fd_readv, fd_writev, file_sync, fd_trim, close_file, 0x0, 1, 0
+};
+
+static int direct_bytes(struct mount * mount, const u8 * buffer, u64 size, u64 offset) {
+    __fuse_struct_iovec vector = {(void*)buffer, size};
+    return direct_transfer(mount, &vector, 1, offset, 1);
+}
+
+static int direct_read(struct mount * mount, u8 * buffer, u64 sector, u64 count) {
+    __fuse_struct_iovec vector = {buffer, count * mount->sector_size};
+    return direct_transfer(mount, &vector, 1, sector * mount->sector_size, 0);
+}
+
+static int direct_write(struct mount * mount, const u8 * buffer, u64 sector, u64 count) {
+    return direct_bytes(mount, buffer, count * mount->sector_size, sector * mount->sector_size);
+}
+
+//Every batch is a single transfer, the pool gathers the small buffers
+static int direct_vector(struct mount * mount, const struct disk_iovec * iov, int iovcnt, u64 sector, uint8_t write) {
+    __fuse_struct_iovec vector[BACKEND_IOV_BATCH];
+    u64 offset = sector * mount->sector_size;
+
+    while (iovcnt > 0) {
+        u64 size;
+        int batch = fill_batch(mount, iov, iovcnt, vector, &size);
+        if (direct_transfer(mount, vector, batch, offset, write)) {
+            return OP_FAILURE;
+        }
+        offset += size;
+        iov += batch;
+        iovcnt -= batch;
+    }
+    return OP_SUCCESS;
+}
+
+static int direct_readv(struct mount * mount, const struct disk_iovec * iov, int iovcnt, u64 sector) {
+    return direct_vector(mount, iov, iovcnt, sector, 0);
+}
+
+static int direct_writev(struct mount * mount, const struct disk_iovec * iov, int iovcnt, u64 sector) {
+    return direct_vector(mount, iov, iovcnt, sector, 1);
+}
+
+static int direct_trim(struct mount * mount, u64 sector, u64 count) {
+    return file_trim(mount, sector, count, direct_bytes);
+}
+
+static void direct_close(struct mount * mount) {
+    direct_destroy(mount->direct);
+    mount->direct = 0x0;
+    close_file(mount);
+}
+
+const struct drive_ops direct_ops = {
+    direct_read, direct_write, direct_readv, direct_writev, file_sync, direct_trim, direct_close, 0x0, 0, 0
+};
+
+struct map_lock {
+    __fuse_mutex_t mutex;
+};
+
+struct map_lock * backend_lock_create() {
+    struct map_lock * lock = __fuse_malloc(sizeof(struct map_lock));
+    if (lock != 0x0) {
+        __fuse_mutex_init(&lock->mutex);
+    }
+    return lock;
+}
+
+void backend_lock_destroy(struct map_lock * lock) {
+    if (lock == 0x0) {
+        return;
+    }
+    __fuse_mutex_destroy(&lock->mutex);
+    __fuse_free(lock);
+}
+
+void backend_lock(struct mount * mount) {
+    if (mount->map_lock != 0x0)
+        __fuse_mutex_lock(&mount->map_lock->mutex);
+}
+
+void backend_unlock(struct mount * mount) {
+    if (mount->map_lock != 0x0)
+        __fuse_mutex_unlock(&mount->map_lock->mutex);
+}
+
+//Copies between the buffer and the mapping, the map lock is held
+typedef int (*map_copy)(struct mount * mount, u8 * buffer, u64 sector, u64 count, uint8_t write);
+
+static int locked_copy(struct mount * mount, map_copy copy, u8 * buffer, u64 sector, u64 count, uint8_t write) {
+    backend_lock(mount);
+    int result = copy(mount, buffer, sector, count, write);
+    backend_unlock(mount);
+    return result;
+}
+
+static int locked_vector(struct mount * mount, map_copy copy, const struct disk_iovec * iov, int iovcnt, u64 sector, uint8_t write) {
+    int result = OP_SUCCESS;
+    backend_lock(mount);
+    for (int i = 0; i < iovcnt && result == OP_SUCCESS; i++) {
+        result = copy(mount, iov[i].buffer, sector, iov[i].count, write);
+        sector += iov[i].count;
+    }
+    backend_unlock(mount);
+    return result;
+}
+
+static void release_map_lock(struct mount * mount) {
+    backend_lock_destroy(mount->map_lock);
+    mount->map_lock = 0x0;
+}
+
+static int mapping_copy(struct mount * mount, u8 * buffer, u64 sector, u64 count, uint8_t write) {
+    u64 offset = sector * mount->sector_size;
+    u64 size = count * mount->sector_size;
+    if (size == 0) {
+        return OP_SUCCESS;
+    }
+    if (write) {
+        __fuse_memcpy(mount->file_ptr + offset, buffer, size);
+        mark_mapping_dirty(mount, offset, size);
+    } else {
+        __fuse_memcpy(buffer, mount->file_ptr + offset, size);
+    }
+    return OP_SUCCESS;
+}
+
+static int mapped_read(struct mount * mount, u8 * buffer, u64 sector, u64 count) {
+    return locked_copy(mount, mapping_copy, buffer, sector, count, 0);
+}
+
+static int mapped_write(struct mount * mount, const u8 * buffer, u64 sector, u64 count) {
+    return locked_copy(mount, mapping_copy, (u8*)buffer, sector, count, 1);
+}
+
+static int mapped_readv(struct mount * mount, const struct disk_iovec * iov, int iovcnt, u64 sector) {
+    return locked_vector(mount, mapping_copy, iov, iovcnt, sector, 0);
+}
+
+static int mapped_writev(struct mount * mount, const struct disk_iovec * iov, int iovcnt, u64 sector) {
+    return locked_vector(mount, mapping_copy, iov, iovcnt, sector, 1);
+}
+
+static int mapped_sync(struct mount * mount) {
+    backend_lock(mount);
+    int result = (mount->file_ptr == 0x0 || !flush_mapping(mount)) ? OP_FAILURE : OP_SUCCESS;
+    backend_unlock(mount);
+    return result;
+}
+
+static void zero_mapping(struct mount * mount, u64 offset, u64 size) {
+    if (size > 0) {
+        __fuse_memset(mount->file_ptr + offset, 0, size);
+        mark_mapping_dirty(mount, offset, size);
+    }
+}
+
+//Only whole pages can be removed, the partial ones at the edges are zeroed
+static int mapped_trim(struct mount * mount, u64 sector, u64 count) {
+    u64 offset = sector * mount->sector_size;
+    u64 size = count * mount->sector_size;
+    u64 page_mask = __fuse_page_size() - 1;
+    u64 first = (offset + page_mask) & ~page_mask;
+    u64 last = (offset + size) & ~page_mask;
+    backend_lock(mount);
+    if (first < last && __fuse_madvise(mount->file_ptr + first, last - first, __fuse_MADV_REMOVE) == 0) {
+        zero_mapping(mount, offset, first - offset);
+        zero_mapping(mount, last, offset + size - last);
+    } else {
+        zero_mapping(mount, offset, size);
+    }
+    backend_unlock(mount);
+    return OP_SUCCESS;
+}
+
+static void mapped_close(struct mount * mount) {
+    unmap_file(mount);
+    close_file(mount);
+    release_map_lock(mount);
+}
+
+static u8 * mapped_memory(struct mount * mount) {
+    return mount->file_ptr;
+}
+
+const struct drive_ops mapped_ops = {
+    mapped_read, mapped_write, mapped_readv, mapped_writev, mapped_sync, mapped_trim, mapped_close, mapped_memory, 0, 1
+};
+
+//Copies through the mapped windows, a transfer may span several of them
+static int window_copy(struct mount * mount, u8 * buffer, u64 size, u64 offset, uint8_t write) {
+    while (size > 0) {
+        u64 length = size;
+        u8 * window = map_window(mount, offset, &length, write);
+        if (window == 0x0) {
+            return OP_FAILURE;
+        }
+        if (write)
+            __fuse_memcpy(window, buffer, length);
+        else
+            __fuse_memcpy(buffer, window, length);
+        buffer += length;
+        offset += length;
+        size -= length;
+    }
+    return OP_SUCCESS;
+}
+
+static int windowed_copy(struct mount * mount, u8 * buffer, u64 sector, u64 count, uint8_t write) {
+    return window_copy(mount, buffer, count * mount->sector_size, sector * mount->sector_size, write);
+}
+
+static int windowed_bytes(struct mount * mount, const u8 * buffer, u64 size, u64 offset) {
+    backend_lock(mount);
+    int result = window_copy(mount, (u8*)buffer, size, offset, 1);
+    backend_unlock(mount);
+    return result;
+}
+
+static int windowed_read(struct mount * mount, u8 * buffer, u64 sector, u64 count) {
+    return locked_copy(mount, windowed_copy, buffer, sector, count, 0);
+}
+
+static int windowed_write(struct mount * mount, const u8 * buffer, u64 sector, u64 count) {
+    return locked_copy(mount, windowed_copy, (u8*)buffer, sector, count, 1);
+}
+
+static int windowed_readv(struct mount * mount, const struct disk_iovec * iov, int iovcnt, u64 sector) {
+    return locked_vector(mount, windowed_copy, iov, iovcnt, sector, 0);
+}
+
+static int windowed_writev(struct mount * mount, const struct disk_iovec * iov, int iovcnt, u64 sector) {
+    return locked_vector(mount, windowed_copy, iov, iovcnt, sector, 1);
+}
+
+static int windowed_sync(struct mount * mount) {
+    backend_lock(mount);
+    int result = (mount->windows == 0x0 || !flush_windows(mount)) ? OP_FAILURE : OP_SUCCESS;
+    backend_unlock(mount);
+    return result;
+}
+
+//Mapped windows see the hole as well, they share the page cache
+static int windowed_trim(struct mount * mount, u64 sector, u64 count) {
+    return file_trim(mount, sector, count, windowed_bytes);
+}
+
+static void windowed_close(struct mount * mount) {
+    unmap_windows(mount);
+    close_file(mount);
+    release_map_lock(mount);
+}
+
+//Windows come and go with the budget, so they are never lent out
+const struct drive_ops windowed_ops = {
+    windowed_read, windowed_write, windowed_readv, windowed_writev, windowed_sync, windowed_trim, windowed_close, 0x0, 0, 1
+};
+
+//Discarded sectors are zeroed instead of read
+static int read_runs(struct mount * mount, u8 * buffer, u64 sector, u64 count) {
+    while (count > 0) {
+        uint8_t discarded;
+        u64 run = discard_run(mount, sector, count, &discarded);
+        if (discarded)
+            __fuse_memset(buffer, 0, run * mount->sector_size);
+        else if (mount->ops->read(mount, buffer, sector, run))
+            return OP_FAILURE;
+        buffer += run * mount->sector_size;
+        sector += run;
+        count -= run;
+    }
+    return OP_SUCCESS;
+}
+
+//Requests reaching the device are charged to its FTL and timing model,
+//after the elevator dispatched what they depend on
+static u64 device_begin(struct mount * mount) {
+    return (mount->timing != 0x0) ? timing_begin(mount->timing) : 0;
+}
+
+//Garbage collection the FTL needed for a write delays its completion
+static void device_end(struct mount * mount, u32 op, u64 sector, u64 count, u64 arrival) {
+    u64 stall = 0;
+    if (mount->ftl != 0x0 && op == DISK_STATS_WRITE) {
+        stall = ftl_write(mount->ftl, sector, count);
+    } else if (mount->ftl != 0x0 && (op == DISK_STATS_TRIM || op == DISK_STATS_RESET)) {
+        ftl_trim(mount->ftl, sector, count);
+    }
+    if (mount->timing != 0x0) {
+        timing_end(mount->timing, op, sector, count, arrival, stall);
+    }
+}
+
+int backend_read(struct mount * mount, u8 * buffer, u64 sector, u64 count) {
+    elevator_unplug(mount, sector, count);
+    u64 arrival = device_begin(mount);
+    int result = read_runs(mount, buffer, sector, count);
+    device_end(mount, DISK_STATS_READ, sector, count, arrival);
+    return result;
+}
+
+int backend_write(struct mount * mount, const u8 * buffer, u64 sector, u64 count) {
+    if (mount->elevator != 0x0) {
+        return elevator_write(mount, buffer, sector, count);
+    }
+    discard_clear(mount, sector, count);
+    u64 arrival = device_begin(mount);
+    int result = mount->ops->write(mount, buffer, sector, count);
+    device_end(mount, DISK_STATS_WRITE, sector, count, arrival);
+    return result;
+}
+
+int backend_readv(struct mount * mount, const struct disk_iovec * iov, int iovcnt, u64 sector) {
+    u64 count = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        count += iov[i].count;
+    }
+    uint8_t discarded;
+    if (discard_run(mount, sector, count, &discarded) < count || discarded) {
+        //Buffer by buffer so the discarded runs can be skipped
+        for (int i = 0; i < iovcnt; i++) {
+            if (backend_read(mount, iov[i].buffer, sector, iov[i].count))
+                return OP_FAILURE;
+            sector += iov[i].count;
+        }
+        return OP_SUCCESS;
+    }
+    elevator_unplug(mount, sector, count);
+    u64 arrival = device_begin(mount);
+    int result = mount->ops->readv(mount, iov, iovcnt, sector);
+    device_end(mount, DISK_STATS_READ, sector, count, arrival);
+    return result;
+}
+
+int backend_writev(struct mount * mount, const struct disk_iovec * iov, int iovcnt, u64 sector) {
+    if (mount->elevator != 0x0) {
+        return elevator_writev(mount, iov, iovcnt, sector);
+    }
+    return backend_dispatch(mount, iov, iovcnt, sector);
+}
+
+int backend_dispatch(struct mount * mount, const struct disk_iovec * iov, int iovcnt, u64 sector) {
+    u64 count = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        count += iov[i].count;
+    }
+    discard_clear(mount, sector, count);
+    u64 arrival = device_begin(mount);
+    int result = mount->ops->writev(mount, iov, iovcnt, sector);
+    device_end(mount, DISK_STATS_WRITE, sector, count, arrival);
+    return result;
+}
+
+static int release(struct mount * mount, u32 op, u64 sector, u64 count) {
+    u64 arrival = device_begin(mount);
+    int result = mount->ops->trim(mount, sector, count);
+    device_end(mount, op, sector, count, arrival);
+    return result;
+}
+
+int backend_trim(struct mount * mount, u64 sector, u64 count) {
+    return release(mount, DISK_STATS_TRIM, sector, count);
+}
+
+int backend_reset(struct mount * mount, u64 sector, u64 count) {
+    return release(mount, DISK_STATS_RESET, sector, count);
+}
+
+int backend_scan_holes(struct mount * mount) {
+    u32 sector_size = mount->sector_size;
+    u64 end = mount->sector_count * sector_size;
+    u64 offset = 0;
+
+    //Without hole support the whole file is a single data extent
+    while (offset < end) {
+        u64 hole = __fuse_lseek(mount->file_handle, offset, __fuse_SEEK_HOLE);
+        if (hole == (u64)-1) {
+            mount->last_error = __fuse_errno();
+            return OP_FAILURE;
+        }
+        if (hole >= end) {
+            break;
+        }
+        //No data past the hole, it runs to the end of the file
+        u64 data = __fuse_lseek(mount->file_handle, hole, __fuse_SEEK_DATA);
+        if (data == (u64)-1 || data > end) {
+            data = end;
+        }
+        //Only sectors entirely inside the hole
+        u64 first = (hole + sector_size - 1) / sector_size;
+        u64 last = data / sector_size;
+        if (first < last && discard_mark(mount, first, last - first)) {
+            return OP_FAILURE;
+        }
+        offset = data;
+    }
+    return OP_SUCCESS;
+}
+
+int backend_sync(struct mount * mount) {
+    int result = elevator_flush(mount);
+    u64 arrival = device_begin(mount);
+    if (mount->ops->sync(mount)) {
+        result = OP_FAILURE;
+    }
+    device_end(mount, DISK_STATS_SYNC, 0, 0, arrival);
+    return result;
+}
+
+int backend_writeback(void * context, u64 sector, u64 count, const u8 * data) {
+    readahead_invalidate(context, sector, count);
+    return backend_write(context, data, sector, count);
+}
@@ -0,0 +1,71 @@
+#ifndef _BACKEND_H
+#define _BACKEND_H
+#include "bfuse.h"
+#include "primitives.h"
+
+//What a kind of drive does to reach its storage, below the elevator and
+//the discard map, which the backend_* calls apply before dispatching
+//Same contract as the backend_* calls
+struct drive_ops {
+    int  (*read)(struct mount * mount, u8 * buffer, u64 sector, u64 count);
+    int  (*write)(struct mount * mount, const u8 * buffer, u64 sector, u64 count);
+    int  (*readv)(struct mount * mount, const struct disk_iovec * iov, int iovcnt, u64 sector);
+    int  (*writev)(struct mount * mount, const struct disk_iovec * iov, int iovcnt, u64 sector);
+    int  (*sync)(struct mount * mount);
+    int  (*trim)(struct mount * mount, u64 sector, u64 count);
+    //Flushes and releases the storage, the drive is not used anymore
+    void (*close)(struct mount * mount);
+    //Memory holding the whole drive for as long as it is registered, 0x0
+    //if the drive has none, read_disk_ref lends it out
+    u8 * (*memory)(struct mount * mount);
+    u8   positional;    //Plain preadv/pwritev on file_handle, io_uring may stand in for them
+    u8   mapped;        //Copies from a mapping of the image under the map lock
+};
+
+//Positional I/O on file_handle
+extern const struct drive_ops fd_ops;
+//Positional I/O with O_DIRECT through the bounce pool of the drive
+extern const struct drive_ops direct_ops;
+//The whole image mapped, DRIVE_MAPPED
+extern const struct drive_ops mapped_ops;
+//Windows of the image mapped on first touch, DRIVE_WINDOWED
+extern const struct drive_ops windowed_ops;
+
+//Transfers straight to the image, below the cache
+//Writes go through the elevator of the drive if it has one, reads of
+//sectors it holds dispatch it first
+//Reads of discarded sectors return zeros without touching the image
+//All return OP_SUCCESS or OP_FAILURE, errors are kept in last_error
+//Mapped images are only touched with the map lock of the drive held,
+//other drives have none and need no lock
+void backend_lock(struct mount * mount);
+void backend_unlock(struct mount * mount);
+struct map_lock * backend_lock_create();
+void backend_lock_destroy(struct map_lock * lock);
+int backend_read(struct mount * mount, u8 * buffer, u64 sector, u64 count);
+int backend_write(struct mount * mount, const u8 * buffer, u64 sector, u64 count);
+//Scatter-gather variants, iov covers consecutive sectors from sector
+int backend_readv(struct mount * mount, const struct disk_iovec * iov, int iovcnt, u64 sector);
+int backend_writev(struct mount * mount, const struct disk_iovec * iov, int iovcnt, u64 sector);
+//Writes to the image bypassing the elevator
+int backend_dispatch(struct mount * mount, const struct disk_iovec * iov, int iovcnt, u64 sector);
+//Deallocates the sectors in the image, they read as zeros afterwards
+//Falls back to writing zeros where the host cannot punch holes
+int backend_trim(struct mount * mount, u64 sector, u64 count);
+//Same as backend_trim for a zone reset, the device is charged a reset
+int backend_reset(struct mount * mount, u64 sector, u64 count);
+//Marks the sectors in holes of the image discarded, so reads of the
+//unallocated parts of a sparse image never reach the host
+int backend_scan_holes(struct mount * mount);
+//Dispatches the elevator and makes every completed write durable on the host file
+int backend_sync(struct mount * mount);
+//Cache writeback callback, context is the mount
+int backend_writeback(void * context, u64 sector, u64 count, const u8 * data);
+
+//Helpers of the drives keeping a file format of their own
+//Transfers size bytes at offset of fd, short transfers are retried and a
+//failure is kept in last_error as an errno value
+int file_transfer(struct mount * mount, int fd, u8 * buffer, u64 size, u64 offset, uint8_t write);
+u64 round_up(u64 value, u64 alignment);
+uint8_t all_zeros(const u8 * data, u64 size);
+#endif
@@ -1,72 +1,273 @@
 #include "bfuse.h"
 #include "dependencies.h"
+#include "cache.h"
+#include "backend.h"
+#include "writeback.h"
+#include "readahead.h"
+#include "async.h"
+#include "elevator.h"
+#include "discard.h"
+#include "direct.h"
+#include "ram.h"
+#include "stats.h"
+#include "timing.h"
+#include "ftl.h"
+#include "zoned.h"
+#include "overlay.h"
+#include "compressed.h"
+#include "dedup.h"
 
-struct mount * mount_header = 0x0;
+//Mount registry, open addressing hash table keyed by mount point
+//Linear probing, the table doubles when it gets 70% full
+#define MOUNT_TABLE_INITIAL_SIZE    16
+#define MOUNT_TABLE_LOAD_NUM        7
+#define MOUNT_TABLE_LOAD_DEN        10
+#define MOUNT_TABLE_TOMBSTONE       ((struct mount *)0x1)
+
+//Registering, removing and looking up drives can happen on any thread.
+//Lookups share mount_table_lock so they run side by side, registering and
+//removing hold it alone. It is created with the first registration, under
+//mount_table_create_lock, lookups before it find nothing
+//The handles returned by open_drive are used without the lock
+static __fuse_mutex_t mount_table_create_lock = __fuse_MUTEX_INITIALIZER;
+static __fuse_rwlock_t * mount_table_lock = 0x0;
+static struct mount ** mount_table = 0x0;
+static u64 mount_table_size = 0;
+static u64 mount_table_count = 0;
+static u64 mount_table_used = 0;
+
+//FNV-1a
+static u64 hash_mount_point(const char * mount_point) {
+    u64 hash = 0xcbf29ce484222325ULL;
+    while (*mount_point) {
+        hash ^= (u8)*mount_point++;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
 
 #ifdef __DEBUG_ENABLED
 #include <stdio.h>
 void debug() {
-    struct mount * current = mount_header;
-    if (current == 0)
+    if (mount_table_count == 0)
         __fuse_printf("Empty list\n");
-    while (current != 0x0) {
-        __fuse_printf("Mount: %s\n", current->mount_point);
-        current = current->next;
+    for (u64 i = 0; i < mount_table_size; i++) {
+        struct mount * current = mount_table[i];
+        if (current != 0x0 && current != MOUNT_TABLE_TOMBSTONE)
+            __fuse_printf("Mount: %s (slot %llu)\n", current->mount_point, (unsigned long long)i);
     }
 }
 #endif
 
+static uint8_t resize_mount_table(u64 new_size) {
+    struct mount ** new_table = __fuse_malloc(new_size * sizeof(struct mount *));
+    if (new_table == 0x0) {
+        return 0;
+    }
+    for (u64 i = 0; i < new_size; i++) {
+        new_table[i] = 0x0;
+    }
+
+    for (u64 i = 0; i < mount_table_size; i++) {
+        struct mount * current = mount_table[i];
+        if (current == 0x0 || current == MOUNT_TABLE_TOMBSTONE)
+            continue;
+        u64 slot = current->mount_hash & (new_size - 1);
+        while (new_table[slot] != 0x0) {
+            slot = (slot + 1) & (new_size - 1);
+        }
+        new_table[slot] = current;
+    }
+
+    if (mount_table != 0x0)
+        __fuse_free(mount_table);
+    mount_table = new_table;
+    mount_table_size = new_size;
+    mount_table_used = mount_table_count;
+    return 1;
+}
+
+static __fuse_rwlock_t * table_lock() {
+    __fuse_rwlock_t * lock = __fuse_load_acquire(&mount_table_lock);
+    if (lock != 0x0) {
+        return lock;
+    }
+    __fuse_mutex_lock(&mount_table_create_lock);
+    if (mount_table_lock == 0x0)
+        __fuse_store_release(&mount_table_lock, __fuse_rwlock_create());
+    lock = mount_table_lock;
+    __fuse_mutex_unlock(&mount_table_create_lock);
+    return lock;
+}
+
+//Returns the slot holding mount_point, or -1 if it is not registered
+static s64 find_mount_slot(const char * mount_point, u64 hash) {
+    if (mount_table_size == 0) {
+        return -1;
+    }
+
+    u64 slot = hash & (mount_table_size - 1);
+    while (mount_table[slot] != 0x0) {
+        struct mount * current = mount_table[slot];
+        if (current != MOUNT_TABLE_TOMBSTONE && current->mount_hash == hash && __fuse_strcmp(current->mount_point, mount_point) == 0) {
+            return (s64)slot;
+        }
+        slot = (slot + 1) & (mount_table_size - 1);
+    }
+    return -1;
+}
+
+struct mount * add_mount(const char * mount_point, const char * file_name, int handle, u64 sector_size, u64 start_sector, u64 sector_count) {
+    u64 hash = hash_mount_point(mount_point);
+    __fuse_rwlock_t * lock = table_lock();
+    if (lock == 0x0) {
+        return 0x0;
+    }
+    __fuse_rwlock_write(lock);
+    if (find_mount_slot(mount_point, hash) != -1) {
+        __fuse_rwlock_unlock(lock);
+        __fuse_printf("Mount point %s already registered\n", mount_point);
+        return 0x0;
+    }
+
+    //Keep the load factor under the limit, tombstones included
+    if ((mount_table_used + 1) * MOUNT_TABLE_LOAD_DEN > mount_table_size * MOUNT_TABLE_LOAD_NUM) {
+        u64 new_size = (mount_table_size == 0) ? MOUNT_TABLE_INITIAL_SIZE : mount_table_size;
+        while ((mount_table_count + 1) * MOUNT_TABLE_LOAD_DEN * 2 > new_size * MOUNT_TABLE_LOAD_NUM) {
+            new_size <<= 1;
+        }
+        if (!resize_mount_table(new_size)) {
+            __fuse_rwlock_unlock(lock);
+            __fuse_printf("Error growing mount table\n");
+            return 0x0;
+        }
+    }
 
-#ifdef __EAGER
-void add_mount(const char * mount_point, const char * file_name, u8 * buffer, u64 sector_size, u64 start_sector, u64 sector_count) {
-#else
-void add_mount(const char * mount_point, const char * file_name, int handle, u64 sector_size, u64 start_sector, u64 sector_count) {
-#endif
     struct mount * new_mount = __fuse_malloc(sizeof(struct mount));
-    __fuse_strncpy(new_mount->mount_point, mount_point, __fuse_strlen(mount_point));
-    __fuse_strncpy(new_mount->file_name, file_name, __fuse_strlen(file_name));
-#ifdef __EAGER
-    new_mount->file_ptr = buffer;
-#else
+    if (new_mount == 0x0) {
+        __fuse_rwlock_unlock(lock);
+        return 0x0;
+    }
+    __fuse_strncpy(new_mount->mount_point, mount_point, MAX_DRIVE_NAME_LENGTH - 1);
+    new_mount->mount_point[MAX_DRIVE_NAME_LENGTH - 1] = 0;
+    __fuse_strncpy(new_mount->file_name, file_name, MAX_FILE_NAME_LENGTH - 1);
+    new_mount->file_name[MAX_FILE_NAME_LENGTH - 1] = 0;
+    new_mount->mount_hash = hash;
     new_mount->file_handle = handle;
-#endif
+    new_mount->file_size = 0;
+    new_mount->ops = &fd_ops;
+    new_mount->file_ptr = 0x0;
+    new_mount->dirty_map = 0x0;
+    new_mount->windows = 0x0;
+    new_mount->lru_head = 0x0;
+    new_mount->lru_tail = 0x0;
+    new_mount->window_count = 0;
+    new_mount->mapped_bytes = 0;
+    new_mount->map_budget = __LAZY_MAP_BUDGET;
+    new_mount->access_hint = 0;
+    new_mount->evicted_dirty = 0;
+    new_mount->map_lock = 0x0;
+    new_mount->discard = discard_create(sector_count);
+    new_mount->stats = stats_create();
+    new_mount->layers_lock = __fuse_rwlock_create();
+    if (new_mount->discard == 0x0 || new_mount->stats == 0x0 || new_mount->layers_lock == 0x0) {
+        __fuse_rwlock_unlock(lock);
+        discard_destroy(new_mount->discard);
+        stats_destroy(new_mount->stats);
+        __fuse_rwlock_destroy(new_mount->layers_lock);
+        __fuse_free(new_mount);
+        return 0x0;
+    }
     new_mount->sector_size = sector_size;
     new_mount->starting_sector = start_sector;
     new_mount->sector_count = sector_count;
-    new_mount->next = mount_header;
+    new_mount->cache = 0x0;
+    new_mount->writeback = 0x0;
+    new_mount->readahead = 0x0;
+    new_mount->async = 0x0;
+    new_mount->elevator = 0x0;
+    new_mount->direct = 0x0;
+    new_mount->ram = 0x0;
+    new_mount->timing = 0x0;
+    new_mount->ftl = 0x0;
+    new_mount->zones = 0x0;
+    new_mount->overlay = 0x0;
+    new_mount->compressed = 0x0;
+    new_mount->dedup = 0x0;
+    new_mount->queue_depth = __QUEUE_DEPTH;
     new_mount->configured = 0;
-    mount_header = new_mount;
+    new_mount->last_error = 0;
+
+    u64 slot = hash & (mount_table_size - 1);
+    while (mount_table[slot] != 0x0 && mount_table[slot] != MOUNT_TABLE_TOMBSTONE) {
+        slot = (slot + 1) & (mount_table_size - 1);
+    }
+    if (mount_table[slot] == 0x0)
+        mount_table_used++;
+    mount_table[slot] = new_mount;
+    mount_table_count++;
+    __fuse_rwlock_unlock(lock);
+    return new_mount;
+}
+
+//Flushes and releases the backing resources of a mount
+static void release_mount(struct mount * mount) {
+    async_destroy(mount);
+    readahead_stop(mount);
+    writeback_stop(mount);
+    cache_destroy(mount->cache);
+    mount->cache = 0x0;
+    elevator_stop(mount);
+    mount->ops->close(mount);
+    discard_destroy(mount->discard);
+    mount->discard = 0x0;
+    stats_destroy(mount->stats);
+    mount->stats = 0x0;
+    timing_stop(mount);
+    ftl_stop(mount);
+    zoned_stop(mount);
+    __fuse_rwlock_destroy(mount->layers_lock);
+    mount->layers_lock = 0x0;
 }
 
+//The drive is taken out of the table first and released without the lock,
+//nothing may be using its handle anymore
 uint8_t remove_mount(const char * mount_point) {
-    struct mount * current = mount_header;
-    struct mount * previous = 0x0;
-    while (current != 0x0) {
-        if (__fuse_strcmp(current->mount_point, mount_point) == 0) {
-            if (previous == 0x0) {
-                mount_header = current->next;
-            } else {
-                previous->next = current->next;
-            }
-            __fuse_free(current);
-            return 1;
-        }
-        previous = current;
-        current = current->next;
+    u64 hash = hash_mount_point(mount_point);
+    __fuse_rwlock_t * lock = __fuse_load_acquire(&mount_table_lock);
+    if (lock == 0x0) {
+        return 0;
+    }
+    __fuse_rwlock_write(lock);
+    s64 slot = find_mount_slot(mount_point, hash);
+    if (slot == -1) {
+        __fuse_rwlock_unlock(lock);
+        return 0;
     }
+    struct mount * mount = mount_table[slot];
+    mount_table[slot] = MOUNT_TABLE_TOMBSTONE;
+    mount_table_count--;
+    __fuse_rwlock_unlock(lock);
 
-    return 0;
+    release_mount(mount);
+    __fuse_free(mount);
+    return 1;
 }
 
 struct mount * get_mount(const char * mount_point) {
-    struct mount * current = mount_header;
-    while (current != 0x0) {
-        if (__fuse_strcmp(current->mount_point, mount_point) == 0) {
-            return current;
-        }
-        current = current->next;
+    u64 hash = hash_mount_point(mount_point);
+    struct mount * mount = 0x0;
+    __fuse_rwlock_t * lock = __fuse_load_acquire(&mount_table_lock);
+    if (lock == 0x0) {
+        return 0x0;
     }
-    return 0x0;
+    __fuse_rwlock_read(lock);
+    s64 slot = find_mount_slot(mount_point, hash);
+    if (slot != -1) {
+        mount = mount_table[slot];
+    }
+    __fuse_rwlock_unlock(lock);
+    return mount;
 }
 
 struct mount* get_drive(const char *mount_point) {
@@ -77,65 +278,539 @@ struct mount* get_drive(const char *mount_point) {
     return mount;
 }
 
-#ifdef __EAGER
-uint8_t * load_file(const char* filename, u64 sector_size, u64 * sectors) {
-#else
-int load_file(const char* filename, u64 sector_size, u64 * sectors) {
-#endif
-    int file = __fuse_open(filename, __fuse_O_RDWR);
+//Opens the image with the open flags, returns the file handle or -1 on error
+int load_file(const char* filename, u64 sector_size, u64 * sectors, u64 * size, int flags) {
+    int file = __fuse_open(filename, flags);
     if (file == -1) {
         __fuse_printf("Error opening file %s\n", filename);
-        goto error;
+        return -1;
     }
 
     __fuse_struct_stat st;
     if (__fuse_fstat(file, &st) == -1) {
         __fuse_printf("Error getting file size\n");
-        goto error;
+        __fuse_close(file);
+        return -1;
     }
 
-    u64 file_size = st.st_size;
-    *sectors = file_size / sector_size;
+    *size = st.st_size;
+    *sectors = *size / sector_size;
+    return file;
+}
 
-#ifdef __EAGER
-    u8 * buffer = __fuse_mmap(0, file_size, __fuse_PROT_READ | __fuse_PROT_WRITE, __fuse_MAP_SHARED, file, 0);
+//Maps the whole image, dirty pages are tracked in a bitmap so IOCTL_SYNC
+//only has to msync the ranges written since the last sync
+uint8_t map_file(struct mount * mount, u64 file_size) {
+    int flags = __fuse_MAP_SHARED;
+#ifdef __EAGER_PREFAULT
+    flags |= __fuse_MAP_POPULATE;
+#endif
+    u8 * buffer = __fuse_mmap(0, file_size, __fuse_PROT_READ | __fuse_PROT_WRITE, flags, mount->file_handle, 0);
     if (buffer == __fuse_MAP_FAILED) {
         __fuse_printf("Error mapping file\n");
-        goto error;
+        return 0;
     }
-    return buffer;
-#else
-    return file;
-#endif
 
-error:
-#ifdef __EAGER
-    return (void*)0x0;
-#else
-    return 0;
-#endif
+    u64 page_size = __fuse_page_size();
+    u64 pages = (file_size + page_size - 1) / page_size;
+    u64 words = (pages + 63) / 64;
+    mount->dirty_map = __fuse_malloc(words * sizeof(u64));
+    if (mount->dirty_map == 0x0) {
+        __fuse_munmap(buffer, file_size);
+        return 0;
+    }
+    __fuse_memset(mount->dirty_map, 0, words * sizeof(u64));
+
+    mount->file_ptr = buffer;
+    mount->page_shift = __builtin_ctzll(page_size);
+    mount->dirty_first = (u64)-1;
+    mount->dirty_last = 0;
+    return 1;
+}
+
+void mark_mapping_dirty(struct mount * mount, u64 offset, u64 size) {
+    u64 first = offset >> mount->page_shift;
+    u64 last = (offset + size - 1) >> mount->page_shift;
+
+    for (u64 page = first; page <= last; page++) {
+        mount->dirty_map[page >> 6] |= 1ULL << (page & 63);
+    }
+    if (first < mount->dirty_first)
+        mount->dirty_first = first;
+    if (last + 1 > mount->dirty_last)
+        mount->dirty_last = last + 1;
+}
+
+uint8_t flush_mapping(struct mount * mount) {
+    uint8_t result = 1;
+    u64 page = mount->dirty_first;
+
+    while (page < mount->dirty_last) {
+        if (!(mount->dirty_map[page >> 6] & (1ULL << (page & 63)))) {
+            page++;
+            continue;
+        }
+
+        //Coalesce the run of dirty pages into a single msync
+        u64 start = page;
+        while (page < mount->dirty_last && (mount->dirty_map[page >> 6] & (1ULL << (page & 63)))) {
+            mount->dirty_map[page >> 6] &= ~(1ULL << (page & 63));
+            page++;
+        }
+
+        u64 offset = start << mount->page_shift;
+        u64 length = (page - start) << mount->page_shift;
+        if (offset + length > mount->file_size)
+            length = mount->file_size - offset;
+        if (__fuse_msync(mount->file_ptr + offset, length, __fuse_MS_SYNC) == -1) {
+            mount->last_error = __fuse_errno();
+            result = 0;
+        }
+    }
+
+    mount->dirty_first = (u64)-1;
+    mount->dirty_last = 0;
+    return result;
+}
+
+void unmap_file(struct mount * mount) {
+    if (mount->file_ptr != 0x0) {
+        flush_mapping(mount);
+        __fuse_munmap(mount->file_ptr, mount->file_size);
+        mount->file_ptr = 0x0;
+    }
+    if (mount->dirty_map != 0x0) {
+        __fuse_free(mount->dirty_map);
+        mount->dirty_map = 0x0;
+    }
+}
+
+//Windows are mapped on first touch and unmapped in LRU order once the
+//mapped bytes exceed map_budget, so startup cost does not depend on the
+//size of the image
+static uint8_t setup_windows(struct mount * mount, u64 file_size) {
+    mount->window_count = (file_size + __LAZY_WINDOW_SIZE - 1) / __LAZY_WINDOW_SIZE;
+    mount->windows = __fuse_malloc(mount->window_count * sizeof(struct map_window *));
+    if (mount->windows == 0x0) {
+        return 0;
+    }
+    __fuse_memset(mount->windows, 0, mount->window_count * sizeof(struct map_window *));
+    return 1;
+}
+
+static void lru_unlink(struct mount * mount, struct map_window * window) {
+    if (window->prev) window->prev->next = window->next;
+    else mount->lru_head = window->next;
+    if (window->next) window->next->prev = window->prev;
+    else mount->lru_tail = window->prev;
+}
+
+static void lru_push(struct mount * mount, struct map_window * window) {
+    window->prev = 0x0;
+    window->next = mount->lru_head;
+    if (mount->lru_head) mount->lru_head->prev = window;
+    else mount->lru_tail = window;
+    mount->lru_head = window;
+}
+
+static void unmap_window(struct mount * mount, struct map_window * window) {
+    //The page cache keeps the data of a shared mapping, only durability
+    //is lost, so the next sync has to fall back to fdatasync
+    if (window->dirty_end > window->dirty_start)
+        mount->evicted_dirty = 1;
+    lru_unlink(mount, window);
+    __fuse_munmap(window->ptr, window->length);
+    mount->windows[window->index] = 0x0;
+    mount->mapped_bytes -= window->length;
+    __fuse_free(window);
+}
+
+void set_map_budget(struct mount * mount, u64 budget) {
+    mount->map_budget = budget;
+    while (mount->lru_tail != 0x0 && mount->mapped_bytes > budget) {
+        unmap_window(mount, mount->lru_tail);
+    }
+}
+
+static void advise_window(struct mount * mount, struct map_window * window) {
+    const int advice[] = {__fuse_MADV_NORMAL, __fuse_MADV_SEQUENTIAL, __fuse_MADV_RANDOM, __fuse_MADV_WILLNEED};
+    __fuse_madvise(window->ptr, window->length, advice[mount->access_hint]);
+}
+
+u8 * map_window(struct mount * mount, u64 offset, u64 * length, uint8_t write) {
+    u64 index = offset / __LAZY_WINDOW_SIZE;
+    if (index >= mount->window_count) {
+        return 0x0;
+    }
+
+    struct map_window * window = mount->windows[index];
+    if (window == 0x0) {
+        u64 start = index * __LAZY_WINDOW_SIZE;
+        u64 window_length = mount->file_size - start;
+        if (window_length > __LAZY_WINDOW_SIZE)
+            window_length = __LAZY_WINDOW_SIZE;
+
+        //Always keep room for at least the window being mapped
+        while (mount->lru_tail != 0x0 && mount->mapped_bytes + window_length > mount->map_budget) {
+            unmap_window(mount, mount->lru_tail);
+        }
+
+        window = __fuse_malloc(sizeof(struct map_window));
+        if (window == 0x0) {
+            return 0x0;
+        }
+        window->ptr = __fuse_mmap(0, window_length, __fuse_PROT_READ | __fuse_PROT_WRITE, __fuse_MAP_SHARED, mount->file_handle, start);
+        if (window->ptr == __fuse_MAP_FAILED) {
+            mount->last_error = __fuse_errno();
+            __fuse_free(window);
+            return 0x0;
+        }
+        window->index = index;
+        window->length = window_length;
+        window->dirty_start = window_length;
+        window->dirty_end = 0;
+        if (mount->access_hint != 0) {
+            advise_window(mount, window);
+        }
+        mount->windows[index] = window;
+        mount->mapped_bytes += window_length;
+        lru_push(mount, window);
+    } else if (mount->lru_head != window) {
+        lru_unlink(mount, window);
+        lru_push(mount, window);
+    }
+
+    u64 inner = offset - index * __LAZY_WINDOW_SIZE;
+    if (*length > window->length - inner)
+        *length = window->length - inner;
+    if (write) {
+        if (inner < window->dirty_start)
+            window->dirty_start = inner;
+        if (inner + *length > window->dirty_end)
+            window->dirty_end = inner + *length;
+    }
+    return window->ptr + inner;
 }
 
+uint8_t flush_windows(struct mount * mount) {
+    uint8_t result = 1;
+    u64 page_mask = __fuse_page_size() - 1;
+
+    for (struct map_window * window = mount->lru_head; window != 0x0; window = window->next) {
+        if (window->dirty_end <= window->dirty_start)
+            continue;
+        u64 start = window->dirty_start & ~page_mask;
+        if (__fuse_msync(window->ptr + start, window->dirty_end - start, __fuse_MS_SYNC) == -1) {
+            mount->last_error = __fuse_errno();
+            result = 0;
+        }
+        window->dirty_start = window->length;
+        window->dirty_end = 0;
+    }
+
+    if (mount->evicted_dirty) {
+        if (__fuse_fdatasync(mount->file_handle) == -1) {
+            mount->last_error = __fuse_errno();
+            result = 0;
+        }
+        mount->evicted_dirty = 0;
+    }
+    return result;
+}
+
+void unmap_windows(struct mount * mount) {
+    if (mount->windows != 0x0) {
+        flush_windows(mount);
+        set_map_budget(mount, 0);
+        __fuse_free(mount->windows);
+        mount->windows = 0x0;
+    }
+}
+
+//Applies one of the ACCESS_HINT_* values to the whole drive
+uint8_t advise_drive(struct mount * mount, u32 hint) {
+    const int map_advice[] = {__fuse_MADV_NORMAL, __fuse_MADV_SEQUENTIAL, __fuse_MADV_RANDOM, __fuse_MADV_WILLNEED};
+    const int file_advice[] = {__fuse_FADV_NORMAL, __fuse_FADV_SEQUENTIAL, __fuse_FADV_RANDOM, __fuse_FADV_WILLNEED};
+    if (hint >= sizeof(map_advice) / sizeof(map_advice[0])) {
+        return 0;
+    }
+    if (mount->ram != 0x0) {
+        //Nothing to prefetch, the whole drive is in memory
+        return 1;
+    }
+
+    int result;
+    if (mount->file_ptr != 0x0)
+        result = __fuse_madvise(mount->file_ptr, mount->file_size, map_advice[hint]);
+    else
+        result = (mount->file_handle == -1) ? -1 : __fuse_fadvise(mount->file_handle, 0, 0, file_advice[hint]);
+    if (result == -1) {
+        mount->last_error = __fuse_errno();
+        return 0;
+    }
+    if (mount->windows != 0x0) {
+        //Windows mapped from now on inherit the hint as well
+        mount->access_hint = hint;
+        for (struct map_window * window = mount->lru_head; window != 0x0; window = window->next) {
+            advise_window(mount, window);
+        }
+    }
+    return 1;
+}
+
+//Transfers of the direct drive that are not aligned bounce through its pool
+static uint8_t setup_direct(struct mount * mount) {
+    u64 alignment = __fuse_direct_alignment(mount->file_handle);
+    if (mount->file_size % alignment != 0) {
+        __fuse_printf("Image size must be a multiple of %llu for O_DIRECT\n", (unsigned long long)alignment);
+        return 0;
+    }
+    mount->direct = direct_create(alignment);
+    return mount->direct != 0x0;
+}
+
+//Picks the ops of the drive and sets up what they need, a failed setup
+//is undone by the close of the ops
+static uint8_t setup_storage(struct mount * mount, u32 flags) {
+    if (flags & (DRIVE_MAPPED | DRIVE_WINDOWED)) {
+        mount->ops = (flags & DRIVE_MAPPED) ? &mapped_ops : &windowed_ops;
+        mount->map_lock = backend_lock_create();
+        if (mount->map_lock == 0x0) {
+            return 0;
+        }
+        return (flags & DRIVE_MAPPED) ? map_file(mount, mount->file_size) : setup_windows(mount, mount->file_size);
+    }
+    if (flags & DRIVE_DIRECT) {
+        mount->ops = &direct_ops;
+        return setup_direct(mount);
+    }
+    mount->ops = &fd_ops;
+    return 1;
+}
+
+//Starts the layers config.h enables above the backend
+static void setup_layers(struct mount * mount) {
+    (void)mount;
+#ifdef __ELEVATOR
+    elevator_start(mount, ELEVATOR_DEADLINE, __ELEVATOR_PLUG_MS);
+#endif
+#ifdef __CACHE_SECTORS
+    mount->cache = cache_create(mount->sector_size, __CACHE_SECTORS, backend_writeback, mount);
+#ifdef __WRITEBACK
+    writeback_start(mount);
+#endif
+#ifdef __READAHEAD
+    readahead_start(mount, (u64)__READAHEAD_MAX_KB << 10);
+#endif
+#endif
+}
 
 uint8_t register_drive(const char * filename, const char* mount_point, u32 sector_size) {
-    u64 sector_count = 0;
+    u32 flags = 0;
 #ifdef __EAGER
-    u8 * reference;
-#else
-    int reference;
+    flags |= DRIVE_MAPPED;
+#endif
+#ifdef __LAZY
+    flags |= DRIVE_WINDOWED;
+#endif
+#ifdef __DIRECT
+    flags |= DRIVE_DIRECT;
 #endif
+    return register_drive_ex(filename, mount_point, sector_size, flags);
+}
+
+uint8_t register_drive_ex(const char * filename, const char* mount_point, u32 sector_size, u32 flags) {
+    u64 sector_count = 0;
+    u64 file_size = 0;
 
-    reference = load_file(filename, sector_size, &sector_count);
-    if (reference == 0x0) {
+    if (get_mount(mount_point) != 0x0) {
+        __fuse_printf("Mount point %s already registered\n", mount_point);
+        return 0;
+    }
+    if ((flags & DRIVE_MAPPED) && (flags & DRIVE_WINDOWED)) {
+        __fuse_printf("DRIVE_MAPPED and DRIVE_WINDOWED are mutually exclusive\n");
+        return 0;
+    }
+    if ((flags & DRIVE_DIRECT) && (flags & (DRIVE_MAPPED | DRIVE_WINDOWED))) {
+        __fuse_printf("O_DIRECT needs positional I/O, it cannot be mapped\n");
+        return 0;
+    }
+
+    int handle = load_file(filename, sector_size, &sector_count, &file_size, __fuse_O_RDWR | ((flags & DRIVE_DIRECT) ? __fuse_O_DIRECT : 0));
+    if (handle == -1) {
         __fuse_printf("Error loading file\n");
         return 0;
     }
-    add_mount(mount_point, filename, reference, sector_size, 0, sector_count);
+
+    struct mount * mount = add_mount(mount_point, filename, handle, sector_size, 0, sector_count);
+    if (mount == 0x0) {
+        __fuse_close(handle);
+        return 0;
+    }
+
+    mount->file_size = file_size;
+    if (!setup_storage(mount, flags)) {
+        remove_mount(mount_point);
+        return 0;
+    }
+    //A failed scan only costs reading the holes. Mapped drives read the
+    //holes from the page cache anyway, and the hole map of a lazy drive
+    //would cost time and memory with the size of the image at registration
+    if (mount->ops == &fd_ops || mount->ops == &direct_ops)
+        backend_scan_holes(mount);
+    setup_layers(mount);
+    return 1;
+}
+
+static uint8_t add_ram_drive(const char * filename, const char* mount_point, u32 sector_size, u64 sector_count) {
+    if (sector_size == 0 || sector_count == 0) {
+        return 0;
+    }
+    struct mount * mount = add_mount(mount_point, filename ? filename : "", -1, sector_size, 0, sector_count);
+    if (mount == 0x0) {
+        return 0;
+    }
+    mount->file_size = sector_count * sector_size;
+    mount->ops = &ram_ops;
+    mount->ram = ram_create(mount->file_size);
+    if (mount->ram == 0x0 || (filename != 0x0 && ram_load(mount, filename))) {
+        __fuse_printf("Error setting up RAM drive %s\n", mount_point);
+        remove_mount(mount_point);
+        return 0;
+    }
+    setup_layers(mount);
+    return 1;
+}
+
+uint8_t register_ram_drive(const char* mount_point, u32 sector_size, u64 sector_count) {
+    return add_ram_drive(0x0, mount_point, sector_size, sector_count);
+}
+
+uint8_t register_ram_drive_from_image(const char * filename, const char* mount_point, u32 sector_size) {
+    u64 sector_count = 0;
+    u64 file_size = 0;
+    int handle = load_file(filename, sector_size, &sector_count, &file_size, __fuse_O_RDONLY);
+    if (handle == -1) {
+        return 0;
+    }
+    __fuse_close(handle);
+    return add_ram_drive(filename, mount_point, sector_size, sector_count);
+}
+
+//Writes back the cache and syncs the drive, returns 0 on failure
+static uint8_t flush_layers(struct mount * mount) {
+    if (mount->cache != 0x0) {
+        __fuse_mutex_lock(&mount->cache->lock);
+        int result = cache_flush(mount->cache);
+        __fuse_mutex_unlock(&mount->cache->lock);
+        if (result) {
+            return 0;
+        }
+    }
+    return backend_sync(mount) == OP_SUCCESS;
+}
+
+//Whatever the cache and the elevator hold goes into memory first
+uint8_t checkpoint_drive(const char* mount_point, const char * filename) {
+    struct mount * mount = get_mount(mount_point);
+    if (mount == 0x0 || mount->ram == 0x0) {
+        return 0;
+    }
+    __fuse_rwlock_read(mount->layers_lock);
+    uint8_t result = flush_layers(mount) && ram_checkpoint(mount, filename) == OP_SUCCESS;
+    __fuse_rwlock_unlock(mount->layers_lock);
+    return result;
+}
+
+uint8_t register_overlay_drive(const char * base_image, const char * delta_file, const char* mount_point, u32 sector_size) {
+    u64 sector_count = 0;
+    u64 file_size = 0;
+    if (sector_size == 0) {
+        return 0;
+    }
+    int handle = load_file(base_image, sector_size, &sector_count, &file_size, __fuse_O_RDONLY);
+    if (handle == -1) {
+        return 0;
+    }
+    struct mount * mount = add_mount(mount_point, base_image, handle, sector_size, 0, sector_count);
+    if (mount == 0x0) {
+        __fuse_close(handle);
+        return 0;
+    }
+    mount->file_size = file_size;
+    mount->ops = &overlay_ops;
+    if (overlay_open(mount, delta_file)) {
+        __fuse_printf("Error opening delta %s\n", delta_file);
+        remove_mount(mount_point);
+        return 0;
+    }
+    setup_layers(mount);
+    return 1;
+}
+
+//Same flush as a checkpoint before the delta goes into the base
+uint8_t commit_drive(const char* mount_point) {
+    struct mount * mount = get_mount(mount_point);
+    if (mount == 0x0 || mount->overlay == 0x0) {
+        return 0;
+    }
+    __fuse_rwlock_read(mount->layers_lock);
+    uint8_t result = flush_layers(mount) && overlay_commit(mount) == OP_SUCCESS;
+    __fuse_rwlock_unlock(mount->layers_lock);
+    return result;
+}
+
+//Drives kept in a file of their own format, probe reads the size of an
+//existing one and open loads it or lays out a new one
+static uint8_t add_store_drive(const char * filename, const char* mount_point, u32 sector_size, u64 sector_count,
+                               const struct drive_ops * ops, int (*probe)(int, u32, u64*), int (*open)(struct mount*)) {
+    u64 file_size = sector_count * sector_size;
+    if (sector_size == 0) {
+        return 0;
+    }
+    int handle = __fuse_create(filename);
+    if (handle == -1) {
+        return 0;
+    }
+    if (probe(handle, sector_size, &file_size) || file_size == 0) {
+        __fuse_close(handle);
+        return 0;
+    }
+    struct mount * mount = add_mount(mount_point, filename, handle, sector_size, 0, file_size / sector_size);
+    if (mount == 0x0) {
+        __fuse_close(handle);
+        return 0;
+    }
+    mount->file_size = file_size;
+    mount->ops = ops;
+    if (open(mount)) {
+        __fuse_printf("Error opening %s\n", filename);
+        remove_mount(mount_point);
+        return 0;
+    }
+    setup_layers(mount);
+    return 1;
+}
+
+uint8_t register_compressed_drive(const char * filename, const char* mount_point, u32 sector_size, u64 sector_count) {
+    return add_store_drive(filename, mount_point, sector_size, sector_count, &compressed_ops, compressed_probe, compressed_open);
+}
+
+uint8_t register_dedup_drive(const char * filename, const char* mount_point, u32 sector_size, u64 sector_count) {
+    return add_store_drive(filename, mount_point, sector_size, sector_count, &dedup_ops, dedup_probe, dedup_open);
+}
+
+uint8_t dump_drive_stats(const char* mount_point) {
+    struct mount * mount = get_mount(mount_point);
+    if (mount == 0x0) {
+        return 0;
+    }
+    stats_dump(mount);
     return 1;
 }
 
 void register_drive_subsection(const char* filename, const char* mount_point, u32 sector_size, u64 starting_sector, u64 sector_count) {
-    add_mount(mount_point, filename, 0x0, sector_size, starting_sector, sector_count);
+    add_mount(mount_point, filename, -1, sector_size, starting_sector, sector_count);
 }
 
 uint8_t unregister_drive(const char *mount_point) {
@@ -18,6 +18,35 @@
 #define ATA_MODEL_LEN      40
 #define ATA_SN_LEN         20
 
+//A mapped window of the image, kept in a per drive LRU list
+struct map_window {
+    u8   *ptr;
+    u64  index;
+    u64  length;
+    u64  dirty_start;
+    u64  dirty_end;
+    struct map_window * prev;
+    struct map_window * next;
+};
+
+struct sector_cache;
+struct writeback;
+struct readahead;
+struct async_queue;
+struct elevator;
+struct discard;
+struct direct;
+struct ram_drive;
+struct map_lock;
+struct drive_ops;
+struct drive_stats;
+struct timing;
+struct ftl;
+struct zoned;
+struct overlay;
+struct compressed;
+struct dedup;
+
 struct mount {
     const char ATA_REVISION[ATA_REV_LEN];
     const char ATA_MODEL[ATA_MODEL_LEN];
@@ -26,11 +55,42 @@ struct mount {
     char mount_point[MAX_DRIVE_NAME_LENGTH];
     char file_name[MAX_FILE_NAME_LENGTH];
 
-#ifdef __EAGER
-    u8   *file_ptr;
-#else
     int  file_handle;
-#endif
+    u64  file_size;
+    const struct drive_ops * ops;   //How the drive reaches its storage, chosen at registration
+    //DRIVE_MAPPED
+    u8   *file_ptr;
+    u64  *dirty_map;
+    u64  dirty_first;
+    u64  dirty_last;
+    u8   page_shift;
+    //DRIVE_WINDOWED
+    struct map_window ** windows;
+    struct map_window * lru_head;
+    struct map_window * lru_tail;
+    u64  window_count;
+    u64  mapped_bytes;
+    u64  map_budget;
+    u32  access_hint;
+    u8   evicted_dirty;
+    struct map_lock * map_lock;     //Only mapped drives have one
+    struct __fuse_rwlock * layers_lock; //Shared by requests, exclusive while a layer is replaced
+    struct sector_cache * cache;
+    struct writeback * writeback;
+    struct readahead * readahead;
+    struct async_queue * async;
+    struct elevator * elevator;
+    struct discard * discard;
+    struct direct * direct;
+    struct ram_drive * ram;
+    struct overlay * overlay;
+    struct compressed * compressed;
+    struct dedup * dedup;
+    struct drive_stats * stats;
+    struct timing * timing;         //Emulated device, 0x0 if requests take as long as the host needs
+    struct ftl * ftl;               //Emulated flash translation layer, 0x0 if writes overwrite in place
+    struct zoned * zones;           //Zones of a zoned drive, 0x0 if it can be written anywhere
+    u32 queue_depth;
     u8   configured;
     u8   can_eject;
     u8   power_state;
@@ -38,7 +98,8 @@ struct mount {
     u64  starting_sector;
     u64  sector_count;
 
-    struct mount * next;
+    u64  mount_hash;
+    int  last_error;
 };
 
 #ifdef __DEBUG_ENABLED
@@ -49,8 +110,67 @@ void debug();
 //Get the drive id from the mount point
 struct mount* get_drive(const char *mount_point);
 
+//Records that [offset, offset + size) of the mapping was written
+void mark_mapping_dirty(struct mount * mount, u64 offset, u64 size);
+//msyncs the dirty ranges of the mapping, returns 0 on failure
+uint8_t flush_mapping(struct mount * mount);
+//Flushes and unmaps the whole image mapping
+void unmap_file(struct mount * mount);
+
+//Returns a pointer to offset inside its window, mapping it if needed
+//length is clamped to the bytes left in the window, returns 0 on failure
+u8 * map_window(struct mount * mount, u64 offset, u64 * length, uint8_t write);
+//msyncs the dirty part of every mapped window, returns 0 on failure
+uint8_t flush_windows(struct mount * mount);
+//Changes the address space budget, unmapping cold windows to fit
+void set_map_budget(struct mount * mount, u64 budget);
+//Flushes and unmaps every window
+void unmap_windows(struct mount * mount);
+
+//Applies an ACCESS_HINT_* value to the drive, returns 0 on failure
+uint8_t advise_drive(struct mount * mount, u32 hint);
+
+//Flags for register_drive_ex, without DRIVE_MAPPED or DRIVE_WINDOWED the
+//image is accessed with positional I/O
+#define DRIVE_DIRECT        0x1     //Bypass the host page cache with O_DIRECT, positional I/O only
+#define DRIVE_MAPPED        0x2     //Map the whole image
+#define DRIVE_WINDOWED      0x4     //Map windows of the image on first touch
+
 //Register an entire file as a drive, size must be multiple of sector size
+//The access mode comes from __EAGER, __LAZY and __DIRECT in config.h
 uint8_t register_drive(const char * filename, const char* mount_point, u32 sector_size);
+//Same as register_drive with DRIVE_* flags
+//With DRIVE_DIRECT the size must be a multiple of the logical block size of the host
+uint8_t register_drive_ex(const char * filename, const char* mount_point, u32 sector_size, u32 flags);
+
+//Register a drive held in anonymous memory, it starts out as zeros
+uint8_t register_ram_drive(const char* mount_point, u32 sector_size, u64 sector_count);
+//Same as register_ram_drive with the drive loaded from an image, which is
+//only read and may be read-only
+uint8_t register_ram_drive_from_image(const char * filename, const char* mount_point, u32 sector_size);
+//Writes a RAM drive to filename, only the changed regions if it was loaded
+//from or last checkpointed to the same file, returns 0 on failure
+uint8_t checkpoint_drive(const char* mount_point, const char * filename);
+
+//Register a copy-on-write drive over an image that is only read, writes go
+//to delta_file, created if it does not exist, so any number of drives can
+//share the image. An existing delta_file carries on from where it was left
+uint8_t register_overlay_drive(const char * base_image, const char * delta_file, const char* mount_point, u32 sector_size);
+//Writes the delta of an overlay into its image and empties it, only while
+//no request is in flight on the drive, returns 0 on failure
+uint8_t commit_drive(const char* mount_point);
+
+//Register a drive stored compressed in filename, created as a container of
+//sector_count sectors if it does not exist or is empty, an existing
+//container keeps its own size
+uint8_t register_compressed_drive(const char * filename, const char* mount_point, u32 sector_size, u64 sector_count);
+//Register a drive that stores every distinct block once in filename, created
+//as a store of sector_count sectors if it does not exist or is empty, an
+//existing store keeps its own size
+uint8_t register_dedup_drive(const char * filename, const char* mount_point, u32 sector_size, u64 sector_count);
+
+//Prints the request counters and latency percentiles of a drive, returns 0 if it is not registered
+uint8_t dump_drive_stats(const char* mount_point);
 
 //Register a part of a file as a drive.
 void register_drive_subsection(const char* filename, const char* mount_point, u32 sector_size, u64 starting_sector, u64 sector_count);
@@ -0,0 +1,402 @@
+#include "cache.h"
+#include "dependencies.h"
+
+//Recommended 2Q tuning: A1in holds 25% of the cache, A1out remembers
+//as many sectors as half the cache
+#define CACHE_KIN_DIVISOR   4
+#define CACHE_KOUT_DIVISOR  2
+
+static u64 hash_sector(struct sector_cache * cache, u64 sector) {
+    return ((sector * 0x9E3779B97F4A7C15ULL) >> 29) & cache->bucket_mask;
+}
+
+static struct cache_entry * find_entry(struct sector_cache * cache, u64 sector) {
+    struct cache_entry * entry = cache->buckets[hash_sector(cache, sector)];
+    while (entry != 0x0 && entry->sector != sector) {
+        entry = entry->hash_next;
+    }
+    return entry;
+}
+
+static void hash_insert(struct sector_cache * cache, struct cache_entry * entry) {
+    u64 bucket = hash_sector(cache, entry->sector);
+    entry->hash_next = cache->buckets[bucket];
+    cache->buckets[bucket] = entry;
+}
+
+static void hash_remove(struct sector_cache * cache, struct cache_entry * entry) {
+    struct cache_entry ** link = &cache->buckets[hash_sector(cache, entry->sector)];
+    while (*link != entry) {
+        link = &(*link)->hash_next;
+    }
+    *link = entry->hash_next;
+}
+
+static struct cache_queue * get_queue(struct sector_cache * cache, u8 queue) {
+    switch (queue) {
+        case CACHE_QUEUE_A1IN:  return &cache->a1in;
+        case CACHE_QUEUE_AM:    return &cache->am;
+        default:                return &cache->a1out;
+    }
+}
+
+static void queue_push(struct sector_cache * cache, struct cache_entry * entry, u8 queue) {
+    struct cache_queue * target = get_queue(cache, queue);
+    entry->queue = queue;
+    entry->prev = 0x0;
+    entry->next = target->head;
+    if (target->head) target->head->prev = entry;
+    else target->tail = entry;
+    target->head = entry;
+    target->count++;
+}
+
+static void queue_remove(struct sector_cache * cache, struct cache_entry * entry) {
+    struct cache_queue * target = get_queue(cache, entry->queue);
+    if (entry->prev) entry->prev->next = entry->next;
+    else target->head = entry->next;
+    if (entry->next) entry->next->prev = entry->prev;
+    else target->tail = entry->prev;
+    target->count--;
+    entry->queue = CACHE_QUEUE_NONE;
+}
+
+static void release_entry(struct sector_cache * cache, struct cache_entry * entry) {
+    if (entry->prefetched) {
+        cache->prefetch_wasted++;
+        entry->prefetched = 0;
+    }
+    if (entry->data != 0x0) {
+        cache->free_buffers[cache->free_buffer_count++] = entry->data;
+        entry->data = 0x0;
+    }
+    entry->next = cache->free_entries;
+    cache->free_entries = entry;
+}
+
+static void dirty_link(struct sector_cache * cache, struct cache_entry * entry) {
+    entry->dirty = 1;
+    entry->dirty_since = __fuse_monotonic_ms();
+    entry->dirty_next = 0x0;
+    entry->dirty_prev = cache->dirty_tail;
+    if (cache->dirty_tail) cache->dirty_tail->dirty_next = entry;
+    else cache->dirty_head = entry;
+    cache->dirty_tail = entry;
+    cache->dirty_count++;
+}
+
+static void dirty_unlink(struct sector_cache * cache, struct cache_entry * entry) {
+    if (entry->dirty_prev) entry->dirty_prev->dirty_next = entry->dirty_next;
+    else cache->dirty_head = entry->dirty_next;
+    if (entry->dirty_next) entry->dirty_next->dirty_prev = entry->dirty_prev;
+    else cache->dirty_tail = entry->dirty_prev;
+    entry->dirty = 0;
+    cache->dirty_count--;
+}
+
+static int compare_entries(const void * a, const void * b) {
+    u64 first = (*(struct cache_entry * const *)a)->sector;
+    u64 second = (*(struct cache_entry * const *)b)->sector;
+    return (first > second) - (first < second);
+}
+
+//Frees a data buffer, demoting the A1in tail to a ghost while A1in is
+//over its share, otherwise dropping the least recently used Am sector
+//A dirty victim forces a writeback of every dirty sector, which keeps
+//the writes coalesced, returns 0 if that writeback fails
+static u8 * reclaim_buffer(struct sector_cache * cache) {
+    if (cache->free_buffer_count > 0) {
+        return cache->free_buffers[--cache->free_buffer_count];
+    }
+
+    struct cache_entry * victim;
+    u8 * buffer;
+    uint8_t from_a1in = (cache->a1in.count > cache->kin || cache->am.count == 0);
+    victim = from_a1in ? cache->a1in.tail : cache->am.tail;
+    if (victim->dirty) {
+        cache->forced_writebacks++;
+        if (cache_flush(cache)) {
+            return 0x0;
+        }
+    }
+
+    if (from_a1in) {
+        queue_remove(cache, victim);
+        buffer = victim->data;
+        victim->data = 0x0;
+        if (victim->prefetched) {
+            cache->prefetch_wasted++;
+            victim->prefetched = 0;
+        }
+        if (cache->a1out.count >= cache->kout && cache->a1out.tail != 0x0) {
+            struct cache_entry * ghost = cache->a1out.tail;
+            queue_remove(cache, ghost);
+            hash_remove(cache, ghost);
+            release_entry(cache, ghost);
+        }
+        if (cache->kout > 0) {
+            queue_push(cache, victim, CACHE_QUEUE_A1OUT);
+        } else {
+            hash_remove(cache, victim);
+            release_entry(cache, victim);
+        }
+    } else {
+        queue_remove(cache, victim);
+        hash_remove(cache, victim);
+        buffer = victim->data;
+        victim->data = 0x0;
+        release_entry(cache, victim);
+    }
+
+    cache->evictions++;
+    return buffer;
+}
+
+struct sector_cache * cache_create(u32 sector_size, u64 capacity, cache_writeback_t writeback, void * context) {
+    if (capacity == 0 || sector_size == 0) {
+        return 0x0;
+    }
+
+    struct sector_cache * cache = __fuse_malloc(sizeof(struct sector_cache));
+    if (cache == 0x0) {
+        return 0x0;
+    }
+    __fuse_memset(cache, 0, sizeof(struct sector_cache));
+    __fuse_mutex_init(&cache->lock);
+
+    cache->sector_size = sector_size;
+    cache->capacity = capacity;
+    cache->writeback = writeback;
+    cache->writeback_context = context;
+    cache->kin = capacity / CACHE_KIN_DIVISOR;
+    cache->kout = capacity / CACHE_KOUT_DIVISOR;
+
+    u64 entry_count = capacity + cache->kout + 1;
+    u64 bucket_count = 1;
+    while (bucket_count < entry_count) {
+        bucket_count <<= 1;
+    }
+    cache->bucket_mask = bucket_count - 1;
+
+    cache->buckets = __fuse_malloc(bucket_count * sizeof(struct cache_entry *));
+    cache->entries = __fuse_malloc(entry_count * sizeof(struct cache_entry));
+    cache->arena = __fuse_malloc(capacity * sector_size);
+    cache->free_buffers = __fuse_malloc(capacity * sizeof(u8 *));
+    cache->flush_list = __fuse_malloc(capacity * sizeof(struct cache_entry *));
+    cache->flush_buffer = __fuse_malloc(CACHE_FLUSH_RUN * sector_size);
+    if (cache->buckets == 0x0 || cache->entries == 0x0 || cache->arena == 0x0 || cache->free_buffers == 0x0 ||
+        cache->flush_list == 0x0 || cache->flush_buffer == 0x0) {
+        cache_destroy(cache);
+        return 0x0;
+    }
+    __fuse_memset(cache->buckets, 0, bucket_count * sizeof(struct cache_entry *));
+
+    for (u64 i = 0; i < entry_count; i++) {
+        cache->entries[i].data = 0x0;
+        cache->entries[i].queue = CACHE_QUEUE_NONE;
+        cache->entries[i].dirty = 0;
+        cache->entries[i].prefetched = 0;
+        cache->entries[i].next = (i + 1 < entry_count) ? &cache->entries[i + 1] : 0x0;
+    }
+    cache->free_entries = &cache->entries[0];
+
+    for (u64 i = 0; i < capacity; i++) {
+        cache->free_buffers[i] = cache->arena + i * sector_size;
+    }
+    cache->free_buffer_count = capacity;
+    return cache;
+}
+
+void cache_destroy(struct sector_cache * cache) {
+    if (cache == 0x0) {
+        return;
+    }
+    if (cache->buckets) __fuse_free(cache->buckets);
+    if (cache->entries) __fuse_free(cache->entries);
+    if (cache->arena) __fuse_free(cache->arena);
+    if (cache->free_buffers) __fuse_free(cache->free_buffers);
+    if (cache->flush_list) __fuse_free(cache->flush_list);
+    if (cache->flush_buffer) __fuse_free(cache->flush_buffer);
+    __fuse_mutex_destroy(&cache->lock);
+    __fuse_free(cache);
+}
+
+u8 * cache_lookup(struct sector_cache * cache, u64 sector) {
+    struct cache_entry * entry = find_entry(cache, sector);
+    if (entry == 0x0 || entry->queue == CACHE_QUEUE_A1OUT) {
+        cache->misses++;
+        return 0x0;
+    }
+
+    cache->hits++;
+    if (entry->prefetched) {
+        cache->prefetch_used++;
+        entry->prefetched = 0;
+    }
+    //A1in is a FIFO, re-references there do not reorder
+    if (entry->queue == CACHE_QUEUE_AM && cache->am.head != entry) {
+        queue_remove(cache, entry);
+        queue_push(cache, entry, CACHE_QUEUE_AM);
+    }
+    return entry->data;
+}
+
+static int store_entry(struct sector_cache * cache, u64 sector, const u8 * data, uint8_t dirty, uint8_t prefetched) {
+    struct cache_entry * entry = find_entry(cache, sector);
+    u8 queue = CACHE_QUEUE_A1IN;
+
+    if (entry != 0x0 && entry->queue != CACHE_QUEUE_A1OUT) {
+        __fuse_memcpy(entry->data, data, cache->sector_size);
+        if (entry->prefetched) {
+            //Overwritten before anyone read it
+            cache->prefetch_wasted++;
+            entry->prefetched = 0;
+        }
+        if (entry->queue == CACHE_QUEUE_AM && cache->am.head != entry) {
+            queue_remove(cache, entry);
+            queue_push(cache, entry, CACHE_QUEUE_AM);
+        }
+        if (dirty && !entry->dirty) {
+            dirty_link(cache, entry);
+        }
+        return 0;
+    }
+
+    u8 * buffer = reclaim_buffer(cache);
+    if (buffer == 0x0) {
+        return 1;
+    }
+
+    //The reclaim may have dropped the ghost, look it up again
+    entry = find_entry(cache, sector);
+    if (entry != 0x0) {
+        //Seen recently enough to still be remembered, goes straight to Am
+        queue_remove(cache, entry);
+        hash_remove(cache, entry);
+        release_entry(cache, entry);
+        cache->ghost_hits++;
+        queue = CACHE_QUEUE_AM;
+    }
+
+    entry = cache->free_entries;
+    cache->free_entries = entry->next;
+    entry->sector = sector;
+    entry->data = buffer;
+    hash_insert(cache, entry);
+    queue_push(cache, entry, queue);
+    __fuse_memcpy(buffer, data, cache->sector_size);
+    if (dirty) {
+        dirty_link(cache, entry);
+    }
+    if (prefetched) {
+        entry->prefetched = 1;
+        cache->prefetched++;
+    }
+    return 0;
+}
+
+int cache_store(struct sector_cache * cache, u64 sector, const u8 * data) {
+    return store_entry(cache, sector, data, 0, 0);
+}
+
+int cache_store_dirty(struct sector_cache * cache, u64 sector, const u8 * data) {
+    return store_entry(cache, sector, data, 1, 0);
+}
+
+int cache_store_prefetched(struct sector_cache * cache, u64 sector, const u8 * data) {
+    return store_entry(cache, sector, data, 0, 1);
+}
+
+uint8_t cache_contains(struct sector_cache * cache, u64 sector) {
+    struct cache_entry * entry = find_entry(cache, sector);
+    return entry != 0x0 && entry->queue != CACHE_QUEUE_A1OUT;
+}
+
+static void drop_entry(struct sector_cache * cache, struct cache_entry * entry) {
+    if (entry->dirty) {
+        dirty_unlink(cache, entry);
+    }
+    queue_remove(cache, entry);
+    hash_remove(cache, entry);
+    release_entry(cache, entry);
+}
+
+void cache_invalidate(struct sector_cache * cache, u64 sector) {
+    struct cache_entry * entry = find_entry(cache, sector);
+    if (entry != 0x0) {
+        drop_entry(cache, entry);
+    }
+}
+
+void cache_invalidate_range(struct sector_cache * cache, u64 sector, u64 count) {
+    //Past the number of entries walking the queues is cheaper than a
+    //lookup per sector
+    if (count <= cache->capacity + cache->kout) {
+        for (u64 i = 0; i < count; i++) {
+            cache_invalidate(cache, sector + i);
+        }
+        return;
+    }
+    struct cache_queue * queues[] = {&cache->a1in, &cache->am, &cache->a1out};
+    for (u32 i = 0; i < sizeof(queues) / sizeof(queues[0]); i++) {
+        struct cache_entry * entry = queues[i]->head;
+        while (entry != 0x0) {
+            struct cache_entry * next = entry->next;
+            if (entry->sector >= sector && entry->sector - sector < count)
+                drop_entry(cache, entry);
+            entry = next;
+        }
+    }
+}
+
+int cache_flush(struct sector_cache * cache) {
+    if (cache->dirty_count == 0) {
+        return 0;
+    }
+
+    u64 count = 0;
+    for (struct cache_entry * entry = cache->dirty_head; entry != 0x0; entry = entry->dirty_next) {
+        cache->flush_list[count++] = entry;
+    }
+    __fuse_qsort(cache->flush_list, count, sizeof(struct cache_entry *), compare_entries);
+
+    int result = 0;
+    u64 i = 0;
+    while (i < count) {
+        u64 run = 1;
+        __fuse_memcpy(cache->flush_buffer, cache->flush_list[i]->data, cache->sector_size);
+        while (i + run < count && run < CACHE_FLUSH_RUN && cache->flush_list[i + run]->sector == cache->flush_list[i]->sector + run) {
+            __fuse_memcpy(cache->flush_buffer + run * cache->sector_size, cache->flush_list[i + run]->data, cache->sector_size);
+            run++;
+        }
+
+        if (cache->writeback(cache->writeback_context, cache->flush_list[i]->sector, run, cache->flush_buffer)) {
+            result = 1;
+        } else {
+            for (u64 j = i; j < i + run; j++) {
+                dirty_unlink(cache, cache->flush_list[j]);
+            }
+            cache->writeback_sectors += run;
+            cache->writeback_runs++;
+        }
+        i += run;
+    }
+    return result;
+}
+
+u64 cache_oldest_dirty(struct sector_cache * cache) {
+    return (cache->dirty_head != 0x0) ? cache->dirty_head->dirty_since : 0;
+}
+
+void cache_reset_stats(struct sector_cache * cache) {
+    cache->hits = 0;
+    cache->misses = 0;
+    cache->ghost_hits = 0;
+    cache->evictions = 0;
+    cache->writeback_sectors = 0;
+    cache->writeback_runs = 0;
+    cache->forced_writebacks = 0;
+    cache->prefetched = 0;
+    cache->prefetch_used = 0;
+    cache->prefetch_wasted = 0;
+}
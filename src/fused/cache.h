@@ -0,0 +1,114 @@
+#ifndef _CACHE_H
+#define _CACHE_H
+#include "config.h"
+#include "dependencies.h"
+
+//Sector cache with 2Q replacement
+//New sectors enter A1in (FIFO), sectors evicted from A1in are remembered
+//in the A1out ghost queue and only a second reference while they are
+//there promotes them to Am (LRU), so a long scan cannot flush Am
+//Dirty sectors are kept in a second list ordered by the time they were
+//first dirtied, they are written back through the writeback callback
+//before they can be evicted
+//Sectors stored by readahead are marked until the first reference, so
+//the cache can tell how much of the readahead was used or wasted
+
+//Largest run of sectors written back with a single callback
+#define CACHE_FLUSH_RUN     128
+
+#define CACHE_QUEUE_NONE    0
+#define CACHE_QUEUE_A1IN    1
+#define CACHE_QUEUE_AM      2
+#define CACHE_QUEUE_A1OUT   3
+
+struct cache_entry {
+    u64  sector;
+    u8   *data;
+    u8   queue;
+    u8   dirty;
+    u8   prefetched;
+    u64  dirty_since;
+    struct cache_entry * hash_next;
+    struct cache_entry * prev;
+    struct cache_entry * next;
+    struct cache_entry * dirty_prev;
+    struct cache_entry * dirty_next;
+};
+
+//Writes count sectors starting at sector to the image, returns 0 on success
+typedef int (*cache_writeback_t)(void * context, u64 sector, u64 count, const u8 * data);
+
+struct cache_queue {
+    struct cache_entry * head;
+    struct cache_entry * tail;
+    u64  count;
+};
+
+struct sector_cache {
+    __fuse_mutex_t lock;
+    u32  sector_size;
+    u64  capacity;
+    u64  kin;
+    u64  kout;
+
+    struct cache_entry ** buckets;
+    u64  bucket_mask;
+
+    struct cache_queue a1in;
+    struct cache_queue am;
+    struct cache_queue a1out;
+
+    struct cache_entry * entries;
+    struct cache_entry * free_entries;
+    u8   *arena;
+    u8   **free_buffers;
+    u64  free_buffer_count;
+
+    cache_writeback_t writeback;
+    void * writeback_context;
+    struct cache_entry * dirty_head;
+    struct cache_entry * dirty_tail;
+    u64  dirty_count;
+    struct cache_entry ** flush_list;
+    u8   *flush_buffer;
+
+    u64  hits;
+    u64  misses;
+    u64  ghost_hits;
+    u64  evictions;
+    u64  writeback_sectors;
+    u64  writeback_runs;
+    u64  forced_writebacks;
+    u64  prefetched;
+    u64  prefetch_used;
+    u64  prefetch_wasted;
+};
+
+//Creates a cache holding capacity sectors, returns 0 on failure
+//writeback is only needed if sectors are ever stored dirty
+struct sector_cache * cache_create(u32 sector_size, u64 capacity, cache_writeback_t writeback, void * context);
+void cache_destroy(struct sector_cache * cache);
+
+//Returns the cached data of sector and records the reference, 0 on miss
+u8 * cache_lookup(struct sector_cache * cache, u64 sector);
+//Stores a copy of data for sector, evicting if needed
+//Returns 0 on success, 1 if a dirty victim could not be written back
+int cache_store(struct sector_cache * cache, u64 sector, const u8 * data);
+//Same as cache_store, the sector stays dirty until it is written back
+int cache_store_dirty(struct sector_cache * cache, u64 sector, const u8 * data);
+//Same as cache_store for sectors read ahead of the reader
+int cache_store_prefetched(struct sector_cache * cache, u64 sector, const u8 * data);
+//Returns 1 if sector is resident, without recording a reference
+uint8_t cache_contains(struct sector_cache * cache, u64 sector);
+//Drops sector from the cache if it is resident, dirty data is discarded
+void cache_invalidate(struct sector_cache * cache, u64 sector);
+//Same as cache_invalidate for every sector of the range
+void cache_invalidate_range(struct sector_cache * cache, u64 sector, u64 count);
+//Writes back every dirty sector in LBA order, coalescing adjacent ones
+//Returns 0 on success, failed sectors stay dirty
+int cache_flush(struct sector_cache * cache);
+//Time the oldest dirty sector was dirtied, 0 if the cache is clean
+u64 cache_oldest_dirty(struct sector_cache * cache);
+
+void cache_reset_stats(struct sector_cache * cache);
+#endif
@@ -0,0 +1,500 @@
+#include "compressed.h"
+#include "backend.h"
+#include "lz.h"
+
+//Bytes of the chunk inside the drive, the last one may be short
+static u64 chunk_bytes(struct compressed * compressed, u64 chunk) {
+    u64 start = chunk * compressed->header.chunk_size;
+    u64 left = compressed->header.size - start;
+    return (left < compressed->header.chunk_size) ? left : compressed->header.chunk_size;
+}
+
+static uint8_t valid_header(const struct compressed_header * header, u32 sector_size) {
+    return header->magic == COMPRESSED_MAGIC && header->version == COMPRESSED_VERSION &&
+        header->chunk_size != 0 && header->chunk_size <= LZ_MAX_INPUT && header->chunk_size % sector_size == 0 &&
+        header->size % sector_size == 0 && header->chunks == (header->size + header->chunk_size - 1) / header->chunk_size;
+}
+
+int compressed_probe(int fd, u32 sector_size, u64 * size) {
+    struct compressed_header header;
+    __fuse_struct_stat st;
+    if (__fuse_fstat(fd, &st) == -1) {
+        return OP_FAILURE;
+    }
+    if (st.st_size == 0) {
+        return OP_SUCCESS;
+    }
+    if (__fuse_pread(fd, &header, sizeof(header), 0) != (s64)sizeof(header) || !valid_header(&header, sector_size)) {
+        __fuse_printf("Not a compressed container of %u byte sectors\n", sector_size);
+        return OP_FAILURE;
+    }
+    *size = header.size;
+    return OP_SUCCESS;
+}
+
+//Chunks as large as the configuration asks that hold whole sectors
+static int create_container(struct mount * mount, struct compressed * compressed) {
+    struct compressed_header * header = &compressed->header;
+    u64 chunk_size = ((u64)__COMPRESSED_CHUNK_KB << 10) / mount->sector_size * mount->sector_size;
+    if (chunk_size == 0 || chunk_size > LZ_MAX_INPUT) {
+        mount->last_error = __fuse_EINVAL;
+        return OP_FAILURE;
+    }
+    header->magic = COMPRESSED_MAGIC;
+    header->version = COMPRESSED_VERSION;
+    header->chunk_size = (u32)chunk_size;
+    header->size = mount->file_size;
+    header->chunks = (mount->file_size + chunk_size - 1) / chunk_size;
+    header->index_offset = round_up(sizeof(struct compressed_header), __fuse_page_size());
+    header->data_offset = round_up(header->index_offset + header->chunks * sizeof(struct compressed_entry), __fuse_page_size());
+    //The index starts as a hole, every chunk is zeros
+    if (__fuse_ftruncate(mount->file_handle, header->data_offset) == -1) {
+        mount->last_error = __fuse_errno();
+        return OP_FAILURE;
+    }
+    return file_transfer(mount, mount->file_handle, (u8*)header, sizeof(struct compressed_header), 0, 1);
+}
+
+int compressed_open(struct mount * mount) {
+    struct compressed * compressed = __fuse_malloc(sizeof(struct compressed));
+    if (compressed == 0x0) {
+        return OP_FAILURE;
+    }
+    __fuse_memset(compressed, 0, sizeof(struct compressed));
+    __fuse_mutex_init(&compressed->lock);
+    __fuse_cond_init(&compressed->loaded);
+    mount->compressed = compressed;
+    struct compressed_header * header = &compressed->header;
+    __fuse_struct_stat st;
+    if (__fuse_fstat(mount->file_handle, &st) == -1) {
+        mount->last_error = __fuse_errno();
+        return OP_FAILURE;
+    }
+    if (st.st_size == 0) {
+        if (create_container(mount, compressed))
+            return OP_FAILURE;
+    } else if (file_transfer(mount, mount->file_handle, (u8*)header, sizeof(struct compressed_header), 0, 0)) {
+        return OP_FAILURE;
+    }
+
+    u64 index_size = header->chunks * sizeof(struct compressed_entry);
+    compressed->slot_count = __COMPRESSED_CACHE_CHUNKS;
+    if (compressed->slot_count > header->chunks)
+        compressed->slot_count = (u32)header->chunks;
+    compressed->index = __fuse_malloc(index_size);
+    compressed->slot_of = __fuse_malloc(header->chunks * sizeof(u32));
+    compressed->slots = __fuse_malloc(compressed->slot_count * sizeof(struct compressed_slot));
+    compressed->record = __fuse_malloc(header->chunk_size);
+    if (compressed->index == 0x0 || compressed->slot_of == 0x0 || compressed->slots == 0x0 || compressed->record == 0x0) {
+        mount->last_error = __fuse_ENOMEM;
+        return OP_FAILURE;
+    }
+    __fuse_memset(compressed->slot_of, 0, header->chunks * sizeof(u32));
+    __fuse_memset(compressed->slots, 0, compressed->slot_count * sizeof(struct compressed_slot));
+    for (u32 i = 0; i < compressed->slot_count; i++) {
+        compressed->slots[i].chunk = COMPRESSED_NO_CHUNK;
+        compressed->slots[i].data = __fuse_malloc(header->chunk_size);
+        compressed->slots[i].record = __fuse_malloc(header->chunk_size);
+        if (compressed->slots[i].data == 0x0 || compressed->slots[i].record == 0x0) {
+            mount->last_error = __fuse_ENOMEM;
+            return OP_FAILURE;
+        }
+    }
+    if (file_transfer(mount, mount->file_handle, (u8*)compressed->index, index_size, header->index_offset, 0)) {
+        return OP_FAILURE;
+    }
+    //Chunks are appended, a crash may leave one past the last entry
+    compressed->next_offset = ((u64)st.st_size > header->data_offset) ? (u64)st.st_size : header->data_offset;
+    for (u64 chunk = 0; chunk < header->chunks; chunk++) {
+        struct compressed_entry * entry = &compressed->index[chunk];
+        if (entry->length > header->chunk_size || (entry->length != 0 && entry->offset + entry->length > compressed->next_offset)) {
+            __fuse_printf("Compressed container index is corrupt\n");
+            mount->last_error = __fuse_EIO;
+            return OP_FAILURE;
+        }
+        compressed->stored += entry->length;
+    }
+    if (compressed->stored < compressed->next_offset - header->data_offset)
+        compressed->garbage = compressed->next_offset - header->data_offset - compressed->stored;
+    return OP_SUCCESS;
+}
+
+static int store_entry(struct mount * mount, struct compressed * compressed, u64 chunk, const struct compressed_entry * entry) {
+    u64 offset = compressed->header.index_offset + chunk * sizeof(struct compressed_entry);
+    if (file_transfer(mount, mount->file_handle, (u8*)entry, sizeof(struct compressed_entry), offset, 1)) {
+        return OP_FAILURE;
+    }
+    compressed->garbage += compressed->index[chunk].length;
+    compressed->stored -= compressed->index[chunk].length;
+    compressed->stored += entry->length;
+    compressed->index[chunk] = *entry;
+    return OP_SUCCESS;
+}
+
+//Copies the live chunks one after the other into a new container next to
+//the old one and renames it over it once it is durable, a compaction cut
+//short leaves the old container as it was
+static int compact(struct mount * mount, struct compressed * compressed) {
+    struct compressed_header * header = &compressed->header;
+    u64 index_size = header->chunks * sizeof(struct compressed_entry);
+    char name[MAX_FILE_NAME_LENGTH + 16];
+    u64 length = __fuse_strlen(mount->file_name);
+    __fuse_memcpy(name, mount->file_name, length);
+    __fuse_memcpy(name + length, ".compact", sizeof(".compact"));
+    struct compressed_entry * index = __fuse_malloc(index_size);
+    int fd = __fuse_create(name);
+    int result = (index == 0x0 || fd == -1 || __fuse_ftruncate(fd, 0) == -1 ||
+        __fuse_ftruncate(fd, header->data_offset) == -1) ? OP_FAILURE : OP_SUCCESS;
+    if (result)
+        mount->last_error = (index == 0x0) ? __fuse_ENOMEM : __fuse_errno();
+
+    u64 offset = header->data_offset;
+    for (u64 chunk = 0; chunk < header->chunks && result == OP_SUCCESS; chunk++) {
+        index[chunk] = compressed->index[chunk];
+        if (index[chunk].length == 0)
+            continue;
+        index[chunk].offset = offset;
+        result = file_transfer(mount, mount->file_handle, compressed->record, index[chunk].length, compressed->index[chunk].offset, 0) ||
+                 file_transfer(mount, fd, compressed->record, index[chunk].length, offset, 1);
+        offset += index[chunk].length;
+    }
+    if (result == OP_SUCCESS)
+        result = file_transfer(mount, fd, (u8*)header, sizeof(struct compressed_header), 0, 1) ||
+                 file_transfer(mount, fd, (u8*)index, index_size, header->index_offset, 1);
+    if (result == OP_SUCCESS && (__fuse_fdatasync(fd) == -1 || __fuse_rename(name, mount->file_name) == -1)) {
+        mount->last_error = __fuse_errno();
+        result = OP_FAILURE;
+    }
+
+    if (result == OP_SUCCESS) {
+        __fuse_close(mount->file_handle);
+        mount->file_handle = fd;
+        __fuse_memcpy(compressed->index, index, index_size);
+        compressed->next_offset = offset;
+        compressed->garbage = 0;
+        compressed->compactions++;
+    } else if (fd != -1) {
+        __fuse_close(fd);
+        __fuse_unlink(name);
+    }
+    __fuse_free(index);
+    return result;
+}
+
+//Appends the chunk of the slot and points its entry at it, zeros only
+//update the entry
+static int store_chunk(struct mount * mount, struct compressed * compressed, struct compressed_slot * slot) {
+    u64 bytes = chunk_bytes(compressed, slot->chunk);
+    struct compressed_entry entry = {0, 0, 0};
+    if (!all_zeros(slot->data, bytes)) {
+        const u8 * data = compressed->record;
+        u64 length = lz_compress(slot->data, bytes, compressed->record, bytes - 1);
+        if (length == 0) {
+            data = slot->data;
+            length = bytes;
+            entry.flags = COMPRESSED_STORED;
+        }
+        entry.offset = compressed->next_offset;
+        entry.length = (u32)length;
+        if (file_transfer(mount, mount->file_handle, (u8*)data, length, entry.offset, 1)) {
+            return OP_FAILURE;
+        }
+        compressed->next_offset += length;
+    }
+    if (store_entry(mount, compressed, slot->chunk, &entry)) {
+        return OP_FAILURE;
+    }
+    slot->dirty = 0;
+    //A failed compaction only leaves the garbage for the next one, so does
+    //a chunk loading from the container it would close
+    if (compressed->loading == 0 && compressed->garbage >= (u64)COMPRESSED_MIN_GARBAGE * compressed->header.chunk_size &&
+        compressed->garbage * 100 > compressed->stored * __COMPRESSED_GARBAGE_PERCENT)
+        compact(mount, compressed);
+    return OP_SUCCESS;
+}
+
+//Runs without the lock, the entry and the file handle were taken under it
+static int load_chunk(struct mount * mount, struct compressed_entry entry, int fd, u64 bytes, struct compressed_slot * slot) {
+    if (entry.length == 0) {
+        __fuse_memset(slot->data, 0, bytes);
+        return OP_SUCCESS;
+    }
+    if (entry.flags & COMPRESSED_STORED) {
+        return file_transfer(mount, fd, slot->data, bytes, entry.offset, 0);
+    }
+    if (file_transfer(mount, fd, slot->record, entry.length, entry.offset, 0)) {
+        return OP_FAILURE;
+    }
+    if (lz_decompress(slot->record, entry.length, slot->data, bytes)) {
+        mount->last_error = __fuse_EIO;
+        return OP_FAILURE;
+    }
+    return OP_SUCCESS;
+}
+
+//Takes the next slot of the clock that is not loading, writing back the
+//chunk it holds, waits if every slot is loading
+static struct compressed_slot * take_slot(struct mount * mount, struct compressed * compressed) {
+    u32 passes = 0;
+    while (compressed->slots[compressed->hand].referenced || compressed->slots[compressed->hand].loading) {
+        compressed->slots[compressed->hand].referenced = 0;
+        compressed->hand = (compressed->hand + 1) % compressed->slot_count;
+        if (++passes == 2 * compressed->slot_count) {
+            __fuse_cond_wait(&compressed->loaded, &compressed->lock);
+            passes = 0;
+        }
+    }
+    struct compressed_slot * slot = &compressed->slots[compressed->hand];
+    compressed->hand = (compressed->hand + 1) % compressed->slot_count;
+    if (slot->chunk != COMPRESSED_NO_CHUNK) {
+        if (slot->dirty && store_chunk(mount, compressed, slot))
+            return 0x0;
+        compressed->slot_of[slot->chunk] = 0;
+        slot->chunk = COMPRESSED_NO_CHUNK;
+    }
+    return slot;
+}
+
+//The slot caching the chunk, taking one from the clock if it is not
+//cached, with its contents loaded unless the caller overwrites all of them
+//Called with the lock held, which is dropped while the chunk loads
+static struct compressed_slot * get_slot(struct mount * mount, struct compressed * compressed, u64 chunk, uint8_t load) {
+    struct compressed_slot * slot;
+    for (;;) {
+        if (compressed->slot_of[chunk] != 0) {
+            slot = &compressed->slots[compressed->slot_of[chunk] - 1];
+            if (!slot->loading) {
+                slot->referenced = 1;
+                compressed->hits++;
+                return slot;
+            }
+            //Loaded or dropped by the time it wakes up, look again
+            __fuse_cond_wait(&compressed->loaded, &compressed->lock);
+            continue;
+        }
+        slot = take_slot(mount, compressed);
+        if (slot == 0x0) {
+            return 0x0;
+        }
+        //Another request may have cached the chunk while take_slot waited,
+        //the slot taken is left free
+        if (compressed->slot_of[chunk] == 0)
+            break;
+    }
+    compressed->misses++;
+    u32 index = (u32)(slot - compressed->slots);
+    slot->chunk = chunk;
+    slot->referenced = 1;
+    compressed->slot_of[chunk] = index + 1;
+    if (!load) {
+        return slot;
+    }
+
+    struct compressed_entry entry = compressed->index[chunk];
+    int fd = mount->file_handle;
+    slot->loading = 1;
+    compressed->loading++;
+    __fuse_mutex_unlock(&compressed->lock);
+    int result = load_chunk(mount, entry, fd, chunk_bytes(compressed, chunk), slot);
+    __fuse_mutex_lock(&compressed->lock);
+    slot->loading = 0;
+    compressed->loading--;
+    __fuse_cond_broadcast(&compressed->loaded);
+    if (result) {
+        compressed->slot_of[chunk] = 0;
+        slot->chunk = COMPRESSED_NO_CHUNK;
+        return 0x0;
+    }
+    return slot;
+}
+
+static int flush_slots(struct mount * mount, struct compressed * compressed) {
+    for (u32 i = 0; i < compressed->slot_count; i++) {
+        struct compressed_slot * slot = &compressed->slots[i];
+        //Loading slots are never dirty
+        if (slot->chunk != COMPRESSED_NO_CHUNK && slot->dirty && store_chunk(mount, compressed, slot))
+            return OP_FAILURE;
+    }
+    return OP_SUCCESS;
+}
+
+static int compressed_read(struct mount * mount, u8 * buffer, u64 sector, u64 count) {
+    struct compressed * compressed = mount->compressed;
+    u64 chunk_size = compressed->header.chunk_size;
+    u64 offset = sector * mount->sector_size;
+    u64 left = count * mount->sector_size;
+    int result = OP_SUCCESS;
+    __fuse_mutex_lock(&compressed->lock);
+    while (left > 0) {
+        u64 within = offset % chunk_size;
+        u64 length = chunk_size - within;
+        if (length > left)
+            length = left;
+        struct compressed_slot * slot = get_slot(mount, compressed, offset / chunk_size, 1);
+        if (slot == 0x0) {
+            result = OP_FAILURE;
+            break;
+        }
+        __fuse_memcpy(buffer, slot->data + within, length);
+        buffer += length;
+        offset += length;
+        left -= length;
+    }
+    __fuse_mutex_unlock(&compressed->lock);
+    return result;
+}
+
+//A write covering a whole chunk does not decompress the old one
+static int compressed_write(struct mount * mount, const u8 * buffer, u64 sector, u64 count) {
+    struct compressed * compressed = mount->compressed;
+    u64 chunk_size = compressed->header.chunk_size;
+    u64 offset = sector * mount->sector_size;
+    u64 left = count * mount->sector_size;
+    int result = OP_SUCCESS;
+    __fuse_mutex_lock(&compressed->lock);
+    while (left > 0) {
+        u64 chunk = offset / chunk_size;
+        u64 within = offset % chunk_size;
+        u64 length = chunk_bytes(compressed, chunk) - within;
+        if (length > left)
+            length = left;
+        struct compressed_slot * slot = get_slot(mount, compressed, chunk, length < chunk_bytes(compressed, chunk));
+        if (slot == 0x0) {
+            result = OP_FAILURE;
+            break;
+        }
+        __fuse_memcpy(slot->data + within, buffer, length);
+        slot->dirty = 1;
+        buffer += length;
+        offset += length;
+        left -= length;
+    }
+    __fuse_mutex_unlock(&compressed->lock);
+    return result;
+}
+
+static int compressed_readv(struct mount * mount, const struct disk_iovec * iov, int iovcnt, u64 sector) {
+    for (int i = 0; i < iovcnt; i++) {
+        if (compressed_read(mount, iov[i].buffer, sector, iov[i].count))
+            return OP_FAILURE;
+        sector += iov[i].count;
+    }
+    return OP_SUCCESS;
+}
+
+static int compressed_writev(struct mount * mount, const struct disk_iovec * iov, int iovcnt, u64 sector) {
+    for (int i = 0; i < iovcnt; i++) {
+        if (compressed_write(mount, iov[i].buffer, sector, iov[i].count))
+            return OP_FAILURE;
+        sector += iov[i].count;
+    }
+    return OP_SUCCESS;
+}
+
+static int compressed_sync(struct mount * mount) {
+    struct compressed * compressed = mount->compressed;
+    __fuse_mutex_lock(&compressed->lock);
+    int result = flush_slots(mount, compressed);
+    if (result == OP_SUCCESS && __fuse_fdatasync(mount->file_handle) == -1) {
+        mount->last_error = __fuse_errno();
+        result = OP_FAILURE;
+    }
+    __fuse_mutex_unlock(&compressed->lock);
+    return result;
+}
+
+//Whole chunks leave the cache and become zeros in the index, the partial
+//ones at the edges are zeroed in the cache
+static int compressed_trim(struct mount * mount, u64 sector, u64 count) {
+    struct compressed * compressed = mount->compressed;
+    u64 chunk_size = compressed->header.chunk_size;
+    u64 offset = sector * mount->sector_size;
+    u64 left = count * mount->sector_size;
+    int result = OP_SUCCESS;
+    __fuse_mutex_lock(&compressed->lock);
+    while (left > 0 && result == OP_SUCCESS) {
+        u64 chunk = offset / chunk_size;
+        u64 within = offset % chunk_size;
+        u64 bytes = chunk_bytes(compressed, chunk);
+        u64 length = bytes - within;
+        if (length > left)
+            length = left;
+
+        if (length < bytes) {
+            struct compressed_slot * slot = get_slot(mount, compressed, chunk, 1);
+            if (slot == 0x0) {
+                result = OP_FAILURE;
+            } else {
+                __fuse_memset(slot->data + within, 0, length);
+                slot->dirty = 1;
+            }
+        } else {
+            while (compressed->slot_of[chunk] != 0 && compressed->slots[compressed->slot_of[chunk] - 1].loading) {
+                __fuse_cond_wait(&compressed->loaded, &compressed->lock);
+            }
+            if (compressed->slot_of[chunk] != 0) {
+                struct compressed_slot * slot = &compressed->slots[compressed->slot_of[chunk] - 1];
+                slot->chunk = COMPRESSED_NO_CHUNK;
+                slot->dirty = 0;
+                compressed->slot_of[chunk] = 0;
+            }
+            struct compressed_entry zeros = {0, 0, 0};
+            if (compressed->index[chunk].length != 0)
+                result = store_entry(mount, compressed, chunk, &zeros);
+        }
+        offset += length;
+        left -= length;
+    }
+    __fuse_mutex_unlock(&compressed->lock);
+    return result;
+}
+
+static void compressed_close(struct mount * mount) {
+    struct compressed * compressed = mount->compressed;
+    if (compressed != 0x0) {
+        if (compressed->slots != 0x0 && compressed->index != 0x0 && mount->file_handle != -1) {
+            flush_slots(mount, compressed);
+            __fuse_fdatasync(mount->file_handle);
+        }
+        for (u32 i = 0; compressed->slots != 0x0 && i < compressed->slot_count; i++) {
+            __fuse_free(compressed->slots[i].data);
+            __fuse_free(compressed->slots[i].record);
+        }
+        __fuse_cond_destroy(&compressed->loaded);
+        __fuse_mutex_destroy(&compressed->lock);
+        __fuse_free(compressed->index);
+        __fuse_free(compressed->slot_of);
+        __fuse_free(compressed->slots);
+        __fuse_free(compressed->record);
+        __fuse_free(compressed);
+        mount->compressed = 0x0;
+    }
+    if (mount->file_handle != -1) {
+        __fuse_close(mount->file_handle);
+        mount->file_handle = -1;
+    }
+}
+
+const struct drive_ops compressed_ops = {
+    compressed_read, compressed_write, compressed_readv, compressed_writev, compressed_sync, compressed_trim, compressed_close, 0x0, 0, 0
+};
+
+//Chunks still dirty in the cache count as they were last written
+void compressed_get_stats(struct mount * mount, struct disk_storage_stats * stats) {
+    struct compressed * compressed = mount->compressed;
+    struct compressed_header * header = &compressed->header;
+    __fuse_mutex_lock(&compressed->lock);
+    for (u64 chunk = 0; chunk < header->chunks; chunk++) {
+        if (compressed->index[chunk].length != 0)
+            stats->logical_bytes += chunk_bytes(compressed, chunk);
+    }
+    stats->stored_bytes = compressed->stored;
+    stats->garbage_bytes = compressed->garbage;
+    stats->metadata_bytes = header->data_offset;
+    stats->memory_bytes = sizeof(struct compressed) + header->chunks * (sizeof(struct compressed_entry) + sizeof(u32)) +
+        (u64)compressed->slot_count * (sizeof(struct compressed_slot) + 2 * header->chunk_size) + header->chunk_size;
+    stats->compactions = compressed->compactions;
+    stats->cache_hits = compressed->hits;
+    stats->cache_misses = compressed->misses;
+    __fuse_mutex_unlock(&compressed->lock);
+}
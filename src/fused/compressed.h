@@ -0,0 +1,94 @@
+#ifndef _COMPRESSED_H
+#define _COMPRESSED_H
+#include "bfuse.h"
+#include "dependencies.h"
+#include "primitives.h"
+
+//Drives stored compressed in a container file that can still be read at
+//any sector without decompressing what comes before it
+//The drive is split in chunks compressed one by one with lz.h: the
+//container holds a header, an index with an entry for every chunk at a
+//fixed place so finding one is a single lookup, and the chunks after it
+//A chunk of zeros takes no space, its entry has a length of 0, one that
+//does not compress is kept as it is
+//Chunks are decompressed into a cache and written back compressed when
+//they leave it or on a sync, always appended at the end of the container
+//with their entry written after them, so the old copy stays valid until
+//the new one is there. The stale copies are garbage that a compaction
+//drops once there is enough of it, copying the live chunks into a new
+//container that replaces the old one
+//Requests hold the lock of the drive except while a chunk that missed the
+//cache is read and decompressed: its slot is marked loading meanwhile so
+//it is neither evicted nor used, requests for the chunk wait for it and
+//other chunks are read and decompressed side by side. Writes of chunks
+//leaving the cache and compactions still happen under the lock, the
+//latter only when no chunk is loading from the container being replaced
+
+#define COMPRESSED_MAGIC        0x504D434445535546ULL   //"FUSEDCMP"
+#define COMPRESSED_VERSION      1
+//Entry flag, the chunk is kept as it is
+#define COMPRESSED_STORED       1
+//Garbage a compaction waits for on top of __COMPRESSED_GARBAGE_PERCENT, in chunks
+#define COMPRESSED_MIN_GARBAGE  16
+#define COMPRESSED_NO_CHUNK     (~0ULL)
+
+//First bytes of the container, the index follows at index_offset
+struct compressed_header {
+    u64  magic;
+    u32  version;
+    u32  chunk_size;
+    u64  size;              //Bytes of the drive
+    u64  chunks;
+    u64  index_offset;
+    u64  data_offset;       //First chunk
+};
+
+struct compressed_entry {
+    u64  offset;
+    u32  length;            //Bytes in the container, 0 if the chunk is zeros
+    u32  flags;
+};
+
+struct compressed_slot {
+    u64  chunk;             //COMPRESSED_NO_CHUNK if the slot is free
+    u8   *data;
+    u8   *record;           //The chunk as it is in the container while it loads
+    u8   dirty;
+    u8   referenced;        //Second chance of the clock
+    u8   loading;           //Read and decompressed without the lock
+};
+
+//The container is the file_handle of the mount
+struct compressed {
+    struct compressed_header header;
+    __fuse_mutex_t lock;
+    __fuse_cond_t loaded;   //A slot stopped loading
+    u32  loading;           //Slots loading
+    struct compressed_entry * index;
+    u32  *slot_of;          //Slot + 1 of every cached chunk, 0 if it is not
+    struct compressed_slot * slots;
+    u32  slot_count;
+    u32  hand;
+    u8   *record;           //A chunk as it is in the container, under the lock
+    u64  next_offset;       //Where the next chunk is appended
+    u64  stored;            //Bytes of live chunks
+    u64  garbage;           //Bytes of stale ones
+    u64  compactions;
+    u64  hits;
+    u64  misses;
+};
+
+//Reads the size of the drive from the header of an existing container into
+//size, an empty file leaves it as it is, fails if the file is not a
+//container of sectors of sector_size
+int compressed_probe(int fd, u32 sector_size, u64 * size);
+//Loads the container of the mount, or lays out an empty one of file_size
+//bytes if the file is empty
+//A failed open is undone by the close of the ops
+int compressed_open(struct mount * mount);
+//Fills the storage counters of the drive, locking it
+void compressed_get_stats(struct mount * mount, struct disk_storage_stats * stats);
+
+//Transfers of drives registered with register_compressed_drive
+extern const struct drive_ops compressed_ops;
+#endif
@@ -4,9 +4,82 @@
 //Configuration starts here
 //----------------------------------------------
 #define __USE_STDINT
+//#define __EAGER               //register_drive maps the whole image (DRIVE_MAPPED) instead of using positional I/O
+//#define __EAGER_PREFAULT      //Prefault the mapping of DRIVE_MAPPED drives when registering (MAP_POPULATE)
+//#define __LAZY                //register_drive maps fixed size windows of the image on first touch (DRIVE_WINDOWED)
+//#define __CACHE_SECTORS 4096  //Give every registered drive a sector cache of this many sectors
+//#define __WRITEBACK           //Start drives with a cache in write-back mode
+//#define __READAHEAD           //Start drives with a cache with sequential readahead
+//#define __ASYNC_THREADS       //Run asynchronous requests on worker threads even if io_uring is available
+//#define __ELEVATOR            //Start drives with the deadline elevator merging and sorting writes
+//#define __DIRECT              //register_drive opens images with O_DIRECT (DRIVE_DIRECT), bypassing the host page cache
+#ifndef __LAZY_WINDOW_SIZE
+#define __LAZY_WINDOW_SIZE      (64ULL << 20)   //Bytes per window, multiple of the page size
+#endif
+#ifndef __LAZY_MAP_BUDGET
+#define __LAZY_MAP_BUDGET       (1ULL << 30)    //Default address space budget per drive
+#endif
+#ifndef __WRITEBACK_INTERVAL_MS
+#define __WRITEBACK_INTERVAL_MS 100             //How often the flusher checks the thresholds
+#endif
+#ifndef __WRITEBACK_MAX_AGE_MS
+#define __WRITEBACK_MAX_AGE_MS  1000            //Oldest a dirty sector may get before a flush
+#endif
+#ifndef __WRITEBACK_DIRTY_RATIO
+#define __WRITEBACK_DIRTY_RATIO 50              //Percent of the cache that may be dirty
+#endif
+#ifndef __READAHEAD_MAX_KB
+#define __READAHEAD_MAX_KB      512             //Largest readahead window
+#endif
+#ifndef __QUEUE_DEPTH
+#define __QUEUE_DEPTH           32              //Default asynchronous requests in flight per thread and drive
+#endif
+#ifndef __ASYNC_WORKERS
+#define __ASYNC_WORKERS         4               //Hardware contexts per drive, a worker thread each
+#endif
+#ifndef __ELEVATOR_PLUG_MS
+#define __ELEVATOR_PLUG_MS      2               //Longest a write waits in the elevator by default
+#endif
+#ifndef __ELEVATOR_PLUG_KB
+#define __ELEVATOR_PLUG_KB      1024            //Bytes the elevator holds before dispatching
+#endif
+#ifndef __DIRECT_BOUNCE_BUFFERS
+#define __DIRECT_BOUNCE_BUFFERS 8               //Aligned buffers for unaligned O_DIRECT transfers per drive
+#endif
+#ifndef __DIRECT_BOUNCE_KB
+#define __DIRECT_BOUNCE_KB      256             //Size of each of them
+#endif
+#ifndef __READAHEAD_STREAMS
+#define __READAHEAD_STREAMS     8               //Sequential readers tracked per drive
+#endif
+#ifndef __STATS_SAMPLE
+#define __STATS_SAMPLE          8               //Every thread times one in this many requests at random for the latency histograms, 1 times all
+#endif
+#ifndef __OVERLAY_CLUSTER_KB
+#define __OVERLAY_CLUSTER_KB    64              //Unit an overlay copies from its base on the first write
+#endif
+#ifndef __COMPRESSED_CHUNK_KB
+#define __COMPRESSED_CHUNK_KB   4               //Unit a compressed drive compresses on its own, at most 64, every random read that misses the cache decompresses one
+#endif
+#ifndef __COMPRESSED_CACHE_CHUNKS
+#define __COMPRESSED_CACHE_CHUNKS 256           //Decompressed chunks a compressed drive caches
+#endif
+#ifndef __COMPRESSED_GARBAGE_PERCENT
+#define __COMPRESSED_GARBAGE_PERCENT 50         //Stale bytes left by rewrites, as a share of the live ones, that start a compaction
+#endif
+#ifndef __DEDUP_BLOCK_KB
+#define __DEDUP_BLOCK_KB        4               //Unit a deduplicated drive hashes and shares
+#endif
+#ifndef __TIMING_SPIN_US
+#define __TIMING_SPIN_US        20              //Emulated completions closer than this are waited for spinning, sleeping overshoots them
+#endif
 //----------------------------------------------
 //Configuration ends here
 
+#if defined(__EAGER) && defined(__LAZY)
+#error "__EAGER and __LAZY are mutually exclusive"
+#endif
+
 #ifdef __USE_STDINT
 #include <stdint.h>
 typedef uint64_t u64;
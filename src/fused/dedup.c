@@ -0,0 +1,538 @@
+#include "dedup.h"
+#include "backend.h"
+
+#define DEDUP_PRIME1        0x9E3779B185EBCA87ULL
+#define DEDUP_PRIME2        0xC2B2AE3D27D4EB4FULL
+#define DEDUP_PRIME3        0x165667B19E3779F9ULL
+#define DEDUP_LANES         4
+//Hash table slots per stored block before it doubles, in tenths
+#define DEDUP_MAX_LOAD      7
+
+static u64 rotate(u64 value, int bits) {
+    return (value << bits) | (value >> (64 - bits));
+}
+
+//The rounds of xxHash64 on four independent lanes, a stripe of 32 bytes
+//feeds a word to each so they run side by side in the pipeline or in
+//vector registers, the lanes are only merged at the end
+static u64 hash_block(const u8 * data, u64 size) {
+    u64 lane[DEDUP_LANES] = {DEDUP_PRIME1 + DEDUP_PRIME2, DEDUP_PRIME2, 0, -DEDUP_PRIME1};
+    u64 offset = 0;
+    for (; offset + DEDUP_LANES * 8 <= size; offset += DEDUP_LANES * 8) {
+        for (int i = 0; i < DEDUP_LANES; i++) {
+            lane[i] = rotate(lane[i] + __fuse_load_le64(data + offset + i * 8) * DEDUP_PRIME2, 31) * DEDUP_PRIME1;
+        }
+    }
+    u64 hash = rotate(lane[0], 1) + rotate(lane[1], 7) + rotate(lane[2], 12) + rotate(lane[3], 18) + size;
+    for (; offset < size; offset++) {
+        hash = rotate(hash ^ (data[offset] * DEDUP_PRIME3), 11) * DEDUP_PRIME1;
+    }
+    hash ^= hash >> 33;
+    hash *= DEDUP_PRIME2;
+    hash ^= hash >> 29;
+    hash *= DEDUP_PRIME3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+//Bytes of the block inside the drive, the last one may be short
+static u64 block_bytes(struct dedup * dedup, u64 block) {
+    u64 start = block * dedup->header.block_size;
+    u64 left = dedup->header.size - start;
+    return (left < dedup->header.block_size) ? left : dedup->header.block_size;
+}
+
+static u64 slot_offset(struct dedup * dedup, u64 slot) {
+    return dedup->header.data_offset + slot * dedup->header.block_size;
+}
+
+static u64 table_index(struct dedup * dedup, u64 hash) {
+    return hash & (dedup->table_size - 1);
+}
+
+static void table_insert(struct dedup * dedup, u64 slot) {
+    u64 i = table_index(dedup, dedup->hashes[slot]);
+    while (dedup->table[i] != 0) {
+        i = table_index(dedup, i + 1);
+    }
+    dedup->table[i] = (u32)(slot + 1);
+}
+
+//Doubles the table before one more slot takes it past DEDUP_MAX_LOAD tenths
+static int table_grow(struct dedup * dedup) {
+    if ((dedup->used_slots + 1) * 10 <= dedup->table_size * DEDUP_MAX_LOAD) {
+        return OP_SUCCESS;
+    }
+    u32 * old = dedup->table;
+    u64 old_size = dedup->table_size;
+    u32 * table = __fuse_malloc(old_size * 2 * sizeof(u32));
+    if (table == 0x0) {
+        return OP_FAILURE;
+    }
+    __fuse_memset(table, 0, old_size * 2 * sizeof(u32));
+    dedup->table = table;
+    dedup->table_size = old_size * 2;
+    for (u64 i = 0; i < old_size; i++) {
+        if (old[i] != 0)
+            table_insert(dedup, old[i] - 1);
+    }
+    __fuse_free(old);
+    return OP_SUCCESS;
+}
+
+//Shifts back the entries after the removed one that probed past it, so
+//lookups never stop early and the table needs no tombstones
+static void table_remove(struct dedup * dedup, u64 slot) {
+    u64 i = table_index(dedup, dedup->hashes[slot]);
+    while (dedup->table[i] != slot + 1) {
+        i = table_index(dedup, i + 1);
+    }
+    u64 j = i;
+    while (1) {
+        j = table_index(dedup, j + 1);
+        if (dedup->table[j] == 0)
+            break;
+        u64 home = table_index(dedup, dedup->hashes[dedup->table[j] - 1]);
+        //The entry at j may move to i unless its home lies in (i, j]
+        uint8_t stays = (i <= j) ? (home > i && home <= j) : (home > i || home <= j);
+        if (!stays) {
+            dedup->table[i] = dedup->table[j];
+            i = j;
+        }
+    }
+    dedup->table[i] = 0;
+}
+
+//The slot holding the same bytes as data, DEDUP_NO_SLOT if there is none
+static int find_slot(struct mount * mount, struct dedup * dedup, const u8 * data, u64 hash, u32 * found) {
+    *found = DEDUP_NO_SLOT;
+    for (u64 i = table_index(dedup, hash); dedup->table[i] != 0; i = table_index(dedup, i + 1)) {
+        u64 slot = dedup->table[i] - 1;
+        if (dedup->hashes[slot] != hash)
+            continue;
+        if (file_transfer(mount, mount->file_handle, dedup->stored, dedup->header.block_size, slot_offset(dedup, slot), 0)) {
+            return OP_FAILURE;
+        }
+        if (__fuse_memcmp(dedup->stored, data, dedup->header.block_size) == 0) {
+            *found = (u32)slot;
+            return OP_SUCCESS;
+        }
+    }
+    return OP_SUCCESS;
+}
+
+static void free_slot(struct dedup * dedup, int fd, u64 slot) {
+    dedup->free_slots[dedup->free_count++] = (u32)slot;
+    //A slot that stays allocated only costs its space until it is reused
+    __fuse_punch_hole(fd, slot_offset(dedup, slot), dedup->header.block_size);
+    __fuse_cond_broadcast(&dedup->freed);
+}
+
+//A slot a read is using is freed once the read is done with it
+static void release_slot(struct dedup * dedup, int fd, u64 slot) {
+    if (--dedup->references[slot] != 0) {
+        return;
+    }
+    table_remove(dedup, slot);
+    dedup->used_slots--;
+    if (dedup->readers[slot] == 0)
+        free_slot(dedup, fd, slot);
+}
+
+//Waits until put_block has a slot to store a new block in. Every slot in
+//use without an entry pointing at it has a read that frees it when done
+//Called before assembling a block in scratch, as the wait drops the lock
+static void reserve_slot(struct dedup * dedup) {
+    while (dedup->free_count == 0 && dedup->next_slot == dedup->header.blocks + 1) {
+        __fuse_cond_wait(&dedup->freed, &dedup->lock);
+    }
+}
+
+static int store_entry(struct mount * mount, struct dedup * dedup, u64 block, u64 entry) {
+    u64 offset = dedup->header.map_offset + block * sizeof(u64);
+    if (file_transfer(mount, mount->file_handle, (u8*)&entry, sizeof(u64), offset, 1)) {
+        return OP_FAILURE;
+    }
+    u64 old = dedup->map[block];
+    dedup->map[block] = entry;
+    if (old != 0)
+        release_slot(dedup, mount->file_handle, old - 1);
+    return OP_SUCCESS;
+}
+
+//Points the block at a slot holding data, a whole block with zeros past
+//the end of the drive, storing it if no slot has the same bytes
+static int put_block(struct mount * mount, struct dedup * dedup, u64 block, const u8 * data) {
+    u64 block_size = dedup->header.block_size;
+    if (all_zeros(data, block_size)) {
+        return (dedup->map[block] != 0) ? store_entry(mount, dedup, block, 0) : OP_SUCCESS;
+    }
+    u64 hash = hash_block(data, block_size);
+    u32 slot;
+    if (find_slot(mount, dedup, data, hash, &slot)) {
+        return OP_FAILURE;
+    }
+    if (slot != DEDUP_NO_SLOT) {
+        dedup->shared_writes++;
+        if (dedup->map[block] == (u64)slot + 1)
+            return OP_SUCCESS;
+        dedup->references[slot]++;
+        return store_entry(mount, dedup, block, (u64)slot + 1);
+    }
+
+    //A slot only this block points at is rewritten in place unless a read
+    //is using it, on failure it keeps its old hash and the comparison stops
+    //anything sharing it
+    u64 entry = dedup->map[block];
+    if (entry != 0 && dedup->references[entry - 1] == 1 && dedup->readers[entry - 1] == 0) {
+        if (file_transfer(mount, mount->file_handle, (u8*)data, block_size, slot_offset(dedup, entry - 1), 1)) {
+            return OP_FAILURE;
+        }
+        table_remove(dedup, entry - 1);
+        dedup->hashes[entry - 1] = hash;
+        table_insert(dedup, entry - 1);
+        return OP_SUCCESS;
+    }
+
+    if (table_grow(dedup)) {
+        mount->last_error = __fuse_ENOMEM;
+        return OP_FAILURE;
+    }
+    slot = (dedup->free_count > 0) ? dedup->free_slots[dedup->free_count - 1] : (u32)dedup->next_slot;
+    if (file_transfer(mount, mount->file_handle, (u8*)data, block_size, slot_offset(dedup, slot), 1)) {
+        return OP_FAILURE;
+    }
+    if (dedup->free_count > 0)
+        dedup->free_count--;
+    else
+        dedup->next_slot++;
+    dedup->hashes[slot] = hash;
+    dedup->references[slot] = 1;
+    table_insert(dedup, slot);
+    dedup->used_slots++;
+    return store_entry(mount, dedup, block, (u64)slot + 1);
+}
+
+static int dedup_write(struct mount * mount, const u8 * buffer, u64 sector, u64 count) {
+    struct dedup * dedup = mount->dedup;
+    u64 block_size = dedup->header.block_size;
+    u64 offset = sector * mount->sector_size;
+    u64 left = count * mount->sector_size;
+    int result = OP_SUCCESS;
+    __fuse_mutex_lock(&dedup->lock);
+    while (left > 0 && result == OP_SUCCESS) {
+        u64 block = offset / block_size;
+        u64 within = offset % block_size;
+        u64 length = block_bytes(dedup, block) - within;
+        if (length > left)
+            length = left;
+
+        reserve_slot(dedup);
+        const u8 * data = buffer;
+        if (length < block_size) {
+            u64 entry = dedup->map[block];
+            if (entry == 0)
+                __fuse_memset(dedup->scratch, 0, block_size);
+            else if (file_transfer(mount, mount->file_handle, dedup->scratch, block_size, slot_offset(dedup, entry - 1), 0))
+                result = OP_FAILURE;
+            __fuse_memcpy(dedup->scratch + within, buffer, length);
+            data = dedup->scratch;
+        }
+        if (result == OP_SUCCESS)
+            result = put_block(mount, dedup, block, data);
+        buffer += length;
+        offset += length;
+        left -= length;
+    }
+    __fuse_mutex_unlock(&dedup->lock);
+    return result;
+}
+
+//Ends a read of count slots from slot, freeing the ones released meanwhile
+static void unpin_slots(struct mount * mount, struct dedup * dedup, u64 slot, u64 count) {
+    __fuse_mutex_lock(&dedup->lock);
+    for (u64 i = slot; i < slot + count; i++) {
+        if (--dedup->readers[i] == 0 && dedup->references[i] == 0)
+            free_slot(dedup, mount->file_handle, i);
+    }
+    __fuse_mutex_unlock(&dedup->lock);
+}
+
+//A run of blocks in consecutive slots or all zeros at a time, the data is
+//read without the lock from slots pinned under it
+static int dedup_read(struct mount * mount, u8 * buffer, u64 sector, u64 count) {
+    struct dedup * dedup = mount->dedup;
+    u64 block_size = dedup->header.block_size;
+    u64 offset = sector * mount->sector_size;
+    u64 left = count * mount->sector_size;
+    while (left > 0) {
+        u64 first = offset / block_size;
+        u64 end = (offset + left - 1) / block_size;
+        u64 last = first;
+        __fuse_mutex_lock(&dedup->lock);
+        u64 entry = dedup->map[first];
+        while (last < end && dedup->map[last + 1] == ((entry != 0) ? entry + last + 1 - first : 0)) {
+            last++;
+        }
+        for (u64 i = 0; entry != 0 && i <= last - first; i++) {
+            dedup->readers[entry - 1 + i]++;
+        }
+        __fuse_mutex_unlock(&dedup->lock);
+        u64 length = (last + 1) * block_size - offset;
+        if (length > left)
+            length = left;
+
+        if (entry == 0) {
+            __fuse_memset(buffer, 0, length);
+        } else {
+            int result = file_transfer(mount, mount->file_handle, buffer, length, slot_offset(dedup, entry - 1) + offset % block_size, 0);
+            unpin_slots(mount, dedup, entry - 1, last - first + 1);
+            if (result)
+                return OP_FAILURE;
+        }
+        buffer += length;
+        offset += length;
+        left -= length;
+    }
+    return OP_SUCCESS;
+}
+
+static int dedup_readv(struct mount * mount, const struct disk_iovec * iov, int iovcnt, u64 sector) {
+    for (int i = 0; i < iovcnt; i++) {
+        if (dedup_read(mount, iov[i].buffer, sector, iov[i].count))
+            return OP_FAILURE;
+        sector += iov[i].count;
+    }
+    return OP_SUCCESS;
+}
+
+static int dedup_writev(struct mount * mount, const struct disk_iovec * iov, int iovcnt, u64 sector) {
+    for (int i = 0; i < iovcnt; i++) {
+        if (dedup_write(mount, iov[i].buffer, sector, iov[i].count))
+            return OP_FAILURE;
+        sector += iov[i].count;
+    }
+    return OP_SUCCESS;
+}
+
+static int dedup_sync(struct mount * mount) {
+    if (__fuse_fdatasync(mount->file_handle) == -1) {
+        mount->last_error = __fuse_errno();
+        return OP_FAILURE;
+    }
+    return OP_SUCCESS;
+}
+
+//Whole blocks become zeros in the map, the partial ones at the edges are
+//written with zeros
+static int dedup_trim(struct mount * mount, u64 sector, u64 count) {
+    struct dedup * dedup = mount->dedup;
+    u64 block_size = dedup->header.block_size;
+    u64 offset = sector * mount->sector_size;
+    u64 left = count * mount->sector_size;
+    while (left > 0) {
+        u64 block = offset / block_size;
+        u64 within = offset % block_size;
+        u64 bytes = block_bytes(dedup, block);
+        u64 length = bytes - within;
+        if (length > left)
+            length = left;
+
+        int result = OP_SUCCESS;
+        __fuse_mutex_lock(&dedup->lock);
+        if (length < bytes)
+            reserve_slot(dedup);
+        if (dedup->map[block] != 0) {
+            if (length < bytes) {
+                result = file_transfer(mount, mount->file_handle, dedup->scratch, block_size, slot_offset(dedup, dedup->map[block] - 1), 0);
+                __fuse_memset(dedup->scratch + within, 0, length);
+                if (result == OP_SUCCESS)
+                    result = put_block(mount, dedup, block, dedup->scratch);
+            } else {
+                result = store_entry(mount, dedup, block, 0);
+            }
+        }
+        __fuse_mutex_unlock(&dedup->lock);
+        if (result) {
+            return OP_FAILURE;
+        }
+        offset += length;
+        left -= length;
+    }
+    return OP_SUCCESS;
+}
+
+static void dedup_close(struct mount * mount) {
+    struct dedup * dedup = mount->dedup;
+    if (mount->file_handle != -1) {
+        __fuse_fdatasync(mount->file_handle);
+        __fuse_close(mount->file_handle);
+        mount->file_handle = -1;
+    }
+    if (dedup == 0x0) {
+        return;
+    }
+    __fuse_cond_destroy(&dedup->freed);
+    __fuse_mutex_destroy(&dedup->lock);
+    __fuse_free(dedup->map);
+    __fuse_free(dedup->references);
+    __fuse_free(dedup->readers);
+    __fuse_free(dedup->hashes);
+    __fuse_free(dedup->free_slots);
+    __fuse_free(dedup->table);
+    __fuse_free(dedup->scratch);
+    __fuse_free(dedup->stored);
+    __fuse_free(dedup);
+    mount->dedup = 0x0;
+}
+
+const struct drive_ops dedup_ops = {
+    dedup_read, dedup_write, dedup_readv, dedup_writev, dedup_sync, dedup_trim, dedup_close, 0x0, 0, 0
+};
+
+static uint8_t valid_header(const struct dedup_header * header, u32 sector_size) {
+    return header->magic == DEDUP_MAGIC && header->version == DEDUP_VERSION &&
+        header->block_size != 0 && header->block_size % sector_size == 0 && header->size % sector_size == 0 &&
+        header->blocks == (header->size + header->block_size - 1) / header->block_size && header->blocks < DEDUP_NO_SLOT;
+}
+
+int dedup_probe(int fd, u32 sector_size, u64 * size) {
+    struct dedup_header header;
+    __fuse_struct_stat st;
+    if (__fuse_fstat(fd, &st) == -1) {
+        return OP_FAILURE;
+    }
+    if (st.st_size == 0) {
+        return OP_SUCCESS;
+    }
+    if (__fuse_pread(fd, &header, sizeof(header), 0) != (s64)sizeof(header) || !valid_header(&header, sector_size)) {
+        __fuse_printf("Not a deduplicated store of %u byte sectors\n", sector_size);
+        return OP_FAILURE;
+    }
+    *size = header.size;
+    return OP_SUCCESS;
+}
+
+//Blocks as large as the configuration asks that hold whole sectors
+static int create_store(struct mount * mount, struct dedup * dedup) {
+    struct dedup_header * header = &dedup->header;
+    u64 block_size = round_up((u64)__DEDUP_BLOCK_KB << 10, mount->sector_size);
+    header->magic = DEDUP_MAGIC;
+    header->version = DEDUP_VERSION;
+    header->block_size = (u32)block_size;
+    header->size = mount->file_size;
+    header->blocks = (mount->file_size + block_size - 1) / block_size;
+    header->map_offset = round_up(sizeof(struct dedup_header), __fuse_page_size());
+    header->data_offset = round_up(header->map_offset + header->blocks * sizeof(u64), __fuse_page_size());
+    if (header->blocks >= DEDUP_NO_SLOT) {
+        mount->last_error = __fuse_EINVAL;
+        return OP_FAILURE;
+    }
+    //The map starts as a hole, every block is zeros
+    if (__fuse_ftruncate(mount->file_handle, header->data_offset) == -1) {
+        mount->last_error = __fuse_errno();
+        return OP_FAILURE;
+    }
+    return file_transfer(mount, mount->file_handle, (u8*)header, sizeof(struct dedup_header), 0, 1);
+}
+
+//Counts the entries of every slot and hashes the slots in use again
+static int rebuild(struct mount * mount, struct dedup * dedup) {
+    struct dedup_header * header = &dedup->header;
+    for (u64 block = 0; block < header->blocks; block++) {
+        u64 entry = dedup->map[block];
+        if (entry == 0)
+            continue;
+        if (entry > header->blocks + 1) {
+            __fuse_printf("Deduplicated store map is corrupt\n");
+            mount->last_error = __fuse_EIO;
+            return OP_FAILURE;
+        }
+        if (dedup->references[entry - 1]++ == 0)
+            dedup->used_slots++;
+        if (entry > dedup->next_slot)
+            dedup->next_slot = entry;
+    }
+    for (u64 slot = dedup->next_slot; slot-- > 0;) {
+        if (dedup->references[slot] == 0) {
+            dedup->free_slots[dedup->free_count++] = (u32)slot;
+            continue;
+        }
+        if (file_transfer(mount, mount->file_handle, dedup->scratch, header->block_size, slot_offset(dedup, slot), 0)) {
+            return OP_FAILURE;
+        }
+        dedup->hashes[slot] = hash_block(dedup->scratch, header->block_size);
+        if (table_grow(dedup)) {
+            mount->last_error = __fuse_ENOMEM;
+            return OP_FAILURE;
+        }
+        table_insert(dedup, slot);
+    }
+    return OP_SUCCESS;
+}
+
+int dedup_open(struct mount * mount) {
+    struct dedup * dedup = __fuse_malloc(sizeof(struct dedup));
+    if (dedup == 0x0) {
+        return OP_FAILURE;
+    }
+    __fuse_memset(dedup, 0, sizeof(struct dedup));
+    __fuse_mutex_init(&dedup->lock);
+    __fuse_cond_init(&dedup->freed);
+    mount->dedup = dedup;
+    struct dedup_header * header = &dedup->header;
+    __fuse_struct_stat st;
+    if (__fuse_fstat(mount->file_handle, &st) == -1) {
+        mount->last_error = __fuse_errno();
+        return OP_FAILURE;
+    }
+    if (st.st_size == 0) {
+        if (create_store(mount, dedup))
+            return OP_FAILURE;
+    } else if (file_transfer(mount, mount->file_handle, (u8*)header, sizeof(struct dedup_header), 0, 0)) {
+        return OP_FAILURE;
+    }
+
+    //A block may be written to a new slot before its old one is released
+    u64 slots = header->blocks + 1;
+    dedup->map = __fuse_malloc(header->blocks * sizeof(u64));
+    dedup->references = __fuse_malloc(slots * sizeof(u32));
+    dedup->readers = __fuse_malloc(slots * sizeof(u32));
+    dedup->hashes = __fuse_malloc(slots * sizeof(u64));
+    dedup->free_slots = __fuse_malloc(slots * sizeof(u32));
+    dedup->table_size = 1024;
+    dedup->table = __fuse_malloc(dedup->table_size * sizeof(u32));
+    dedup->scratch = __fuse_malloc(header->block_size);
+    dedup->stored = __fuse_malloc(header->block_size);
+    if (dedup->map == 0x0 || dedup->references == 0x0 || dedup->readers == 0x0 || dedup->hashes == 0x0 || dedup->free_slots == 0x0 ||
+        dedup->table == 0x0 || dedup->scratch == 0x0 || dedup->stored == 0x0) {
+        mount->last_error = __fuse_ENOMEM;
+        return OP_FAILURE;
+    }
+    __fuse_memset(dedup->references, 0, slots * sizeof(u32));
+    __fuse_memset(dedup->readers, 0, slots * sizeof(u32));
+    __fuse_memset(dedup->table, 0, dedup->table_size * sizeof(u32));
+    if (file_transfer(mount, mount->file_handle, (u8*)dedup->map, header->blocks * sizeof(u64), header->map_offset, 0)) {
+        return OP_FAILURE;
+    }
+    return rebuild(mount, dedup);
+}
+
+//Shared slots count once in stored_bytes and once per entry in logical_bytes
+void dedup_get_stats(struct mount * mount, struct disk_storage_stats * stats) {
+    struct dedup * dedup = mount->dedup;
+    struct dedup_header * header = &dedup->header;
+    u64 slots = header->blocks + 1;
+    __fuse_mutex_lock(&dedup->lock);
+    for (u64 block = 0; block < header->blocks; block++) {
+        if (dedup->map[block] != 0)
+            stats->logical_bytes += block_bytes(dedup, block);
+    }
+    stats->stored_bytes = dedup->used_slots * header->block_size;
+    stats->metadata_bytes = header->data_offset;
+    stats->memory_bytes = sizeof(struct dedup) + header->blocks * sizeof(u64) +
+        slots * (2 * sizeof(u32) + sizeof(u64) + sizeof(u32)) + dedup->table_size * sizeof(u32) + 2 * (u64)header->block_size;
+    stats->unique_blocks = dedup->used_slots;
+    stats->shared_writes = dedup->shared_writes;
+    __fuse_mutex_unlock(&dedup->lock);
+}
@@ -0,0 +1,71 @@
+#ifndef _DEDUP_H
+#define _DEDUP_H
+#include "bfuse.h"
+#include "dependencies.h"
+#include "primitives.h"
+
+//Drives that store every distinct block once
+//The drive is split in blocks of __DEDUP_BLOCK_KB. The store file holds a
+//header, a map with an entry for every block of the drive and the slots
+//holding the distinct blocks. An entry is the slot of its block + 1, 0 if
+//the block is zeros, so a read resolves in one lookup
+//A written block is hashed and looked up in a table of the stored ones,
+//a hash match is compared byte for byte before the block shares the slot.
+//Slots count the entries pointing at them and the last one to leave
+//punches the slot out of the file and frees it for the next new block
+//Data goes to its slot before the entry points at it. The counts and the
+//hash table are rebuilt from the map when the store is opened
+//Writes and trims hold the lock of the drive. Reads take it to look up
+//their slots and pin them, then read the store without it: a pinned slot
+//is not rewritten in place and, once no entry points at it, stays out of
+//the free slots until the last read unpins it
+
+#define DEDUP_MAGIC         0x5055444445535546ULL   //"FUSEDDUP"
+#define DEDUP_VERSION       1
+#define DEDUP_NO_SLOT       (~0U)
+
+//First bytes of the store, the map follows at map_offset
+struct dedup_header {
+    u64  magic;
+    u32  version;
+    u32  block_size;
+    u64  size;              //Bytes of the drive
+    u64  blocks;
+    u64  map_offset;
+    u64  data_offset;       //First slot
+};
+
+//The store is the file_handle of the mount
+struct dedup {
+    struct dedup_header header;
+    __fuse_mutex_t lock;
+    __fuse_cond_t freed;    //A slot went back to the free slots
+    u64  *map;
+    u32  *references;       //Entries pointing at every slot
+    u32  *readers;          //Reads pinning every slot
+    u64  *hashes;           //Hash of the block in every slot
+    u32  *free_slots;       //Stack of slots with no references below next_slot
+    u64  free_count;
+    u64  next_slot;         //Slots past it were never used
+    u64  used_slots;
+    u32  *table;            //Slot + 1 by hash, open addressing, 0 if empty
+    u64  table_size;        //Power of 2
+    u8   *scratch;          //A block being assembled, under the lock
+    u8   *stored;           //A stored block compared against it
+    u64  shared_writes;     //Blocks written that were already stored
+};
+
+//Reads the size of the drive from the header of an existing store into
+//size, an empty file leaves it as it is, fails if the file is not a store
+//of sectors of sector_size
+int dedup_probe(int fd, u32 sector_size, u64 * size);
+//Loads the store of the mount, or lays out an empty one of file_size bytes
+//if the file is empty
+//A failed open is undone by the close of the ops
+int dedup_open(struct mount * mount);
+//Fills the storage counters of the drive, locking it
+void dedup_get_stats(struct mount * mount, struct disk_storage_stats * stats);
+
+//Transfers of drives registered with register_dedup_drive
+extern const struct drive_ops dedup_ops;
+#endif
@@ -1,9 +1,44 @@
+//pread/pwrite, preadv/pwritev, io_uring, hole punching and seeking, O_DIRECT and the non POSIX mmap flags
+#define _GNU_SOURCE
 #include "dependencies.h"
+#include <time.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+const int __fuse_MAP_POPULATE = MAP_POPULATE;
+const int __fuse_MAP_ANONYMOUS = MAP_ANONYMOUS;
+const int __fuse_MAP_HUGETLB = MAP_HUGETLB;
+const int __fuse_O_DIRECT = O_DIRECT;
+const int __fuse_SEEK_DATA = SEEK_DATA;
+const int __fuse_SEEK_HOLE = SEEK_HOLE;
+const int __fuse_MADV_NORMAL = MADV_NORMAL;
+const int __fuse_MADV_SEQUENTIAL = MADV_SEQUENTIAL;
+const int __fuse_MADV_RANDOM = MADV_RANDOM;
+const int __fuse_MADV_WILLNEED = MADV_WILLNEED;
+const int __fuse_MADV_REMOVE = MADV_REMOVE;
+const int __fuse_MADV_DONTNEED = MADV_DONTNEED;
+const int __fuse_MADV_HUGEPAGE = MADV_HUGEPAGE;
+const int __fuse_FADV_NORMAL = POSIX_FADV_NORMAL;
+const int __fuse_FADV_SEQUENTIAL = POSIX_FADV_SEQUENTIAL;
+const int __fuse_FADV_RANDOM = POSIX_FADV_RANDOM;
+const int __fuse_FADV_WILLNEED = POSIX_FADV_WILLNEED;
 
 void * __fuse_memcpy(void *dest, const void *src, size_t n) {
     return memcpy(dest, src, n);
 }
 
+void * __fuse_memmove(void *dest, const void *src, size_t n) {
+    return memmove(dest, src, n);
+}
+
+int __fuse_memcmp(const void *s1, const void *s2, size_t n) {
+    return memcmp(s1, s2, n);
+}
+
+void * __fuse_memset(void *dest, int c, size_t n) {
+    return memset(dest, c, n);
+}
+
 u64 __fuse_lseek(int fd, u64 offset, int whence) {
     return lseek(fd, offset, whence);
 }
@@ -32,11 +67,47 @@ int __fuse_open(const char *pathname, int flags) {
     return open(pathname, flags);
 }
 
+int __fuse_create(const char *pathname) {
+    return open(pathname, O_RDWR | O_CREAT, 0644);
+}
+
+int __fuse_ftruncate(int fd, u64 length) {
+    return ftruncate(fd, length);
+}
+
+int __fuse_rename(const char *oldpath, const char *newpath) {
+    return rename(oldpath, newpath);
+}
+
+int __fuse_unlink(const char *pathname) {
+    return unlink(pathname);
+}
+
 //write to disk
 u64 __fuse_write(int fd, const void *buf, u64 count) {
     return write(fd, buf, count);
 }
 
+s64 __fuse_pread(int fd, void *buf, u64 count, u64 offset) {
+    return pread(fd, buf, count, offset);
+}
+
+s64 __fuse_pwrite(int fd, const void *buf, u64 count, u64 offset) {
+    return pwrite(fd, buf, count, offset);
+}
+
+s64 __fuse_preadv(int fd, const __fuse_struct_iovec *iov, int iovcnt, u64 offset) {
+    return preadv(fd, iov, iovcnt, offset);
+}
+
+s64 __fuse_pwritev(int fd, const __fuse_struct_iovec *iov, int iovcnt, u64 offset) {
+    return pwritev(fd, iov, iovcnt, offset);
+}
+
+int __fuse_errno() {
+    return errno;
+}
+
 void * __fuse_mmap(void *addr, u64 length, int prot, int flags, int fd, u64 offset) {
     return mmap(addr, length, prot, flags, fd, offset);
 }
@@ -45,13 +116,346 @@ int __fuse_munmap(void *addr, u64 length) {
     return munmap(addr, length);
 }
 
+int __fuse_msync(void *addr, u64 length, int flags) {
+    return msync(addr, length, flags);
+}
+
+int __fuse_madvise(void *addr, u64 length, int advice) {
+    return madvise(addr, length, advice);
+}
+
+//posix_fadvise returns the error instead of setting errno
+int __fuse_fadvise(int fd, u64 offset, u64 length, int advice) {
+    int ret = posix_fadvise(fd, offset, length, advice);
+    if (ret != 0) {
+        errno = ret;
+        return -1;
+    }
+    return 0;
+}
+
+int __fuse_fdatasync(int fd) {
+    return fdatasync(fd);
+}
+
+int __fuse_punch_hole(int fd, u64 offset, u64 length) {
+    return fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length);
+}
+
+u64 __fuse_page_size() {
+    return sysconf(_SC_PAGESIZE);
+}
+
+//statx reports it since Linux 6.1, the file system block size is always enough
+u64 __fuse_direct_alignment(int fd) {
+    u64 alignment = 0;
+#ifdef STATX_DIOALIGN
+    struct statx stx;
+    if (statx(fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &stx) == 0 && (stx.stx_mask & STATX_DIOALIGN)) {
+        alignment = (stx.stx_dio_mem_align > stx.stx_dio_offset_align) ? stx.stx_dio_mem_align : stx.stx_dio_offset_align;
+    }
+#endif
+    if (alignment == 0) {
+        struct stat st;
+        alignment = (fstat(fd, &st) == 0 && st.st_blksize > 0) ? (u64)st.st_blksize : 4096;
+    }
+    return alignment;
+}
+
 void * __fuse_malloc(u64 size) {
     return malloc(size);
 }
+void * __fuse_aligned_alloc(u64 alignment, u64 size) {
+    void * ptr;
+    if (posix_memalign(&ptr, alignment, size) != 0) {
+        return 0x0;
+    }
+    return ptr;
+}
+
 void __fuse_free(void * ptr) {
     free(ptr);
 }
 
+void __fuse_qsort(void *base, u64 count, u64 size, int (*compare)(const void *, const void *)) {
+    qsort(base, count, size, compare);
+}
+
+u64 __fuse_monotonic_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+u64 __fuse_monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void __fuse_sleep_until_ns(u64 deadline) {
+    struct timespec ts;
+    ts.tv_sec = deadline / 1000000000ULL;
+    ts.tv_nsec = deadline % 1000000000ULL;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, 0x0) == EINTR);
+}
+
+int __fuse_thread_create(__fuse_thread_t *thread, void *(*routine)(void *), void *arg) {
+    return pthread_create(thread, 0x0, routine, arg);
+}
+
+int __fuse_thread_join(__fuse_thread_t thread) {
+    return pthread_join(thread, 0x0);
+}
+
+void __fuse_once(__fuse_once_t *once, void (*routine)(void)) {
+    pthread_once(once, routine);
+}
+
+int __fuse_thread_key_create(__fuse_thread_key_t *key, void (*destructor)(void *)) {
+    return pthread_key_create(key, destructor);
+}
+
+void __fuse_thread_key_set(__fuse_thread_key_t key, void *value) {
+    pthread_setspecific(key, value);
+}
+
+void __fuse_mutex_init(__fuse_mutex_t *mutex) {
+    pthread_mutex_init(mutex, 0x0);
+}
+
+void __fuse_mutex_destroy(__fuse_mutex_t *mutex) {
+    pthread_mutex_destroy(mutex);
+}
+
+void __fuse_mutex_lock(__fuse_mutex_t *mutex) {
+    pthread_mutex_lock(mutex);
+}
+
+void __fuse_mutex_unlock(__fuse_mutex_t *mutex) {
+    pthread_mutex_unlock(mutex);
+}
+
+struct __fuse_rwlock {
+    pthread_rwlock_t lock;
+};
+
+__fuse_rwlock_t * __fuse_rwlock_create() {
+    __fuse_rwlock_t * lock = malloc(sizeof(__fuse_rwlock_t));
+    if (lock == 0x0) {
+        return 0x0;
+    }
+    if (pthread_rwlock_init(&lock->lock, 0x0) != 0) {
+        free(lock);
+        return 0x0;
+    }
+    return lock;
+}
+
+void __fuse_rwlock_destroy(__fuse_rwlock_t *lock) {
+    if (lock == 0x0) {
+        return;
+    }
+    pthread_rwlock_destroy(&lock->lock);
+    free(lock);
+}
+
+void __fuse_rwlock_read(__fuse_rwlock_t *lock) {
+    pthread_rwlock_rdlock(&lock->lock);
+}
+
+void __fuse_rwlock_write(__fuse_rwlock_t *lock) {
+    pthread_rwlock_wrlock(&lock->lock);
+}
+
+void __fuse_rwlock_unlock(__fuse_rwlock_t *lock) {
+    pthread_rwlock_unlock(&lock->lock);
+}
+
+void __fuse_cond_init(__fuse_cond_t *cond) {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+void __fuse_cond_destroy(__fuse_cond_t *cond) {
+    pthread_cond_destroy(cond);
+}
+
+void __fuse_cond_signal(__fuse_cond_t *cond) {
+    pthread_cond_signal(cond);
+}
+
+void __fuse_cond_broadcast(__fuse_cond_t *cond) {
+    pthread_cond_broadcast(cond);
+}
+
+void __fuse_cond_wait(__fuse_cond_t *cond, __fuse_mutex_t *mutex) {
+    pthread_cond_wait(cond, mutex);
+}
+
+void __fuse_cond_timedwait_ms(__fuse_cond_t *cond, __fuse_mutex_t *mutex, u64 ms) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ts.tv_sec += ms / 1000;
+    ts.tv_nsec += (ms % 1000) * 1000000;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(cond, mutex, &ts);
+}
+
+struct __fuse_uring {
+    int fd;
+    u32 entries;
+    u32 pending;
+    u32 *sq_head, *sq_tail, *sq_mask, *sq_array;
+    u32 *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    u64 sq_size, cq_size, sqes_size;
+};
+
+static uint8_t uring_supports(int fd) {
+    const u8 ops[] = {IORING_OP_READ, IORING_OP_WRITE, IORING_OP_FSYNC};
+    u64 size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe * probe = calloc(1, size);
+    if (probe == 0x0) {
+        return 0;
+    }
+    uint8_t supported = syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+    for (u32 i = 0; supported && i < sizeof(ops); i++) {
+        supported = ops[i] <= probe->last_op && (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(probe);
+    return supported;
+}
+
+struct __fuse_uring * __fuse_uring_create(u32 entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (fd < 0) {
+        return 0x0;
+    }
+    struct __fuse_uring * ring = calloc(1, sizeof(struct __fuse_uring));
+    if (ring == 0x0 || !uring_supports(fd)) {
+        free(ring);
+        close(fd);
+        return 0x0;
+    }
+    ring->fd = fd;
+    ring->entries = params.sq_entries;
+    ring->sq_size = params.sq_off.array + params.sq_entries * sizeof(u32);
+    ring->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_size > ring->sq_size) ring->sq_size = ring->cq_size;
+        ring->cq_size = ring->sq_size;
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring->sq_ring = mmap(0x0, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    ring->cq_ring = (params.features & IORING_FEAT_SINGLE_MMAP) ? ring->sq_ring :
+        mmap(0x0, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(0x0, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        if (ring->sq_ring != MAP_FAILED) munmap(ring->sq_ring, ring->sq_size);
+        if (ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring) munmap(ring->cq_ring, ring->cq_size);
+        if (ring->sqes != MAP_FAILED) munmap(ring->sqes, ring->sqes_size);
+        close(fd);
+        free(ring);
+        return 0x0;
+    }
+
+    u8 * sq = ring->sq_ring;
+    u8 * cq = ring->cq_ring;
+    ring->sq_head = (u32*)(sq + params.sq_off.head);
+    ring->sq_tail = (u32*)(sq + params.sq_off.tail);
+    ring->sq_mask = (u32*)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (u32*)(sq + params.sq_off.array);
+    ring->cq_head = (u32*)(cq + params.cq_off.head);
+    ring->cq_tail = (u32*)(cq + params.cq_off.tail);
+    ring->cq_mask = (u32*)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    return ring;
+}
+
+void __fuse_uring_destroy(struct __fuse_uring * ring) {
+    if (ring == 0x0) {
+        return;
+    }
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring != ring->sq_ring) munmap(ring->cq_ring, ring->cq_size);
+    munmap(ring->sq_ring, ring->sq_size);
+    close(ring->fd);
+    free(ring);
+}
+
+int __fuse_uring_prepare(struct __fuse_uring * ring, int op, int fd, void * buffer, u32 length, u64 offset, u64 user_data) {
+    u32 tail = *ring->sq_tail;
+    u32 head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (tail - head >= ring->entries) {
+        return -1;
+    }
+
+    u32 index = tail & *ring->sq_mask;
+    struct io_uring_sqe * sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->fd = fd;
+    sqe->user_data = user_data;
+    switch (op) {
+        case __FUSE_URING_READ:
+        case __FUSE_URING_WRITE:
+            sqe->opcode = (op == __FUSE_URING_READ) ? IORING_OP_READ : IORING_OP_WRITE;
+            sqe->addr = (u64)buffer;
+            sqe->len = length;
+            sqe->off = offset;
+            break;
+        default:
+            sqe->opcode = IORING_OP_FSYNC;
+            sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+            sqe->flags = IOSQE_IO_DRAIN;
+            break;
+    }
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->pending++;
+    return 0;
+}
+
+int __fuse_uring_submit(struct __fuse_uring * ring) {
+    while (1) {
+        int done = syscall(__NR_io_uring_enter, ring->fd, ring->pending, 0, 0, 0x0, 0);
+        if (done >= 0) {
+            ring->pending -= done;
+            return done;
+        }
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+}
+
+void __fuse_uring_wait(struct __fuse_uring * ring) {
+    while (syscall(__NR_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS, 0x0, 0) < 0 && errno == EINTR);
+}
+
+int __fuse_uring_reap(struct __fuse_uring * ring, u64 * user_data, s32 * res) {
+    u32 head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+    struct io_uring_cqe * cqe = &ring->cqes[head & *ring->cq_mask];
+    *user_data = cqe->user_data;
+    *res = cqe->res;
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
 int __fuse_strcmp(const char * str1, const char * str2) {
     return strcmp(str1, str2);
 }
@@ -11,29 +11,166 @@
 #include <unistd.h>
 #include <sys/stat.h>
 #include <stdarg.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include <pthread.h>
 
 typedef struct stat __fuse_struct_stat;
+typedef struct iovec __fuse_struct_iovec;
+typedef pthread_t __fuse_thread_t;
+typedef pthread_mutex_t __fuse_mutex_t;
+typedef pthread_cond_t __fuse_cond_t;
+typedef pthread_key_t __fuse_thread_key_t;
+typedef pthread_once_t __fuse_once_t;
+#define __fuse_MUTEX_INITIALIZER PTHREAD_MUTEX_INITIALIZER
+#define __fuse_ONCE_INIT PTHREAD_ONCE_INIT
 
 #define __fuse_PROT_WRITE    PROT_WRITE
 #define __fuse_PROT_READ     PROT_READ
 #define __fuse_SEEK_SET      SEEK_SET
 #define __fuse_MAP_FAILED    MAP_FAILED
 #define __fuse_MAP_SHARED    MAP_SHARED
+#define __fuse_MAP_PRIVATE   MAP_PRIVATE
 #define __fuse_O_RDWR        O_RDWR
+#define __fuse_O_RDONLY      O_RDONLY
+#define __fuse_EINTR         EINTR
+#define __fuse_EIO           EIO
+#define __fuse_EINVAL        EINVAL
+#define __fuse_ENOMEM        ENOMEM
+#define __fuse_MS_SYNC       MS_SYNC
+#define __fuse_EBUSY         EBUSY
+
+//Non POSIX flags, resolved in dependencies.c
+extern const int __fuse_MAP_POPULATE;
+extern const int __fuse_MAP_ANONYMOUS;
+extern const int __fuse_MAP_HUGETLB;
+extern const int __fuse_O_DIRECT;
+extern const int __fuse_SEEK_DATA;
+extern const int __fuse_SEEK_HOLE;
+extern const int __fuse_MADV_NORMAL;
+extern const int __fuse_MADV_SEQUENTIAL;
+extern const int __fuse_MADV_RANDOM;
+extern const int __fuse_MADV_WILLNEED;
+extern const int __fuse_MADV_REMOVE;
+extern const int __fuse_MADV_DONTNEED;
+extern const int __fuse_MADV_HUGEPAGE;
+extern const int __fuse_FADV_NORMAL;
+extern const int __fuse_FADV_SEQUENTIAL;
+extern const int __fuse_FADV_RANDOM;
+extern const int __fuse_FADV_WILLNEED;
 
 
 void * __fuse_memcpy(void *dest, const void *src, size_t n);
+void * __fuse_memset(void *dest, int c, size_t n);
+void * __fuse_memmove(void *dest, const void *src, size_t n);
+int __fuse_memcmp(const void *s1, const void *s2, size_t n);
 u64 __fuse_lseek(int fd, u64 offset, int whence);
 u64 __fuse_read(int fd, void *buf, u64 count);
 u64 __fuse_write(int fd, const void *buf, u64 count);
+s64 __fuse_pread(int fd, void *buf, u64 count, u64 offset);
+s64 __fuse_pwrite(int fd, const void *buf, u64 count, u64 offset);
+s64 __fuse_preadv(int fd, const __fuse_struct_iovec *iov, int iovcnt, u64 offset);
+s64 __fuse_pwritev(int fd, const __fuse_struct_iovec *iov, int iovcnt, u64 offset);
+int __fuse_errno();
 int __fuse_printf(const char *format, ...);
 int __fuse_fstat(int fd, struct stat *statbuf);
 int __fuse_close(int fd);
 int __fuse_open(const char *pathname, int flags);
+//Opens for reading and writing, creating the file if it does not exist
+int __fuse_create(const char *pathname);
+int __fuse_ftruncate(int fd, u64 length);
+//Replaces newpath with oldpath atomically
+int __fuse_rename(const char *oldpath, const char *newpath);
+int __fuse_unlink(const char *pathname);
 void * __fuse_mmap(void *addr, u64 length, int prot, int flags, int fd, u64 offset);
 int __fuse_munmap(void *addr, u64 length);
+int __fuse_msync(void *addr, u64 length, int flags);
+int __fuse_madvise(void *addr, u64 length, int advice);
+int __fuse_fadvise(int fd, u64 offset, u64 length, int advice);
+int __fuse_fdatasync(int fd);
+//Deallocates the byte range of the file keeping its size, it reads as zeros afterwards
+int __fuse_punch_hole(int fd, u64 offset, u64 length);
+u64 __fuse_page_size();
+//Alignment O_DIRECT transfers on fd need for buffers, offsets and lengths
+u64 __fuse_direct_alignment(int fd);
 void * __fuse_malloc(u64 size);
+//Released with __fuse_free, returns 0 on failure
+void * __fuse_aligned_alloc(u64 alignment, u64 size);
 void __fuse_free(void * ptr);
+void __fuse_qsort(void *base, u64 count, u64 size, int (*compare)(const void *, const void *));
+u64 __fuse_monotonic_ms();
+u64 __fuse_monotonic_ns();
+//Sleeps until __fuse_monotonic_ns reaches deadline
+void __fuse_sleep_until_ns(u64 deadline);
+
+int __fuse_thread_create(__fuse_thread_t *thread, void *(*routine)(void *), void *arg);
+int __fuse_thread_join(__fuse_thread_t thread);
+//Runs routine once over every thread that calls it with the same once
+void __fuse_once(__fuse_once_t *once, void (*routine)(void));
+//A thread that set a value for key other than 0 calls destructor with it
+//when it exits, returns 0 on success
+int __fuse_thread_key_create(__fuse_thread_key_t *key, void (*destructor)(void *));
+void __fuse_thread_key_set(__fuse_thread_key_t key, void *value);
+void __fuse_mutex_init(__fuse_mutex_t *mutex);
+void __fuse_mutex_destroy(__fuse_mutex_t *mutex);
+void __fuse_mutex_lock(__fuse_mutex_t *mutex);
+void __fuse_mutex_unlock(__fuse_mutex_t *mutex);
+//Held by any number of readers or a single writer, opaque so includers need
+//no feature macros for it
+typedef struct __fuse_rwlock __fuse_rwlock_t;
+//Returns 0 on failure
+__fuse_rwlock_t * __fuse_rwlock_create();
+void __fuse_rwlock_destroy(__fuse_rwlock_t *lock);
+void __fuse_rwlock_read(__fuse_rwlock_t *lock);
+void __fuse_rwlock_write(__fuse_rwlock_t *lock);
+void __fuse_rwlock_unlock(__fuse_rwlock_t *lock);
+//Condition variables measure timeouts on the monotonic clock
+void __fuse_cond_init(__fuse_cond_t *cond);
+void __fuse_cond_destroy(__fuse_cond_t *cond);
+void __fuse_cond_signal(__fuse_cond_t *cond);
+void __fuse_cond_broadcast(__fuse_cond_t *cond);
+void __fuse_cond_wait(__fuse_cond_t *cond, __fuse_mutex_t *mutex);
+void __fuse_cond_timedwait_ms(__fuse_cond_t *cond, __fuse_mutex_t *mutex, u64 ms);
+
+//Atomics for the lock-free rings, GCC and clang builtins
+#define __fuse_load_acquire(ptr)            __atomic_load_n(ptr, __ATOMIC_ACQUIRE)
+#define __fuse_store_release(ptr, value)    __atomic_store_n(ptr, value, __ATOMIC_RELEASE)
+#define __fuse_fetch_add(ptr, value)        __atomic_fetch_add(ptr, value, __ATOMIC_ACQ_REL)
+#define __fuse_fetch_or(ptr, value)         __atomic_fetch_or(ptr, value, __ATOMIC_ACQ_REL)
+#define __fuse_exchange(ptr, value)         __atomic_exchange_n(ptr, value, __ATOMIC_ACQ_REL)
+#define __fuse_fence()                      __atomic_thread_fence(__ATOMIC_SEQ_CST)
+//Counters with a single writer that others only sum up need no ordering
+#define __fuse_load_relaxed(ptr)            __atomic_load_n(ptr, __ATOMIC_RELAXED)
+#define __fuse_store_relaxed(ptr, value)    __atomic_store_n(ptr, value, __ATOMIC_RELAXED)
+
+//Little endian 64 bit load from any address, byte by byte so it works
+//unaligned on every host, compilers turn it into a single load. Inline as
+//the codecs and hashes calling it do so once every few bytes
+static inline u64 __fuse_load_le64(const u8 * p) {
+    return (u64)p[0] | ((u64)p[1] << 8) | ((u64)p[2] << 16) | ((u64)p[3] << 24) |
+        ((u64)p[4] << 32) | ((u64)p[5] << 40) | ((u64)p[6] << 48) | ((u64)p[7] << 56);
+}
+
+//Minimal io_uring, raw syscalls so liburing is not needed
+//The caller serializes every call on the same ring, except
+//__fuse_uring_wait which one other thread may call meanwhile
+#define __FUSE_URING_READ   0
+#define __FUSE_URING_WRITE  1
+#define __FUSE_URING_FSYNC  2   //fdatasync, waits for every earlier request
+struct __fuse_uring;
+//Returns 0 if io_uring or one of the operations above is not available
+struct __fuse_uring * __fuse_uring_create(u32 entries);
+void __fuse_uring_destroy(struct __fuse_uring * ring);
+//Queues a request, returns -1 if the submission queue is full
+int __fuse_uring_prepare(struct __fuse_uring * ring, int op, int fd, void * buffer, u32 length, u64 offset, u64 user_data);
+//Hands the queued requests to the kernel
+//Returns the number of requests submitted or -1 with errno set
+int __fuse_uring_submit(struct __fuse_uring * ring);
+//Blocks until there is at least one completion
+void __fuse_uring_wait(struct __fuse_uring * ring);
+//Takes one completion, res is the byte count or -errno, returns 0 if there is none
+int __fuse_uring_reap(struct __fuse_uring * ring, u64 * user_data, s32 * res);
+
 int __fuse_strcmp(const char * str1, const char * str2);
 char *__fuse_strncpy(char *dest, const char *src, u64 n);
 u64 __fuse_strlen(const char *s);
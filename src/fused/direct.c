@@ -0,0 +1,235 @@
+#include "direct.h"
+#include "primitives.h"
+
+//Raw transfer of an aligned range, short transfers are retried
+static int transfer(struct mount * mount, u8 * buffer, u64 size, u64 offset, uint8_t write) {
+    while (size > 0) {
+        s64 done = write ? __fuse_pwrite(mount->file_handle, buffer, size, offset)
+                         : __fuse_pread(mount->file_handle, buffer, size, offset);
+        if (done < 0) {
+            if (__fuse_errno() == __fuse_EINTR)
+                continue;
+            mount->last_error = __fuse_errno();
+            return OP_FAILURE;
+        }
+        if (done == 0) {
+            mount->last_error = __fuse_EIO;
+            return OP_FAILURE;
+        }
+        buffer += done;
+        offset += done;
+        size -= done;
+    }
+    return OP_SUCCESS;
+}
+
+static u8 * take_buffer(struct direct * direct) {
+    __fuse_mutex_lock(&direct->lock);
+    while (direct->free_count == 0) {
+        __fuse_cond_wait(&direct->wake, &direct->lock);
+    }
+    u8 * buffer = direct->free_buffers[--direct->free_count];
+    __fuse_mutex_unlock(&direct->lock);
+    return buffer;
+}
+
+static void give_buffer(struct direct * direct, u8 * buffer) {
+    __fuse_mutex_lock(&direct->lock);
+    direct->free_buffers[direct->free_count++] = buffer;
+    __fuse_cond_broadcast(&direct->wake);
+    __fuse_mutex_unlock(&direct->lock);
+}
+
+//Writes covering whole blocks run together, a partial block write runs
+//alone and new writes wait behind it
+static void enter_write(struct direct * direct, uint8_t exclusive) {
+    __fuse_mutex_lock(&direct->lock);
+    if (exclusive) {
+        while (direct->exclusive) {
+            __fuse_cond_wait(&direct->wake, &direct->lock);
+        }
+        direct->exclusive = 1;
+        while (direct->writers > 0) {
+            __fuse_cond_wait(&direct->wake, &direct->lock);
+        }
+    } else {
+        while (direct->exclusive) {
+            __fuse_cond_wait(&direct->wake, &direct->lock);
+        }
+        direct->writers++;
+    }
+    __fuse_mutex_unlock(&direct->lock);
+}
+
+static void leave_write(struct direct * direct, uint8_t exclusive) {
+    __fuse_mutex_lock(&direct->lock);
+    if (exclusive)
+        direct->exclusive = 0;
+    else
+        direct->writers--;
+    __fuse_cond_broadcast(&direct->wake);
+    __fuse_mutex_unlock(&direct->lock);
+}
+
+//Position in the buffers of a transfer
+struct cursor {
+    const __fuse_struct_iovec * vector;
+    u64  skip;      //Bytes of the current buffer already moved
+};
+
+//Copies length bytes between the window and the buffers at the cursor
+static void cursor_copy(struct cursor * cursor, u8 * window, u64 length, uint8_t gather) {
+    while (length > 0) {
+        u8 * base = (u8*)cursor->vector->iov_base + cursor->skip;
+        u64 left = cursor->vector->iov_len - cursor->skip;
+        u64 step = (left < length) ? left : length;
+        if (gather)
+            __fuse_memcpy(window, base, step);
+        else
+            __fuse_memcpy(base, window, step);
+        window += step;
+        length -= step;
+        cursor->skip += step;
+        if (cursor->skip == cursor->vector->iov_len) {
+            cursor->vector++;
+            cursor->skip = 0;
+        }
+    }
+}
+
+//Moves the range through a bounce buffer a window at a time, windows
+//are widened to whole blocks and a write reads the blocks it only covers
+//in part first
+static int bounce(struct mount * mount, struct cursor * cursor, u64 size, u64 offset, uint8_t write) {
+    struct direct * direct = mount->direct;
+    u64 block = direct->alignment;
+    u64 mask = block - 1;
+    u8 * window = take_buffer(direct);
+    int result = OP_SUCCESS;
+
+    while (size > 0 && result == OP_SUCCESS) {
+        u64 start = offset & ~mask;
+        u64 end = (offset + size + mask) & ~mask;
+        if (end - start > direct->buffer_size)
+            end = start + direct->buffer_size;
+        u64 length = (end - offset < size) ? end - offset : size;
+        u8 * inner = window + (offset - start);
+
+        if (write) {
+            if (offset > start)
+                result = transfer(mount, window, block, start, 0);
+            if (result == OP_SUCCESS && offset + length < end)
+                result = transfer(mount, window + (end - start - block), block, end - block, 0);
+            if (result == OP_SUCCESS) {
+                cursor_copy(cursor, inner, length, 1);
+                result = transfer(mount, window, end - start, start, 1);
+            }
+        } else {
+            result = transfer(mount, window, end - start, start, 0);
+            if (result == OP_SUCCESS)
+                cursor_copy(cursor, inner, length, 0);
+        }
+        offset += length;
+        size -= length;
+    }
+    give_buffer(direct, window);
+    return result;
+}
+
+//Hands an aligned list to the kernel as is, whatever a short transfer
+//leaves is finished through the pool
+static int zero_copy(struct mount * mount, const __fuse_struct_iovec * vector, int count, u64 size, u64 offset, uint8_t write) {
+    if (count == 1) {
+        return transfer(mount, vector->iov_base, size, offset, write);
+    }
+    s64 done;
+    do {
+        done = write ? __fuse_pwritev(mount->file_handle, vector, count, offset)
+                     : __fuse_preadv(mount->file_handle, vector, count, offset);
+    } while (done < 0 && __fuse_errno() == __fuse_EINTR);
+    if (done < 0) {
+        mount->last_error = __fuse_errno();
+        return OP_FAILURE;
+    }
+    if ((u64)done == size) {
+        return OP_SUCCESS;
+    }
+    struct cursor cursor = {vector, 0};
+    while (done > 0) {
+        u64 step = cursor.vector->iov_len - cursor.skip;
+        if (step > (u64)done)
+            step = done;
+        cursor.skip += step;
+        done -= step;
+        offset += step;
+        size -= step;
+        if (cursor.skip == cursor.vector->iov_len) {
+            cursor.vector++;
+            cursor.skip = 0;
+        }
+    }
+    return bounce(mount, &cursor, size, offset, write);
+}
+
+int direct_transfer(struct mount * mount, const __fuse_struct_iovec * vector, int count, u64 offset, uint8_t write) {
+    struct direct * direct = mount->direct;
+    u64 mask = direct->alignment - 1;
+    u64 size = 0;
+    u64 misaligned = offset;
+    for (int i = 0; i < count; i++) {
+        size += vector[i].iov_len;
+        misaligned |= (u64)vector[i].iov_base | vector[i].iov_len;
+    }
+    //Only a write covering part of a block has to keep the others away
+    uint8_t partial = ((size | offset) & mask) != 0;
+    int result;
+
+    if (write)
+        enter_write(direct, partial);
+    if ((misaligned & mask) == 0) {
+        result = zero_copy(mount, vector, count, size, offset, write);
+    } else {
+        struct cursor cursor = {vector, 0};
+        result = bounce(mount, &cursor, size, offset, write);
+    }
+    if (write)
+        leave_write(direct, partial);
+    return result;
+}
+
+struct direct * direct_create(u64 alignment) {
+    struct direct * direct = __fuse_malloc(sizeof(struct direct));
+    if (direct == 0x0) {
+        return 0x0;
+    }
+    __fuse_memset(direct, 0, sizeof(struct direct));
+    direct->alignment = alignment;
+    //A window always fits a block on each side of a sector
+    direct->buffer_size = (u64)__DIRECT_BOUNCE_KB << 10;
+    if (direct->buffer_size < 2 * alignment)
+        direct->buffer_size = 2 * alignment;
+    direct->buffer_size = (direct->buffer_size + alignment - 1) & ~(alignment - 1);
+
+    direct->arena = __fuse_aligned_alloc(alignment, direct->buffer_size * __DIRECT_BOUNCE_BUFFERS);
+    if (direct->arena == 0x0) {
+        __fuse_free(direct);
+        return 0x0;
+    }
+    for (u32 i = 0; i < __DIRECT_BOUNCE_BUFFERS; i++) {
+        direct->free_buffers[i] = direct->arena + i * direct->buffer_size;
+    }
+    direct->free_count = __DIRECT_BOUNCE_BUFFERS;
+    __fuse_mutex_init(&direct->lock);
+    __fuse_cond_init(&direct->wake);
+    return direct;
+}
+
+void direct_destroy(struct direct * direct) {
+    if (direct == 0x0) {
+        return;
+    }
+    __fuse_cond_destroy(&direct->wake);
+    __fuse_mutex_destroy(&direct->lock);
+    __fuse_free(direct->arena);
+    __fuse_free(direct);
+}
@@ -0,0 +1,35 @@
+#ifndef _DIRECT_H
+#define _DIRECT_H
+#include "bfuse.h"
+#include "dependencies.h"
+
+//O_DIRECT transfers for drives registered with DRIVE_DIRECT
+//The image bypasses the host page cache, so the buffer, the offset and
+//the length of every transfer must be aligned to the logical block size
+//Aligned transfers go straight from the caller buffers, the rest are
+//gathered into or scattered from one of __DIRECT_BOUNCE_BUFFERS aligned
+//buffers, so a list of small buffers still makes large transfers. A write that
+//only covers part of a block reads the block first and holds off every
+//other write meanwhile, so the sectors around it are not lost
+
+struct direct {
+    u64  alignment;
+    u64  buffer_size;
+
+    __fuse_mutex_t lock;
+    __fuse_cond_t wake;
+    u8   *arena;
+    u8   *free_buffers[__DIRECT_BOUNCE_BUFFERS];
+    u32  free_count;
+    u32  writers;       //Writes in flight that cover whole blocks
+    u8   exclusive;     //A partial block write holds the drive or waits for it
+};
+
+//Returns 0 on failure
+struct direct * direct_create(u64 alignment);
+void direct_destroy(struct direct * direct);
+
+//Reads or writes the buffers of vector in order from offset on
+//Returns OP_SUCCESS or OP_FAILURE with the errno in last_error
+int direct_transfer(struct mount * mount, const __fuse_struct_iovec * vector, int count, u64 offset, uint8_t write);
+#endif
@@ -0,0 +1,102 @@
+#include "discard.h"
+#include "primitives.h"
+
+//Sets or clears count bits from first a word at a time
+//Returns how many bits changed
+static u64 update_range(u64 * map, u64 first, u64 count, uint8_t set) {
+    u64 changed = 0;
+    while (count > 0) {
+        u64 bit = first & 63;
+        u64 length = (count < 64 - bit) ? count : 64 - bit;
+        u64 mask = (length == 64) ? ~0ULL : ((1ULL << length) - 1) << bit;
+        u64 * word = &map[first >> 6];
+        if (set) {
+            changed += __builtin_popcountll(mask & ~*word);
+            *word |= mask;
+        } else {
+            changed += __builtin_popcountll(mask & *word);
+            *word &= ~mask;
+        }
+        first += length;
+        count -= length;
+    }
+    return changed;
+}
+
+struct discard * discard_create(u64 sectors) {
+    struct discard * discard = __fuse_malloc(sizeof(struct discard));
+    if (discard == 0x0) {
+        return 0x0;
+    }
+    __fuse_mutex_init(&discard->lock);
+    discard->map = 0x0;
+    discard->sectors = sectors;
+    discard->discarded = 0;
+    return discard;
+}
+
+void discard_destroy(struct discard * discard) {
+    if (discard == 0x0) {
+        return;
+    }
+    __fuse_mutex_destroy(&discard->lock);
+    __fuse_free(discard->map);
+    __fuse_free(discard);
+}
+
+int discard_mark(struct mount * mount, u64 sector, u64 count) {
+    struct discard * discard = mount->discard;
+    __fuse_mutex_lock(&discard->lock);
+    if (discard->map == 0x0) {
+        u64 words = (discard->sectors + 63) / 64;
+        discard->map = __fuse_malloc(words * sizeof(u64));
+        if (discard->map == 0x0) {
+            __fuse_mutex_unlock(&discard->lock);
+            return OP_FAILURE;
+        }
+        __fuse_memset(discard->map, 0, words * sizeof(u64));
+    }
+    u64 discarded = discard->discarded + update_range(discard->map, sector, count, 1);
+    __fuse_store_release(&discard->discarded, discarded);
+    __fuse_mutex_unlock(&discard->lock);
+    return OP_SUCCESS;
+}
+
+void discard_clear(struct mount * mount, u64 sector, u64 count) {
+    struct discard * discard = mount->discard;
+    if (__fuse_load_acquire(&discard->discarded) == 0) {
+        return;
+    }
+    __fuse_mutex_lock(&discard->lock);
+    u64 discarded = discard->discarded - update_range(discard->map, sector, count, 0);
+    __fuse_store_release(&discard->discarded, discarded);
+    __fuse_mutex_unlock(&discard->lock);
+}
+
+u64 discard_run(struct mount * mount, u64 sector, u64 count, uint8_t * discarded) {
+    struct discard * discard = mount->discard;
+    *discarded = 0;
+    if (__fuse_load_acquire(&discard->discarded) == 0) {
+        return count;
+    }
+
+    __fuse_mutex_lock(&discard->lock);
+    const u64 * map = discard->map;
+    uint8_t state = (map[sector >> 6] >> (sector & 63)) & 1;
+    u64 flip = state ? ~0ULL : 0;
+    u64 run = 0;
+    while (run < count) {
+        u64 current = sector + run;
+        //Bits that differ from the first one, from current on
+        u64 differ = (map[current >> 6] ^ flip) >> (current & 63);
+        if (differ != 0) {
+            run += __builtin_ctzll(differ);
+            break;
+        }
+        run += 64 - (current & 63);
+    }
+    __fuse_mutex_unlock(&discard->lock);
+
+    *discarded = state;
+    return (run < count) ? run : count;
+}
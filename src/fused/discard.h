@@ -0,0 +1,30 @@
+#ifndef _DISCARD_H
+#define _DISCARD_H
+#include "bfuse.h"
+#include "dependencies.h"
+
+//Sectors known to read as zeros, a bit per sector
+//They are the holes of the image found when the drive is registered
+//and the ranges released with IOCTL_TRIM since
+//Reads of discarded sectors are answered with zeros without touching
+//the image and a write makes its sectors live again
+//The bitmap is only allocated once the first sector is marked
+struct discard {
+    __fuse_mutex_t lock;
+    u64  *map;
+    u64  sectors;
+    u64  discarded;     //Bits set, read without the lock by the fast paths
+};
+
+//Returns 0 on failure
+struct discard * discard_create(u64 sectors);
+void discard_destroy(struct discard * discard);
+
+//Marks the sectors discarded, returns OP_FAILURE if the bitmap could not be allocated
+int discard_mark(struct mount * mount, u64 sector, u64 count);
+//Marks the sectors live, called before they are written
+void discard_clear(struct mount * mount, u64 sector, u64 count);
+//Length of the run of sectors starting at sector that are all discarded
+//or all live, up to count, discarded tells which one it is
+u64 discard_run(struct mount * mount, u64 sector, u64 count, uint8_t * discarded);
+#endif
@@ -0,0 +1,325 @@
+#include "elevator.h"
+#include "backend.h"
+
+static uint8_t touches(u64 sector, u64 count, u64 other, u64 other_count) {
+    return sector <= other + other_count && other <= sector + count;
+}
+
+static int compare_requests(const void * a, const void * b) {
+    const struct elevator_request * first = a;
+    const struct elevator_request * second = b;
+    if (first->sector != second->sector)
+        return (first->sector < second->sector) ? -1 : 1;
+    return 0;
+}
+
+//Writes the plug out and empties it, called with the lock held
+//Queued copies of a sector all hold the same data, so a request that
+//overlaps the run before it only adds the sectors past its end
+static int dispatch(struct elevator * elevator) {
+    struct mount * mount = elevator->mount;
+    u32 sector_size = mount->sector_size;
+    int result = OP_SUCCESS;
+
+    if (elevator->count == 0) {
+        return OP_SUCCESS;
+    }
+    if (elevator->policy == ELEVATOR_DEADLINE) {
+        __fuse_qsort(elevator->requests, elevator->count, sizeof(struct elevator_request), compare_requests);
+    }
+
+    u32 i = 0;
+    while (i < elevator->count) {
+        struct elevator_request * first = &elevator->requests[i++];
+        u64 start = first->sector;
+        u64 end = first->sector + first->count;
+        int iovcnt = 0;
+        elevator->iov[iovcnt].buffer = first->data;
+        elevator->iov[iovcnt++].count = first->count;
+
+        while (i < elevator->count) {
+            struct elevator_request * next = &elevator->requests[i];
+            if (next->sector < start || next->sector > end)
+                break;
+            if (next->sector + next->count > end) {
+                elevator->iov[iovcnt].buffer = next->data + (end - next->sector) * sector_size;
+                elevator->iov[iovcnt++].count = next->sector + next->count - end;
+                end = next->sector + next->count;
+            }
+            i++;
+        }
+
+        if (backend_dispatch(mount, elevator->iov, iovcnt, start)) {
+            elevator->error = mount->last_error;
+            result = OP_FAILURE;
+        }
+        elevator->dispatched++;
+        elevator->sectors += end - start;
+    }
+
+    for (i = 0; i < elevator->count; i++) {
+        __fuse_free(elevator->requests[i].data);
+    }
+    elevator->count = 0;
+    elevator->bytes = 0;
+    elevator->plugs++;
+    return result;
+}
+
+static void * dispatcher(void * arg) {
+    struct elevator * elevator = arg;
+
+    __fuse_mutex_lock(&elevator->lock);
+    while (!elevator->stop) {
+        if (elevator->count == 0) {
+            __fuse_cond_wait(&elevator->wake, &elevator->lock);
+            continue;
+        }
+        u64 now = __fuse_monotonic_ms();
+        u64 due = elevator->plug_start + elevator->plug_ms;
+        if (now < due) {
+            __fuse_cond_timedwait_ms(&elevator->wake, &elevator->lock, due - now);
+            continue;
+        }
+        dispatch(elevator);
+    }
+    __fuse_mutex_unlock(&elevator->lock);
+    return 0x0;
+}
+
+//Merges the write into a queued one it touches, returns 0 if there is none
+static uint8_t merge(struct elevator * elevator, const u8 * buffer, u64 sector, u64 count) {
+    u32 sector_size = elevator->mount->sector_size;
+    u32 first = (elevator->policy == ELEVATOR_NOOP) ? elevator->count - 1 : 0;
+
+    for (u32 i = first; i < elevator->count; i++) {
+        struct elevator_request * request = &elevator->requests[i];
+        if (!touches(sector, count, request->sector, request->count))
+            continue;
+
+        u64 start = (sector < request->sector) ? sector : request->sector;
+        u64 end = (sector + count > request->sector + request->count) ? sector + count : request->sector + request->count;
+        if (start < request->sector || end - start > request->capacity) {
+            //Doubling keeps a sequential writer from copying its run every time
+            u64 capacity = (start == request->sector) ? 2 * (end - start) : end - start;
+            u8 * data = __fuse_malloc(capacity * sector_size);
+            if (data == 0x0) {
+                return 0;
+            }
+            __fuse_memcpy(data + (request->sector - start) * sector_size, request->data, request->count * sector_size);
+            __fuse_free(request->data);
+            request->data = data;
+            request->capacity = capacity;
+        }
+        __fuse_memcpy(request->data + (sector - start) * sector_size, buffer, count * sector_size);
+        elevator->bytes += (end - start - request->count) * sector_size;
+        request->sector = start;
+        request->count = end - start;
+        return 1;
+    }
+    return 0;
+}
+
+//Called with the lock held
+static int queue_write(struct elevator * elevator, const u8 * buffer, u64 sector, u64 count) {
+    struct mount * mount = elevator->mount;
+    u32 sector_size = mount->sector_size;
+    uint8_t covered = 0;
+
+    elevator->writes++;
+    for (u32 i = 0; i < elevator->count; i++) {
+        struct elevator_request * request = &elevator->requests[i];
+        u64 low = (sector > request->sector) ? sector : request->sector;
+        u64 high = (sector + count < request->sector + request->count) ? sector + count : request->sector + request->count;
+        if (low >= high)
+            continue;
+        __fuse_memcpy(request->data + (low - request->sector) * sector_size, buffer + (low - sector) * sector_size, (high - low) * sector_size);
+        if (low == sector && high == sector + count)
+            covered = 1;
+    }
+    if (covered) {
+        elevator->merged++;
+        return OP_SUCCESS;
+    }
+
+    u64 limit = (u64)__ELEVATOR_PLUG_KB << 10;
+    if (count * sector_size > limit) {
+        //The queued copies already hold this write, order does not matter
+        struct disk_iovec iov = {(void*)buffer, (u32)count};
+        elevator->dispatched++;
+        elevator->sectors += count;
+        return backend_dispatch(mount, &iov, 1, sector);
+    }
+
+    int result = OP_SUCCESS;
+    if (elevator->count > 0 && merge(elevator, buffer, sector, count)) {
+        elevator->merged++;
+        if (elevator->bytes > limit)
+            result = dispatch(elevator);
+        return result;
+    }
+
+    if (elevator->count == ELEVATOR_MAX_REQUESTS || elevator->bytes + count * sector_size > limit) {
+        result = dispatch(elevator);
+    }
+    u8 * data = __fuse_malloc(count * sector_size);
+    if (data == 0x0) {
+        //Nothing queued overlaps it anymore, write it now
+        struct disk_iovec iov = {(void*)buffer, (u32)count};
+        dispatch(elevator);
+        return backend_dispatch(mount, &iov, 1, sector) ? OP_FAILURE : result;
+    }
+    __fuse_memcpy(data, buffer, count * sector_size);
+    struct elevator_request * request = &elevator->requests[elevator->count++];
+    request->sector = sector;
+    request->count = count;
+    request->capacity = count;
+    request->data = data;
+    elevator->bytes += count * sector_size;
+    if (elevator->count == 1) {
+        elevator->plug_start = __fuse_monotonic_ms();
+        __fuse_cond_signal(&elevator->wake);
+    }
+    return result;
+}
+
+int elevator_start(struct mount * mount, u32 policy, u32 plug_ms) {
+    if (policy != ELEVATOR_NONE && policy != ELEVATOR_NOOP && policy != ELEVATOR_DEADLINE) {
+        mount->last_error = __fuse_EINVAL;
+        return OP_FAILURE;
+    }
+    if (elevator_stop(mount)) {
+        return OP_FAILURE;
+    }
+    if (policy == ELEVATOR_NONE) {
+        return OP_SUCCESS;
+    }
+
+    struct elevator * elevator = __fuse_malloc(sizeof(struct elevator));
+    if (elevator == 0x0) {
+        return OP_FAILURE;
+    }
+    __fuse_memset(elevator, 0, sizeof(struct elevator));
+    elevator->mount = mount;
+    elevator->policy = policy;
+    elevator->plug_ms = plug_ms;
+    __fuse_mutex_init(&elevator->lock);
+    __fuse_cond_init(&elevator->wake);
+
+    if (__fuse_thread_create(&elevator->thread, dispatcher, elevator) != 0) {
+        __fuse_cond_destroy(&elevator->wake);
+        __fuse_mutex_destroy(&elevator->lock);
+        __fuse_free(elevator);
+        return OP_FAILURE;
+    }
+    mount->elevator = elevator;
+    return OP_SUCCESS;
+}
+
+int elevator_stop(struct mount * mount) {
+    struct elevator * elevator = mount->elevator;
+    if (elevator == 0x0) {
+        return OP_SUCCESS;
+    }
+
+    __fuse_mutex_lock(&elevator->lock);
+    elevator->stop = 1;
+    __fuse_cond_signal(&elevator->wake);
+    __fuse_mutex_unlock(&elevator->lock);
+    __fuse_thread_join(elevator->thread);
+
+    mount->elevator = 0x0;
+    int result = dispatch(elevator);
+    if (elevator->error != 0) {
+        mount->last_error = elevator->error;
+        result = OP_FAILURE;
+    }
+    __fuse_cond_destroy(&elevator->wake);
+    __fuse_mutex_destroy(&elevator->lock);
+    __fuse_free(elevator);
+    return result;
+}
+
+int elevator_write(struct mount * mount, const u8 * buffer, u64 sector, u64 count) {
+    struct elevator * elevator = mount->elevator;
+    __fuse_mutex_lock(&elevator->lock);
+    int result = queue_write(elevator, buffer, sector, count);
+    __fuse_mutex_unlock(&elevator->lock);
+    return result;
+}
+
+int elevator_writev(struct mount * mount, const struct disk_iovec * iov, int iovcnt, u64 sector) {
+    struct elevator * elevator = mount->elevator;
+    int result = OP_SUCCESS;
+    __fuse_mutex_lock(&elevator->lock);
+    for (int i = 0; i < iovcnt; i++) {
+        if (queue_write(elevator, iov[i].buffer, sector, iov[i].count))
+            result = OP_FAILURE;
+        sector += iov[i].count;
+    }
+    __fuse_mutex_unlock(&elevator->lock);
+    return result;
+}
+
+void elevator_unplug(struct mount * mount, u64 sector, u64 count) {
+    struct elevator * elevator = mount->elevator;
+    if (elevator == 0x0) {
+        return;
+    }
+    __fuse_mutex_lock(&elevator->lock);
+    for (u32 i = 0; i < elevator->count; i++) {
+        struct elevator_request * request = &elevator->requests[i];
+        if (sector < request->sector + request->count && request->sector < sector + count) {
+            dispatch(elevator);
+            break;
+        }
+    }
+    __fuse_mutex_unlock(&elevator->lock);
+}
+
+int elevator_flush(struct mount * mount) {
+    struct elevator * elevator = mount->elevator;
+    if (elevator == 0x0) {
+        return OP_SUCCESS;
+    }
+    __fuse_mutex_lock(&elevator->lock);
+    int result = dispatch(elevator);
+    if (elevator->error != 0) {
+        mount->last_error = elevator->error;
+        elevator->error = 0;
+        result = OP_FAILURE;
+    }
+    __fuse_mutex_unlock(&elevator->lock);
+    return result;
+}
+
+void elevator_get_stats(struct mount * mount, struct disk_elevator_stats * stats) {
+    struct elevator * elevator = mount->elevator;
+    __fuse_memset(stats, 0, sizeof(struct disk_elevator_stats));
+    if (elevator == 0x0) {
+        return;
+    }
+    __fuse_mutex_lock(&elevator->lock);
+    stats->policy = elevator->policy;
+    stats->writes = elevator->writes;
+    stats->merged = elevator->merged;
+    stats->dispatched = elevator->dispatched;
+    stats->sectors = elevator->sectors;
+    stats->plugs = elevator->plugs;
+    stats->queued = elevator->count;
+    __fuse_mutex_unlock(&elevator->lock);
+}
+
+void elevator_reset_stats(struct mount * mount) {
+    struct elevator * elevator = mount->elevator;
+    if (elevator == 0x0) {
+        return;
+    }
+    __fuse_mutex_lock(&elevator->lock);
+    elevator->writes = 0;
+    elevator->merged = 0;
+    elevator->dispatched = 0;
+    elevator->sectors = 0;
+    elevator->plugs = 0;
+    __fuse_mutex_unlock(&elevator->lock);
+}
@@ -0,0 +1,66 @@
+#ifndef _ELEVATOR_H
+#define _ELEVATOR_H
+#include "bfuse.h"
+#include "primitives.h"
+#include "dependencies.h"
+
+//Write scheduler between the cache and the image
+//Writes are held in a plug for up to plug_ms after the first one was
+//queued. A write landing on queued sectors also updates those, so every
+//queued copy of a sector holds its last write and the plug can go out in
+//any order, and a write touching a queued one is merged into it
+//Dispatching writes each run of adjacent sectors with one vectored write
+//ELEVATOR_NOOP keeps the arrival order and only merges with the last
+//write, ELEVATOR_DEADLINE merges with any queued write and dispatches in
+//sector order, the plug window is the deadline of every write
+//Reads and syncs of queued sectors dispatch the plug first
+
+//Writes held at once, a full plug is dispatched by the writer
+#define ELEVATOR_MAX_REQUESTS   128
+
+struct elevator_request {
+    u64  sector;
+    u64  count;
+    u64  capacity;      //Sectors data has room for, grows on back merges
+    u8   *data;
+};
+
+struct elevator {
+    struct mount * mount;
+    u32  policy;
+    u32  plug_ms;
+    __fuse_mutex_t lock;
+    __fuse_cond_t wake;
+    __fuse_thread_t thread;
+    u8   stop;
+
+    struct elevator_request requests[ELEVATOR_MAX_REQUESTS];
+    struct disk_iovec iov[ELEVATOR_MAX_REQUESTS];
+    u32  count;
+    u64  bytes;
+    u64  plug_start;    //When the first write of the plug was queued
+    int  error;         //errno of a failed dispatch, returned by the next sync
+
+    u64  writes;
+    u64  merged;
+    u64  dispatched;
+    u64  sectors;
+    u64  plugs;
+};
+
+//Starts scheduling the writes of a drive, replacing the current policy
+int elevator_start(struct mount * mount, u32 policy, u32 plug_ms);
+//Dispatches the plug and stops scheduling
+int elevator_stop(struct mount * mount);
+
+//Queues a write, returns OP_FAILURE only if a dispatch it forced failed
+int elevator_write(struct mount * mount, const u8 * buffer, u64 sector, u64 count);
+int elevator_writev(struct mount * mount, const struct disk_iovec * iov, int iovcnt, u64 sector);
+//Dispatches the plug if it holds any of the sectors
+void elevator_unplug(struct mount * mount, u64 sector, u64 count);
+//Dispatches the plug, fails if this or an earlier dispatch failed
+int elevator_flush(struct mount * mount);
+
+void elevator_get_stats(struct mount * mount, struct disk_elevator_stats * stats);
+void elevator_reset_stats(struct mount * mount);
+#endif
@@ -0,0 +1,303 @@
+#include "ftl.h"
+#include "discard.h"
+
+static u32 pick(u32 value, u32 fallback) {
+    return (value != 0) ? value : fallback;
+}
+
+//Least erased free block, free blocks never run out as long as garbage
+//collection keeps FTL_GC_RESERVE of them
+static u64 take_free(struct ftl * ftl) {
+    u64 best = ftl->blocks;
+    for (u64 b = 0; b < ftl->blocks; b++) {
+        if (ftl->block[b].state == FTL_BLOCK_FREE && (best == ftl->blocks || ftl->block[b].erases < ftl->block[best].erases)) {
+            best = b;
+        }
+    }
+    ftl->block[best].state = FTL_BLOCK_OPEN;
+    ftl->block[best].written = 0;
+    ftl->free_blocks--;
+    return best;
+}
+
+static void unmap(struct ftl * ftl, u64 page) {
+    u32 physical = ftl->l2p[page];
+    if (physical == FTL_UNMAPPED) {
+        return;
+    }
+    ftl->p2l[physical] = FTL_UNMAPPED;
+    ftl->block[physical / ftl->params.pages_per_block].valid--;
+    ftl->l2p[page] = FTL_UNMAPPED;
+}
+
+//Programs the logical page at the end of the open block of the stream
+static void program(struct ftl * ftl, u32 stream, u64 page) {
+    u64 b = ftl->stream[stream];
+    if (b == ftl->blocks || ftl->block[b].written == ftl->params.pages_per_block) {
+        if (b != ftl->blocks) {
+            ftl->block[b].state = FTL_BLOCK_FULL;
+        }
+        b = take_free(ftl);
+        ftl->stream[stream] = b;
+    }
+    unmap(ftl, page);
+    struct ftl_block * block = &ftl->block[b];
+    u32 physical = (u32)(b * ftl->params.pages_per_block + block->written++);
+    ftl->l2p[page] = physical;
+    ftl->p2l[physical] = (u32)page;
+    block->valid++;
+    block->modified = ftl->host_writes;
+    ftl->counters.nand_pages++;
+}
+
+//Full block with the fewest valid pages, or the best ratio of space freed
+//to the cost of moving the rest weighted by the age of the block, blocks
+//if every full block is entirely valid
+static u64 pick_victim(struct ftl * ftl) {
+    u32 pages = ftl->params.pages_per_block;
+    u64 best = ftl->blocks;
+    u64 best_gain = 0, best_cost = 1;
+    for (u64 b = 0; b < ftl->blocks; b++) {
+        struct ftl_block * block = &ftl->block[b];
+        if (block->state != FTL_BLOCK_FULL || block->valid == pages) {
+            continue;
+        }
+        u64 gain = pages - block->valid;
+        u64 cost = block->valid;
+        if (ftl->params.policy == FTL_GC_COST_BENEFIT) {
+            gain *= ftl->host_writes - block->modified + 1;
+            cost *= 2;
+        }
+        //gain / cost > best_gain / best_cost, an empty block wins outright
+        if (best == ftl->blocks || cost == 0 || gain * best_cost > best_gain * cost) {
+            best = b;
+            best_gain = gain;
+            best_cost = cost;
+            if (cost == 0)
+                break;
+        }
+    }
+    return best;
+}
+
+//Moves the valid pages of the block to the GC stream and erases it,
+//returns how long that took
+static u64 collect(struct ftl * ftl, u64 victim) {
+    struct disk_ftl * params = &ftl->params;
+    struct ftl_block * block = &ftl->block[victim];
+    u64 stall = 0;
+    for (u32 i = 0; i < block->written && block->valid > 0; i++) {
+        u32 page = ftl->p2l[victim * params->pages_per_block + i];
+        if (page != FTL_UNMAPPED) {
+            program(ftl, FTL_STREAM_GC, page);
+            ftl->counters.gc_pages++;
+            stall += (u64)(params->read_us + params->program_us) * 1000;
+        }
+    }
+    block->written = 0;
+    block->erases++;
+    block->state = FTL_BLOCK_FREE;
+    ftl->free_blocks++;
+    ftl->counters.gc_blocks++;
+    return stall + (u64)params->erase_us * 1000;
+}
+
+//Full block holding the coldest data if the wear spread is over wear_gap
+static u64 wear_victim(struct ftl * ftl) {
+    u64 coldest = ftl->blocks;
+    u32 most = 0;
+    for (u64 b = 0; b < ftl->blocks; b++) {
+        struct ftl_block * block = &ftl->block[b];
+        if (block->erases > most) {
+            most = block->erases;
+        }
+        if (block->state == FTL_BLOCK_FULL && (coldest == ftl->blocks || block->erases < ftl->block[coldest].erases)) {
+            coldest = b;
+        }
+    }
+    if (coldest == ftl->blocks || most - ftl->block[coldest].erases <= ftl->params.wear_gap) {
+        return ftl->blocks;
+    }
+    return coldest;
+}
+
+//Collects blocks until FTL_GC_RESERVE are free, then levels wear once
+static u64 reclaim(struct ftl * ftl) {
+    u64 stall = 0;
+    while (ftl->free_blocks < FTL_GC_RESERVE) {
+        u64 victim = pick_victim(ftl);
+        if (victim == ftl->blocks) {
+            break;
+        }
+        stall += collect(ftl, victim);
+    }
+    u64 worn = wear_victim(ftl);
+    if (worn != ftl->blocks) {
+        stall += collect(ftl, worn);
+        ftl->counters.wear_moves++;
+    }
+    return stall;
+}
+
+int ftl_start(struct mount * mount, const struct disk_ftl * params) {
+    u32 page_size = pick(params->page_size, 4096);
+    if (params->policy > FTL_GC_COST_BENEFIT || page_size < mount->sector_size || page_size % mount->sector_size != 0 || params->pages_per_block == 1) {
+        mount->last_error = __fuse_EINVAL;
+        return OP_FAILURE;
+    }
+    ftl_stop(mount);
+    if (params->policy == FTL_NONE) {
+        return OP_SUCCESS;
+    }
+
+    struct ftl * ftl = __fuse_malloc(sizeof(struct ftl));
+    if (ftl == 0x0) {
+        mount->last_error = __fuse_ENOMEM;
+        return OP_FAILURE;
+    }
+    __fuse_memset(ftl, 0, sizeof(struct ftl));
+    ftl->params.policy = params->policy;
+    ftl->params.page_size = page_size;
+    ftl->params.pages_per_block = pick(params->pages_per_block, 256);
+    ftl->params.over_provisioning = pick(params->over_provisioning, 7);
+    ftl->params.wear_gap = pick(params->wear_gap, 64);
+    ftl->params.read_us = pick(params->read_us, 50);
+    ftl->params.program_us = pick(params->program_us, 200);
+    ftl->params.erase_us = pick(params->erase_us, 2000);
+    ftl->sector_size = mount->sector_size;
+    ftl->sectors_per_page = page_size / mount->sector_size;
+    ftl->pages = (mount->sector_count + ftl->sectors_per_page - 1) / ftl->sectors_per_page;
+
+    //The free blocks garbage collection keeps and the open blocks come on
+    //top of the over-provisioning, at least one more guarantees a victim
+    u32 pages_per_block = ftl->params.pages_per_block;
+    u64 logical_blocks = (ftl->pages + pages_per_block - 1) / pages_per_block;
+    u64 spare = (logical_blocks * ftl->params.over_provisioning + 99) / 100;
+    ftl->blocks = logical_blocks + ((spare > 0) ? spare : 1) + FTL_GC_RESERVE + 2;
+    if (ftl->blocks * pages_per_block >= FTL_UNMAPPED) {
+        __fuse_free(ftl);
+        mount->last_error = __fuse_EINVAL;
+        return OP_FAILURE;
+    }
+    ftl->l2p = __fuse_malloc(ftl->pages * sizeof(u32));
+    ftl->p2l = __fuse_malloc(ftl->blocks * pages_per_block * sizeof(u32));
+    ftl->block = __fuse_malloc(ftl->blocks * sizeof(struct ftl_block));
+    if (ftl->l2p == 0x0 || ftl->p2l == 0x0 || ftl->block == 0x0) {
+        __fuse_free(ftl->l2p);
+        __fuse_free(ftl->p2l);
+        __fuse_free(ftl->block);
+        __fuse_free(ftl);
+        mount->last_error = __fuse_ENOMEM;
+        return OP_FAILURE;
+    }
+    __fuse_memset(ftl->l2p, 0xFF, ftl->pages * sizeof(u32));
+    __fuse_memset(ftl->p2l, 0xFF, ftl->blocks * pages_per_block * sizeof(u32));
+    __fuse_memset(ftl->block, 0, ftl->blocks * sizeof(struct ftl_block));
+    ftl->free_blocks = ftl->blocks;
+    ftl->stream[FTL_STREAM_HOST] = ftl->blocks;
+    ftl->stream[FTL_STREAM_GC] = ftl->blocks;
+
+    //The data already on the drive, written in order
+    for (u64 page = 0; page < ftl->pages; page++) {
+        u64 sector = page * ftl->sectors_per_page;
+        u64 count = ftl->sectors_per_page;
+        if (sector + count > mount->sector_count) {
+            count = mount->sector_count - sector;
+        }
+        uint8_t discarded;
+        if (discard_run(mount, sector, count, &discarded) < count || !discarded) {
+            program(ftl, FTL_STREAM_HOST, page);
+        }
+    }
+    ftl->counters.nand_pages = 0;
+    __fuse_mutex_init(&ftl->lock);
+    mount->ftl = ftl;
+    return OP_SUCCESS;
+}
+
+void ftl_stop(struct mount * mount) {
+    struct ftl * ftl = mount->ftl;
+    if (ftl == 0x0) {
+        return;
+    }
+    mount->ftl = 0x0;
+    __fuse_mutex_destroy(&ftl->lock);
+    __fuse_free(ftl->l2p);
+    __fuse_free(ftl->p2l);
+    __fuse_free(ftl->block);
+    __fuse_free(ftl);
+}
+
+u64 ftl_write(struct ftl * ftl, u64 sector, u64 count) {
+    u64 first = sector / ftl->sectors_per_page;
+    u64 last = (sector + count - 1) / ftl->sectors_per_page;
+    u64 stall = 0;
+    __fuse_mutex_lock(&ftl->lock);
+    for (u64 page = first; page <= last; page++) {
+        ftl->host_writes++;
+        //Collect before the host stream can need a block
+        u64 open = ftl->stream[FTL_STREAM_HOST];
+        if (open == ftl->blocks || ftl->block[open].written == ftl->params.pages_per_block) {
+            unmap(ftl, page);
+            stall += reclaim(ftl);
+        }
+        program(ftl, FTL_STREAM_HOST, page);
+    }
+    ftl->counters.host_pages += last - first + 1;
+    ftl->counters.host_bytes += count * ftl->sector_size;
+    ftl->counters.gc_stall_ns += stall;
+    __fuse_mutex_unlock(&ftl->lock);
+    return stall;
+}
+
+void ftl_trim(struct ftl * ftl, u64 sector, u64 count) {
+    u64 first = (sector + ftl->sectors_per_page - 1) / ftl->sectors_per_page;
+    u64 end = (sector + count) / ftl->sectors_per_page;
+    __fuse_mutex_lock(&ftl->lock);
+    for (u64 page = first; page < end; page++) {
+        if (ftl->l2p[page] != FTL_UNMAPPED) {
+            unmap(ftl, page);
+            ftl->counters.trimmed_pages++;
+        }
+    }
+    __fuse_mutex_unlock(&ftl->lock);
+}
+
+int ftl_get_stats(struct mount * mount, struct disk_ftl_stats * stats) {
+    struct ftl * ftl = mount->ftl;
+    u32 * erase_counts = stats->erase_counts;
+    __fuse_memset(stats, 0, sizeof(struct disk_ftl_stats));
+    stats->erase_counts = erase_counts;
+    if (ftl == 0x0) {
+        return OP_SUCCESS;
+    }
+    __fuse_mutex_lock(&ftl->lock);
+    *stats = ftl->counters;
+    stats->erase_counts = erase_counts;
+    stats->blocks = ftl->blocks;
+    stats->free_blocks = ftl->free_blocks;
+    stats->min_erases = ftl->block[0].erases;
+    for (u64 b = 0; b < ftl->blocks; b++) {
+        struct ftl_block * block = &ftl->block[b];
+        stats->valid_pages += block->valid;
+        stats->erases += block->erases;
+        if (block->erases < stats->min_erases)
+            stats->min_erases = block->erases;
+        if (block->erases > stats->max_erases)
+            stats->max_erases = block->erases;
+        if (erase_counts != 0x0)
+            erase_counts[b] = block->erases;
+    }
+    __fuse_mutex_unlock(&ftl->lock);
+    return OP_SUCCESS;
+}
+
+void ftl_reset_stats(struct mount * mount) {
+    struct ftl * ftl = mount->ftl;
+    if (ftl == 0x0) {
+        return;
+    }
+    __fuse_mutex_lock(&ftl->lock);
+    __fuse_memset(&ftl->counters, 0, sizeof(struct disk_ftl_stats));
+    __fuse_mutex_unlock(&ftl->lock);
+}
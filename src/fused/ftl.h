@@ -0,0 +1,75 @@
+#ifndef _FTL_H
+#define _FTL_H
+#include "bfuse.h"
+#include "primitives.h"
+#include "dependencies.h"
+
+//Flash translation layer of an emulated SSD, charged where writes and
+//trims reach the drive like the timing model
+//The data stays where the backend keeps it, the FTL only follows where
+//flash would have put it: logical pages are mapped to physical pages of
+//erase blocks that are only written in order, a write programs a new page
+//and leaves the old one stale, a trim only leaves it stale
+//Host writes and pages moved by garbage collection fill separate blocks
+//so cold data collected once stays together. When the free blocks run
+//down to FTL_GC_RESERVE the write that needs one waits while a victim is
+//collected: its valid pages are read and programmed elsewhere and the
+//block erased, that time is the GC stall and is added to the write by
+//the timing model
+//Free blocks are taken least erased first, and once the most erased block
+//is more than wear_gap erases ahead of the least erased one holding data
+//that block is collected too so its cold data moves to worn flash
+//The FTL starts with the live sectors of the drive written in order, a
+//page whose sectors are all discarded starts unmapped
+
+//Free blocks garbage collection keeps, one for each write stream and a spare
+#define FTL_GC_RESERVE          3
+#define FTL_UNMAPPED            0xFFFFFFFFu
+
+#define FTL_BLOCK_FREE          0
+#define FTL_BLOCK_OPEN          1   //Being filled by a write stream
+#define FTL_BLOCK_FULL          2
+
+#define FTL_STREAM_HOST         0
+#define FTL_STREAM_GC           1
+
+struct ftl_block {
+    u32  valid;             //Pages still mapped
+    u32  written;           //Pages programmed since the last erase
+    u32  erases;
+    u8   state;
+    u64  modified;          //Host page writes when a page was last programmed here
+};
+
+struct ftl {
+    struct disk_ftl params; //Defaults filled in
+    u32  sector_size;
+    u32  sectors_per_page;
+    u64  pages;             //Logical pages
+    u64  blocks;
+    __fuse_mutex_t lock;
+
+    u32  *l2p;              //Physical page of every logical page
+    u32  *p2l;              //Logical page of every physical page, FTL_UNMAPPED if stale
+    struct ftl_block * block;
+    u64  stream[2];         //Open block of each write stream, blocks if none
+    u64  free_blocks;
+
+    u64  host_writes;       //Sequence number of host page writes, ages blocks
+    struct disk_ftl_stats counters;
+};
+
+//Starts emulating the FTL, replacing the current one
+//Only while no request is in flight on the drive
+int ftl_start(struct mount * mount, const struct disk_ftl * params);
+void ftl_stop(struct mount * mount);
+
+//Maps the pages of a write, returns the GC stall in nanoseconds
+u64 ftl_write(struct ftl * ftl, u64 sector, u64 count);
+//Unmaps the pages inside the range
+void ftl_trim(struct ftl * ftl, u64 sector, u64 count);
+
+int ftl_get_stats(struct mount * mount, struct disk_ftl_stats * stats);
+//Clears the write and GC counters, erase counts are wear and stay
+void ftl_reset_stats(struct mount * mount);
+#endif
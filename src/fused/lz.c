@@ -0,0 +1,211 @@
+#include "lz.h"
+#include "primitives.h"
+#include "dependencies.h"
+
+//The last match ends this far from the end of the input, the tail is
+//always literals
+#define LZ_TAIL         5
+//Inputs shorter than this are stored as literals only
+#define LZ_MIN_INPUT    (LZ_MIN_MATCH + LZ_TAIL + 4)
+//Misses in a row before the search starts skipping ahead
+#define LZ_SKIP_SHIFT   6
+//Shorter copies are done in a loop, most sequences are a few bytes and
+//calling out for them costs more than the copy
+#define LZ_SHORT_COPY   32
+//Copies move words of this many bytes, the first two unconditionally
+#define LZ_WORD         8
+//Bytes a copy may write past its end
+#define LZ_WILD         (2 * LZ_WORD)
+
+//Byte by byte so it works unaligned, compilers turn it into a single load
+static u32 read32(const u8 * p) {
+    return (u32)p[0] | ((u32)p[1] << 8) | ((u32)p[2] << 16) | ((u32)p[3] << 24);
+}
+
+//Spelled out so it becomes a single store as well
+static void write64(u8 * p, u64 value) {
+    p[0] = (u8)value;
+    p[1] = (u8)(value >> 8);
+    p[2] = (u8)(value >> 16);
+    p[3] = (u8)(value >> 24);
+    p[4] = (u8)(value >> 32);
+    p[5] = (u8)(value >> 40);
+    p[6] = (u8)(value >> 48);
+    p[7] = (u8)(value >> 56);
+}
+
+static u32 hash(u32 sequence) {
+    return (sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+static void copy_literals(u8 * target, const u8 * source, u64 length) {
+    if (length >= LZ_SHORT_COPY) {
+        __fuse_memcpy(target, source, length);
+        return;
+    }
+    for (u64 i = 0; i < length; i++) {
+        target[i] = source[i];
+    }
+}
+
+//A match may overlap its target, it repeats its first offset bytes so every
+//copy doubles what can be copied from it at once. The loop reads the bytes
+//it has just written
+static void copy_match(u8 * target, u64 offset, u64 length) {
+    const u8 * match = target - offset;
+    if (length < LZ_SHORT_COPY) {
+        for (u64 i = 0; i < length; i++) {
+            target[i] = match[i];
+        }
+        return;
+    }
+    for (u64 step = offset; length > 0; step *= 2) {
+        u64 size = (step < length) ? step : length;
+        __fuse_memcpy(target, match, size);
+        target += size;
+        length -= size;
+    }
+}
+
+//Copies length rounded up to a word, a word at a time with the first two
+//always copied, so the few bytes of most sequences take no branch that
+//depends on their length. The source may overlap the target from a word
+//before it
+static void wild_copy(u8 * target, const u8 * source, u64 length) {
+    u8 * end = target + length;
+    write64(target, __fuse_load_le64(source));
+    write64(target + LZ_WORD, __fuse_load_le64(source + LZ_WORD));
+    target += LZ_WILD;
+    source += LZ_WILD;
+    while (target < end) {
+        write64(target, __fuse_load_le64(source));
+        target += LZ_WORD;
+        source += LZ_WORD;
+    }
+}
+
+//Writes the rest of a length that did not fit its nibble
+static u8 * put_length(u8 * out, u64 length) {
+    while (length >= 255) {
+        *out++ = 255;
+        length -= 255;
+    }
+    *out++ = (u8)length;
+    return out;
+}
+
+//Worst case size of a sequence, the token, the length bytes, the offset
+static u64 sequence_bound(u64 literals) {
+    return 1 + literals + literals / 255 + 1 + 2 + LZ_MAX_INPUT / 255 + 1;
+}
+
+static u8 * put_sequence(u8 * out, const u8 * literals, u64 literal_length, u64 offset, u64 match_length) {
+    u8 * token = out++;
+    u64 extra = (match_length != 0) ? match_length - LZ_MIN_MATCH : 0;
+    *token = (u8)(((literal_length < 15) ? literal_length : 15) << 4);
+    if (literal_length >= 15)
+        out = put_length(out, literal_length - 15);
+    copy_literals(out, literals, literal_length);
+    out += literal_length;
+    if (match_length == 0) {
+        return out;
+    }
+    *token |= (u8)((extra < 15) ? extra : 15);
+    *out++ = (u8)offset;
+    *out++ = (u8)(offset >> 8);
+    if (extra >= 15)
+        out = put_length(out, extra - 15);
+    return out;
+}
+
+u64 lz_compress(const u8 * input, u64 size, u8 * output, u64 capacity) {
+    u16 table[1 << LZ_HASH_BITS] = {0};
+    u8 * out = output;
+    u64 anchor = 0;
+    u64 position = 0;
+    u64 misses = 0;
+    if (size > LZ_MAX_INPUT) {
+        return 0;
+    }
+
+    if (size >= LZ_MIN_INPUT) {
+        u64 limit = size - LZ_MIN_MATCH - LZ_TAIL;
+        while (position < limit) {
+            u32 sequence = read32(input + position);
+            u32 slot = hash(sequence);
+            u64 candidate = table[slot];
+            table[slot] = (u16)position;
+            if (candidate >= position || read32(input + candidate) != sequence) {
+                position += 1 + (misses++ >> LZ_SKIP_SHIFT);
+                continue;
+            }
+            u64 length = LZ_MIN_MATCH;
+            while (position + length < size - LZ_TAIL && input[candidate + length] == input[position + length]) {
+                length++;
+            }
+            if ((u64)(out - output) + sequence_bound(position - anchor) > capacity) {
+                return 0;
+            }
+            out = put_sequence(out, input + anchor, position - anchor, position - candidate, length);
+            position += length;
+            anchor = position;
+            misses = 0;
+        }
+    }
+    if ((u64)(out - output) + sequence_bound(size - anchor) > capacity) {
+        return 0;
+    }
+    out = put_sequence(out, input + anchor, size - anchor, 0, 0);
+    return (u64)(out - output);
+}
+
+//Adds the bytes after a nibble of 15, fails past the end of the input
+static int get_length(const u8 ** in, const u8 * end, u64 * length) {
+    u8 byte;
+    do {
+        if (*in >= end)
+            return OP_FAILURE;
+        byte = *(*in)++;
+        *length += byte;
+    } while (byte == 255);
+    return OP_SUCCESS;
+}
+
+int lz_decompress(const u8 * input, u64 size, u8 * output, u64 expected) {
+    const u8 * in = input;
+    const u8 * end = input + size;
+    u64 produced = 0;
+    while (in < end) {
+        u8 token = *in++;
+        u64 literals = token >> 4;
+        if (literals == 15 && get_length(&in, end, &literals))
+            return OP_FAILURE;
+        if (literals > (u64)(end - in) || literals > expected - produced)
+            return OP_FAILURE;
+        if (produced + literals + LZ_WILD <= expected && literals + LZ_WILD <= (u64)(end - in))
+            wild_copy(output + produced, in, literals);
+        else
+            copy_literals(output + produced, in, literals);
+        in += literals;
+        produced += literals;
+        if (in == end)
+            break;
+
+        if (end - in < 2)
+            return OP_FAILURE;
+        u64 offset = (u64)in[0] | ((u64)in[1] << 8);
+        in += 2;
+        u64 length = token & 15;
+        if (length == 15 && get_length(&in, end, &length))
+            return OP_FAILURE;
+        length += LZ_MIN_MATCH;
+        if (offset == 0 || offset > produced || length > expected - produced)
+            return OP_FAILURE;
+        if (offset >= LZ_WORD && length < LZ_SHORT_COPY && produced + length + LZ_WILD <= expected)
+            wild_copy(output + produced, output + produced - offset, length);
+        else
+            copy_match(output + produced, offset, length);
+        produced += length;
+    }
+    return (produced == expected) ? OP_SUCCESS : OP_FAILURE;
+}
@@ -0,0 +1,25 @@
+#ifndef _LZ_H
+#define _LZ_H
+#include "config.h"
+
+//Byte oriented LZ77 in the block format of LZ4, fast to decode and good
+//at the long runs of zeros and repeated patterns of file system images
+//A block is a list of sequences: a token with the literal length in its
+//high nibble and the match length minus LZ_MIN_MATCH in the low one, 15
+//meaning more bytes follow that add up to the rest (255 each until a
+//smaller one), the literals, a 16 bit little endian offset back into the
+//output and the rest of the match length. The last sequence has only
+//literals
+//Inputs are at most LZ_MAX_INPUT bytes so every offset fits in 16 bits
+
+#define LZ_MIN_MATCH    4
+#define LZ_MAX_INPUT    65536
+#define LZ_HASH_BITS    12
+
+//Compresses size bytes of input into output, returns the compressed size
+//or 0 if it would take more than capacity bytes
+u64 lz_compress(const u8 * input, u64 size, u8 * output, u64 capacity);
+//Decompresses size bytes of input into output, returns OP_FAILURE unless
+//the block is well formed and decodes to exactly expected bytes
+int lz_decompress(const u8 * input, u64 size, u8 * output, u64 expected);
+#endif
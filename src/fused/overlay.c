@@ -0,0 +1,376 @@
+#include "overlay.h"
+#include "primitives.h"
+#include "backend.h"
+
+//Entries with a cluster of their own in the delta
+static uint8_t in_delta(u64 entry) {
+    return entry != 0 && !(entry & OVERLAY_ZERO);
+}
+
+//Bytes of the cluster inside the drive, the last one may be short
+static u64 cluster_bytes(struct overlay * overlay, u64 cluster) {
+    u64 start = cluster * overlay->header.cluster_size;
+    u64 left = overlay->header.size - start;
+    return (left < overlay->header.cluster_size) ? left : overlay->header.cluster_size;
+}
+
+static int store_entry(struct mount * mount, struct overlay * overlay, u64 cluster, u64 entry) {
+    u64 offset = overlay->header.table_offset + cluster * sizeof(u64);
+    if (file_transfer(mount, overlay->delta, (u8*)&entry, sizeof(u64), offset, 1)) {
+        return OP_FAILURE;
+    }
+    overlay->table[cluster] = entry;
+    return OP_SUCCESS;
+}
+
+static int create_delta(struct mount * mount, struct overlay * overlay) {
+    struct overlay_header * header = &overlay->header;
+    u64 cluster_size = round_up((u64)__OVERLAY_CLUSTER_KB << 10, mount->sector_size);
+    header->magic = OVERLAY_MAGIC;
+    header->version = OVERLAY_VERSION;
+    header->cluster_size = (u32)cluster_size;
+    header->size = mount->file_size;
+    header->clusters = (mount->file_size + cluster_size - 1) / cluster_size;
+    header->table_offset = round_up(sizeof(struct overlay_header), __fuse_page_size());
+    header->data_offset = round_up(header->table_offset + header->clusters * sizeof(u64), cluster_size);
+    //The table starts as a hole, every cluster reads from the base
+    if (__fuse_ftruncate(overlay->delta, header->data_offset) == -1) {
+        mount->last_error = __fuse_errno();
+        return OP_FAILURE;
+    }
+    return file_transfer(mount, overlay->delta, (u8*)header, sizeof(struct overlay_header), 0, 1);
+}
+
+//The table lies between the header and the first cluster, which is where
+//an empty delta ends
+static uint8_t valid_header(const struct overlay_header * header, u32 sector_size, u64 file_size) {
+    return header->magic == OVERLAY_MAGIC && header->version == OVERLAY_VERSION &&
+        header->cluster_size != 0 && header->cluster_size % sector_size == 0 &&
+        header->clusters == (header->size + header->cluster_size - 1) / header->cluster_size &&
+        header->table_offset >= sizeof(struct overlay_header) &&
+        header->data_offset >= header->table_offset + header->clusters * sizeof(u64) &&
+        header->data_offset % header->cluster_size == 0 && header->data_offset <= file_size;
+}
+
+static int load_delta(struct mount * mount, struct overlay * overlay, u64 file_size) {
+    struct overlay_header * header = &overlay->header;
+    if (file_transfer(mount, overlay->delta, (u8*)header, sizeof(struct overlay_header), 0, 0)) {
+        return OP_FAILURE;
+    }
+    if (!valid_header(header, mount->sector_size, file_size)) {
+        __fuse_printf("Delta is corrupt or not a delta of %u byte sectors\n", mount->sector_size);
+        mount->last_error = __fuse_EINVAL;
+        return OP_FAILURE;
+    }
+    if (header->size != mount->file_size) {
+        __fuse_printf("Delta does not belong to a base of this size\n");
+        mount->last_error = __fuse_EINVAL;
+        return OP_FAILURE;
+    }
+    return OP_SUCCESS;
+}
+
+//Clusters of the delta are aligned and lie between the table and the end
+//of the file, zero entries may keep the cluster they had
+static uint8_t valid_entry(struct overlay * overlay, u64 entry) {
+    u64 offset = entry & ~OVERLAY_ZERO;
+    return offset == 0 || (offset % overlay->header.cluster_size == 0 && offset >= overlay->header.data_offset &&
+        offset + overlay->header.cluster_size <= overlay->next_offset);
+}
+
+int overlay_open(struct mount * mount, const char * delta) {
+    struct overlay * overlay = __fuse_malloc(sizeof(struct overlay));
+    if (overlay == 0x0) {
+        return OP_FAILURE;
+    }
+    __fuse_memset(overlay, 0, sizeof(struct overlay));
+    __fuse_mutex_init(&overlay->lock);
+    mount->overlay = overlay;
+    overlay->delta = __fuse_create(delta);
+    __fuse_struct_stat st;
+    if (overlay->delta == -1 || __fuse_fstat(overlay->delta, &st) == -1) {
+        mount->last_error = __fuse_errno();
+        return OP_FAILURE;
+    }
+    if ((st.st_size == 0) ? create_delta(mount, overlay) : load_delta(mount, overlay, (u64)st.st_size)) {
+        return OP_FAILURE;
+    }
+
+    struct overlay_header * header = &overlay->header;
+    u64 table_size = header->clusters * sizeof(u64);
+    overlay->table = __fuse_malloc(table_size);
+    overlay->scratch = __fuse_malloc(header->cluster_size);
+    overlay->zeros = __fuse_malloc(header->cluster_size);
+    if (overlay->table == 0x0 || overlay->scratch == 0x0 || overlay->zeros == 0x0) {
+        mount->last_error = __fuse_ENOMEM;
+        return OP_FAILURE;
+    }
+    __fuse_memset(overlay->zeros, 0, header->cluster_size);
+    if (file_transfer(mount, overlay->delta, (u8*)overlay->table, table_size, header->table_offset, 0)) {
+        return OP_FAILURE;
+    }
+    //Clusters are appended, a crash may leave one past the last entry
+    overlay->next_offset = round_up((u64)st.st_size, header->cluster_size);
+    if (overlay->next_offset < header->data_offset)
+        overlay->next_offset = header->data_offset;
+    for (u64 cluster = 0; cluster < header->clusters; cluster++) {
+        if (!valid_entry(overlay, overlay->table[cluster])) {
+            __fuse_printf("Delta table is corrupt\n");
+            mount->last_error = __fuse_EIO;
+            return OP_FAILURE;
+        }
+        if (in_delta(overlay->table[cluster]))
+            overlay->allocated++;
+    }
+    return OP_SUCCESS;
+}
+
+//The cluster distance clusters after the one of entry can be read along
+//with it: both in the base, both zeros or consecutive in the delta
+static uint8_t continues(u64 entry, u64 next, u64 distance, u64 cluster_size) {
+    if (entry == 0)
+        return next == 0;
+    if (entry & OVERLAY_ZERO)
+        return (next & OVERLAY_ZERO) != 0;
+    return next == entry + distance * cluster_size;
+}
+
+//A run of clusters that continue the first one at a time
+static int overlay_read(struct mount * mount, u8 * buffer, u64 sector, u64 count) {
+    struct overlay * overlay = mount->overlay;
+    u64 cluster_size = overlay->header.cluster_size;
+    u64 offset = sector * mount->sector_size;
+    u64 left = count * mount->sector_size;
+    while (left > 0) {
+        u64 first = offset / cluster_size;
+        u64 end = (offset + left - 1) / cluster_size;
+        u64 last = first;
+        __fuse_mutex_lock(&overlay->lock);
+        u64 entry = overlay->table[first];
+        while (last < end && continues(entry, overlay->table[last + 1], last + 1 - first, cluster_size)) {
+            last++;
+        }
+        __fuse_mutex_unlock(&overlay->lock);
+        u64 length = (last + 1) * cluster_size - offset;
+        if (length > left)
+            length = left;
+
+        int result = OP_SUCCESS;
+        if (entry == 0)
+            result = file_transfer(mount, mount->file_handle, buffer, length, offset, 0);
+        else if (entry & OVERLAY_ZERO)
+            __fuse_memset(buffer, 0, length);
+        else
+            result = file_transfer(mount, overlay->delta, buffer, length, entry + offset % cluster_size, 0);
+        if (result) {
+            return OP_FAILURE;
+        }
+        buffer += length;
+        offset += length;
+        left -= length;
+    }
+    return OP_SUCCESS;
+}
+
+//First write to a cluster, the lock is held: the rest of it comes from
+//the base or is zeros, the whole cluster is written before its entry so
+//the entry never points at a cluster that is not there
+static int copy_on_write(struct mount * mount, struct overlay * overlay, u64 cluster, const u8 * buffer, u64 within, u64 length) {
+    u64 cluster_size = overlay->header.cluster_size;
+    u64 entry = overlay->table[cluster];
+    u64 bytes = cluster_bytes(overlay, cluster);
+    const u8 * data = buffer;
+    if (length < bytes) {
+        if (entry == 0) {
+            if (file_transfer(mount, mount->file_handle, overlay->scratch, bytes, cluster * cluster_size, 0))
+                return OP_FAILURE;
+        } else {
+            __fuse_memset(overlay->scratch, 0, bytes);
+        }
+        __fuse_memcpy(overlay->scratch + within, buffer, length);
+        data = overlay->scratch;
+    }
+    //A trimmed cluster keeps the place it had in the delta
+    u64 target = (entry & ~OVERLAY_ZERO) ? entry & ~OVERLAY_ZERO : overlay->next_offset;
+    if (file_transfer(mount, overlay->delta, (u8*)data, bytes, target, 1) || store_entry(mount, overlay, cluster, target)) {
+        return OP_FAILURE;
+    }
+    if (target == overlay->next_offset)
+        overlay->next_offset += cluster_size;
+    overlay->allocated++;
+    return OP_SUCCESS;
+}
+
+static int overlay_write(struct mount * mount, const u8 * buffer, u64 sector, u64 count) {
+    struct overlay * overlay = mount->overlay;
+    u64 cluster_size = overlay->header.cluster_size;
+    u64 offset = sector * mount->sector_size;
+    u64 left = count * mount->sector_size;
+    while (left > 0) {
+        u64 cluster = offset / cluster_size;
+        u64 within = offset % cluster_size;
+        u64 length = cluster_size - within;
+        if (length > left)
+            length = left;
+
+        int result;
+        __fuse_mutex_lock(&overlay->lock);
+        u64 entry = overlay->table[cluster];
+        if (in_delta(entry)) {
+            __fuse_mutex_unlock(&overlay->lock);
+            result = file_transfer(mount, overlay->delta, (u8*)buffer, length, entry + within, 1);
+        } else {
+            result = copy_on_write(mount, overlay, cluster, buffer, within, length);
+            __fuse_mutex_unlock(&overlay->lock);
+        }
+        if (result) {
+            return OP_FAILURE;
+        }
+        buffer += length;
+        offset += length;
+        left -= length;
+    }
+    return OP_SUCCESS;
+}
+
+static int overlay_readv(struct mount * mount, const struct disk_iovec * iov, int iovcnt, u64 sector) {
+    for (int i = 0; i < iovcnt; i++) {
+        if (overlay_read(mount, iov[i].buffer, sector, iov[i].count))
+            return OP_FAILURE;
+        sector += iov[i].count;
+    }
+    return OP_SUCCESS;
+}
+
+static int overlay_writev(struct mount * mount, const struct disk_iovec * iov, int iovcnt, u64 sector) {
+    for (int i = 0; i < iovcnt; i++) {
+        if (overlay_write(mount, iov[i].buffer, sector, iov[i].count))
+            return OP_FAILURE;
+        sector += iov[i].count;
+    }
+    return OP_SUCCESS;
+}
+
+static int overlay_sync(struct mount * mount) {
+    if (__fuse_fdatasync(mount->overlay->delta) == -1) {
+        mount->last_error = __fuse_errno();
+        return OP_FAILURE;
+    }
+    return OP_SUCCESS;
+}
+
+//Whole clusters point at zeros and are punched out of the delta, the
+//partial ones at the edges are written with zeros
+static int overlay_trim(struct mount * mount, u64 sector, u64 count) {
+    struct overlay * overlay = mount->overlay;
+    u64 cluster_size = overlay->header.cluster_size;
+    u64 offset = sector * mount->sector_size;
+    u64 left = count * mount->sector_size;
+    while (left > 0) {
+        u64 cluster = offset / cluster_size;
+        u64 within = offset % cluster_size;
+        u64 bytes = cluster_bytes(overlay, cluster);
+        u64 length = bytes - within;
+        if (length > left)
+            length = left;
+
+        int result = OP_SUCCESS;
+        if (length < bytes) {
+            result = overlay_write(mount, overlay->zeros, offset / mount->sector_size, length / mount->sector_size);
+        } else {
+            __fuse_mutex_lock(&overlay->lock);
+            u64 entry = overlay->table[cluster];
+            if (!(entry & OVERLAY_ZERO)) {
+                if (in_delta(entry)) {
+                    __fuse_punch_hole(overlay->delta, entry, cluster_size);
+                    overlay->allocated--;
+                }
+                result = store_entry(mount, overlay, cluster, entry | OVERLAY_ZERO);
+            }
+            __fuse_mutex_unlock(&overlay->lock);
+        }
+        if (result) {
+            return OP_FAILURE;
+        }
+        offset += length;
+        left -= length;
+    }
+    return OP_SUCCESS;
+}
+
+static void overlay_close(struct mount * mount) {
+    struct overlay * overlay = mount->overlay;
+    if (mount->file_handle != -1) {
+        __fuse_close(mount->file_handle);
+        mount->file_handle = -1;
+    }
+    if (overlay == 0x0) {
+        return;
+    }
+    if (overlay->delta != -1) {
+        __fuse_fdatasync(overlay->delta);
+        __fuse_close(overlay->delta);
+    }
+    __fuse_mutex_destroy(&overlay->lock);
+    __fuse_free(overlay->table);
+    __fuse_free(overlay->scratch);
+    __fuse_free(overlay->zeros);
+    __fuse_free(overlay);
+    mount->overlay = 0x0;
+}
+
+const struct drive_ops overlay_ops = {
+    overlay_read, overlay_write, overlay_readv, overlay_writev, overlay_sync, overlay_trim, overlay_close, 0x0, 0, 0
+};
+
+//Zeros are punched out of the base, or written where the host cannot
+static int commit_cluster(struct mount * mount, struct overlay * overlay, int base, u64 cluster) {
+    u64 entry = overlay->table[cluster];
+    u64 offset = cluster * overlay->header.cluster_size;
+    u64 bytes = cluster_bytes(overlay, cluster);
+    if (entry & OVERLAY_ZERO) {
+        if (__fuse_punch_hole(base, offset, bytes) == 0)
+            return OP_SUCCESS;
+        return file_transfer(mount, base, overlay->zeros, bytes, offset, 1);
+    }
+    if (file_transfer(mount, overlay->delta, overlay->scratch, bytes, entry, 0)) {
+        return OP_FAILURE;
+    }
+    return file_transfer(mount, base, overlay->scratch, bytes, offset, 1);
+}
+
+int overlay_commit(struct mount * mount) {
+    struct overlay * overlay = mount->overlay;
+    struct overlay_header * header = &overlay->header;
+    int base = __fuse_open(mount->file_name, __fuse_O_RDWR);
+    if (base == -1) {
+        mount->last_error = __fuse_errno();
+        return OP_FAILURE;
+    }
+
+    int result = OP_SUCCESS;
+    __fuse_mutex_lock(&overlay->lock);
+    for (u64 cluster = 0; cluster < header->clusters && result == OP_SUCCESS; cluster++) {
+        if (overlay->table[cluster] != 0)
+            result = commit_cluster(mount, overlay, base, cluster);
+    }
+    if (result == OP_SUCCESS && __fuse_fdatasync(base) == -1) {
+        mount->last_error = __fuse_errno();
+        result = OP_FAILURE;
+    }
+    //Only once the base is durable, truncating drops the clusters and
+    //leaves the table a hole again
+    if (result == OP_SUCCESS && (__fuse_ftruncate(overlay->delta, header->table_offset) == -1 ||
+        __fuse_ftruncate(overlay->delta, header->data_offset) == -1 || __fuse_fdatasync(overlay->delta) == -1)) {
+        mount->last_error = __fuse_errno();
+        result = OP_FAILURE;
+    }
+    if (result == OP_SUCCESS) {
+        __fuse_memset(overlay->table, 0, header->clusters * sizeof(u64));
+        overlay->next_offset = header->data_offset;
+        overlay->allocated = 0;
+    }
+    __fuse_mutex_unlock(&overlay->lock);
+    __fuse_close(base);
+    return result;
+}
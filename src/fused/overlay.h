@@ -0,0 +1,61 @@
+#ifndef _OVERLAY_H
+#define _OVERLAY_H
+#include "bfuse.h"
+#include "dependencies.h"
+
+//Copy-on-write drives over a base image that is only read
+//Writes go to a delta file split in clusters: a header, a table with an
+//entry for every cluster of the drive and the clusters written so far,
+//appended in the order they were first written so the delta stays as
+//small as the data that changed. An entry holds the offset of its cluster
+//in the delta, 0 if the cluster still reads from the base
+//The first write to a cluster copies the rest of it from the base under
+//the lock of the overlay, later writes and every read go straight to the
+//file holding the cluster
+//A trim of whole clusters points their entries at zeros, partial ones are
+//written as zeros
+//Commit writes the clusters of the delta into the base and empties the
+//delta, other overlays of the same base see the change underneath their
+//own clusters
+
+#define OVERLAY_MAGIC       0x4C564F4445535546ULL   //"FUSEDOVL"
+#define OVERLAY_VERSION     1
+//Entry flag, the cluster reads as zeros, offsets are cluster aligned
+#define OVERLAY_ZERO        1ULL
+
+//First bytes of the delta, the table follows at table_offset
+struct overlay_header {
+    u64  magic;
+    u32  version;
+    u32  cluster_size;
+    u64  size;              //Bytes of the drive, the size of the base
+    u64  clusters;
+    u64  table_offset;
+    u64  data_offset;       //First cluster
+};
+
+//The base is the file_handle of the mount, opened read only
+struct overlay {
+    int  delta;
+    struct overlay_header header;
+    __fuse_mutex_t lock;    //Table and allocations
+    u64  *table;
+    u64  next_offset;       //Where the next cluster is appended
+    u64  allocated;         //Clusters in the delta
+    u8   *scratch;          //A cluster being copied, under the lock
+    u8   *zeros;            //A cluster of zeros
+};
+
+//Opens the delta over the base of the mount, creating it if it is missing
+//or empty, an existing one has to match the size of the base
+//A failed open is undone by the close of the ops
+int overlay_open(struct mount * mount, const char * delta);
+
+//Transfers of drives registered with register_overlay_drive
+extern const struct drive_ops overlay_ops;
+//Writes the delta into the base and empties it, only while no request is
+//in flight and after the layers above were flushed
+//A commit cut short leaves the delta as it was, committing it again
+//finishes the job
+int overlay_commit(struct mount * mount);
+#endif
@@ -1,74 +1,581 @@
 #include "primitives.h"
 #include "dependencies.h"
 #include "bfuse.h"
+#include "cache.h"
+#include "backend.h"
+#include "writeback.h"
+#include "readahead.h"
+#include "async.h"
+#include "elevator.h"
+#include "discard.h"
+#include "stats.h"
+#include "timing.h"
+#include "ftl.h"
+#include "zoned.h"
+#include "compressed.h"
+#include "dedup.h"
 #ifdef __DEBUG_ENABLED
 #pragma GCC diagnostic ignored "-Wunused-parameter"
 #pragma GCC diagnostic ignored "-Wreturn-type"
 #endif
 
-int read_disk(const char* drive, void *buffer, int sector, int count) {
-    
-    struct mount* mount = get_drive(drive);
-    if (mount == 0) {
+drive_t open_drive(const char * drive) {
+    return get_drive(drive);
+}
+
+//Requests hold the layers lock of the drive shared, so whatever they find
+//in front of the image stays there until they are done, replacing it
+//holds the lock exclusive
+static void begin_request(struct mount * mount) {
+    __fuse_rwlock_read(mount->layers_lock);
+}
+
+static void end_request(struct mount * mount) {
+    __fuse_rwlock_unlock(mount->layers_lock);
+}
+
+//Rejects transfers that fall outside the drive
+static int check_range(struct mount * mount, u64 sector, u64 count) {
+    if (count > mount->sector_count || sector > mount->sector_count - count) {
+        mount->last_error = __fuse_EINVAL;
         return OP_FAILURE;
     }
-    u64 offset = sector * mount->sector_size;
-    u64 size = count * mount->sector_size;
-#ifdef __EAGER
-    __fuse_memcpy(buffer, mount->file_ptr + offset, size);
-#else
-    __fuse_lseek(mount->file_handle, offset, __fuse_SEEK_SET);
-    if (__fuse_read(mount->file_handle, buffer, size) != size) {
+    return OP_SUCCESS;
+}
+
+//Serves hits from the cache and reads each run of missing sectors with
+//a single backend transfer
+static int cached_read(struct mount * mount, u8 * buffer, u64 sector, u64 count) {
+    struct sector_cache * cache = mount->cache;
+    u32 sector_size = mount->sector_size;
+    u64 i = 0;
+
+    while (i < count) {
+        u8 * data = cache_lookup(cache, sector + i);
+        if (data != 0x0) {
+            __fuse_memcpy(buffer + i * sector_size, data, sector_size);
+            i++;
+            continue;
+        }
+
+        u64 end = i + 1;
+        while (end < count && (data = cache_lookup(cache, sector + end)) == 0x0) {
+            end++;
+        }
+        //Copy the hit that ended the run before the stores can evict it
+        if (end < count) {
+            __fuse_memcpy(buffer + end * sector_size, data, sector_size);
+        }
+
+        if (backend_read(mount, buffer + i * sector_size, sector + i, end - i)) {
+            return OP_FAILURE;
+        }
+        for (u64 j = i; j < end; j++) {
+            cache_store(cache, sector + j, buffer + j * sector_size);
+        }
+        i = (end < count) ? end + 1 : end;
+    }
+    return OP_SUCCESS;
+}
+
+static int read_sectors(struct mount * mount, u8 * buffer, u64 sector, u64 count) {
+    if (mount->cache != 0x0) {
+        __fuse_mutex_lock(&mount->cache->lock);
+        readahead_wait(mount, sector, count);
+        int result = cached_read(mount, buffer, sector, count);
+        readahead_observe(mount, sector, count);
+        __fuse_mutex_unlock(&mount->cache->lock);
+        return result;
+    }
+    return backend_read(mount, buffer, sector, count);
+}
+
+int read_disk_h(drive_t mount, void *buffer, u64 sector, u32 count) {
+    if (mount == 0 || check_range(mount, sector, count)) {
         return OP_FAILURE;
     }
-    __fuse_lseek(mount->file_handle, 0, __fuse_SEEK_SET);
-#endif
+    begin_request(mount);
+    u64 start = stats_begin(mount);
+    int result = read_sectors(mount, buffer, sector, count);
+    stats_end(mount, DISK_STATS_READ, (u64)count * mount->sector_size, start, result);
+    end_request(mount);
+    return result;
+}
+
+//Keeps the cache in line with a write through, a failed write may have
+//partially reached the image so those sectors are dropped instead
+static void written_through(struct mount * mount, const u8 * buffer, u64 sector, u64 count, int result) {
+    for (u64 i = 0; i < count; i++) {
+        if (result == OP_SUCCESS)
+            cache_store(mount->cache, sector + i, buffer + i * mount->sector_size);
+        else
+            cache_invalidate(mount->cache, sector + i);
+    }
+}
+
+//Without write-back the cache is write through, written sectors are kept
+//so the usual read-modify-write of metadata blocks hits on the next read
+//Write-back is looked up under the cache lock, it is turned off under it
+static int write_sectors(struct mount * mount, const u8 * buffer, u64 sector, u64 count) {
+    if (mount->cache == 0x0) {
+        return backend_write(mount, buffer, sector, count);
+    }
+
+    int result;
+    __fuse_mutex_lock(&mount->cache->lock);
+    if (mount->writeback != 0x0) {
+        result = writeback_write(mount, buffer, sector, count);
+    } else {
+        readahead_invalidate(mount, sector, count);
+        result = backend_write(mount, buffer, sector, count);
+        written_through(mount, buffer, sector, count, result);
+    }
+    __fuse_mutex_unlock(&mount->cache->lock);
+    return result;
+}
+
+//Zoned drives reserve the sectors at the write pointers first
+static int check_zones(struct mount * mount, u64 sector, u64 count) {
+    return (mount->zones != 0x0) ? zoned_write(mount, sector, count) : OP_SUCCESS;
+}
+
+int write_disk_h(drive_t mount, void *buffer, u64 sector, u32 count) {
+    if (mount == 0 || check_range(mount, sector, count)) {
+        return OP_FAILURE;
+    }
+    begin_request(mount);
+    int result = check_zones(mount, sector, count);
+    if (result == OP_SUCCESS) {
+        u64 start = stats_begin(mount);
+        result = write_sectors(mount, buffer, sector, count);
+        stats_end(mount, DISK_STATS_WRITE, (u64)count * mount->sector_size, start, result);
+    }
+    end_request(mount);
+    return result;
+}
+
+//Memory lent by the drive, 0x0 if reads have to be copied
+//With write-back the newest data may only be in the cache, an emulated
+//device has to be charged for the read
+static u8 * lendable_memory(struct mount * mount) {
+    if (mount->ops->memory == 0x0 || mount->writeback != 0x0 || mount->timing != 0x0) {
+        return 0x0;
+    }
+    return mount->ops->memory(mount);
+}
+
+int read_disk_ref(drive_t mount, u64 sector, u32 count, const void ** ptr) {
+    if (mount == 0 || ptr == 0x0 || check_range(mount, sector, count)) {
+        return OP_FAILURE;
+    }
+    begin_request(mount);
+    u8 * memory = lendable_memory(mount);
+    if (memory != 0x0) {
+        //Only the elevator may hold newer data, trimmed sectors are zeros in memory too
+        u64 start = stats_begin(mount);
+        elevator_unplug(mount, sector, count);
+        *ptr = memory + sector * mount->sector_size;
+        stats_end(mount, DISK_STATS_READ, (u64)count * mount->sector_size, start, OP_SUCCESS);
+        end_request(mount);
+        return OP_SUCCESS;
+    }
+    end_request(mount);
+
+    u8 * buffer = __fuse_malloc((u64)count * mount->sector_size);
+    if (buffer == 0x0) {
+        mount->last_error = __fuse_ENOMEM;
+        return OP_FAILURE;
+    }
+    if (read_disk_h(mount, buffer, sector, count)) {
+        __fuse_free(buffer);
+        return OP_FAILURE;
+    }
+    *ptr = buffer;
     return OP_SUCCESS;
 }
 
-int write_disk(const char * drive, void *buffer, int sector, int count) {
-    struct mount* mount = get_drive(drive);
-    if (mount == 0) {
+int release_disk_ref(drive_t mount, const void * ptr) {
+    if (mount == 0 || ptr == 0x0) {
         return OP_FAILURE;
     }
-    u64 offset = sector * mount->sector_size;
-    u64 size = count * mount->sector_size;
+    //Lent pointers are the only ones inside the memory of the drive
+    u8 * memory = (mount->ops->memory != 0x0) ? mount->ops->memory(mount) : 0x0;
+    u64 address = (u64)ptr;
+    if (memory != 0x0 && address >= (u64)memory && address < (u64)memory + mount->file_size) {
+        return OP_SUCCESS;
+    }
+    __fuse_free((void*)ptr);
+    return OP_SUCCESS;
+}
 
-#ifdef __EAGER
-    __fuse_memcpy(mount->file_ptr + offset, buffer, size);
-#else
-    __fuse_lseek(mount->file_handle, offset, __fuse_SEEK_SET);
-    if (__fuse_write(mount->file_handle, buffer, size) != size) {
+//Total sectors of a scatter-gather list, 0 if it is malformed
+static u64 vector_sectors(const struct disk_iovec * iov, int iovcnt) {
+    u64 count = 0;
+    if (iov == 0x0 || iovcnt <= 0) {
+        return 0;
+    }
+    for (int i = 0; i < iovcnt; i++) {
+        count += iov[i].count;
+    }
+    return count;
+}
+
+static int read_vector(struct mount * mount, const struct disk_iovec * iov, int iovcnt, u64 sector, u64 count) {
+    if (mount->cache == 0x0) {
+        return backend_readv(mount, iov, iovcnt, sector);
+    }
+
+    int result = OP_SUCCESS;
+    u64 next = sector;
+    __fuse_mutex_lock(&mount->cache->lock);
+    readahead_wait(mount, sector, count);
+    for (int i = 0; i < iovcnt && result == OP_SUCCESS; i++) {
+        result = cached_read(mount, iov[i].buffer, next, iov[i].count);
+        next += iov[i].count;
+    }
+    readahead_observe(mount, sector, count);
+    __fuse_mutex_unlock(&mount->cache->lock);
+    return result;
+}
+
+int read_disk_v(drive_t mount, const struct disk_iovec * iov, int iovcnt, u64 sector) {
+    u64 count = vector_sectors(iov, iovcnt);
+    if (mount == 0 || count == 0 || check_range(mount, sector, count)) {
+        return OP_FAILURE;
+    }
+    begin_request(mount);
+    u64 start = stats_begin(mount);
+    int result = read_vector(mount, iov, iovcnt, sector, count);
+    stats_end(mount, DISK_STATS_READ, count * mount->sector_size, start, result);
+    end_request(mount);
+    return result;
+}
+
+static int write_vector(struct mount * mount, const struct disk_iovec * iov, int iovcnt, u64 sector, u64 count) {
+    if (mount->cache == 0x0) {
+        return backend_writev(mount, iov, iovcnt, sector);
+    }
+
+    int result = OP_SUCCESS;
+    __fuse_mutex_lock(&mount->cache->lock);
+    if (mount->writeback != 0x0) {
+        for (int i = 0; i < iovcnt && result == OP_SUCCESS; i++) {
+            result = writeback_write(mount, iov[i].buffer, sector, iov[i].count);
+            sector += iov[i].count;
+        }
+    } else {
+        readahead_invalidate(mount, sector, count);
+        result = backend_writev(mount, iov, iovcnt, sector);
+        for (int i = 0; i < iovcnt; i++) {
+            written_through(mount, iov[i].buffer, sector, iov[i].count, result);
+            sector += iov[i].count;
+        }
+    }
+    __fuse_mutex_unlock(&mount->cache->lock);
+    return result;
+}
+
+int write_disk_v(drive_t mount, const struct disk_iovec * iov, int iovcnt, u64 sector) {
+    u64 count = vector_sectors(iov, iovcnt);
+    if (mount == 0 || count == 0 || check_range(mount, sector, count)) {
+        return OP_FAILURE;
+    }
+    begin_request(mount);
+    int result = check_zones(mount, sector, count);
+    if (result == OP_SUCCESS) {
+        u64 start = stats_begin(mount);
+        result = write_vector(mount, iov, iovcnt, sector, count);
+        stats_end(mount, DISK_STATS_WRITE, count * mount->sector_size, start, result);
+    }
+    end_request(mount);
+    return result;
+}
+
+//Writes back the cache before syncing the image
+static int flush_disk(struct mount * mount) {
+    if (mount->cache != 0x0) {
+        __fuse_mutex_lock(&mount->cache->lock);
+        int result = cache_flush(mount->cache);
+        __fuse_mutex_unlock(&mount->cache->lock);
+        if (result) {
+            return OP_FAILURE;
+        }
+    }
+    return backend_sync(mount);
+}
+
+static int sync_disk(struct mount * mount) {
+    u64 start = stats_begin(mount);
+    int result = flush_disk(mount);
+    stats_end(mount, DISK_STATS_SYNC, 0, start, result);
+    return result;
+}
+
+//Drops the range from every layer above the image before it is
+//deallocated, a later write makes it live again
+//op is DISK_STATS_TRIM or DISK_STATS_RESET for a zone reset
+static int discard_sectors(struct mount * mount, u64 sector, u64 count, u32 op) {
+    //Holding the cache lock keeps readers from caching the old data meanwhile
+    if (mount->cache != 0x0) {
+        __fuse_mutex_lock(&mount->cache->lock);
+        readahead_invalidate(mount, sector, count);
+        cache_invalidate_range(mount->cache, sector, count);
+    }
+    elevator_unplug(mount, sector, count);
+    int result = discard_mark(mount, sector, count);
+    if (result == OP_SUCCESS) {
+        result = (op == DISK_STATS_RESET) ? backend_reset(mount, sector, count) : backend_trim(mount, sector, count);
+    }
+    if (mount->cache != 0x0) {
+        __fuse_mutex_unlock(&mount->cache->lock);
+    }
+    return result;
+}
+
+static int trim_disk(struct mount * mount, const struct disk_trim * trim) {
+    if (trim == 0x0 || trim->count == 0 || check_range(mount, trim->sector, trim->count)) {
+        return OP_FAILURE;
+    }
+    u64 start = stats_begin(mount);
+    int result = discard_sectors(mount, trim->sector, trim->count, DISK_STATS_TRIM);
+    stats_end(mount, DISK_STATS_TRIM, trim->count * mount->sector_size, start, result);
+    return result;
+}
+
+//Discards a zone for zoned_reset, counted as a reset of its size
+static int reset_sectors(struct mount * mount, u64 sector, u64 count) {
+    u64 start = stats_begin(mount);
+    int result = discard_sectors(mount, sector, count, DISK_STATS_RESET);
+    stats_end(mount, DISK_STATS_RESET, count * mount->sector_size, start, result);
+    return result;
+}
+
+int append_disk_zone(drive_t mount, void *buffer, u64 sector, u32 count, u64 * written) {
+    if (mount == 0 || written == 0x0 || count == 0) {
+        return OP_FAILURE;
+    }
+    begin_request(mount);
+    int result = zoned_append(mount, sector, count, written);
+    if (result == OP_SUCCESS) {
+        u64 start = stats_begin(mount);
+        result = write_sectors(mount, buffer, *written, count);
+        stats_end(mount, DISK_STATS_WRITE, (u64)count * mount->sector_size, start, result);
+    }
+    end_request(mount);
+    return result;
+}
+
+//Starts write-back and readahead again on the cache of the drive, stops
+//both if either fails
+static int restart_cache_helpers(struct mount * mount, uint8_t writeback, u64 readahead) {
+    if (mount->cache == 0x0) {
+        return OP_SUCCESS;
+    }
+    if ((writeback && writeback_start(mount)) || (readahead && readahead_start(mount, readahead))) {
+        readahead_stop(mount);
+        writeback_stop(mount);
         return OP_FAILURE;
     }
-    __fuse_lseek(mount->file_handle, 0, __fuse_SEEK_SET);
-#endif
     return OP_SUCCESS;
 }
 
-int ioctl_disk(const char * drive, int request, void *buffer) {
-    struct mount* mount = get_drive(drive);
-    if (mount == 0) {
+//Replaces the cache of the drive, a capacity of 0 disables it
+//Called with the layers lock held exclusive, no request is using the cache
+//Dirty sectors are written back first, write-back and readahead are kept
+//The old cache is only released once they run on the new one, if they
+//cannot the drive goes back to it as it was
+static int resize_cache(struct mount * mount, u64 capacity) {
+    uint8_t writeback = (mount->writeback != 0x0);
+    u64 readahead = (mount->readahead != 0x0) ? mount->readahead->max_bytes : 0;
+    readahead_stop(mount);
+    if (writeback_stop(mount)) {
         return OP_FAILURE;
     }
 
-    u64 result = *(u64*) buffer;
+    struct sector_cache * old = mount->cache;
+    struct sector_cache * cache = 0x0;
+    if (capacity > 0) {
+        cache = cache_create(mount->sector_size, capacity, backend_writeback, mount);
+        if (cache == 0x0) {
+            restart_cache_helpers(mount, writeback, readahead);
+            return OP_FAILURE;
+        }
+    }
+    mount->cache = cache;
+    if (restart_cache_helpers(mount, writeback, readahead)) {
+        mount->cache = old;
+        cache_destroy(cache);
+        restart_cache_helpers(mount, writeback, readahead);
+        return OP_FAILURE;
+    }
+    cache_destroy(old);
+    return OP_SUCCESS;
+}
+
+static int set_access_hint(struct mount * mount, u32 hint) {
+    backend_lock(mount);
+    uint8_t result = advise_drive(mount, hint);
+    backend_unlock(mount);
+    return result ? OP_SUCCESS : OP_FAILURE;
+}
+
+//Only drives mapping windows of their image have a budget
+static int set_window_budget(struct mount * mount, u64 budget) {
+    if (mount->windows == 0x0) {
+        return OP_FAILURE;
+    }
+    backend_lock(mount);
+    set_map_budget(mount, budget);
+    backend_unlock(mount);
+    return OP_SUCCESS;
+}
+
+static int set_writeback(struct mount * mount, u32 enable) {
+    return enable ? writeback_start(mount) : writeback_stop(mount);
+}
+
+static int set_readahead(struct mount * mount, u64 max_bytes) {
+    if (max_bytes == 0) {
+        readahead_stop(mount);
+        return OP_SUCCESS;
+    }
+    return readahead_start(mount, max_bytes);
+}
+
+//Write-back flushes and readahead prefetches go through the elevator
+//without a request, they are stopped while it is replaced
+static int set_elevator(struct mount * mount, const struct disk_elevator * elevator) {
+    uint8_t writeback = (mount->writeback != 0x0);
+    u64 readahead = (mount->readahead != 0x0) ? mount->readahead->max_bytes : 0;
+    readahead_stop(mount);
+    if (writeback_stop(mount)) {
+        restart_cache_helpers(mount, writeback, readahead);
+        return OP_FAILURE;
+    }
+    int result = elevator_start(mount, elevator->policy, elevator->plug_ms);
+    if (restart_cache_helpers(mount, writeback, readahead)) {
+        result = OP_FAILURE;
+    }
+    return result;
+}
+
+static int get_cache_stats(struct mount * mount, struct disk_cache_stats * stats) {
+    struct sector_cache * cache = mount->cache;
+    __fuse_memset(stats, 0, sizeof(struct disk_cache_stats));
+    if (cache == 0x0) {
+        return OP_SUCCESS;
+    }
+    __fuse_mutex_lock(&cache->lock);
+    stats->capacity = cache->capacity;
+    stats->resident = cache->a1in.count + cache->am.count;
+    stats->dirty = cache->dirty_count;
+    stats->hits = cache->hits;
+    stats->misses = cache->misses;
+    stats->ghost_hits = cache->ghost_hits;
+    stats->evictions = cache->evictions;
+    stats->writeback_sectors = cache->writeback_sectors;
+    stats->writeback_runs = cache->writeback_runs;
+    stats->forced_writebacks = cache->forced_writebacks;
+    stats->readahead_windows = (mount->readahead != 0x0) ? mount->readahead->windows : 0;
+    stats->prefetched = cache->prefetched;
+    stats->prefetch_used = cache->prefetch_used;
+    stats->prefetch_wasted = cache->prefetch_wasted;
+    __fuse_mutex_unlock(&cache->lock);
+    return OP_SUCCESS;
+}
+
+static int reset_cache_stats(struct mount * mount) {
+    if (mount->cache != 0x0) {
+        __fuse_mutex_lock(&mount->cache->lock);
+        cache_reset_stats(mount->cache);
+        if (mount->readahead != 0x0)
+            mount->readahead->windows = 0;
+        __fuse_mutex_unlock(&mount->cache->lock);
+    }
+    return OP_SUCCESS;
+}
+
+static int get_storage_stats(struct mount * mount, struct disk_storage_stats * stats) {
+    __fuse_memset(stats, 0, sizeof(struct disk_storage_stats));
+    if (mount->compressed != 0x0)
+        compressed_get_stats(mount, stats);
+    if (mount->dedup != 0x0)
+        dedup_get_stats(mount, stats);
+    return OP_SUCCESS;
+}
+
+int submit_disk_io(drive_t mount, const struct disk_io * requests, int count) {
+    if (mount == 0 || requests == 0x0 || count < 0) {
+        return -1;
+    }
+    return async_submit(mount, requests, count);
+}
+
+int poll_disk_completions(drive_t mount, struct disk_completion * completions, int max) {
+    if (mount == 0 || completions == 0x0) {
+        return 0;
+    }
+    return async_complete(mount, completions, 0, max);
+}
+
+int wait_disk_completions(drive_t mount, struct disk_completion * completions, int min, int max) {
+    if (mount == 0 || completions == 0x0) {
+        return 0;
+    }
+    return async_complete(mount, completions, min, max);
+}
+
+//Requests that replace a layer of the drive, they wait for the requests
+//in flight and hold the next ones back until they are done
+static uint8_t replaces_layers(int request) {
+    return request == IOCTL_SET_CACHE_SIZE || request == IOCTL_SET_WRITEBACK || request == IOCTL_SET_READAHEAD ||
+           request == IOCTL_SET_ELEVATOR;
+}
+
+static int disk_ioctl(struct mount * mount, int request, void *buffer) {
+    u64 result = 0;
     switch (request) {
-        case IOCTL_SYNC:                {return OP_FAILURE;}
-        case IOCTL_TRIM:                {return OP_FAILURE;}
+        case IOCTL_SYNC:                {return sync_disk(mount);}
+        case IOCTL_TRIM:                {return trim_disk(mount, buffer);}
         case IOCTL_GET_SECTOR_SIZE:     {result = mount->sector_size; break;}
         case IOCTL_GET_SECTOR_COUNT:    {result = mount->sector_count; break;}
-        case IOCTL_IDLE:                {mount->power_state = DEV_PWR_IDLE; break;}
-        case IOCTL_POWEROFF:            {mount->power_state = DEV_PWR_OFF; break;}
-        case IOCTL_LOCK:                {mount->can_eject = 0; break;}
-        case IOCTL_UNLOCK:              {mount->can_eject = 1; break;}
-        case IOCTL_ATA_GET_REV:         {__fuse_memcpy(buffer, mount->ATA_REVISION, ATA_REV_LEN); break;}
-        case IOCTL_ATA_GET_MODEL:       {__fuse_memcpy(buffer, mount->ATA_MODEL, ATA_MODEL_LEN); break;}
-        case IOCTL_ATA_GET_SN:          {__fuse_memcpy(buffer, mount->ATA_SERIAL, ATA_SN_LEN); break;}
+        case IOCTL_IDLE:                {mount->power_state = DEV_PWR_IDLE; return OP_SUCCESS;}
+        case IOCTL_POWEROFF:            {mount->power_state = DEV_PWR_OFF; return OP_SUCCESS;}
+        case IOCTL_LOCK:                {mount->can_eject = 0; return OP_SUCCESS;}
+        case IOCTL_UNLOCK:              {mount->can_eject = 1; return OP_SUCCESS;}
+        case IOCTL_ATA_GET_REV:         {__fuse_memcpy(buffer, mount->ATA_REVISION, ATA_REV_LEN); return OP_SUCCESS;}
+        case IOCTL_ATA_GET_MODEL:       {__fuse_memcpy(buffer, mount->ATA_MODEL, ATA_MODEL_LEN); return OP_SUCCESS;}
+        case IOCTL_ATA_GET_SN:          {__fuse_memcpy(buffer, mount->ATA_SERIAL, ATA_SN_LEN); return OP_SUCCESS;}
+        case IOCTL_GET_LAST_ERROR:      {result = mount->last_error; break;}
+        case IOCTL_SET_ACCESS_HINT:     {return set_access_hint(mount, *(u32*)buffer);}
+        case IOCTL_SET_CACHE_SIZE:      {return resize_cache(mount, *(u64*)buffer);}
+        case IOCTL_GET_CACHE_STATS:     {return get_cache_stats(mount, buffer);}
+        case IOCTL_RESET_CACHE_STATS:   {return reset_cache_stats(mount);}
+        case IOCTL_SET_WRITEBACK:       {return set_writeback(mount, *(u32*)buffer);}
+        case IOCTL_SET_READAHEAD:       {return set_readahead(mount, *(u64*)buffer);}
+        case IOCTL_SET_QUEUE_DEPTH:     {return async_set_depth(mount, *(u32*)buffer);}
+        case IOCTL_SET_ELEVATOR:        {return set_elevator(mount, buffer);}
+        case IOCTL_GET_ELEVATOR_STATS:  {elevator_get_stats(mount, buffer); return OP_SUCCESS;}
+        case IOCTL_RESET_ELEVATOR_STATS:{elevator_reset_stats(mount); return OP_SUCCESS;}
+        case IOCTL_GET_STATS:           {stats_get(mount, buffer); return OP_SUCCESS;}
+        case IOCTL_RESET_STATS:         {stats_reset(mount); return OP_SUCCESS;}
+        case IOCTL_SET_TIMING:          {return timing_start(mount, buffer);}
+        case IOCTL_GET_TIMING:          {timing_get(mount, buffer); return OP_SUCCESS;}
+        case IOCTL_SET_FTL:             {return ftl_start(mount, buffer);}
+        case IOCTL_GET_FTL_STATS:       {return ftl_get_stats(mount, buffer);}
+        case IOCTL_RESET_FTL_STATS:     {ftl_reset_stats(mount); return OP_SUCCESS;}
+        case IOCTL_SET_ZONES:           {return zoned_start(mount, buffer);}
+        case IOCTL_REPORT_ZONES:        {return zoned_report(mount, buffer);}
+        case IOCTL_OPEN_ZONE:
+        case IOCTL_CLOSE_ZONE:
+        case IOCTL_FINISH_ZONE:         {return zoned_manage(mount, request, *(u64*)buffer);}
+        case IOCTL_RESET_ZONE:          {return zoned_reset(mount, *(u64*)buffer, reset_sectors);}
+        case IOCTL_GET_STORAGE_STATS:   {return get_storage_stats(mount, buffer);}
+        case IOCTL_SET_MAP_BUDGET:      {return set_window_budget(mount, *(u64*)buffer);}
         case IOCTL_EJECT:               {
             if (mount->can_eject) {
                 mount->power_state = DEV_PWR_EJECTED;
-                break;
+                return OP_SUCCESS;
             } else {
                 return OP_FAILURE;
             }
@@ -79,8 +586,20 @@ int ioctl_disk(const char * drive, int request, void *buffer) {
     return OP_SUCCESS;
 }
 
-int get_disk_status(const char * drive) {
-    struct mount* mount = get_drive(drive);
+int ioctl_disk_h(drive_t mount, int request, void *buffer) {
+    if (mount == 0) {
+        return OP_FAILURE;
+    }
+    if (replaces_layers(request))
+        __fuse_rwlock_write(mount->layers_lock);
+    else
+        begin_request(mount);
+    int result = disk_ioctl(mount, request, buffer);
+    end_request(mount);
+    return result;
+}
+
+int get_disk_status_h(drive_t mount) {
     if (mount == 0) {
         return STATUS_NON_PRESENT;
     }
@@ -88,12 +607,13 @@ int get_disk_status(const char * drive) {
     if (mount->configured == 0) {
         return STATUS_NOT_READY;
     }
-    //TODO: Add busy option after delay emulation is implemented
+    if (timing_busy(mount)) {
+        return STATUS_BUSY;
+    }
     return STATUS_READY;
 }
 
-int init_disk(const char * drive) {
-    struct mount* mount = get_drive(drive);
+int init_disk_h(drive_t mount) {
     if (mount == 0) {
         return OP_FAILURE;
     }
@@ -104,4 +624,24 @@ int init_disk(const char * drive) {
 
     mount->configured = 1;
     return OP_SUCCESS;
+}
+
+int read_disk(const char* drive, void *buffer, int sector, int count) {
+    return read_disk_h(get_drive(drive), buffer, sector, count);
+}
+
+int write_disk(const char * drive, void *buffer, int sector, int count) {
+    return write_disk_h(get_drive(drive), buffer, sector, count);
+}
+
+int ioctl_disk(const char * drive, int request, void *buffer) {
+    return ioctl_disk_h(get_drive(drive), request, buffer);
+}
+
+int get_disk_status(const char * drive) {
+    return get_disk_status_h(get_drive(drive));
+}
+
+int init_disk(const char * drive) {
+    return init_disk_h(get_drive(drive));
 }
\ No newline at end of file
@@ -35,6 +35,342 @@
 #define IOCTL_ISDIO_READ           20
 #define IOCTL_ISDIO_WRITE          21
 #define IOCTL_ISDIO_MRITE          22
+#define IOCTL_GET_LAST_ERROR       23
+#define IOCTL_SET_ACCESS_HINT      24
+#define IOCTL_SET_MAP_BUDGET       25
+#define IOCTL_SET_CACHE_SIZE       26
+#define IOCTL_GET_CACHE_STATS      27
+#define IOCTL_RESET_CACHE_STATS    28
+#define IOCTL_SET_WRITEBACK        29
+#define IOCTL_SET_READAHEAD        30
+#define IOCTL_SET_QUEUE_DEPTH      31
+#define IOCTL_SET_ELEVATOR         32
+#define IOCTL_GET_ELEVATOR_STATS   33
+#define IOCTL_RESET_ELEVATOR_STATS 34
+#define IOCTL_GET_STATS            35
+#define IOCTL_RESET_STATS          36
+#define IOCTL_SET_TIMING           37
+#define IOCTL_GET_TIMING           38
+#define IOCTL_SET_FTL              39
+#define IOCTL_GET_FTL_STATS        40
+#define IOCTL_RESET_FTL_STATS      41
+#define IOCTL_SET_ZONES            42
+#define IOCTL_REPORT_ZONES         43
+#define IOCTL_OPEN_ZONE            44
+#define IOCTL_CLOSE_ZONE           45
+#define IOCTL_FINISH_ZONE          46
+#define IOCTL_RESET_ZONE           47
+#define IOCTL_GET_STORAGE_STATS    48
+
+//Range released by IOCTL_TRIM
+struct disk_trim {
+    u64 sector;
+    u64 count;
+};
+
+//Access pattern hints for IOCTL_SET_ACCESS_HINT
+#define ACCESS_HINT_NORMAL          0
+#define ACCESS_HINT_SEQUENTIAL      1
+#define ACCESS_HINT_RANDOM          2
+#define ACCESS_HINT_WILLNEED        3
+
+//Sector cache counters, filled by IOCTL_GET_CACHE_STATS
+struct disk_cache_stats {
+    u64 capacity;           //Sectors the cache can hold
+    u64 resident;           //Sectors currently cached
+    u64 dirty;              //Sectors waiting to be written back
+    u64 hits;
+    u64 misses;
+    u64 ghost_hits;         //Misses on recently evicted sectors, promoted to the hot queue
+    u64 evictions;
+    u64 writeback_sectors;  //Sectors written back to the image
+    u64 writeback_runs;     //Host writes issued for them
+    u64 forced_writebacks;  //Flushes forced by evicting a dirty sector
+    u64 readahead_windows;  //Windows requested by sequential readers
+    u64 prefetched;         //Sectors stored by readahead
+    u64 prefetch_used;      //Prefetched sectors that were read later
+    u64 prefetch_wasted;    //Prefetched sectors evicted or overwritten unread
+};
+
+//Write scheduling policies for IOCTL_SET_ELEVATOR
+#define ELEVATOR_NONE               0   //Writes go straight to the image
+#define ELEVATOR_NOOP               1   //Arrival order, merges with the last write only
+#define ELEVATOR_DEADLINE           2   //Sector order, merges with any queued write
+
+struct disk_elevator {
+    u32 policy;
+    u32 plug_ms;            //Longest a write is held before it is dispatched
+};
+
+//Elevator counters, filled by IOCTL_GET_ELEVATOR_STATS
+//writes / dispatched is the merge ratio
+struct disk_elevator_stats {
+    u64 policy;
+    u64 writes;             //Writes that reached the elevator
+    u64 merged;             //Writes merged into or absorbed by a queued one
+    u64 dispatched;         //Host writes issued for them
+    u64 sectors;            //Sectors written by those host writes
+    u64 plugs;              //Times the plug was dispatched
+    u64 queued;             //Writes held in the plug right now
+};
+
+//Operations counted by struct disk_stats
+#define DISK_STATS_READ             0
+#define DISK_STATS_WRITE            1
+#define DISK_STATS_SYNC             2
+#define DISK_STATS_TRIM             3
+#define DISK_STATS_RESET            4   //Zone resets
+#define DISK_STATS_OPS              5
+
+//Transfer sizes, bucket 0 counts transfers of up to 512 bytes and bucket i
+//those of up to 512 << i bytes, the last one everything larger
+#define DISK_STATS_SIZE_BUCKETS     16
+//Latencies in nanoseconds, log-linear like an HDR histogram: the first
+//buckets hold a value each, after that every power of two is split in
+//1 << DISK_STATS_LATENCY_SUB_BITS buckets, so a bucket is within 1/16 of
+//its values, the last one also counts everything from about 68 s on
+#define DISK_STATS_LATENCY_SUB_BITS 4
+#define DISK_STATS_LATENCY_BUCKETS  528
+
+//Drive counters, filled by IOCTL_GET_STATS
+//Every request made through the primitives or submit_disk_io is counted
+//once it reaches the drive, latencies run from there to its completion
+//Every thread times one request in __STATS_SAMPLE at random, the latency
+//counters cover those
+//The mean queue depth is the time spent in requests over elapsed_ns, the
+//sum over every op of latency_sum * ops / timed / elapsed_ns
+struct disk_stats {
+    u64 ops[DISK_STATS_OPS];
+    u64 bytes[DISK_STATS_OPS];      //Bytes read, written, trimmed and reset
+    u64 errors[DISK_STATS_OPS];     //Requests that failed
+    u64 inflight;                   //Requests the drive is working on right now
+    u64 elapsed_ns;                 //Since the drive was registered or the counters reset
+    u64 timed[DISK_STATS_OPS];      //Requests in the latency counters
+    u64 latency_sum[DISK_STATS_OPS];
+    u64 latency_max[DISK_STATS_OPS];
+    u64 sizes[2][DISK_STATS_SIZE_BUCKETS];  //Reads and writes
+    u64 latency[DISK_STATS_OPS][DISK_STATS_LATENCY_BUCKETS];
+};
+
+//Latency under which the given share of the requests of op completed,
+//in hundredths of a percent (9990 is p99.9), 0 if there were none
+//The value is the largest one of its bucket
+u64 disk_stats_percentile(const struct disk_stats * stats, u32 op, u32 hundredths);
+
+//Device timing models for IOCTL_SET_TIMING
+#define TIMING_NONE                 0   //Requests take as long as the host needs
+#define TIMING_HDD                  1   //Seeks over the LBA distance, rotational latency, media transfer rate
+#define TIMING_SATA_SSD             2   //Per op latency on a few channels, SATA link bandwidth
+#define TIMING_NVME                 3   //Lower latency on many channels, PCIe link bandwidth
+
+#define TIMING_CLOCK_REAL           0   //Requests sleep until the emulated device completes them
+#define TIMING_CLOCK_VIRTUAL        1   //Requests return at once and advance a clock per thread instead
+
+//Device parameters, 0 takes the default of the model
+//Requests in flight on more threads or through submit_disk_io than the
+//device has channels queue up for them
+struct disk_timing {
+    u32 model;
+    u32 clock;
+    u32 read_us;            //Latency of a read, the command overhead of an HDD
+    u32 write_us;
+    u32 seek_us;            //HDD, seek over the whole drive
+    u32 rpm;                //HDD
+    u32 mb_per_s;           //Link bandwidth, the media transfer rate of an HDD
+    u32 channels;           //Requests the device works on at once, always 1 for an HDD
+    u32 reset_us;           //Zone reset
+};
+
+//Emulated device time, filled by IOCTL_GET_TIMING
+//Times are on the clock of the model, nanoseconds since the model was set
+//for the virtual clock
+struct disk_timing_stats {
+    struct disk_timing timing;  //Parameters in use, defaults filled in
+    u64 requests;           //Requests the device completed or is working on
+    u64 queue_ns;           //Time they waited for a channel
+    u64 service_ns;         //Time from taking a channel to completing
+    u64 seeks;              //HDD requests that did not continue the last one
+    u64 busy_until;         //When the device completes the last request scheduled
+    u64 clock_ns;           //Virtual clock of the calling thread on the drive
+};
+
+//Garbage collection policies for IOCTL_SET_FTL
+#define FTL_NONE                    0   //Writes overwrite their sectors in place
+#define FTL_GC_GREEDY               1   //Collects the block with the fewest valid pages
+#define FTL_GC_COST_BENEFIT         2   //Collects the block with the most (1 - u) * age / 2u, u its valid share
+
+//Flash of the FTL, 0 takes the default
+struct disk_ftl {
+    u32 policy;
+    u32 page_size;          //Bytes, a multiple of the sector size, 4096
+    u32 pages_per_block;    //256
+    u32 over_provisioning;  //Flash beyond the size of the drive in percent, 7
+    u32 wear_gap;           //Erases the most worn block may be ahead of the least worn one holding data, 64
+    u32 read_us;            //Page read, 50
+    u32 program_us;         //Page program, 200
+    u32 erase_us;           //Block erase, 2000
+};
+
+//FTL counters, filled by IOCTL_GET_FTL_STATS
+//nand_pages / host_pages is the write amplification, a write covering part
+//of a page programs all of it
+struct disk_ftl_stats {
+    u64 host_pages;         //Pages written by the host
+    u64 host_bytes;
+    u64 nand_pages;         //Pages programmed for the host and by garbage collection
+    u64 gc_pages;           //Valid pages garbage collection moved
+    u64 gc_blocks;          //Blocks garbage collection erased
+    u64 gc_stall_ns;        //Time writes waited for garbage collection
+    u64 wear_moves;         //Blocks collected only to level wear
+    u64 trimmed_pages;      //Mapped pages released by trims
+    u64 blocks;             //Erase blocks of the flash
+    u64 free_blocks;
+    u64 valid_pages;
+    u64 erases;             //Sum of the erase counts of the blocks
+    u64 min_erases;
+    u64 max_erases;
+    u32 * erase_counts;     //Set by the caller to blocks entries for the erase count of every block, or 0x0
+};
+
+//Zones of a zoned drive, set with IOCTL_SET_ZONES
+//The drive is split in zones of zone_sectors, the last one may be shorter,
+//the first conventional ones are written anywhere like a normal drive and
+//the others only sequentially at their write pointer, a write to one that
+//does not start there, runs past its end or finds it full fails with EIO
+//in last_error
+//A zone_sectors of 0 turns zones off
+struct disk_zoned {
+    u64 zone_sectors;
+    u32 conventional;
+};
+
+#define ZONE_TYPE_CONVENTIONAL      0
+#define ZONE_TYPE_SEQUENTIAL        1
+
+#define ZONE_COND_NOT_WP            0   //Conventional, no write pointer
+#define ZONE_COND_EMPTY             1
+#define ZONE_COND_IMPLICIT_OPEN     2   //Opened by a write
+#define ZONE_COND_EXPLICIT_OPEN     3   //Opened with IOCTL_OPEN_ZONE
+#define ZONE_COND_CLOSED            4
+#define ZONE_COND_FULL              5
+
+struct disk_zone {
+    u64 start;
+    u64 length;
+    u64 write_pointer;      //Next sector a write to the zone has to start at, the end of the zone once full or if conventional
+    u32 type;
+    u32 condition;
+};
+
+//Filled by IOCTL_REPORT_ZONES, zones points to count entries set by the
+//caller that get the zones from the one holding sector on, reported says
+//how many there were
+struct disk_zone_report {
+    u64 sector;
+    u32 count;
+    u32 reported;
+    struct disk_zone * zones;
+};
+
+//How a drive stores its data, filled by IOCTL_GET_STORAGE_STATS
+//Drives keeping the sectors as they are in their image report zeros
+//logical_bytes / stored_bytes is the compression or deduplication ratio
+struct disk_storage_stats {
+    u64 logical_bytes;      //Bytes of the drive holding data, zeros take no space
+    u64 stored_bytes;       //Bytes holding them in the backing file
+    u64 garbage_bytes;      //Stale bytes in the backing file until a compaction drops them
+    u64 metadata_bytes;     //Bytes of headers and indexes in the backing file
+    u64 memory_bytes;       //Memory the backend holds for indexes and caches
+    u64 compactions;
+    u64 cache_hits;
+    u64 cache_misses;
+    u64 unique_blocks;      //Distinct blocks a deduplicated drive stores
+    u64 shared_writes;      //Blocks written that were already stored
+};
+
+//Opaque drive handle, resolved once from the mount point by open_drive
+//Valid until the drive is unregistered
+struct mount;
+typedef struct mount * drive_t;
+
+//Resolves the mount point to a drive handle
+//Returns 0 if the drive is not registered
+drive_t open_drive(const char * drive);
+
+//Handle based variants of the primitives below, same semantics
+//without the per call mount point lookup. The lookup hashes the name and
+//shares the lock of the mount table with registrations, hot paths should
+//open the drive once and use these
+int read_disk_h(drive_t drive, void *buffer, u64 sector, u32 count);
+int write_disk_h(drive_t drive, void *buffer, u64 sector, u32 count);
+int ioctl_disk_h(drive_t drive, int request, void *buffer);
+int get_disk_status_h(drive_t drive);
+int init_disk_h(drive_t drive);
+
+//One buffer of a scatter-gather transfer, count is in sectors
+struct disk_iovec {
+    void * buffer;
+    u32 count;
+};
+
+//Reads the sectors starting at sector into the buffers of iov in order
+//so a contiguous range can land in several buffers with one transfer
+//Returns 0 on success, 1 on failure
+int read_disk_v(drive_t drive, const struct disk_iovec * iov, int iovcnt, u64 sector);
+//Writes the buffers of iov in order to the sectors starting at sector
+//Returns 0 on success, 1 on failure
+int write_disk_v(drive_t drive, const struct disk_iovec * iov, int iovcnt, u64 sector);
+
+//Reads count sectors from sector without copying them if the drive keeps
+//its data in memory (DRIVE_MAPPED and RAM drives without write-back),
+//*ptr then points into that memory and later writes show through it
+//Other drives read into a buffer of their own that later writes leave alone
+//*ptr stays valid until it is handed to release_disk_ref
+//Returns 0 on success, 1 on failure
+int read_disk_ref(drive_t drive, u64 sector, u32 count, const void ** ptr);
+//Returns a pointer obtained from read_disk_ref on the same drive
+//Returns 0 on success, 1 on failure
+int release_disk_ref(drive_t drive, const void * ptr);
+
+//Writes count sectors at the write pointer of the sequential zone holding
+//sector, *written gets the sector they went to
+//Appends from several threads land one after the other without the
+//callers agreeing on the write pointer
+//Returns 0 on success, 1 on failure
+int append_disk_zone(drive_t drive, void *buffer, u64 sector, u32 count, u64 * written);
+
+#define DISK_IO_READ    0
+#define DISK_IO_WRITE   1
+#define DISK_IO_SYNC    2   //Completes after every request submitted before it
+
+//Asynchronous request, tag is handed back untouched in the completion
+//The buffer must stay valid until the request completes
+struct disk_io {
+    u32 op;
+    u32 count;
+    u64 sector;
+    void * buffer;
+    u64 tag;
+};
+
+struct disk_completion {
+    u64 tag;
+    int result;     //0 on success, 1 on failure
+    int error;      //errno value of the failure
+};
+
+//Queues the requests, requests complete in any order
+//Every thread has its own queue on a drive and gets back only the
+//completions of its requests, a sync covers what the thread submitted
+//before it
+//Returns how many were accepted, fewer than count once the queue depth
+//is reached, or -1 on failure
+int submit_disk_io(drive_t drive, const struct disk_io * requests, int count);
+//Returns up to max completions without blocking
+int poll_disk_completions(drive_t drive, struct disk_completion * completions, int max);
+//Blocks until min completions are available and returns up to max
+//Returns early if fewer than min requests are outstanding
+int wait_disk_completions(drive_t drive, struct disk_completion * completions, int min, int max);
 
 //Reads n sectors with offset into buffer
 //Returns 0 on success, 1 on failure
@@ -45,8 +381,8 @@ int write_disk(const char * drive, void *buffer, int sector, int count);
 //Sends a command to the disk, may send or receive data through buffer
 //Returns 0 on success, 1 on failure
 //Valid operations (recommended):
-// 0 - Syncronize, make sure the disk is done writing
-// 1 - Trim, remove data from the disk.
+// 0 - Syncronize, make sure the disk is done writing, also writes back the cache
+// 1 - Trim, releases the range of struct disk_trim in buffer, it reads as zeros afterwards
 // 2 - Get sector size, returns the sector size in buffer (4 bytes)
 // 3 - Get sector count, returns the sector count in buffer (8 bytes)
 // 4 - Get block size, returns the block size in buffer (4 bytes)
@@ -69,13 +405,39 @@ int write_disk(const char * drive, void *buffer, int sector, int count);
 // 20 - isdio read, read from the sdio
 // 21 - isdio write, write to the sdio
 // 22 - isdio mrite, write to the sdio multiple
+// 23 - get last error, returns the errno of the last failed transfer in buffer (4 bytes)
+// 24 - set access hint, expected access pattern (ACCESS_HINT_*) from buffer (4 bytes)
+// 25 - set map budget, bytes of the image a lazy drive may keep mapped, from buffer (8 bytes)
+// 26 - set cache size, sectors of sector cache for the drive from buffer, 0 disables it, waits for the requests in flight (8 bytes)
+// 27 - get cache stats, returns struct disk_cache_stats in buffer
+// 28 - reset cache stats, clears the sector cache counters
+// 29 - set writeback, 1 turns write-back caching on, 0 flushes and turns it off, waits for the requests in flight (4 bytes)
+// 30 - set readahead, largest readahead window in bytes, 0 turns readahead off, waits for the requests in flight (8 bytes)
+// 31 - set queue depth, asynchronous requests in flight per thread, only while none is outstanding (4 bytes)
+// 32 - set elevator, write scheduling policy and plug window from struct disk_elevator in buffer, waits for the requests in flight
+// 33 - get elevator stats, returns struct disk_elevator_stats in buffer
+// 34 - reset elevator stats, clears the elevator counters
+// 35 - get stats, returns struct disk_stats in buffer
+// 36 - reset stats, clears the drive counters, the requests in flight stay counted
+// 37 - set timing, emulates the device of struct disk_timing in buffer, only while no request is in flight
+// 38 - get timing, returns struct disk_timing_stats in buffer
+// 39 - set ftl, emulates the flash translation layer of struct disk_ftl in buffer, only while no request is in flight
+// 40 - get ftl stats, returns struct disk_ftl_stats in buffer
+// 41 - reset ftl stats, clears the write and garbage collection counters, the erase counts stay
+// 42 - set zones, splits the drive in the zones of struct disk_zoned in buffer, only while no request is in flight
+// 43 - report zones, fills struct disk_zone_report in buffer
+// 44 - open zone, opens the sequential zone holding the sector in buffer (8 bytes)
+// 45 - close zone, closes the sequential zone holding the sector in buffer (8 bytes)
+// 46 - finish zone, moves the write pointer of the zone holding the sector in buffer to its end (8 bytes)
+// 47 - reset zone, discards the zone holding the sector in buffer and rewinds its write pointer (8 bytes)
+// 48 - get storage stats, returns struct disk_storage_stats in buffer
 
 int ioctl_disk(const char * drive, int request, void *buffer);
 //Get status of the drive
 //Possible status values:
 //0 - drive is not ready
 //1 - drive is ready
-//2 - drive is busy
+//2 - drive is busy, an emulated request is in flight (IOCTL_SET_TIMING)
 //3 - drive is not present
 //4 - uncontrolled error
 int get_disk_status(const char * drive);
@@ -0,0 +1,239 @@
+#include "ram.h"
+#include "primitives.h"
+#include "backend.h"
+
+//Set after the data is in place, a checkpoint clears the bit before
+//copying the region so a write racing with it is never lost
+static void mark_dirty(struct ram_drive * ram, u64 offset, u64 size) {
+    u64 first = offset >> RAM_REGION_SHIFT;
+    u64 last = (offset + size - 1) >> RAM_REGION_SHIFT;
+    for (u64 region = first; region <= last; region++) {
+        u64 bit = 1ULL << (region & 63);
+        if (!(__fuse_load_acquire(&ram->dirty[region >> 6]) & bit))
+            __fuse_fetch_or(&ram->dirty[region >> 6], bit);
+    }
+}
+
+static uint8_t region_is_zero(const u8 * data, u64 length) {
+    const u64 * words = (const u64 *)data;
+    for (u64 i = 0; i < length / sizeof(u64); i++) {
+        if (words[i] != 0)
+            return 0;
+    }
+    return 1;
+}
+
+struct ram_drive * ram_create(u64 size) {
+    struct ram_drive * ram = __fuse_malloc(sizeof(struct ram_drive));
+    if (ram == 0x0) {
+        return 0x0;
+    }
+    __fuse_memset(ram, 0, sizeof(struct ram_drive));
+    ram->size = size;
+    ram->regions = (size + (1ULL << RAM_REGION_SHIFT) - 1) >> RAM_REGION_SHIFT;
+
+    ram->mapped = (size + RAM_HUGEPAGE_SIZE - 1) & ~(RAM_HUGEPAGE_SIZE - 1);
+    ram->memory = __fuse_mmap(0, ram->mapped, __fuse_PROT_READ | __fuse_PROT_WRITE,
+        __fuse_MAP_PRIVATE | __fuse_MAP_ANONYMOUS | __fuse_MAP_HUGETLB, -1, 0);
+    ram->huge = (ram->memory != __fuse_MAP_FAILED);
+    if (!ram->huge) {
+        //No hugetlbfs pages reserved, fall back to transparent huge pages
+        u64 page_mask = __fuse_page_size() - 1;
+        ram->mapped = (size + page_mask) & ~page_mask;
+        ram->memory = __fuse_mmap(0, ram->mapped, __fuse_PROT_READ | __fuse_PROT_WRITE,
+            __fuse_MAP_PRIVATE | __fuse_MAP_ANONYMOUS, -1, 0);
+        if (ram->memory == __fuse_MAP_FAILED) {
+            __fuse_free(ram);
+            return 0x0;
+        }
+        __fuse_madvise(ram->memory, ram->mapped, __fuse_MADV_HUGEPAGE);
+    }
+
+    u64 words = (ram->regions + 63) / 64;
+    ram->dirty = __fuse_malloc(words * sizeof(u64));
+    if (ram->dirty == 0x0) {
+        __fuse_munmap(ram->memory, ram->mapped);
+        __fuse_free(ram);
+        return 0x0;
+    }
+    __fuse_memset(ram->dirty, 0, words * sizeof(u64));
+    __fuse_mutex_init(&ram->lock);
+    return ram;
+}
+
+void ram_destroy(struct ram_drive * ram) {
+    if (ram == 0x0) {
+        return;
+    }
+    __fuse_mutex_destroy(&ram->lock);
+    __fuse_munmap(ram->memory, ram->mapped);
+    __fuse_free(ram->dirty);
+    __fuse_free(ram);
+}
+
+//Holes are left untouched, anonymous memory already reads as zeros
+//The image is only read, so it may be read-only
+int ram_load(struct mount * mount, const char * filename) {
+    struct ram_drive * ram = mount->ram;
+    int fd = __fuse_open(filename, __fuse_O_RDONLY);
+    if (fd == -1) {
+        mount->last_error = __fuse_errno();
+        return OP_FAILURE;
+    }
+
+    int result = OP_SUCCESS;
+    u64 offset = 0;
+    while (offset < ram->size && result == OP_SUCCESS) {
+        //No data past offset
+        u64 data = __fuse_lseek(fd, offset, __fuse_SEEK_DATA);
+        if (data == (u64)-1 || data >= ram->size)
+            break;
+        u64 hole = __fuse_lseek(fd, data, __fuse_SEEK_HOLE);
+        if (hole == (u64)-1 || hole > ram->size)
+            hole = ram->size;
+        result = file_transfer(mount, fd, ram->memory + data, hole - data, data, 0);
+        offset = hole;
+    }
+    __fuse_close(fd);
+
+    if (result == OP_SUCCESS) {
+        __fuse_strncpy(ram->image, filename, MAX_FILE_NAME_LENGTH - 1);
+        ram->image[MAX_FILE_NAME_LENGTH - 1] = 0;
+    }
+    return result;
+}
+
+static int ram_read(struct mount * mount, u8 * buffer, u64 sector, u64 count) {
+    struct ram_drive * ram = mount->ram;
+    __fuse_memcpy(buffer, ram->memory + sector * mount->sector_size, count * mount->sector_size);
+    return OP_SUCCESS;
+}
+
+static int ram_write(struct mount * mount, const u8 * buffer, u64 sector, u64 count) {
+    struct ram_drive * ram = mount->ram;
+    u64 offset = sector * mount->sector_size;
+    u64 size = count * mount->sector_size;
+    if (size == 0) {
+        return OP_SUCCESS;
+    }
+    __fuse_memcpy(ram->memory + offset, buffer, size);
+    mark_dirty(ram, offset, size);
+    return OP_SUCCESS;
+}
+
+//Whole pages are given back to the kernel, the edges are zeroed
+static int ram_trim(struct mount * mount, u64 sector, u64 count) {
+    struct ram_drive * ram = mount->ram;
+    u64 offset = sector * mount->sector_size;
+    u64 size = count * mount->sector_size;
+    u64 page_mask = (ram->huge ? RAM_HUGEPAGE_SIZE : __fuse_page_size()) - 1;
+    u64 first = (offset + page_mask) & ~page_mask;
+    u64 last = (offset + size) & ~page_mask;
+
+    if (first < last && __fuse_madvise(ram->memory + first, last - first, __fuse_MADV_DONTNEED) == 0) {
+        __fuse_memset(ram->memory + offset, 0, first - offset);
+        __fuse_memset(ram->memory + last, 0, offset + size - last);
+    } else {
+        __fuse_memset(ram->memory + offset, 0, size);
+    }
+    mark_dirty(ram, offset, size);
+    return OP_SUCCESS;
+}
+
+static int ram_readv(struct mount * mount, const struct disk_iovec * iov, int iovcnt, u64 sector) {
+    for (int i = 0; i < iovcnt; i++) {
+        ram_read(mount, iov[i].buffer, sector, iov[i].count);
+        sector += iov[i].count;
+    }
+    return OP_SUCCESS;
+}
+
+static int ram_writev(struct mount * mount, const struct disk_iovec * iov, int iovcnt, u64 sector) {
+    for (int i = 0; i < iovcnt; i++) {
+        ram_write(mount, iov[i].buffer, sector, iov[i].count);
+        sector += iov[i].count;
+    }
+    return OP_SUCCESS;
+}
+
+//Memory has nowhere to be synced to, checkpoint_drive saves it
+static int ram_sync(struct mount * mount) {
+    (void)mount;
+    return OP_SUCCESS;
+}
+
+static void ram_close(struct mount * mount) {
+    ram_destroy(mount->ram);
+    mount->ram = 0x0;
+}
+
+static u8 * ram_memory(struct mount * mount) {
+    return mount->ram->memory;
+}
+
+const struct drive_ops ram_ops = {
+    ram_read, ram_write, ram_readv, ram_writev, ram_sync, ram_trim, ram_close, ram_memory, 0, 0
+};
+
+int ram_checkpoint(struct mount * mount, const char * filename) {
+    struct ram_drive * ram = mount->ram;
+    u64 region_size = 1ULL << RAM_REGION_SHIFT;
+
+    __fuse_mutex_lock(&ram->lock);
+    uint8_t full = (__fuse_strcmp(ram->image, filename) != 0);
+    int fd = __fuse_create(filename);
+    if (fd == -1) {
+        mount->last_error = __fuse_errno();
+        __fuse_mutex_unlock(&ram->lock);
+        return OP_FAILURE;
+    }
+    //A new target starts as one hole, only regions with data are written
+    if (full && (__fuse_ftruncate(fd, 0) == -1 || __fuse_ftruncate(fd, ram->size) == -1)) {
+        mount->last_error = __fuse_errno();
+        __fuse_close(fd);
+        __fuse_mutex_unlock(&ram->lock);
+        return OP_FAILURE;
+    }
+
+    int result = OP_SUCCESS;
+    u64 words = (ram->regions + 63) / 64;
+    for (u64 word = 0; word < words && result == OP_SUCCESS; word++) {
+        u64 bits = __fuse_exchange(&ram->dirty[word], 0);
+        if (full) {
+            u64 left = ram->regions - word * 64;
+            bits = (left >= 64) ? ~0ULL : (1ULL << left) - 1;
+        }
+        u64 pending = bits;
+        while (pending != 0) {
+            u64 region = word * 64 + __builtin_ctzll(pending);
+            u64 offset = region << RAM_REGION_SHIFT;
+            u64 length = (ram->size - offset < region_size) ? ram->size - offset : region_size;
+            //Zero regions are left as holes, or punched when the host allows it
+            uint8_t hole = region_is_zero(ram->memory + offset, length)
+                && (full || __fuse_punch_hole(fd, offset, length) == 0);
+            if (!hole && file_transfer(mount, fd, ram->memory + offset, length, offset, 1)) {
+                //Whatever was not written stays dirty
+                __fuse_fetch_or(&ram->dirty[word], pending);
+                result = OP_FAILURE;
+                break;
+            }
+            pending &= pending - 1;
+        }
+    }
+
+    if (result == OP_SUCCESS && __fuse_fdatasync(fd) == -1) {
+        mount->last_error = __fuse_errno();
+        result = OP_FAILURE;
+    }
+    __fuse_close(fd);
+    if (result && full) {
+        //The bits were dropped for the old file, it is behind everywhere now
+        mark_dirty(ram, 0, ram->size);
+    }
+    if (result == OP_SUCCESS) {
+        __fuse_strncpy(ram->image, filename, MAX_FILE_NAME_LENGTH - 1);
+        ram->image[MAX_FILE_NAME_LENGTH - 1] = 0;
+    }
+    __fuse_mutex_unlock(&ram->lock);
+    return result;
+}
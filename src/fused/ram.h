@@ -0,0 +1,38 @@
+#ifndef _RAM_H
+#define _RAM_H
+#include "bfuse.h"
+#include "dependencies.h"
+
+//Drives that live in anonymous memory instead of an image
+//The memory comes from hugetlbfs pages when some are reserved and is
+//advised for transparent huge pages otherwise
+//Writes mark the regions they touch dirty, a checkpoint writes only
+//those back if it goes to the file the drive was loaded from or last
+//checkpointed to, and the whole drive, skipping zero regions, otherwise
+
+//Bytes covered by a dirty bit
+#define RAM_REGION_SHIFT    16
+#define RAM_HUGEPAGE_SIZE   (2ULL << 20)
+
+struct ram_drive {
+    u8   *memory;
+    u64  size;
+    u64  mapped;        //Bytes mapped, the size rounded up to the page used
+    u8   huge;          //Backed by hugetlbfs pages
+    u64  *dirty;        //A bit per region written since the last checkpoint
+    u64  regions;
+    __fuse_mutex_t lock;
+    char image[MAX_FILE_NAME_LENGTH];   //File the clean regions match, empty if none
+};
+
+//Returns 0 on failure, the drive reads as zeros
+struct ram_drive * ram_create(u64 size);
+void ram_destroy(struct ram_drive * ram);
+//Loads the allocated extents of the file, which the drive matches afterwards
+int ram_load(struct mount * mount, const char * filename);
+
+//Transfers of drives registered with register_ram_drive
+extern const struct drive_ops ram_ops;
+//Writes the drive to filename, creating it if needed
+int ram_checkpoint(struct mount * mount, const char * filename);
+#endif
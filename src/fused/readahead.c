@@ -0,0 +1,234 @@
+#include "readahead.h"
+#include "primitives.h"
+#include "cache.h"
+#include "backend.h"
+
+static uint8_t overlaps(u64 sector, u64 count, u64 other, u64 other_count) {
+    return sector < other + other_count && other < sector + count;
+}
+
+//Reads the queued windows and caches the sectors nobody stored meanwhile
+static void * prefetcher(void * arg) {
+    struct readahead * readahead = arg;
+    struct sector_cache * cache = readahead->cache;
+    struct mount * mount = readahead->mount;
+
+    __fuse_mutex_lock(&cache->lock);
+    while (1) {
+        while (!readahead->stop && readahead->queue_count == 0) {
+            __fuse_cond_wait(&readahead->wake, &cache->lock);
+        }
+        if (readahead->stop)
+            break;
+
+        struct readahead_request request = readahead->queue[readahead->queue_head];
+        readahead->queue_head = (readahead->queue_head + 1) % READAHEAD_QUEUE;
+        readahead->queue_count--;
+
+        while (request.count > 0 && cache_contains(cache, request.sector)) {
+            request.sector++;
+            request.count--;
+        }
+        while (request.count > 0 && cache_contains(cache, request.sector + request.count - 1)) {
+            request.count--;
+        }
+        if (request.count == 0)
+            continue;
+
+        readahead->busy_sector = request.sector;
+        readahead->busy_count = request.count;
+        readahead->busy_stale = 0;
+        //Copying from the mapping is cheap and the windows are shared
+        //with the reader, keep the lock
+        uint8_t unlock = !mount->ops->mapped;
+        if (unlock)
+            __fuse_mutex_unlock(&cache->lock);
+        int result = backend_read(mount, readahead->buffer, request.sector, request.count);
+        if (unlock)
+            __fuse_mutex_lock(&cache->lock);
+
+        if (result == OP_SUCCESS) {
+            //A store can force a writeback that makes the rest stale
+            for (u64 i = 0; i < request.count && !readahead->busy_stale; i++) {
+                if (cache_contains(cache, request.sector + i))
+                    continue;
+                if (cache_store_prefetched(cache, request.sector + i, readahead->buffer + i * mount->sector_size))
+                    break;
+            }
+        }
+        readahead->busy_count = 0;
+        __fuse_cond_broadcast(&readahead->done);
+    }
+    __fuse_mutex_unlock(&cache->lock);
+    return 0x0;
+}
+
+static struct readahead_stream * find_stream(struct readahead * readahead, u64 sector) {
+    for (u32 i = 0; i < __READAHEAD_STREAMS; i++) {
+        struct readahead_stream * stream = &readahead->streams[i];
+        if (stream->active && (sector == stream->next || (sector > stream->next && sector < stream->ahead))) {
+            return stream;
+        }
+    }
+    return 0x0;
+}
+
+//Takes a free stream or the one that went unused the longest
+static struct readahead_stream * replace_stream(struct readahead * readahead) {
+    struct readahead_stream * victim = &readahead->streams[0];
+    for (u32 i = 0; i < __READAHEAD_STREAMS; i++) {
+        struct readahead_stream * stream = &readahead->streams[i];
+        if (!stream->active) {
+            return stream;
+        }
+        if (stream->last_used < victim->last_used) {
+            victim = stream;
+        }
+    }
+    return victim;
+}
+
+static void request_window(struct readahead * readahead, u64 sector, u64 count) {
+    if (readahead->queue_count == READAHEAD_QUEUE) {
+        readahead->dropped++;
+        return;
+    }
+    u64 tail = (readahead->queue_head + readahead->queue_count) % READAHEAD_QUEUE;
+    readahead->queue[tail].sector = sector;
+    readahead->queue[tail].count = count;
+    readahead->queue_count++;
+    readahead->windows++;
+    __fuse_cond_signal(&readahead->wake);
+}
+
+int readahead_start(struct mount * mount, u64 max_bytes) {
+    readahead_stop(mount);
+    if (mount->cache == 0x0 || max_bytes < mount->sector_size) {
+        return OP_FAILURE;
+    }
+
+    struct readahead * readahead = __fuse_malloc(sizeof(struct readahead));
+    if (readahead == 0x0) {
+        return OP_FAILURE;
+    }
+    __fuse_memset(readahead, 0, sizeof(struct readahead));
+    readahead->mount = mount;
+    readahead->cache = mount->cache;
+    readahead->max_bytes = max_bytes;
+
+    //The window being read and the next one have to fit in A1in or
+    //they push each other out before they are read
+    u64 limit = mount->cache->capacity / 8;
+    readahead->max_window = max_bytes / mount->sector_size;
+    if (readahead->max_window > limit) readahead->max_window = limit;
+    if (readahead->max_window == 0) readahead->max_window = 1;
+    readahead->min_window = READAHEAD_MIN_BYTES / mount->sector_size;
+    if (readahead->min_window == 0) readahead->min_window = 1;
+    if (readahead->min_window > readahead->max_window) readahead->min_window = readahead->max_window;
+
+    readahead->buffer = __fuse_malloc(readahead->max_window * mount->sector_size);
+    if (readahead->buffer == 0x0) {
+        __fuse_free(readahead);
+        return OP_FAILURE;
+    }
+    __fuse_cond_init(&readahead->wake);
+    __fuse_cond_init(&readahead->done);
+
+    if (__fuse_thread_create(&readahead->thread, prefetcher, readahead) != 0) {
+        __fuse_cond_destroy(&readahead->wake);
+        __fuse_cond_destroy(&readahead->done);
+        __fuse_free(readahead->buffer);
+        __fuse_free(readahead);
+        return OP_FAILURE;
+    }
+    __fuse_mutex_lock(&mount->cache->lock);
+    mount->readahead = readahead;
+    __fuse_mutex_unlock(&mount->cache->lock);
+    return OP_SUCCESS;
+}
+
+void readahead_stop(struct mount * mount) {
+    struct readahead * readahead = mount->readahead;
+    if (readahead == 0x0) {
+        return;
+    }
+
+    __fuse_mutex_lock(&readahead->cache->lock);
+    readahead->stop = 1;
+    __fuse_cond_signal(&readahead->wake);
+    __fuse_mutex_unlock(&readahead->cache->lock);
+    __fuse_thread_join(readahead->thread);
+
+    //Readers look readahead up under the lock, the ones waiting for the
+    //worker look again once woken and find it gone
+    __fuse_mutex_lock(&readahead->cache->lock);
+    mount->readahead = 0x0;
+    __fuse_cond_broadcast(&readahead->done);
+    __fuse_mutex_unlock(&readahead->cache->lock);
+    __fuse_cond_destroy(&readahead->wake);
+    __fuse_cond_destroy(&readahead->done);
+    __fuse_free(readahead->buffer);
+    __fuse_free(readahead);
+}
+
+void readahead_wait(struct mount * mount, u64 sector, u64 count) {
+    struct readahead * readahead;
+    while ((readahead = mount->readahead) != 0x0 && readahead->busy_count > 0 &&
+           overlaps(sector, count, readahead->busy_sector, readahead->busy_count)) {
+        __fuse_cond_wait(&readahead->done, &readahead->cache->lock);
+    }
+}
+
+void readahead_observe(struct mount * mount, u64 sector, u64 count) {
+    struct readahead * readahead = mount->readahead;
+    if (readahead == 0x0) {
+        return;
+    }
+
+    u64 end = sector + count;
+    readahead->clock++;
+    struct readahead_stream * stream = find_stream(readahead, sector);
+    if (stream == 0x0) {
+        //Nothing is prefetched until the stream proves sequential
+        stream = replace_stream(readahead);
+        stream->active = 1;
+        stream->next = end;
+        stream->ahead = end;
+        stream->marker = end;
+        stream->window = 0;
+        stream->last_used = readahead->clock;
+        return;
+    }
+
+    stream->next = end;
+    stream->last_used = readahead->clock;
+    if (stream->ahead < end) {
+        //The reader overtook the readahead
+        stream->ahead = end;
+    }
+    if (end <= stream->marker || stream->ahead >= mount->sector_count) {
+        return;
+    }
+
+    stream->window = (stream->window == 0) ? readahead->min_window : stream->window * 2;
+    if (stream->window > readahead->max_window) {
+        stream->window = readahead->max_window;
+    }
+    u64 window = stream->window;
+    if (window > mount->sector_count - stream->ahead) {
+        window = mount->sector_count - stream->ahead;
+    }
+    request_window(readahead, stream->ahead, window);
+    stream->marker = stream->ahead;
+    stream->ahead += window;
+}
+
+void readahead_invalidate(struct mount * mount, u64 sector, u64 count) {
+    struct readahead * readahead = mount->readahead;
+    if (readahead == 0x0) {
+        return;
+    }
+    if (readahead->busy_count > 0 && overlaps(sector, count, readahead->busy_sector, readahead->busy_count)) {
+        readahead->busy_stale = 1;
+    }
+}
@@ -0,0 +1,73 @@
+#ifndef _READAHEAD_H
+#define _READAHEAD_H
+#include "bfuse.h"
+#include "dependencies.h"
+
+//Sequential readahead into the sector cache
+//Every drive tracks up to __READAHEAD_STREAMS sequential readers, the
+//second consecutive read of a stream prefetches READAHEAD_MIN_BYTES past
+//it and every time the reader enters the prefetched window the next one
+//is requested with twice the size, up to the configured maximum
+//Prefetches are done by a worker thread per drive so the reader only
+//waits if it catches up with the window being read
+
+//First window of a stream
+#define READAHEAD_MIN_BYTES     (16 << 10)
+//Prefetch requests waiting for the worker, more are dropped
+#define READAHEAD_QUEUE         16
+
+struct readahead_stream {
+    u64  next;      //Sector a sequential reader asks for next
+    u64  ahead;     //End of the prefetched sectors
+    u64  marker;    //Reaching this sector requests the next window
+    u64  window;    //Size of the last window in sectors
+    u64  last_used;
+    u8   active;
+};
+
+struct readahead_request {
+    u64  sector;
+    u64  count;
+};
+
+struct readahead {
+    struct mount * mount;
+    struct sector_cache * cache;
+    __fuse_thread_t thread;
+    __fuse_cond_t wake;
+    __fuse_cond_t done;
+    u8   stop;
+
+    u64  max_bytes;
+    u64  min_window;
+    u64  max_window;
+    u64  clock;
+    struct readahead_stream streams[__READAHEAD_STREAMS];
+
+    struct readahead_request queue[READAHEAD_QUEUE];
+    u64  queue_head;
+    u64  queue_count;
+
+    //Range the worker is reading, cleared once it is in the cache
+    u64  busy_sector;
+    u64  busy_count;
+    u8   busy_stale;
+    u8   *buffer;
+
+    u64  windows;
+    u64  dropped;
+};
+
+//Starts readahead of up to max_bytes per window on a drive with a cache
+int readahead_start(struct mount * mount, u64 max_bytes);
+//Waits for the worker and forgets every stream
+void readahead_stop(struct mount * mount);
+
+//The rest are called with the cache lock held
+//Waits until the sectors are not being prefetched
+void readahead_wait(struct mount * mount, u64 sector, u64 count);
+//Records a read and requests the windows the stream needs
+void readahead_observe(struct mount * mount, u64 sector, u64 count);
+//Keeps a prefetch in flight from caching data older than a write
+void readahead_invalidate(struct mount * mount, u64 sector, u64 count);
+#endif
@@ -0,0 +1,369 @@
+#include "stats.h"
+
+#define LATENCY_SUB     (1u << DISK_STATS_LATENCY_SUB_BITS)
+
+static const char * op_names[DISK_STATS_OPS] = {"read", "write", "sync", "trim", "reset"};
+
+static u64 next_stats_id = 1;
+static u64 next_thread_id = 1;
+//Every drive, for threads leaving their shards
+static __fuse_mutex_t registry_lock = __fuse_MUTEX_INITIALIZER;
+static struct drive_stats * registry = 0x0;
+//Holds the id of a thread that counted so its shards are left when it exits
+static __fuse_thread_key_t exit_key;
+static __fuse_once_t exit_key_once = __fuse_ONCE_INIT;
+static uint8_t exit_key_ready = 0;
+
+//Shards of the calling thread on the drives it used last, a drive id is
+//never reused so a binding to a dropped drive cannot match
+struct stats_binding {
+    u64  id;
+    struct stats_shard * shard;
+};
+static _Thread_local u64 thread_id = 0;
+static _Thread_local struct stats_binding bindings[STATS_BINDINGS];
+static _Thread_local u32 binding_next = 0;
+//Picks the requests the thread times, a fixed period would line up with
+//workloads repeating a pattern of requests and never time some of them
+static _Thread_local u32 sample_state = 0;
+
+//Values under LATENCY_SUB have a bucket each, larger ones keep the top
+//DISK_STATS_LATENCY_SUB_BITS bits under their highest one
+static u32 latency_bucket(u64 ns) {
+    if (ns < LATENCY_SUB) {
+        return (u32)ns;
+    }
+    u32 shift = 63 - __builtin_clzll(ns) - DISK_STATS_LATENCY_SUB_BITS;
+    u32 bucket = (shift + 1) * LATENCY_SUB + (u32)((ns >> shift) & (LATENCY_SUB - 1));
+    return (bucket < DISK_STATS_LATENCY_BUCKETS) ? bucket : DISK_STATS_LATENCY_BUCKETS - 1;
+}
+
+//Largest latency counted in the bucket
+static u64 bucket_limit(u32 bucket) {
+    if (bucket < LATENCY_SUB) {
+        return bucket;
+    }
+    u32 shift = bucket / LATENCY_SUB - 1;
+    u64 mantissa = LATENCY_SUB + bucket % LATENCY_SUB;
+    return ((mantissa + 1) << shift) - 1;
+}
+
+static u32 size_bucket(u64 bytes) {
+    if (bytes <= 512) {
+        return 0;
+    }
+    u32 bucket = 64 - __builtin_clzll(bytes - 1) - 9;
+    return (bucket < DISK_STATS_SIZE_BUCKETS) ? bucket : DISK_STATS_SIZE_BUCKETS - 1;
+}
+
+//Counters of a shard are only written by its owner
+static void bump(u64 * counter, u64 value) {
+    __fuse_store_relaxed(counter, __fuse_load_relaxed(counter) + value);
+}
+
+static void clear_counters(struct disk_stats * counters) {
+    u64 * words = (u64 *)counters;
+    for (u64 i = 0; i < sizeof(struct disk_stats) / sizeof(u64); i++) {
+        __fuse_store_relaxed(&words[i], 0);
+    }
+}
+
+struct drive_stats * stats_create() {
+    struct drive_stats * stats = __fuse_malloc(sizeof(struct drive_stats));
+    if (stats == 0x0) {
+        return 0x0;
+    }
+    __fuse_memset(stats, 0, sizeof(struct drive_stats));
+    stats->id = __fuse_fetch_add(&next_stats_id, 1);
+    stats->epoch_start = __fuse_monotonic_ns();
+    __fuse_mutex_init(&stats->lock);
+    __fuse_mutex_lock(&registry_lock);
+    stats->next = registry;
+    registry = stats;
+    __fuse_mutex_unlock(&registry_lock);
+    return stats;
+}
+
+void stats_destroy(struct drive_stats * stats) {
+    if (stats == 0x0) {
+        return;
+    }
+    __fuse_mutex_lock(&registry_lock);
+    struct drive_stats ** link = &registry;
+    while (*link != stats) {
+        link = &(*link)->next;
+    }
+    *link = stats->next;
+    __fuse_mutex_unlock(&registry_lock);
+    struct stats_shard * shard = stats->shards;
+    while (shard != 0x0) {
+        struct stats_shard * next = shard->next;
+        __fuse_free(shard);
+        shard = next;
+    }
+    __fuse_mutex_destroy(&stats->lock);
+    __fuse_free(stats);
+}
+
+//Runs when a thread that counted exits, its shards keep their counters
+//for the next threads new to the drives to count on
+static void leave_shards(void * id) {
+    __fuse_mutex_lock(&registry_lock);
+    for (struct drive_stats * stats = registry; stats != 0x0; stats = stats->next) {
+        __fuse_mutex_lock(&stats->lock);
+        for (struct stats_shard * shard = stats->shards; shard != 0x0; shard = shard->next) {
+            if (shard->owner == (u64)id)
+                shard->owner = 0;
+        }
+        __fuse_mutex_unlock(&stats->lock);
+    }
+    __fuse_mutex_unlock(&registry_lock);
+}
+
+static void create_exit_key() {
+    exit_key_ready = (__fuse_thread_key_create(&exit_key, leave_shards) == 0);
+}
+
+//Finds the shard of the calling thread, takes over one left by a thread
+//that exited or adds one, returns 0 on failure
+static struct stats_shard * find_shard(struct drive_stats * stats) {
+    if (thread_id == 0) {
+        __fuse_once(&exit_key_once, create_exit_key);
+        thread_id = __fuse_fetch_add(&next_thread_id, 1);
+        if (exit_key_ready)
+            __fuse_thread_key_set(exit_key, (void *)thread_id);
+    }
+    __fuse_mutex_lock(&stats->lock);
+    struct stats_shard * shard = stats->shards;
+    while (shard != 0x0 && shard->owner != thread_id) {
+        shard = shard->next;
+    }
+    if (shard == 0x0) {
+        shard = stats->shards;
+        while (shard != 0x0 && shard->owner != 0) {
+            shard = shard->next;
+        }
+        if (shard != 0x0)
+            shard->owner = thread_id;
+    }
+    if (shard == 0x0) {
+        shard = __fuse_malloc(sizeof(struct stats_shard));
+        if (shard != 0x0) {
+            __fuse_memset(shard, 0, sizeof(struct stats_shard));
+            shard->owner = thread_id;
+            shard->epoch = __fuse_load_acquire(&stats->epoch);
+            shard->next = stats->shards;
+            __fuse_store_release(&stats->shards, shard);
+        }
+    }
+    __fuse_mutex_unlock(&stats->lock);
+    if (shard == 0x0) {
+        return 0x0;
+    }
+    bindings[binding_next].id = stats->id;
+    bindings[binding_next].shard = shard;
+    binding_next = (binding_next + 1) % STATS_BINDINGS;
+    return shard;
+}
+
+//Returns the shard of the calling thread, cleared if a reset happened
+//since it last counted, or 0 if it could not be allocated
+static struct stats_shard * get_shard(struct drive_stats * stats) {
+    struct stats_shard * shard = 0x0;
+    for (u32 i = 0; i < STATS_BINDINGS; i++) {
+        if (bindings[i].id == stats->id) {
+            shard = bindings[i].shard;
+            break;
+        }
+    }
+    if (shard == 0x0 && (shard = find_shard(stats)) == 0x0) {
+        return 0x0;
+    }
+    u64 epoch = __fuse_load_acquire(&stats->epoch);
+    if (shard->epoch != epoch) {
+        clear_counters(&shard->counters);
+        __fuse_store_release(&shard->epoch, epoch);
+    }
+    return shard;
+}
+
+u64 stats_begin(struct mount * mount) {
+    struct stats_shard * shard = get_shard(mount->stats);
+    if (shard == 0x0) {
+        return 0;
+    }
+    bump(&shard->inflight, 1);
+    if (sample_state == 0) {
+        sample_state = (u32)thread_id | 1;
+    }
+    //xorshift32
+    sample_state ^= sample_state << 13;
+    sample_state ^= sample_state >> 17;
+    sample_state ^= sample_state << 5;
+    if (sample_state % __STATS_SAMPLE != 0) {
+        return 0;
+    }
+    return __fuse_monotonic_ns();
+}
+
+//A request may complete on another thread than it began on, only the sum
+//of the requests in flight over every shard means anything
+void stats_end(struct mount * mount, u32 op, u64 bytes, u64 start, int result) {
+    struct stats_shard * shard = get_shard(mount->stats);
+    if (shard == 0x0) {
+        return;
+    }
+    __fuse_store_relaxed(&shard->inflight, shard->inflight - 1);
+    struct disk_stats * counters = &shard->counters;
+
+    bump(&counters->ops[op], 1);
+    if (result == OP_SUCCESS)
+        bump(&counters->bytes[op], bytes);
+    else
+        bump(&counters->errors[op], 1);
+    if (op == DISK_STATS_READ || op == DISK_STATS_WRITE)
+        bump(&counters->sizes[op][size_bucket(bytes)], 1);
+    if (start == 0) {
+        return;
+    }
+    u64 latency = __fuse_monotonic_ns() - start;
+    bump(&counters->timed[op], 1);
+    bump(&counters->latency_sum[op], latency);
+    bump(&counters->latency[op][latency_bucket(latency)], 1);
+    if (latency > counters->latency_max[op])
+        __fuse_store_relaxed(&counters->latency_max[op], latency);
+}
+
+//The counters are all u64, the shards of the current epoch are summed as
+//arrays and the maxima fixed up afterwards
+void stats_get(struct mount * mount, struct disk_stats * snapshot) {
+    struct drive_stats * stats = mount->stats;
+    u64 * total = (u64 *)snapshot;
+    u64 words = sizeof(struct disk_stats) / sizeof(u64);
+    u64 epoch = __fuse_load_acquire(&stats->epoch);
+    __fuse_memset(snapshot, 0, sizeof(struct disk_stats));
+
+    u64 latency_max[DISK_STATS_OPS] = {0};
+    u64 inflight = 0;
+    struct stats_shard * shard = __fuse_load_acquire(&stats->shards);
+    for (; shard != 0x0; shard = shard->next) {
+        inflight += __fuse_load_relaxed(&shard->inflight);
+        if (__fuse_load_acquire(&shard->epoch) != epoch)
+            continue;
+        u64 * counters = (u64 *)&shard->counters;
+        for (u64 i = 0; i < words; i++) {
+            total[i] += __fuse_load_relaxed(&counters[i]);
+        }
+        for (u32 op = 0; op < DISK_STATS_OPS; op++) {
+            u64 max = __fuse_load_relaxed(&shard->counters.latency_max[op]);
+            if (latency_max[op] < max)
+                latency_max[op] = max;
+        }
+    }
+    for (u32 op = 0; op < DISK_STATS_OPS; op++) {
+        snapshot->latency_max[op] = latency_max[op];
+    }
+    //Requests in flight wrap around in the shards they completed in
+    snapshot->inflight = inflight;
+    snapshot->elapsed_ns = __fuse_monotonic_ns() - __fuse_load_relaxed(&stats->epoch_start);
+}
+
+void stats_reset(struct mount * mount) {
+    struct drive_stats * stats = mount->stats;
+    __fuse_mutex_lock(&stats->lock);
+    __fuse_store_relaxed(&stats->epoch_start, __fuse_monotonic_ns());
+    __fuse_store_release(&stats->epoch, stats->epoch + 1);
+    __fuse_mutex_unlock(&stats->lock);
+}
+u64 disk_stats_percentile(const struct disk_stats * stats, u32 op, u32 hundredths) {
+    if (stats == 0x0 || op >= DISK_STATS_OPS) {
+        return 0;
+    }
+    const u64 * buckets = stats->latency[op];
+    u64 total = 0;
+    for (u32 i = 0; i < DISK_STATS_LATENCY_BUCKETS; i++) {
+        total += buckets[i];
+    }
+    if (total == 0) {
+        return 0;
+    }
+    if (hundredths > 10000)
+        hundredths = 10000;
+    //The request the share ends at, counting from the fastest
+    u64 rank = (total * hundredths + 9999) / 10000;
+    if (rank == 0)
+        rank = 1;
+
+    u64 seen = 0;
+    for (u32 i = 0; i < DISK_STATS_LATENCY_BUCKETS; i++) {
+        seen += buckets[i];
+        if (seen >= rank) {
+            u64 limit = bucket_limit(i);
+            //The slowest request is known exactly, no need to round past it
+            u64 max = stats->latency_max[op];
+            return (max != 0 && max < limit) ? max : limit;
+        }
+    }
+    return stats->latency_max[op];
+}
+
+//Prints the transfers of a size bucket as <=4K: count
+static void print_size(u32 bucket, u64 count) {
+    unsigned long long limit = 512ULL << bucket;
+    const char * relation = "<=";
+    if (bucket == DISK_STATS_SIZE_BUCKETS - 1) {
+        limit >>= 1;
+        relation = ">";
+    }
+    if (limit >= (1ULL << 20))
+        __fuse_printf(" %s%lluM: %llu", relation, limit >> 20, (unsigned long long)count);
+    else if (limit >= (1ULL << 10))
+        __fuse_printf(" %s%lluK: %llu", relation, limit >> 10, (unsigned long long)count);
+    else
+        __fuse_printf(" %s%llu: %llu", relation, limit, (unsigned long long)count);
+}
+
+void stats_dump(struct mount * mount) {
+    struct disk_stats * stats = __fuse_malloc(sizeof(struct disk_stats));
+    if (stats == 0x0) {
+        return;
+    }
+    stats_get(mount, stats);
+
+    __fuse_printf("Drive %s\n", mount->mount_point);
+    __fuse_printf("%6s %12s %8s %16s %10s %10s %10s %10s %12s\n", "", "requests", "errors", "bytes",
+        "mean ns", "p50 ns", "p99 ns", "p99.9 ns", "max ns");
+    u64 requests = 0;
+    for (u32 op = 0; op < DISK_STATS_OPS; op++) {
+        u64 count = stats->ops[op];
+        requests += count;
+        __fuse_printf("%6s %12llu %8llu %16llu %10llu %10llu %10llu %10llu %12llu\n", op_names[op],
+            (unsigned long long)count, (unsigned long long)stats->errors[op], (unsigned long long)stats->bytes[op],
+            (unsigned long long)(stats->timed[op] ? stats->latency_sum[op] / stats->timed[op] : 0),
+            (unsigned long long)disk_stats_percentile(stats, op, 5000),
+            (unsigned long long)disk_stats_percentile(stats, op, 9900),
+            (unsigned long long)disk_stats_percentile(stats, op, 9990),
+            (unsigned long long)stats->latency_max[op]);
+    }
+
+    //Time spent in requests, the timed ones stand for all of them
+    u64 busy = 0;
+    for (u32 op = 0; op < DISK_STATS_OPS; op++) {
+        if (stats->timed[op] != 0)
+            busy += stats->latency_sum[op] / stats->timed[op] * stats->ops[op];
+    }
+    //In tenths, without floating point
+    u64 depth = stats->elapsed_ns ? busy * 10 / stats->elapsed_ns : 0;
+    __fuse_printf("Queue depth mean %llu.%llu, %llu in flight, %llu requests in %llu ms\n",
+        (unsigned long long)(depth / 10), (unsigned long long)(depth % 10), (unsigned long long)stats->inflight,
+        (unsigned long long)requests, (unsigned long long)(stats->elapsed_ns / 1000000));
+    for (u32 op = DISK_STATS_READ; op <= DISK_STATS_WRITE; op++) {
+        __fuse_printf("%s sizes:", op_names[op]);
+        for (u32 i = 0; i < DISK_STATS_SIZE_BUCKETS; i++) {
+            if (stats->sizes[op][i] != 0)
+                print_size(i, stats->sizes[op][i]);
+        }
+        __fuse_printf("\n");
+    }
+    __fuse_free(stats);
+}
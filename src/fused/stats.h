@@ -0,0 +1,58 @@
+#ifndef _STATS_H
+#define _STATS_H
+#include "bfuse.h"
+#include "primitives.h"
+#include "dependencies.h"
+
+//Request counters of a drive, always on
+//Every thread counts its requests in a shard of its own that only it
+//writes, so counting is a plain add and never a locked instruction, which
+//would wait for the stores of the transfer to drain, a snapshot sums the
+//shards. The queue depth comes from the time spent in requests instead of
+//a shared count of the requests in flight for the same reason
+//Reading the clock around a request also costs about as much as a request
+//to a memory backed drive, a thread times one in __STATS_SAMPLE at random
+//A reset starts a new epoch, each thread clears its shard the next time
+//it counts and snapshots skip the shards of older epochs, a request
+//completing meanwhile may be counted on either side of it
+//A thread that exits leaves its shards with their counters, the next
+//thread new to the drive counts on one of them, so there are only as many
+//shards as threads ever counted at the same time
+
+//Drives a thread remembers its shard for without a lookup
+#define STATS_BINDINGS      8
+
+//Counters of one thread on one drive
+struct stats_shard {
+    struct disk_stats counters;
+    u64  inflight;                  //Begun here minus completed here, survives resets
+    u64  owner;                     //Id of the thread, 0 once it exits
+    u64  epoch;                     //Reset the counters started after
+    struct stats_shard * next;
+};
+
+struct drive_stats {
+    u64  id;
+    u64  epoch;
+    u64  epoch_start;               //When the drive was registered or last reset
+    __fuse_mutex_t lock;            //Only taken to add or take over a shard
+    struct stats_shard * shards;
+    struct drive_stats * next;
+};
+
+//Returns 0 on failure
+struct drive_stats * stats_create();
+void stats_destroy(struct drive_stats * stats);
+
+//Counts a request reaching the drive, returns when it did or 0 if it is not timed
+u64 stats_begin(struct mount * mount);
+//Counts the completion of a request of op, start is what stats_begin returned
+//bytes is the size of the transfer, only added to the total on success
+void stats_end(struct mount * mount, u32 op, u64 bytes, u64 start, int result);
+
+void stats_get(struct mount * mount, struct disk_stats * stats);
+//Clears every counter but the requests in flight
+void stats_reset(struct mount * mount);
+//Prints a summary of the counters
+void stats_dump(struct mount * mount);
+#endif
@@ -0,0 +1,274 @@
+#include "timing.h"
+
+static u64 next_timing_id = 1;
+
+//Virtual clocks of the calling thread on the drives it used last, a model
+//id is never reused so setting a model restarts the clocks of every thread
+struct timing_binding {
+    u64  id;
+    u64  clock;
+};
+static _Thread_local struct timing_binding bindings[TIMING_BINDINGS];
+static _Thread_local u32 binding_next = 0;
+
+//Parameters of each model, indexed by TIMING_*
+static const struct disk_timing defaults[] = {
+    {TIMING_NONE,     0,  0,  0,     0,    0,    0,  0,    0},
+    {TIMING_HDD,      0, 50, 50, 15000, 7200,  160,  1,   50},
+    {TIMING_SATA_SSD, 0, 90, 60,     0,    0,  550,  8, 2000},
+    {TIMING_NVME,     0, 70, 20,     0,    0, 3500, 32, 2000},
+};
+
+static u32 pick(u32 value, u32 fallback) {
+    return (value != 0) ? value : fallback;
+}
+
+static u64 later(u64 a, u64 b) {
+    return (a > b) ? a : b;
+}
+
+static u64 * find_clock(struct timing * timing) {
+    for (u32 i = 0; i < TIMING_BINDINGS; i++) {
+        if (bindings[i].id == timing->id) {
+            return &bindings[i].clock;
+        }
+    }
+    struct timing_binding * binding = &bindings[binding_next];
+    binding_next = (binding_next + 1) % TIMING_BINDINGS;
+    binding->id = timing->id;
+    binding->clock = 0;
+    return &binding->clock;
+}
+
+//Nanoseconds to move bytes at mb_per_s
+static u64 transfer_ns(struct timing * timing, u64 bytes) {
+    return bytes * 1000 / timing->params.mb_per_s;
+}
+
+//Command overhead, a seek unless the request continues the last one or
+//stays on its track, the wait for the sector to turn under the head and
+//the transfer at the media rate
+//A zone reset only updates the zone metadata, the head stays
+static u64 hdd_service(struct timing * timing, u32 op, u64 sector, u64 count, u64 start) {
+    struct disk_timing * params = &timing->params;
+    if (op == DISK_STATS_TRIM) {
+        return start;
+    }
+    if (op == DISK_STATS_RESET) {
+        return start + (u64)params->reset_us * 1000;
+    }
+    u64 time = start + (u64)((op == DISK_STATS_READ) ? params->read_us : params->write_us) * 1000;
+    if (sector != timing->head) {
+        u64 distance = (sector > timing->head) ? sector - timing->head : timing->head - sector;
+        if (distance * timing->sector_size >= timing->track_bytes) {
+            u64 settle = TIMING_HDD_SETTLE_US * 1000ULL;
+            u64 stroke = (u64)params->seek_us * 1000;
+            stroke = (stroke > settle) ? stroke - settle : 0;
+            time += settle + stroke * distance / timing->sector_count;
+        }
+        u64 angle = (sector * timing->sector_size) % timing->track_bytes * timing->rotation_ns / timing->track_bytes;
+        time += (angle + timing->rotation_ns - time % timing->rotation_ns) % timing->rotation_ns;
+        timing->seeks++;
+    }
+    timing->head = sector + count;
+    return time + transfer_ns(timing, count * timing->sector_size);
+}
+
+//Books the first gap of the link from ready long enough for the transfer,
+//returns when it ends
+static u64 reserve_link(struct timing * timing, u64 ready, u64 duration) {
+    struct timing_interval * link = timing->link;
+    u64 start = ready;
+    u32 i = 0;
+    for (; i < timing->link_count; i++) {
+        if (link[i].end <= start) {
+            continue;
+        }
+        if (link[i].start >= start + duration) {
+            break;
+        }
+        start = link[i].end;
+    }
+    u64 end = start + duration;
+    if (i > 0 && link[i - 1].end == start) {
+        link[i - 1].end = end;
+        if (i < timing->link_count && link[i].start == end) {
+            link[i - 1].end = link[i].end;
+            __fuse_memmove(&link[i], &link[i + 1], (timing->link_count - i - 1) * sizeof(struct timing_interval));
+            timing->link_count--;
+        }
+        return end;
+    }
+    if (i < timing->link_count && link[i].start == end) {
+        link[i].start = start;
+        return end;
+    }
+    if (timing->link_count == TIMING_LINK_SLOTS) {
+        __fuse_memmove(&link[0], &link[1], (TIMING_LINK_SLOTS - 1) * sizeof(struct timing_interval));
+        timing->link_count--;
+        i = (i > 0) ? i - 1 : 0;
+    }
+    __fuse_memmove(&link[i + 1], &link[i], (timing->link_count - i) * sizeof(struct timing_interval));
+    link[i].start = start;
+    link[i].end = end;
+    timing->link_count++;
+    return end;
+}
+
+//Latency on the channel and the transfer on the shared link, reads move
+//their data once it was read and writes before it is programmed
+//A zone reset erases its blocks without a transfer
+static u64 ssd_service(struct timing * timing, u32 op, u64 count, u64 start) {
+    struct disk_timing * params = &timing->params;
+    u64 transfer = transfer_ns(timing, count * timing->sector_size);
+    if (op == DISK_STATS_READ) {
+        return reserve_link(timing, start + (u64)params->read_us * 1000, transfer);
+    }
+    if (op == DISK_STATS_WRITE) {
+        return reserve_link(timing, start, transfer) + (u64)params->write_us * 1000;
+    }
+    if (op == DISK_STATS_RESET) {
+        return start + (u64)params->reset_us * 1000;
+    }
+    return start + (u64)params->write_us * 1000;
+}
+
+//Returns when the device completes the request, a sync once every request
+//scheduled before it did
+static u64 schedule(struct timing * timing, u32 op, u64 sector, u64 count, u64 arrival, u64 stall) {
+    if (op == DISK_STATS_SYNC) {
+        return later(arrival, timing->busy_until);
+    }
+    //The channel idle for the shortest time, or the first to free up
+    u32 channel = 0;
+    for (u32 i = 1; i < timing->params.channels; i++) {
+        u64 free = timing->channel_free[i];
+        u64 best = timing->channel_free[channel];
+        if (free <= arrival ? (best > arrival || free > best) : (best > arrival && free < best)) {
+            channel = i;
+        }
+    }
+    u64 start = later(arrival, timing->channel_free[channel]);
+    u64 completion = (timing->params.model == TIMING_HDD) ?
+        hdd_service(timing, op, sector, count, start + stall) : ssd_service(timing, op, count, start + stall);
+    timing->channel_free[channel] = completion;
+    timing->busy_until = later(timing->busy_until, completion);
+    timing->requests++;
+    timing->queue_ns += start - arrival;
+    timing->service_ns += completion - start;
+    return completion;
+}
+
+//Sleeping wakes up late, the last __TIMING_SPIN_US are spun
+static void wait_until(u64 deadline) {
+    u64 spin = __TIMING_SPIN_US * 1000ULL;
+    if (deadline > __fuse_monotonic_ns() + spin) {
+        __fuse_sleep_until_ns(deadline - spin);
+    }
+    while (__fuse_monotonic_ns() < deadline);
+}
+
+int timing_start(struct mount * mount, const struct disk_timing * params) {
+    if (params->model > TIMING_NVME || params->clock > TIMING_CLOCK_VIRTUAL) {
+        mount->last_error = __fuse_EINVAL;
+        return OP_FAILURE;
+    }
+    timing_stop(mount);
+    if (params->model == TIMING_NONE) {
+        return OP_SUCCESS;
+    }
+
+    struct timing * timing = __fuse_malloc(sizeof(struct timing));
+    if (timing == 0x0) {
+        mount->last_error = __fuse_ENOMEM;
+        return OP_FAILURE;
+    }
+    __fuse_memset(timing, 0, sizeof(struct timing));
+    const struct disk_timing * model = &defaults[params->model];
+    timing->params.model = params->model;
+    timing->params.clock = params->clock;
+    timing->params.read_us = pick(params->read_us, model->read_us);
+    timing->params.write_us = pick(params->write_us, model->write_us);
+    timing->params.seek_us = pick(params->seek_us, model->seek_us);
+    timing->params.rpm = pick(params->rpm, model->rpm);
+    timing->params.mb_per_s = pick(params->mb_per_s, model->mb_per_s);
+    timing->params.channels = pick(params->channels, model->channels);
+    timing->params.reset_us = pick(params->reset_us, model->reset_us);
+    if (params->model == TIMING_HDD) {
+        timing->params.channels = 1;
+        timing->rotation_ns = 60000000000ULL / timing->params.rpm;
+        timing->track_bytes = (u64)timing->params.mb_per_s * timing->rotation_ns / 1000;
+    } else if (timing->params.channels > TIMING_MAX_CHANNELS) {
+        timing->params.channels = TIMING_MAX_CHANNELS;
+    }
+    timing->sector_count = mount->sector_count;
+    timing->sector_size = mount->sector_size;
+    timing->id = __fuse_fetch_add(&next_timing_id, 1);
+    __fuse_mutex_init(&timing->lock);
+    mount->timing = timing;
+    return OP_SUCCESS;
+}
+
+void timing_stop(struct mount * mount) {
+    struct timing * timing = mount->timing;
+    if (timing == 0x0) {
+        return;
+    }
+    mount->timing = 0x0;
+    __fuse_mutex_destroy(&timing->lock);
+    __fuse_free(timing);
+}
+
+u64 timing_begin(struct timing * timing) {
+    __fuse_fetch_add(&timing->inflight, 1);
+    if (timing->params.clock == TIMING_CLOCK_VIRTUAL) {
+        return *find_clock(timing);
+    }
+    return __fuse_monotonic_ns();
+}
+
+void timing_end(struct timing * timing, u32 op, u64 sector, u64 count, u64 arrival, u64 stall) {
+    __fuse_mutex_lock(&timing->lock);
+    u64 completion = schedule(timing, op, sector, count, arrival, stall);
+    __fuse_mutex_unlock(&timing->lock);
+    if (timing->params.clock == TIMING_CLOCK_VIRTUAL) {
+        *find_clock(timing) = completion;
+    } else {
+        wait_until(completion);
+    }
+    __fuse_fetch_add(&timing->inflight, (u64)-1);
+}
+
+void timing_get(struct mount * mount, struct disk_timing_stats * stats) {
+    struct timing * timing = mount->timing;
+    __fuse_memset(stats, 0, sizeof(struct disk_timing_stats));
+    if (timing == 0x0) {
+        return;
+    }
+    __fuse_mutex_lock(&timing->lock);
+    stats->timing = timing->params;
+    stats->requests = timing->requests;
+    stats->queue_ns = timing->queue_ns;
+    stats->service_ns = timing->service_ns;
+    stats->seeks = timing->seeks;
+    stats->busy_until = timing->busy_until;
+    __fuse_mutex_unlock(&timing->lock);
+    if (timing->params.clock == TIMING_CLOCK_VIRTUAL) {
+        stats->clock_ns = *find_clock(timing);
+    }
+}
+
+uint8_t timing_busy(struct mount * mount) {
+    struct timing * timing = mount->timing;
+    if (timing == 0x0) {
+        return 0;
+    }
+    if (__fuse_load_acquire(&timing->inflight) != 0) {
+        return 1;
+    }
+    u64 now = (timing->params.clock == TIMING_CLOCK_VIRTUAL) ? *find_clock(timing) : __fuse_monotonic_ns();
+    __fuse_mutex_lock(&timing->lock);
+    uint8_t busy = timing->busy_until > now;
+    __fuse_mutex_unlock(&timing->lock);
+    return busy;
+}
@@ -0,0 +1,81 @@
+#ifndef _TIMING_H
+#define _TIMING_H
+#include "bfuse.h"
+#include "primitives.h"
+#include "dependencies.h"
+
+//Emulated device timing, charged where requests leave the cache and the
+//elevator for the drive so cache hits and queued writes stay free
+//The device has a few channels working on one request each and a link the
+//transfers share: a request waits for a free channel, spends the per op
+//latency on it and moves its data over the link, reads after the latency
+//and writes before it, so bandwidth caps the throughput once enough
+//requests are in flight to hide the latency
+//Virtual clocks of different threads drift apart, so requests may reach the
+//device out of order: a request takes the channel that went idle last
+//before it arrived and its transfer the first gap on the link that fits,
+//so the stream of every thread keeps a channel and fills the link where
+//the others left room
+//An HDD has a single channel, a request not continuing the last one seeks
+//for a time proportional to the distance and waits for its sector to come
+//under the head, the angle of the platter follows the clock
+//With the real clock a request sleeps until the device would complete it,
+//the host I/O overlaps the emulated time. With the virtual clock it returns
+//at once and every thread keeps a clock per drive that its requests
+//advance, so the device time of a workload is known without waiting for it
+
+//Channels of the device, more are clamped
+#define TIMING_MAX_CHANNELS     64
+//Drives a thread keeps a virtual clock for
+#define TIMING_BINDINGS         8
+//Transfers the link remembers, older ones are forgotten
+#define TIMING_LINK_SLOTS       64
+//Shortest HDD seek, to the next track
+#define TIMING_HDD_SETTLE_US    800
+
+//Time the link is busy with transfers
+struct timing_interval {
+    u64  start;
+    u64  end;
+};
+
+struct timing {
+    u64  id;                    //Never reused, binds the virtual clocks of the threads
+    struct disk_timing params;  //Defaults of the model filled in
+    u64  sector_count;
+    u32  sector_size;
+    u64  track_bytes;           //HDD, bytes passing under the head in a rotation
+    u64  rotation_ns;
+    __fuse_mutex_t lock;
+
+    u64  channel_free[TIMING_MAX_CHANNELS];
+    struct timing_interval link[TIMING_LINK_SLOTS];     //By start, adjacent ones merged
+    u32  link_count;
+    u64  head;                  //HDD, sector after the last request
+    u64  busy_until;            //Completion of the last request scheduled
+    u64  inflight;              //Requests between timing_begin and timing_end
+
+    u64  requests;
+    u64  queue_ns;
+    u64  service_ns;
+    u64  seeks;
+};
+
+//Starts emulating the model, replacing the current one
+//Only while no request is in flight on the drive
+int timing_start(struct mount * mount, const struct disk_timing * params);
+void timing_stop(struct mount * mount);
+
+//A request reaching the device, returns its arrival time
+u64 timing_begin(struct timing * timing);
+//Schedules the request of op (DISK_STATS_*) on the device and, with the
+//real clock, sleeps until it completes
+//stall is time the device spent on it before its own work, garbage
+//collection the FTL needed for a write
+void timing_end(struct timing * timing, u32 op, u64 sector, u64 count, u64 arrival, u64 stall);
+
+void timing_get(struct mount * mount, struct disk_timing_stats * stats);
+//An emulated request is in flight, or one completing after the clock of
+//the calling thread in virtual mode
+uint8_t timing_busy(struct mount * mount);
+#endif
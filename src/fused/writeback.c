@@ -0,0 +1,95 @@
+#include "writeback.h"
+#include "primitives.h"
+#include "cache.h"
+
+static uint8_t over_dirty_ratio(struct sector_cache * cache) {
+    return cache->dirty_count * 100 > cache->capacity * __WRITEBACK_DIRTY_RATIO;
+}
+
+static void * flusher(void * arg) {
+    struct writeback * writeback = arg;
+    struct sector_cache * cache = writeback->cache;
+
+    __fuse_mutex_lock(&cache->lock);
+    while (!writeback->stop) {
+        __fuse_cond_timedwait_ms(&writeback->wake, &cache->lock, __WRITEBACK_INTERVAL_MS);
+        if (writeback->stop || cache->dirty_count == 0)
+            continue;
+
+        u64 oldest = cache_oldest_dirty(cache);
+        if (over_dirty_ratio(cache) || __fuse_monotonic_ms() - oldest >= __WRITEBACK_MAX_AGE_MS) {
+            cache_flush(cache);
+        }
+    }
+    __fuse_mutex_unlock(&cache->lock);
+    return 0x0;
+}
+
+int writeback_start(struct mount * mount) {
+    if (mount->writeback != 0x0) {
+        return OP_SUCCESS;
+    }
+    if (mount->cache == 0x0) {
+        return OP_FAILURE;
+    }
+
+    struct writeback * writeback = __fuse_malloc(sizeof(struct writeback));
+    if (writeback == 0x0) {
+        return OP_FAILURE;
+    }
+    writeback->mount = mount;
+    writeback->cache = mount->cache;
+    writeback->stop = 0;
+    __fuse_cond_init(&writeback->wake);
+
+    if (__fuse_thread_create(&writeback->thread, flusher, writeback) != 0) {
+        __fuse_cond_destroy(&writeback->wake);
+        __fuse_free(writeback);
+        return OP_FAILURE;
+    }
+    __fuse_mutex_lock(&mount->cache->lock);
+    mount->writeback = writeback;
+    __fuse_mutex_unlock(&mount->cache->lock);
+    return OP_SUCCESS;
+}
+
+int writeback_stop(struct mount * mount) {
+    struct writeback * writeback = mount->writeback;
+    if (writeback == 0x0) {
+        return OP_SUCCESS;
+    }
+
+    struct sector_cache * cache = writeback->cache;
+    __fuse_mutex_lock(&cache->lock);
+    writeback->stop = 1;
+    __fuse_cond_signal(&writeback->wake);
+    __fuse_mutex_unlock(&cache->lock);
+    __fuse_thread_join(writeback->thread);
+
+    //Writers look write-back up under the lock, once it is gone they write
+    //through and only what is dirty now is left to flush
+    __fuse_mutex_lock(&cache->lock);
+    mount->writeback = 0x0;
+    int result = cache_flush(cache) ? OP_FAILURE : OP_SUCCESS;
+    __fuse_mutex_unlock(&cache->lock);
+
+    __fuse_cond_destroy(&writeback->wake);
+    __fuse_free(writeback);
+    return result;
+}
+
+int writeback_write(struct mount * mount, const u8 * buffer, u64 sector, u64 count) {
+    struct sector_cache * cache = mount->cache;
+    int result = OP_SUCCESS;
+
+    for (u64 i = 0; i < count; i++) {
+        if (cache_store_dirty(cache, sector + i, buffer + i * mount->sector_size)) {
+            result = OP_FAILURE;
+            break;
+        }
+    }
+    if (over_dirty_ratio(cache)) {
+        __fuse_cond_signal(&mount->writeback->wake);
+    }
+    return result;
+}
@@ -0,0 +1,25 @@
+#ifndef _WRITEBACK_H
+#define _WRITEBACK_H
+#include "bfuse.h"
+#include "dependencies.h"
+
+//Write-back mode, writes only dirty the sector cache and a flusher
+//thread per drive writes them out once the oldest dirty sector is older
+//than __WRITEBACK_MAX_AGE_MS or more than __WRITEBACK_DIRTY_RATIO percent
+//of the cache is dirty
+struct writeback {
+    struct mount * mount;
+    struct sector_cache * cache;
+    __fuse_thread_t thread;
+    __fuse_cond_t wake;
+    u8   stop;
+};
+
+//Starts the flusher of a drive that has a cache, returns OP_FAILURE otherwise
+int writeback_start(struct mount * mount);
+//Writes back everything dirty and stops the flusher
+int writeback_stop(struct mount * mount);
+//Dirties count sectors in the cache, the host write happens later
+//Called with the cache lock held, after checking write-back is on
+int writeback_write(struct mount * mount, const u8 * buffer, u64 sector, u64 count);
+#endif
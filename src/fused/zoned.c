@@ -0,0 +1,208 @@
+#include "zoned.h"
+#include "discard.h"
+
+//Sector after the last live one of the zone, its start if all are discarded
+static u64 live_end(struct mount * mount, const struct disk_zone * zone) {
+    u64 end = zone->start;
+    u64 sector = zone->start;
+    u64 left = zone->length;
+    while (left > 0) {
+        uint8_t discarded;
+        u64 run = discard_run(mount, sector, left, &discarded);
+        sector += run;
+        left -= run;
+        if (!discarded)
+            end = sector;
+    }
+    return end;
+}
+
+static void init_zone(struct mount * mount, struct zoned * zoned, u64 index) {
+    struct disk_zone * zone = &zoned->zone[index];
+    zone->start = index * zoned->zone_sectors;
+    zone->length = mount->sector_count - zone->start;
+    if (zone->length > zoned->zone_sectors)
+        zone->length = zoned->zone_sectors;
+    u64 end = zone->start + zone->length;
+    if (index < zoned->conventional) {
+        zone->type = ZONE_TYPE_CONVENTIONAL;
+        zone->condition = ZONE_COND_NOT_WP;
+        zone->write_pointer = end;
+        return;
+    }
+    zone->type = ZONE_TYPE_SEQUENTIAL;
+    zone->write_pointer = live_end(mount, zone);
+    if (zone->write_pointer == zone->start)
+        zone->condition = ZONE_COND_EMPTY;
+    else if (zone->write_pointer == end)
+        zone->condition = ZONE_COND_FULL;
+    else
+        zone->condition = ZONE_COND_CLOSED;
+}
+
+int zoned_start(struct mount * mount, const struct disk_zoned * params) {
+    u64 zone_sectors = params->zone_sectors;
+    if (zone_sectors > mount->sector_count) {
+        mount->last_error = __fuse_EINVAL;
+        return OP_FAILURE;
+    }
+    u64 count = (zone_sectors != 0) ? (mount->sector_count + zone_sectors - 1) / zone_sectors : 0;
+    if (params->conventional > count) {
+        mount->last_error = __fuse_EINVAL;
+        return OP_FAILURE;
+    }
+    zoned_stop(mount);
+    if (zone_sectors == 0) {
+        return OP_SUCCESS;
+    }
+
+    struct zoned * zoned = __fuse_malloc(sizeof(struct zoned));
+    struct disk_zone * zone = __fuse_malloc(count * sizeof(struct disk_zone));
+    if (zoned == 0x0 || zone == 0x0) {
+        __fuse_free(zoned);
+        __fuse_free(zone);
+        mount->last_error = __fuse_ENOMEM;
+        return OP_FAILURE;
+    }
+    zoned->zone_sectors = zone_sectors;
+    zoned->count = count;
+    zoned->conventional = params->conventional;
+    zoned->zone = zone;
+    for (u64 i = 0; i < count; i++) {
+        init_zone(mount, zoned, i);
+    }
+    __fuse_mutex_init(&zoned->lock);
+    mount->zones = zoned;
+    return OP_SUCCESS;
+}
+
+void zoned_stop(struct mount * mount) {
+    struct zoned * zoned = mount->zones;
+    if (zoned == 0x0) {
+        return;
+    }
+    mount->zones = 0x0;
+    __fuse_mutex_destroy(&zoned->lock);
+    __fuse_free(zoned->zone);
+    __fuse_free(zoned);
+}
+
+//Sequential zone holding sector, 0x0 with EINVAL in last_error if the
+//drive has no zones or it is conventional
+static struct disk_zone * sequential_zone(struct mount * mount, u64 sector) {
+    struct zoned * zoned = mount->zones;
+    if (zoned == 0x0 || sector >= mount->sector_count || sector / zoned->zone_sectors < zoned->conventional) {
+        mount->last_error = __fuse_EINVAL;
+        return 0x0;
+    }
+    return &zoned->zone[sector / zoned->zone_sectors];
+}
+
+//Moves the write pointer past a write of count sectors from sector,
+//the lock is held
+static int advance(struct disk_zone * zone, u64 sector, u64 count) {
+    u64 end = zone->start + zone->length;
+    if (zone->condition == ZONE_COND_FULL || sector != zone->write_pointer || count > end - sector) {
+        return OP_FAILURE;
+    }
+    zone->write_pointer += count;
+    if (zone->write_pointer == end)
+        zone->condition = ZONE_COND_FULL;
+    else if (zone->condition != ZONE_COND_EXPLICIT_OPEN)
+        zone->condition = ZONE_COND_IMPLICIT_OPEN;
+    return OP_SUCCESS;
+}
+
+int zoned_write(struct mount * mount, u64 sector, u64 count) {
+    struct zoned * zoned = mount->zones;
+    if (count == 0) {
+        return OP_SUCCESS;
+    }
+    u64 first = sector / zoned->zone_sectors;
+    u64 last = (sector + count - 1) / zoned->zone_sectors;
+    //Conventional zones take any write that stays among them
+    if (last < zoned->conventional) {
+        return OP_SUCCESS;
+    }
+    int result = OP_FAILURE;
+    if (first == last) {
+        __fuse_mutex_lock(&zoned->lock);
+        result = advance(&zoned->zone[first], sector, count);
+        __fuse_mutex_unlock(&zoned->lock);
+    }
+    if (result) {
+        mount->last_error = __fuse_EIO;
+    }
+    return result;
+}
+
+int zoned_append(struct mount * mount, u64 sector, u64 count, u64 * written) {
+    struct disk_zone * zone = sequential_zone(mount, sector);
+    if (zone == 0x0) {
+        return OP_FAILURE;
+    }
+    __fuse_mutex_lock(&mount->zones->lock);
+    *written = zone->write_pointer;
+    int result = advance(zone, zone->write_pointer, count);
+    __fuse_mutex_unlock(&mount->zones->lock);
+    if (result) {
+        mount->last_error = __fuse_EIO;
+    }
+    return result;
+}
+
+int zoned_report(struct mount * mount, struct disk_zone_report * report) {
+    struct zoned * zoned = mount->zones;
+    report->reported = 0;
+    if (zoned == 0x0) {
+        return OP_SUCCESS;
+    }
+    if (report->sector >= mount->sector_count || (report->zones == 0x0 && report->count > 0)) {
+        mount->last_error = __fuse_EINVAL;
+        return OP_FAILURE;
+    }
+    u64 first = report->sector / zoned->zone_sectors;
+    u64 count = zoned->count - first;
+    if (count > report->count)
+        count = report->count;
+    __fuse_mutex_lock(&zoned->lock);
+    __fuse_memcpy(report->zones, &zoned->zone[first], count * sizeof(struct disk_zone));
+    __fuse_mutex_unlock(&zoned->lock);
+    report->reported = (u32)count;
+    return OP_SUCCESS;
+}
+
+int zoned_manage(struct mount * mount, int request, u64 sector) {
+    struct disk_zone * zone = sequential_zone(mount, sector);
+    if (zone == 0x0) {
+        return OP_FAILURE;
+    }
+    __fuse_mutex_lock(&mount->zones->lock);
+    u32 condition = zone->condition;
+    if (request == IOCTL_OPEN_ZONE && condition != ZONE_COND_FULL) {
+        zone->condition = ZONE_COND_EXPLICIT_OPEN;
+    } else if (request == IOCTL_CLOSE_ZONE && (condition == ZONE_COND_IMPLICIT_OPEN || condition == ZONE_COND_EXPLICIT_OPEN)) {
+        zone->condition = (zone->write_pointer == zone->start) ? ZONE_COND_EMPTY : ZONE_COND_CLOSED;
+    } else if (request == IOCTL_FINISH_ZONE) {
+        //The sectors skipped were discarded, they read as zeros
+        zone->write_pointer = zone->start + zone->length;
+        zone->condition = ZONE_COND_FULL;
+    }
+    __fuse_mutex_unlock(&mount->zones->lock);
+    return OP_SUCCESS;
+}
+
+int zoned_reset(struct mount * mount, u64 sector, zone_discard discard) {
+    struct disk_zone * zone = sequential_zone(mount, sector);
+    if (zone == 0x0) {
+        return OP_FAILURE;
+    }
+    __fuse_mutex_lock(&mount->zones->lock);
+    int result = discard(mount, zone->start, zone->length);
+    if (result == OP_SUCCESS) {
+        zone->write_pointer = zone->start;
+        zone->condition = ZONE_COND_EMPTY;
+    }
+    __fuse_mutex_unlock(&mount->zones->lock);
+    return result;
+}
@@ -0,0 +1,49 @@
+#ifndef _ZONED_H
+#define _ZONED_H
+#include "bfuse.h"
+#include "primitives.h"
+#include "dependencies.h"
+
+//Zoned block device emulation, write pointers enforced where requests
+//enter the drive so the cache, the elevator and the async queues see
+//only writes the zones allowed
+//A write to a sequential zone reserves its sectors by moving the write
+//pointer under the lock before it is made, so concurrent writers and
+//appends get disjoint ranges, a write that then fails leaves the pointer
+//past sectors that may not hold the data like a device would
+//A reset keeps the lock while the zone is discarded so nothing is written
+//to it meanwhile, writes already past their reservation have to be
+//waited for by the caller like on a device
+//Every sequential zone starts with its write pointer after its last live
+//sector, so an image written sequentially before keeps its data
+//Open zones are not limited, open and close only change the condition
+
+//Discards the sectors of a zone being reset
+typedef int (*zone_discard)(struct mount * mount, u64 sector, u64 count);
+
+struct zoned {
+    u64  zone_sectors;
+    u64  count;                 //Zones, the last one may be shorter
+    u32  conventional;
+    __fuse_mutex_t lock;
+    struct disk_zone * zone;
+};
+
+//Splits the drive in zones, replacing the current ones
+//Only while no request is in flight on the drive
+int zoned_start(struct mount * mount, const struct disk_zoned * params);
+void zoned_stop(struct mount * mount);
+
+//Checks a write against the zones it covers and moves the write pointer
+//past it, fails with EIO in last_error if it breaks the zone rules
+int zoned_write(struct mount * mount, u64 sector, u64 count);
+//Reserves count sectors at the write pointer of the zone holding sector,
+//*written gets the first one
+int zoned_append(struct mount * mount, u64 sector, u64 count, u64 * written);
+
+int zoned_report(struct mount * mount, struct disk_zone_report * report);
+//IOCTL_OPEN_ZONE, IOCTL_CLOSE_ZONE or IOCTL_FINISH_ZONE on the zone holding sector
+int zoned_manage(struct mount * mount, int request, u64 sector);
+//Discards the zone holding sector with discard and rewinds its write pointer
+int zoned_reset(struct mount * mount, u64 sector, zone_discard discard);
+#endif
@@ -134,4 +134,11 @@ int main(int argc, char *argv[]) {
         }   
         free(buffer);
     }
+
+    //With a write-back cache the image is only up to date after a sync
+    if (ioctl_disk(drive, IOCTL_SYNC, 0x0)) {
+        printf("Failed to sync drive\n");
+        return 1;
+    }
+    return 0;
 }